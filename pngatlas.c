@@ -0,0 +1,1428 @@
+/*
+ * pngatlas.c
+ * 
+ * See the README file for further information.
+ */
+#include "sophistry.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * The maximum length in bytes of a line in a sprite list file,
+ * including the line break.
+ */
+#define PNGATLAS_MAX_LINE (4096)
+
+/*
+ * The maximum number of decoding threads.
+ */
+#define PNGATLAS_MAX_THREADS (64)
+
+/*
+ * The maximum number of pixels of padding between sprites.
+ */
+#define PNGATLAS_MAX_PADDING (256)
+
+/*
+ * The number of scanlines in each band of the atlas.  Two bands are
+ * held in memory, one being decoded while the other is encoded.
+ */
+#define PNGATLAS_BAND (64)
+
+/*
+ * Structure describing one sprite.
+ */
+typedef struct {
+  
+  /*
+   * The path to the image file of the sprite, dynamically allocated.
+   */
+  char *pPath;
+  
+  /*
+   * The width and height of the sprite in pixels.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The position of the top-left corner of the sprite in the atlas.
+   */
+  int32_t x;
+  int32_t y;
+  
+  /*
+   * The reader of the sprite while its scanlines are being decoded, or
+   * NULL before and after.  Only used by the thread that owns the
+   * sprite.
+   */
+  SPH_IMAGE_READER *pr;
+
+} PNGATLAS_SPRITE;
+
+/*
+ * Structure holding the list of sprites in input order.
+ */
+typedef struct {
+  
+  /*
+   * The sprites.
+   */
+  PNGATLAS_SPRITE *pSprites;
+  
+  /*
+   * The number of sprites, and the allocated capacity of the array.
+   */
+  int32_t count;
+  int32_t cap;
+
+} PNGATLAS_LIST;
+
+/*
+ * Structure describing one segment of the skyline of the packer.
+ * 
+ * The skyline is the top edge of the area that is already filled, from
+ * left to right, as a list of horizontal segments.
+ */
+typedef struct {
+  
+  /*
+   * The left edge, the height, and the width of the segment.
+   */
+  int32_t x;
+  int32_t y;
+  int32_t w;
+
+} PNGATLAS_SEGMENT;
+
+struct PNGATLAS_TAG;
+
+/*
+ * Structure describing a decoding worker thread.
+ */
+typedef struct {
+  
+  /*
+   * The atlas state, and the index of the worker.  Worker i decodes the
+   * sprites at positions i, i + n, i + 2n, and so on of the sprites in
+   * placement order, where n is the number of workers.
+   */
+  struct PNGATLAS_TAG *pa;
+  int index;
+
+} PNGATLAS_WORKER;
+
+/*
+ * Structure holding the state of the atlas builder while it writes.
+ */
+typedef struct PNGATLAS_TAG {
+  
+  /*
+   * The sprites, sorted by the top edge of their position.
+   */
+  PNGATLAS_SPRITE **ppOrder;
+  int32_t count;
+  
+  /*
+   * The width and height of the atlas in pixels, and the number of
+   * bands.
+   */
+  int32_t w;
+  int32_t h;
+  int32_t bands;
+  
+  /*
+   * The two band buffers, each holding PNGATLAS_BAND scanlines that are
+   * pitch pixels apart.  Band k goes into buffer (k % 2).  The areas of
+   * a buffer that no sprite covers are always transparent black.
+   */
+  uint32_t *pBuf[2];
+  int32_t pitch;
+  
+  /*
+   * The number of worker threads, or one if sprites are decoded on the
+   * calling thread.
+   */
+  int nworkers;
+  
+  /*
+   * Lock and condition protecting the band counters and the stop state.
+   * The condition is broadcast whenever any of them changes.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * The number of bands written so far, and the number of workers that
+   * have finished the band in each buffer.
+   */
+  int32_t written;
+  int ready[2];
+  
+  /*
+   * Non-zero once anything has failed, the error code of the first
+   * failure, and the sprite that failed, or NULL if it was the writer.
+   */
+  int stop;
+  int errcode;
+  const PNGATLAS_SPRITE *pFailed;
+
+} PNGATLAS;
+
+/*
+ * Add a sprite to the end of a sprite list.
+ * 
+ * The path is copied.
+ * 
+ * Parameters:
+ * 
+ *   pl - the sprite list
+ * 
+ *   pPath - the sprite path
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there are too many sprites
+ */
+static int pngatlas_add(PNGATLAS_LIST *pl, const char *pPath) {
+  
+  int status = 1;
+  int32_t ncap = 0;
+  PNGATLAS_SPRITE *pNew = NULL;
+  PNGATLAS_SPRITE *ps = NULL;
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Grow the array if needed */
+  if (pl->count >= pl->cap) {
+    if (pl->cap >= SPH_IMAGE_MAXDIM) {
+      status = 0;
+    } else {
+      ncap = (pl->cap > 0) ? (pl->cap * 2) : 64;
+      if (ncap > SPH_IMAGE_MAXDIM) {
+        ncap = SPH_IMAGE_MAXDIM;
+      }
+      pNew = (PNGATLAS_SPRITE *) realloc(
+                pl->pSprites, ((size_t) ncap) * sizeof(PNGATLAS_SPRITE));
+      if (pNew == NULL) {
+        abort();
+      }
+      pl->pSprites = pNew;
+      pl->cap = ncap;
+    }
+  }
+  
+  /* Copy the path */
+  if (status) {
+    ps = &((pl->pSprites)[pl->count]);
+    memset(ps, 0, sizeof(PNGATLAS_SPRITE));
+    ps->pPath = (char *) malloc(strlen(pPath) + 1);
+    if (ps->pPath == NULL) {
+      abort();
+    }
+    strcpy(ps->pPath, pPath);
+    (pl->count)++;
+  }
+  
+  return status;
+}
+
+/*
+ * Add the sprites of a sprite list file to the end of a sprite list.
+ * 
+ * The file has one sprite path per line.  Empty lines are skipped.
+ * 
+ * Parameters:
+ * 
+ *   pl - the sprite list
+ * 
+ *   pListPath - the path to the sprite list file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the file can't be read or has too
+ *   many sprites or too long a line
+ */
+static int pngatlas_readList(PNGATLAS_LIST *pl, const char *pListPath) {
+  
+  int status = 1;
+  size_t len = 0;
+  FILE *fh = NULL;
+  char line[PNGATLAS_MAX_LINE];
+  
+  /* Initialize buffers */
+  memset(line, 0, sizeof(line));
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pListPath == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  fh = fopen(pListPath, "r");
+  if (fh == NULL) {
+    status = 0;
+  }
+  
+  /* Add each line */
+  while (status && (fgets(line, sizeof(line), fh) != NULL)) {
+    len = strlen(line);
+    if ((len > 0) && (line[len - 1] == '\n')) {
+      line[len - 1] = 0;
+      len--;
+    } else if (!feof(fh)) {
+      status = 0;
+      break;
+    }
+    if ((len > 0) && (line[len - 1] == '\r')) {
+      line[len - 1] = 0;
+      len--;
+    }
+    if (len > 0) {
+      status = pngatlas_add(pl, line);
+    }
+  }
+  if (status && ferror(fh)) {
+    status = 0;
+  }
+  
+  /* Close the file if open */
+  if (fh != NULL) {
+    fclose(fh);
+  }
+  
+  return status;
+}
+
+/*
+ * Compare two sprites for the packing order, taller sprites first, then
+ * wider sprites first.
+ * 
+ * Parameters:
+ * 
+ *   pA - pointer to the first sprite pointer
+ * 
+ *   pB - pointer to the second sprite pointer
+ * 
+ * Return:
+ * 
+ *   less than, equal to, or greater than zero if the first sprite is
+ *   packed before, with, or after the second
+ */
+static int pngatlas_cmpSize(const void *pA, const void *pB) {
+  
+  const PNGATLAS_SPRITE *psa = NULL;
+  const PNGATLAS_SPRITE *psb = NULL;
+  int result = 0;
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+  psa = *((const PNGATLAS_SPRITE * const *) pA);
+  psb = *((const PNGATLAS_SPRITE * const *) pB);
+  
+  if (psa->h != psb->h) {
+    result = (psa->h > psb->h) ? -1 : 1;
+  } else if (psa->w != psb->w) {
+    result = (psa->w > psb->w) ? -1 : 1;
+  } else if (psa != psb) {
+    result = (psa < psb) ? -1 : 1;
+  }
+  
+  return result;
+}
+
+/*
+ * Compare two sprites for the writing order, by the top edge of their
+ * position, then by the left edge.
+ * 
+ * Parameters:
+ * 
+ *   pA - pointer to the first sprite pointer
+ * 
+ *   pB - pointer to the second sprite pointer
+ * 
+ * Return:
+ * 
+ *   less than, equal to, or greater than zero if the first sprite is
+ *   written before, with, or after the second
+ */
+static int pngatlas_cmpPos(const void *pA, const void *pB) {
+  
+  const PNGATLAS_SPRITE *psa = NULL;
+  const PNGATLAS_SPRITE *psb = NULL;
+  int result = 0;
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+  psa = *((const PNGATLAS_SPRITE * const *) pA);
+  psb = *((const PNGATLAS_SPRITE * const *) pB);
+  
+  if (psa->y != psb->y) {
+    result = (psa->y < psb->y) ? -1 : 1;
+  } else if (psa->x != psb->x) {
+    result = (psa->x < psb->x) ? -1 : 1;
+  }
+  
+  return result;
+}
+
+/*
+ * Pack the sprites into an atlas of a given width.
+ * 
+ * The sprites are placed from the tallest to the shortest with a
+ * skyline packer.  Each sprite goes where its bottom edge ends up
+ * highest in the atlas, which is the leftmost such place on a tie.
+ * Each sprite takes up padding more pixels to the right and below it,
+ * which may reach past the right and bottom edges of the atlas.
+ * 
+ * ppOrder is an array of pointers to all the sprites, which is sorted
+ * into packing order.  The position of each sprite is set.
+ * 
+ * Parameters:
+ * 
+ *   ppOrder - pointers to the sprites
+ * 
+ *   count - the number of sprites
+ * 
+ *   w - the width of the atlas in pixels
+ * 
+ *   padding - the padding in pixels
+ * 
+ *   pHeight - receives the height of the atlas
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if a sprite is wider than the atlas
+ *   or the atlas would be too tall
+ */
+static int pngatlas_pack(
+    PNGATLAS_SPRITE ** ppOrder,
+    int32_t            count,
+    int32_t            w,
+    int32_t            padding,
+    int32_t          * pHeight) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t k = 0;
+  int32_t n = 0;
+  int32_t best = 0;
+  int32_t rw = 0;
+  int32_t rh = 0;
+  int32_t top = 0;
+  int32_t best_top = 0;
+  int32_t covered = 0;
+  int64_t y = 0;
+  int64_t bottom = 0;
+  int64_t h = 0;
+  PNGATLAS_SPRITE *ps = NULL;
+  PNGATLAS_SEGMENT *pSky = NULL;
+  
+  /* Check parameters */
+  if ((ppOrder == NULL) || (pHeight == NULL)) {
+    abort();
+  }
+  if ((count < 1) || (w < 1) || (w > SPH_IMAGE_MAXDIM) ||
+      (padding < 0) || (padding > PNGATLAS_MAX_PADDING)) {
+    abort();
+  }
+  
+  /* Each placement adds at most one segment to the skyline, which
+   * starts out as one segment across the padded width */
+  pSky = (PNGATLAS_SEGMENT *) malloc(
+            (((size_t) count) + 1) * sizeof(PNGATLAS_SEGMENT));
+  if (pSky == NULL) {
+    abort();
+  }
+  pSky[0].x = 0;
+  pSky[0].y = 0;
+  pSky[0].w = w + padding;
+  n = 1;
+  
+  qsort(ppOrder, (size_t) count, sizeof(PNGATLAS_SPRITE *),
+    &pngatlas_cmpSize);
+  
+  for(i = 0; i < count; i++) {
+    ps = ppOrder[i];
+    rw = ps->w + padding;
+    rh = ps->h + padding;
+    
+    /* Find the segment to start at, where the sprite rests on the
+     * highest segment that it spans */
+    best = -1;
+    best_top = 0;
+    for(j = 0; j < n; j++) {
+      if (pSky[j].x + rw > w + padding) {
+        break;
+      }
+      top = 0;
+      covered = 0;
+      for(k = j; covered < rw; k++) {
+        if (pSky[k].y > top) {
+          top = pSky[k].y;
+        }
+        covered += pSky[k].w;
+      }
+      if ((best < 0) || (top < best_top)) {
+        best = j;
+        best_top = top;
+      }
+    }
+    if (best < 0) {
+      status = 0;
+      break;
+    }
+    
+    /* Place the sprite */
+    ps->x = pSky[best].x;
+    ps->y = best_top;
+    y = ((int64_t) best_top) + rh;
+    if (y > SPH_IMAGE_MAXDIM + padding) {
+      status = 0;
+      break;
+    }
+    if (y > bottom) {
+      bottom = y;
+    }
+    
+    /* Cut the segments under the sprite, then insert the top edge of
+     * the sprite as a new segment */
+    k = best;
+    while ((k < n) && (pSky[k].x < ps->x + rw)) {
+      if (pSky[k].x + pSky[k].w <= ps->x + rw) {
+        k++;
+      } else {
+        pSky[k].w -= ps->x + rw - pSky[k].x;
+        pSky[k].x = ps->x + rw;
+        break;
+      }
+    }
+    memmove(&(pSky[best + 1]), &(pSky[k]),
+      ((size_t) (n - k)) * sizeof(PNGATLAS_SEGMENT));
+    n = n - (k - best) + 1;
+    pSky[best].x = ps->x;
+    pSky[best].y = (int32_t) y;
+    pSky[best].w = rw;
+    
+    /* Merge neighboring segments of the same height */
+    for(j = ((best > 0) ? (best - 1) : 0); (j + 1 < n) && (j <= best); ) {
+      if (pSky[j].y == pSky[j + 1].y) {
+        pSky[j].w += pSky[j + 1].w;
+        memmove(&(pSky[j + 1]), &(pSky[j + 2]),
+          ((size_t) (n - j - 2)) * sizeof(PNGATLAS_SEGMENT));
+        n--;
+      } else {
+        j++;
+      }
+    }
+  }
+  
+  /* The padding below the lowest sprites isn't part of the atlas */
+  if (status) {
+    h = bottom - padding;
+    if (h < 1) {
+      h = 1;
+    }
+    *pHeight = (int32_t) h;
+  }
+  
+  free(pSky);
+  
+  return status;
+}
+
+/*
+ * Lock the atlas state.
+ * 
+ * Parameters:
+ * 
+ *   pa - the atlas state
+ */
+static void pngatlas_lock(PNGATLAS *pa) {
+  if (pthread_mutex_lock(&(pa->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Unlock the atlas state.
+ * 
+ * Parameters:
+ * 
+ *   pa - the atlas state
+ */
+static void pngatlas_unlock(PNGATLAS *pa) {
+  if (pthread_mutex_unlock(&(pa->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Record a failure and wake up all waiting threads.
+ * 
+ * Only the first error is kept.  The caller must hold the lock.
+ * 
+ * Parameters:
+ * 
+ *   pa - the atlas state
+ * 
+ *   errcode - the error code
+ * 
+ *   ps - the sprite that failed, or NULL if it was the writer
+ */
+static void pngatlas_fail(
+          PNGATLAS        * pa,
+          int               errcode,
+    const PNGATLAS_SPRITE * ps) {
+  if (!(pa->stop)) {
+    pa->stop = 1;
+    pa->errcode = errcode;
+    pa->pFailed = ps;
+  }
+  if (pthread_cond_broadcast(&(pa->cond))) {
+    abort();
+  }
+}
+
+/*
+ * Decode the part of a band of the atlas that a worker owns.
+ * 
+ * The scanlines of each sprite that the band covers are decoded
+ * straight into their place in the band buffer.  The reader of a sprite
+ * is opened at its first scanline and closed after its last one.
+ * 
+ * *pNext is the first of the sprites that the worker owns, in placement
+ * order, that isn't finished yet.  It starts out as first, and this
+ * function moves it along as sprites are finished.
+ * 
+ * Parameters:
+ * 
+ *   pa - the atlas state
+ * 
+ *   step - the number of workers
+ * 
+ *   pNext - the first unfinished sprite of the worker
+ * 
+ *   k - the band
+ * 
+ *   pErr - receives the error code on failure
+ * 
+ *   ppFailed - receives the sprite that failed
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngatlas_decode(
+          PNGATLAS         * pa,
+          int                step,
+          int32_t          * pNext,
+          int32_t            k,
+          int              * pErr,
+    const PNGATLAS_SPRITE ** ppFailed) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t y0 = 0;
+  int32_t y1 = 0;
+  int32_t a = 0;
+  int32_t b = 0;
+  uint32_t *pBuf = NULL;
+  PNGATLAS_SPRITE *ps = NULL;
+  
+  /* Check parameters */
+  if ((pa == NULL) || (step < 1) || (pNext == NULL) ||
+      (pErr == NULL) || (ppFailed == NULL)) {
+    abort();
+  }
+  if ((k < 0) || (k >= pa->bands)) {
+    abort();
+  }
+  
+  y0 = k * PNGATLAS_BAND;
+  y1 = y0 + PNGATLAS_BAND;
+  if (y1 > pa->h) {
+    y1 = pa->h;
+  }
+  pBuf = (pa->pBuf)[k % 2];
+  
+  /* Go through the sprites of the worker that start above the end of
+   * the band */
+  for(i = *pNext; i < pa->count; i += step) {
+    ps = (pa->ppOrder)[i];
+    if (ps->y >= y1) {
+      break;
+    }
+    a = (ps->y > y0) ? ps->y : y0;
+    b = ps->y + ps->h;
+    if (b <= y0) {
+      continue;
+    }
+    if (b > y1) {
+      b = y1;
+    }
+    
+    /* Open the sprite at its first scanline, checking that it still has
+     * the size it had when it was packed */
+    if (ps->pr == NULL) {
+      ps->pr = sph_image_reader_newFromPath(ps->pPath, pErr);
+      if (ps->pr == NULL) {
+        status = 0;
+      } else if ((sph_image_reader_width(ps->pr) != ps->w) ||
+                  (sph_image_reader_height(ps->pr) != ps->h)) {
+        *pErr = SPH_IMAGE_ERR_READDATA;
+        status = 0;
+      }
+    }
+    
+    /* Decode its scanlines in the band */
+    if (status) {
+      if (!sph_image_reader_readRows(
+              ps->pr,
+              pBuf + ((size_t) (a - y0)) * pa->pitch + ps->x,
+              pa->pitch,
+              b - a,
+              pErr)) {
+        status = 0;
+      }
+    }
+    
+    if (!status) {
+      *ppFailed = ps;
+      break;
+    }
+    
+    /* Close it after its last scanline */
+    if (b >= ps->y + ps->h) {
+      sph_image_reader_close(ps->pr);
+      ps->pr = NULL;
+    }
+  }
+  
+  /* Move past the finished sprites */
+  while ((*pNext < pa->count) &&
+          ((pa->ppOrder)[*pNext]->y + (pa->ppOrder)[*pNext]->h <= y1)) {
+    *pNext += step;
+  }
+  
+  return status;
+}
+
+/*
+ * Decoding worker thread.
+ * 
+ * For each band in turn, the worker waits until the band buffer is
+ * free, decodes its part of the band, and reports it.  The worker
+ * returns after the last band, or when anything fails.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the PNGATLAS_WORKER structure
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *pngatlas_worker(void *pParam) {
+  
+  int ok = 0;
+  int quit = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t k = 0;
+  int32_t next = 0;
+  const PNGATLAS_SPRITE *pFailed = NULL;
+  PNGATLAS_WORKER *pk = NULL;
+  PNGATLAS *pa = NULL;
+  
+  /* Check parameter */
+  if (pParam == NULL) {
+    abort();
+  }
+  pk = (PNGATLAS_WORKER *) pParam;
+  pa = pk->pa;
+  next = pk->index;
+  
+  for(k = 0; k < pa->bands; k++) {
+    /* Wait until the band that last used the buffer is written */
+    pngatlas_lock(pa);
+    while ((!(pa->stop)) && (pa->written < k - 1)) {
+      if (pthread_cond_wait(&(pa->cond), &(pa->lock))) {
+        abort();
+      }
+    }
+    quit = pa->stop;
+    pngatlas_unlock(pa);
+    if (quit) {
+      break;
+    }
+    
+    /* Decode the part of the band */
+    ok = pngatlas_decode(pa, pa->nworkers, &next, k, &err, &pFailed);
+    
+    /* Report it */
+    pngatlas_lock(pa);
+    if (ok) {
+      ((pa->ready)[k % 2])++;
+      if (pthread_cond_broadcast(&(pa->cond))) {
+        abort();
+      }
+    } else {
+      pngatlas_fail(pa, err, pFailed);
+    }
+    pngatlas_unlock(pa);
+    if (!ok) {
+      break;
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Write a string as a quoted JSON string.
+ * 
+ * Parameters:
+ * 
+ *   fh - the output file
+ * 
+ *   pStr - the string
+ */
+static void pngatlas_putJson(FILE *fh, const char *pStr) {
+  
+  const unsigned char *pc = NULL;
+  
+  /* Check parameters */
+  if ((fh == NULL) || (pStr == NULL)) {
+    abort();
+  }
+  
+  fputc('"', fh);
+  for(pc = (const unsigned char *) pStr; *pc != 0; pc++) {
+    if ((*pc == '"') || (*pc == '\\')) {
+      fprintf(fh, "\\%c", *pc);
+    } else if (*pc < 0x20) {
+      fprintf(fh, "\\u%04x", (unsigned int) *pc);
+    } else {
+      fputc(*pc, fh);
+    }
+  }
+  fputc('"', fh);
+}
+
+/*
+ * Write a string as a quoted CSV field.
+ * 
+ * Parameters:
+ * 
+ *   fh - the output file
+ * 
+ *   pStr - the string
+ */
+static void pngatlas_putCsv(FILE *fh, const char *pStr) {
+  
+  const char *pc = NULL;
+  
+  /* Check parameters */
+  if ((fh == NULL) || (pStr == NULL)) {
+    abort();
+  }
+  
+  fputc('"', fh);
+  for(pc = pStr; *pc != 0; pc++) {
+    if (*pc == '"') {
+      fputc('"', fh);
+    }
+    fputc(*pc, fh);
+  }
+  fputc('"', fh);
+}
+
+/*
+ * Write the placement map of the sprites.
+ * 
+ * If json is non-zero, the map is a JSON object with the width and
+ * height of the atlas and an array of the sprites.  Otherwise, it is a
+ * CSV file with a header line and one line per sprite.  The sprites are
+ * listed in input order, each with its path, position, and size.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the map file
+ * 
+ *   json - non-zero for JSON, zero for CSV
+ * 
+ *   pl - the sprite list
+ * 
+ *   w - the width of the atlas
+ * 
+ *   h - the height of the atlas
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the file can't be written
+ */
+static int pngatlas_writeMap(
+    const char          * pPath,
+          int             json,
+    const PNGATLAS_LIST * pl,
+          int32_t         w,
+          int32_t         h) {
+  
+  int status = 1;
+  int32_t i = 0;
+  FILE *fh = NULL;
+  const PNGATLAS_SPRITE *ps = NULL;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pl == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  fh = fopen(pPath, "w");
+  if (fh == NULL) {
+    status = 0;
+  }
+  
+  /* Write the header */
+  if (status) {
+    if (json) {
+      fprintf(fh, "{\n  \"width\": %ld,\n  \"height\": %ld,\n",
+        (long) w, (long) h);
+      fprintf(fh, "  \"sprites\": [");
+    } else {
+      fprintf(fh, "name,x,y,width,height\n");
+    }
+  }
+  
+  /* Write each sprite */
+  for(i = 0; status && (i < pl->count); i++) {
+    ps = &((pl->pSprites)[i]);
+    if (json) {
+      fprintf(fh, "%s\n    {\"name\": ", (i > 0) ? "," : "");
+      pngatlas_putJson(fh, ps->pPath);
+      fprintf(fh, ", \"x\": %ld, \"y\": %ld, "
+        "\"width\": %ld, \"height\": %ld}",
+        (long) ps->x, (long) ps->y, (long) ps->w, (long) ps->h);
+    } else {
+      pngatlas_putCsv(fh, ps->pPath);
+      fprintf(fh, ",%ld,%ld,%ld,%ld\n",
+        (long) ps->x, (long) ps->y, (long) ps->w, (long) ps->h);
+    }
+  }
+  
+  /* Write the footer */
+  if (status && json) {
+    fprintf(fh, "\n  ]\n}\n");
+  }
+  
+  /* Close the file if open */
+  if (fh != NULL) {
+    if (ferror(fh)) {
+      status = 0;
+    }
+    if (fclose(fh) != 0) {
+      status = 0;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Perform the atlas operation.
+ * 
+ * The header of each sprite is read to get its size, and the sprites
+ * are packed into an atlas of width w, or of a width computed from the
+ * total area of the sprites if w is zero.  The atlas is then written
+ * to pOutPath in bands of scanlines.  For each band, the scanlines of
+ * every sprite that the band covers are decoded straight into their
+ * place in the band, and the band is written in one batch.  Only the
+ * sprites that the current band covers are open at any time, so memory
+ * depends on the width of the atlas and the sprites in one band, never
+ * on the height of the atlas or the total number of sprites.  With more
+ * than one thread, the sprites of a band are decoded in parallel on
+ * worker threads, while the calling thread encodes the previous band.
+ * 
+ * The position of each sprite is set in the sprite list, and the width
+ * and height of the atlas are written to pWidth and pHeight.
+ * 
+ * pError is optionally a pointer to an integer that receives an error
+ * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
+ * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).  If the
+ * error came from a sprite, ppFailed receives the sprite, and otherwise
+ * NULL.
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   pl - the sprites
+ * 
+ *   w - the width of the atlas, or zero for automatic
+ * 
+ *   padding - the padding between sprites in pixels
+ * 
+ *   threads - the number of decoding threads
+ * 
+ *   pWidth - receives the width of the atlas
+ * 
+ *   pHeight - receives the height of the atlas
+ * 
+ *   ppFailed - receives the sprite that failed, or NULL
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngatlas(
+    const char             * pOutPath,
+          PNGATLAS_LIST    * pl,
+          int32_t            w,
+          int32_t            padding,
+          int                threads,
+          int32_t          * pWidth,
+          int32_t          * pHeight,
+    const PNGATLAS_SPRITE ** ppFailed,
+          int              * pError) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int quit = 0;
+  int started = 0;
+  int i = 0;
+  int32_t k = 0;
+  int32_t n = 0;
+  int32_t next = 0;
+  int32_t widest = 0;
+  double area = 0.0;
+  PNGATLAS_SPRITE *ps = NULL;
+  const PNGATLAS_SPRITE *pFailed = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  PNGATLAS *pa = NULL;
+  PNGATLAS_WORKER workers[PNGATLAS_MAX_THREADS];
+  pthread_t tids[PNGATLAS_MAX_THREADS];
+  
+  /* Initialize structures */
+  memset(workers, 0, sizeof(workers));
+  memset(tids, 0, sizeof(tids));
+  
+  /* Check parameters */
+  if ((pOutPath == NULL) || (pl == NULL) ||
+      (pWidth == NULL) || (pHeight == NULL) || (ppFailed == NULL)) {
+    abort();
+  }
+  if ((pl->count < 1) || (w < 0) || (w > SPH_IMAGE_MAXDIM) ||
+      (padding < 0) || (padding > PNGATLAS_MAX_PADDING) ||
+      (threads < 1) || (threads > PNGATLAS_MAX_THREADS)) {
+    abort();
+  }
+  *ppFailed = NULL;
+  
+  /* Allocate the state */
+  pa = (PNGATLAS *) malloc(sizeof(PNGATLAS));
+  if (pa == NULL) {
+    abort();
+  }
+  memset(pa, 0, sizeof(PNGATLAS));
+  if (pthread_mutex_init(&(pa->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pa->cond), NULL)) {
+    abort();
+  }
+  pa->count = pl->count;
+  pa->ppOrder = (PNGATLAS_SPRITE **) malloc(
+                  ((size_t) pl->count) * sizeof(PNGATLAS_SPRITE *));
+  if (pa->ppOrder == NULL) {
+    abort();
+  }
+  
+  /* Get the size of each sprite from its header */
+  for(k = 0; k < pl->count; k++) {
+    ps = &((pl->pSprites)[k]);
+    (pa->ppOrder)[k] = ps;
+    ps->pr = sph_image_reader_newFromPath(ps->pPath, &err);
+    if (ps->pr == NULL) {
+      pFailed = ps;
+      status = 0;
+      break;
+    }
+    ps->w = sph_image_reader_width(ps->pr);
+    ps->h = sph_image_reader_height(ps->pr);
+    sph_image_reader_close(ps->pr);
+    ps->pr = NULL;
+    
+    if (ps->w > widest) {
+      widest = ps->w;
+    }
+    area += ((double) (ps->w + padding)) * ((double) (ps->h + padding));
+  }
+  
+  /* Without a given width, aim for a square atlas */
+  if (status && (w < 1)) {
+    area = ceil(sqrt(area));
+    if (area > SPH_IMAGE_MAXDIM) {
+      area = SPH_IMAGE_MAXDIM;
+    }
+    w = (int32_t) area;
+    if (w < widest) {
+      w = widest;
+    }
+  }
+  
+  /* Pack the sprites */
+  if (status) {
+    if (!pngatlas_pack(pa->ppOrder, pa->count, w, padding, &(pa->h))) {
+      err = SPH_IMAGE_ERR_IMAGEDIM;
+      status = 0;
+    }
+  }
+  
+  /* Put the sprites in writing order and allocate the band buffers,
+   * which start out transparent */
+  if (status) {
+    qsort(pa->ppOrder, (size_t) pa->count, sizeof(PNGATLAS_SPRITE *),
+      &pngatlas_cmpPos);
+    pa->w = w;
+    pa->bands = (pa->h + PNGATLAS_BAND - 1) / PNGATLAS_BAND;
+    pa->pitch = w;
+    for(i = 0; i < 2; i++) {
+      (pa->pBuf)[i] = (uint32_t *) calloc(
+          ((size_t) pa->pitch) * PNGATLAS_BAND, sizeof(uint32_t));
+      if ((pa->pBuf)[i] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* Allocate writer */
+  if (status) {
+    pw = sph_image_writer_newFromPath(
+        pOutPath, pa->w, pa->h, SPH_IMAGE_DOWN_NONE, 0, &err);
+    if (pw == NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Start the workers, no more than there are sprites */
+  if (status) {
+    pa->nworkers = threads;
+    if (pa->nworkers > pa->count) {
+      pa->nworkers = (int) pa->count;
+    }
+    if (pa->nworkers > 1) {
+      for(i = 0; i < pa->nworkers; i++) {
+        workers[i].pa = pa;
+        workers[i].index = i;
+        if (pthread_create(&(tids[i]), NULL, &pngatlas_worker,
+                            &(workers[i]))) {
+          pngatlas_lock(pa);
+          pngatlas_fail(pa, SPH_IMAGE_ERR_UNKNOWN, NULL);
+          pngatlas_unlock(pa);
+          break;
+        }
+        started++;
+      }
+    }
+  }
+  
+  /* Write each band once it is decoded, clearing it for reuse */
+  for(k = 0; status && (k < pa->bands); k++) {
+    n = pa->h - k * PNGATLAS_BAND;
+    if (n > PNGATLAS_BAND) {
+      n = PNGATLAS_BAND;
+    }
+    
+    if (pa->nworkers > 1) {
+      pngatlas_lock(pa);
+      while ((!(pa->stop)) && ((pa->ready)[k % 2] < pa->nworkers)) {
+        if (pthread_cond_wait(&(pa->cond), &(pa->lock))) {
+          abort();
+        }
+      }
+      quit = pa->stop;
+      pngatlas_unlock(pa);
+      if (quit) {
+        status = 0;
+        break;
+      }
+    
+    } else {
+      if (!pngatlas_decode(pa, 1, &next, k, &err, &pFailed)) {
+        status = 0;
+        break;
+      }
+    }
+    
+    if (!sph_image_writer_writeRows(
+            pw, (pa->pBuf)[k % 2], pa->pitch, n, &err)) {
+      status = 0;
+    }
+    memset((pa->pBuf)[k % 2], 0,
+      ((size_t) pa->pitch) * PNGATLAS_BAND * sizeof(uint32_t));
+    
+    pngatlas_lock(pa);
+    if (status) {
+      (pa->ready)[k % 2] = 0;
+      pa->written = k + 1;
+      if (pthread_cond_broadcast(&(pa->cond))) {
+        abort();
+      }
+    } else {
+      pngatlas_fail(pa, err, NULL);
+    }
+    pngatlas_unlock(pa);
+  }
+  
+  /* Wait for the workers */
+  for(i = 0; i < started; i++) {
+    if (pthread_join(tids[i], NULL)) {
+      abort();
+    }
+  }
+  if (pa->stop) {
+    status = 0;
+    err = pa->errcode;
+    pFailed = pa->pFailed;
+  }
+  
+  if (status) {
+    *pWidth = pa->w;
+    *pHeight = pa->h;
+  } else {
+    *ppFailed = pFailed;
+  }
+  
+  /* Release everything, including sprites left open by an error */
+  sph_image_writer_close(pw);
+  for(k = 0; k < pl->count; k++) {
+    sph_image_reader_close((pl->pSprites)[k].pr);
+    (pl->pSprites)[k].pr = NULL;
+  }
+  free((pa->pBuf)[0]);
+  free((pa->pBuf)[1]);
+  free(pa->ppOrder);
+  if (pthread_cond_destroy(&(pa->cond))) {
+    abort();
+  }
+  if (pthread_mutex_destroy(&(pa->lock))) {
+    abort();
+  }
+  free(pa);
+  
+  /* Set error code if provided */
+  if (pError != NULL) {
+    if (status) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    } else {
+      *pError = err;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Program entrypoint.
+ */
+int main(int argc, char *argv[]) {
+  
+  int status = 1;
+  int errcode = 0;
+  int x = 0;
+  int threads = 0;
+  int32_t i = 0;
+  int32_t w = 0;
+  int32_t h = 0;
+  int32_t padding = 0;
+  long lv = 0;
+  char *pEnd = NULL;
+  const char *pJsonPath = NULL;
+  const char *pCsvPath = NULL;
+  const PNGATLAS_SPRITE *pFailed = NULL;
+  PNGATLAS_LIST sprites;
+  
+  const char *pModuleName = NULL;
+  
+  /* Initialize structures */
+  memset(&sprites, 0, sizeof(PNGATLAS_LIST));
+  
+  /* Determine the module name */
+  if (argc >= 1) {
+    if (argv != NULL) {
+      pModuleName = argv[0];
+    }
+  }
+  if (pModuleName == NULL) {
+    pModuleName = "pngatlas";
+  }
+  
+  /* We must have at least 1 parameter (plus the module name) */
+  if (argc < 2) {
+    fprintf(stderr, "%s: Unexpected number of parameters!\n",
+      pModuleName);
+    status = 0;
+  }
+  
+  /* Verify all parameters exist */
+  if (status) {
+    if (argv == NULL) {
+      abort();
+    }
+    for(x = 0; x < argc; x++) {
+      if (argv[x] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* Sprites and options follow the output path */
+  x = 2;
+  while (status && (x < argc)) {
+    if ((strcmp(argv[x], "-threads") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 1) || (lv > PNGATLAS_MAX_THREADS)) {
+        fprintf(stderr, "%s: Invalid thread count!\n", pModuleName);
+        status = 0;
+      }
+      threads = (int) lv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-width") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 1) || (lv > SPH_IMAGE_MAXDIM)) {
+        fprintf(stderr, "%s: Invalid atlas width!\n", pModuleName);
+        status = 0;
+      }
+      w = (int32_t) lv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-padding") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 0) || (lv > PNGATLAS_MAX_PADDING)) {
+        fprintf(stderr, "%s: Invalid padding!\n", pModuleName);
+        status = 0;
+      }
+      padding = (int32_t) lv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-json") == 0) && (x + 1 < argc)) {
+      pJsonPath = argv[x + 1];
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-csv") == 0) && (x + 1 < argc)) {
+      pCsvPath = argv[x + 1];
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-list") == 0) && (x + 1 < argc)) {
+      if (!pngatlas_readList(&sprites, argv[x + 1])) {
+        fprintf(stderr, "%s: Can't read sprite list %s!\n",
+          pModuleName, argv[x + 1]);
+        status = 0;
+      }
+      x += 2;
+    
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "%s: Unrecognized option %s!\n",
+        pModuleName, argv[x]);
+      status = 0;
+    
+    } else {
+      if (!pngatlas_add(&sprites, argv[x])) {
+        fprintf(stderr, "%s: Too many sprites!\n", pModuleName);
+        status = 0;
+      }
+      x++;
+    }
+  }
+  
+  /* There must be at least one sprite */
+  if (status && (sprites.count < 1)) {
+    fprintf(stderr, "%s: No sprites given!\n", pModuleName);
+    status = 0;
+  }
+  
+  /* If no thread count was given, use one thread per processor */
+  if (status && (threads < 1)) {
+    lv = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lv < 1) {
+      lv = 1;
+    } else if (lv > PNGATLAS_MAX_THREADS) {
+      lv = PNGATLAS_MAX_THREADS;
+    }
+    threads = (int) lv;
+  }
+  
+  /* Call through to program function */
+  if (status) {
+    if (!pngatlas(argv[1], &sprites, w, padding, threads,
+                    &w, &h, &pFailed, &errcode)) {
+      if (pFailed != NULL) {
+        fprintf(stderr, "%s: %s: %s!\n",
+          pModuleName,
+          pFailed->pPath,
+          sph_image_errorString(errcode));
+      } else {
+        fprintf(stderr, "%s: %s!\n",
+          pModuleName,
+          sph_image_errorString(errcode));
+      }
+      status = 0;
+    }
+  }
+  
+  /* Write the placement maps */
+  if (status && (pJsonPath != NULL)) {
+    if (!pngatlas_writeMap(pJsonPath, 1, &sprites, w, h)) {
+      fprintf(stderr, "%s: Can't write map %s!\n",
+        pModuleName, pJsonPath);
+      status = 0;
+    }
+  }
+  if (status && (pCsvPath != NULL)) {
+    if (!pngatlas_writeMap(pCsvPath, 0, &sprites, w, h)) {
+      fprintf(stderr, "%s: Can't write map %s!\n",
+        pModuleName, pCsvPath);
+      status = 0;
+    }
+  }
+  
+  if (status) {
+    printf("%s: packed %ld sprites into %ldx%ld\n",
+      pModuleName, (long) sprites.count, (long) w, (long) h);
+  }
+  
+  /* Free the sprite list */
+  for(i = 0; i < sprites.count; i++) {
+    free((sprites.pSprites)[i].pPath);
+  }
+  free(sprites.pSprites);
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
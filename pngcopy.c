@@ -5,28 +5,950 @@
  */
 #include "sophistry.h"
 #include <limits.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * The maximum number of compression trials and trial threads.
+ */
+#define PNGCOPY_MAX_TRIALS (64)
+#define PNGCOPY_MAX_THREADS (64)
+
+/*
+ * The largest Gaussian blur radius and sharpening amount.  The blur
+ * kernel reaches out three times the radius, which must fit in
+ * SPH_IMAGE_CONVOLVE_MAXTAPS.
+ */
+#define PNGCOPY_MAX_BLUR (10.0)
+#define PNGCOPY_MAX_SHARPEN (2.0)
+
+/*
+ * The range of gamma adjustments.
+ */
+#define PNGCOPY_MIN_GAMMA (0.1)
+#define PNGCOPY_MAX_GAMMA (10.0)
+
+/*
+ * Structure describing a resize and filtering of the image while it is
+ * copied.
+ */
+typedef struct {
+  
+  /*
+   * The requested output width and height in pixels.
+   * 
+   * If one of them is zero, it is computed from the other so that the
+   * aspect ratio of the input is kept.  If both are zero, the image is
+   * not resized.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The SPH_IMAGE_KERNEL constant and the flags passed to
+   * sph_image_resampler_new().
+   */
+  int kernel;
+  int flags;
+  
+  /*
+   * The standard deviation in pixels of a Gaussian blur applied after
+   * resizing, or zero for no blur.
+   */
+  double blur;
+  
+  /*
+   * The amount of sharpening applied after resizing and blurring, or
+   * zero for no sharpening.
+   */
+  double sharpen;
+  
+  /*
+   * The gamma adjustment applied to the color channels while decoding,
+   * or zero for none.  Values above one brighten the image.
+   */
+  double gamma;
+
+} PNGCOPY_RESIZE;
+
+/*
+ * Structure describing one compression trial.
+ */
+typedef struct {
+  
+  /*
+   * The compression parameters passed to
+   * sph_image_writer_setCompression().
+   */
+  int level;
+  int strategy;
+  int filters;
+  
+  /*
+   * The results of the trial.
+   * 
+   * status is non-zero if the trial succeeded, errcode is the error
+   * code if it failed, and size is the size in bytes of the output
+   * file if it succeeded.
+   */
+  int status;
+  int errcode;
+  long size;
+
+} PNGCOPY_TRIAL;
+
+/*
+ * Structure holding a decoded copy of the output image, so that the
+ * compression trials don't need to decode the input again.
+ */
+typedef struct {
+  
+  /*
+   * The packed ARGB pixels of the image, one scanline after another
+   * without padding, or NULL if the image couldn't be kept.  The buffer
+   * is allocated with malloc().
+   */
+  uint32_t *pPixels;
+  
+  /*
+   * The width and height of the image in pixels.
+   */
+  int32_t w;
+  int32_t h;
+
+} PNGCOPY_IMAGE;
+
+/*
+ * Structure shared between the trial worker threads.
+ */
+typedef struct {
+  
+  /*
+   * Lock protecting the next field.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * The index of the next trial that no thread has claimed.
+   */
+  int next;
+  
+  /*
+   * The trials to run.
+   */
+  PNGCOPY_TRIAL *pTrials;
+  int count;
+  
+  /*
+   * The copy operation parameters.
+   * 
+   * If the pPixels field of pImage isn't NULL, the trials only encode
+   * that image.  Otherwise, each trial copies the input image in full.
+   */
+  const char *pOutPath;
+  const char *pInPath;
+  int dconv;
+  const PNGCOPY_RESIZE *pResize;
+  const PNGCOPY_IMAGE *pImage;
+
+} PNGCOPY_POOL;
+
+/*
+ * The default trial set, used when "-trials default" is given.
+ */
+static const PNGCOPY_TRIAL m_default_trials[] = {
+  {9, SPH_IMAGE_STRATEGY_FILTERED, SPH_IMAGE_FILTER_ALL,   0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_DEFAULT,  SPH_IMAGE_FILTER_ALL,   0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_DEFAULT,  SPH_IMAGE_FILTER_NONE,  0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_FILTERED, SPH_IMAGE_FILTER_SUB,   0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_FILTERED, SPH_IMAGE_FILTER_UP,    0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_FILTERED, SPH_IMAGE_FILTER_PAETH, 0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_DEFAULT,  SPH_IMAGE_FILTER_PAETH, 0, 0, 0},
+  {9, SPH_IMAGE_STRATEGY_RLE,      SPH_IMAGE_FILTER_ALL,   0, 0, 0}
+};
+
+/*
+ * Names of the compression strategies, indexed by SPH_IMAGE_STRATEGY
+ * constant.
+ */
+static const char *const m_strategy_names[] = {
+  "auto", "default", "filtered", "huffman", "rle", "fixed"
+};
+
+/*
+ * Names of the PNG filters, indexed by bit position in the
+ * SPH_IMAGE_FILTER flags.
+ */
+static const char *const m_filter_names[] = {
+  "none", "sub", "up", "avg", "paeth"
+};
+
+/*
+ * Names of the resampling kernels, indexed by SPH_IMAGE_KERNEL constant
+ * minus one.
+ */
+static const char *const m_kernel_names[] = {
+  "box", "triangle", "cubic", "lanczos"
+};
+
+/*
+ * Add the filtering stages of a resize to the end of a pipeline.
+ * 
+ * A blur is a separable Gaussian kernel reaching out three standard
+ * deviations.  Sharpening subtracts amount times the four neighbors
+ * of each pixel from (1 + 4 * amount) times the pixel, which boosts
+ * edges without changing flat areas.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline
+ * 
+ *   pResize - the resize
+ */
+static void pngcopy_addFilters(
+          SPH_IMAGE_PIPELINE * pp,
+    const PNGCOPY_RESIZE     * pResize) {
+  
+  int32_t r = 0;
+  int32_t i = 0;
+  double sum = 0.0;
+  double g[SPH_IMAGE_CONVOLVE_MAXTAPS];
+  double k[9];
+  
+  /* Initialize buffers */
+  memset(g, 0, sizeof(g));
+  memset(k, 0, sizeof(k));
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pResize == NULL)) {
+    abort();
+  }
+  if ((pResize->blur < 0.0) || (pResize->blur > PNGCOPY_MAX_BLUR) ||
+      (pResize->sharpen < 0.0) ||
+      (pResize->sharpen > PNGCOPY_MAX_SHARPEN)) {
+    abort();
+  }
+  
+  /* Add the blur, with weights adding up to one */
+  if (pResize->blur > 0.0) {
+    r = (int32_t) ceil(3.0 * pResize->blur);
+    for(i = -r; i <= r; i++) {
+      g[i + r] = exp(-((double) (i * i)) /
+                      (2.0 * pResize->blur * pResize->blur));
+      sum += g[i + r];
+    }
+    for(i = 0; i < 2 * r + 1; i++) {
+      g[i] /= sum;
+    }
+    sph_image_pipeline_addSeparable(pp, 2 * r + 1, g, 2 * r + 1, g, 0, 0);
+  }
+  
+  /* Add the sharpening */
+  if (pResize->sharpen > 0.0) {
+    k[1] = -(pResize->sharpen);
+    k[3] = -(pResize->sharpen);
+    k[4] = 1.0 + 4.0 * pResize->sharpen;
+    k[5] = -(pResize->sharpen);
+    k[7] = -(pResize->sharpen);
+    sph_image_pipeline_addConvolution(pp, 3, 3, k, 0, 0);
+  }
+}
+
+/*
+ * Apply the gamma adjustment of a resize to an image reader.
+ * 
+ * The adjustment becomes tone curves of the reader, so it is done while
+ * decoding at no extra cost.  Alpha is left alone.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader
+ * 
+ *   pResize - the resize
+ */
+static void pngcopy_setGamma(
+          SPH_IMAGE_READER * pr,
+    const PNGCOPY_RESIZE   * pResize) {
+  
+  int i = 0;
+  int c = 0;
+  uint8_t v = 0;
+  uint8_t tables[1024];
+  
+  /* Initialize buffers */
+  memset(tables, 0, sizeof(tables));
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pResize == NULL)) {
+    abort();
+  }
+  if ((pResize->gamma < PNGCOPY_MIN_GAMMA) ||
+      (pResize->gamma > PNGCOPY_MAX_GAMMA)) {
+    abort();
+  }
+  
+  /* Build the identity alpha table and the three color tables */
+  for(i = 0; i < 256; i++) {
+    tables[i] = (uint8_t) i;
+    v = (uint8_t) floor(
+          255.0 * pow(((double) i) / 255.0, 1.0 / pResize->gamma) + 0.5);
+    for(c = 1; c < 4; c++) {
+      tables[c * 256 + i] = v;
+    }
+  }
+  
+  sph_image_reader_setCurves(pr, tables);
+}
+
+/*
+ * Keep a copy of each output scanline of a pipeline.
+ * 
+ * This is the rowFn callback of the stage that pngcopy() adds to the
+ * end of the pipeline to keep the image.  The scanline is passed on
+ * unchanged and also copied into its place in the image buffer.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the PNGCOPY_IMAGE structure
+ * 
+ *   y - the output scanline
+ * 
+ *   first - the first input scanline of the window
+ * 
+ *   ppIn - the input scanlines of the window
+ * 
+ *   pOut - the output scanline
+ * 
+ * Return:
+ * 
+ *   non-zero
+ */
+static int pngcopy_keepRow(
+          void            * pParam,
+          int32_t           y,
+          int32_t           first,
+    const uint32_t *const * ppIn,
+          uint32_t        * pOut) {
+  
+  PNGCOPY_IMAGE *pi = NULL;
+  
+  /* Check parameters */
+  pi = (PNGCOPY_IMAGE *) pParam;
+  if ((pi == NULL) || (pi->pPixels == NULL) ||
+      (ppIn == NULL) || (ppIn[0] == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((y < 0) || (y >= pi->h) || (first != y)) {
+    abort();
+  }
+  
+  /* Pass the scanline on and keep it */
+  memcpy(pOut, ppIn[0], ((size_t) pi->w) * sizeof(uint32_t));
+  memcpy(pi->pPixels + ((size_t) y) * ((size_t) pi->w), ppIn[0],
+          ((size_t) pi->w) * sizeof(uint32_t));
+  
+  /* Return */
+  return 1;
+}
+
+/*
+ * Perform the image copy operation.
+ * 
+ * pOutPath and pInPath specify the output and input image paths,
+ * respectively.
+ * 
+ * dconv is the down-conversion to use.  It must be one of the constants
+ * SPH_IMAGE_DOWN defined by Sophistry.
+ * 
+ * pResize is optionally the resize to apply.  If NULL, or if the
+ * requested size is the size of the input, the image keeps its size.
+ * Otherwise, the scanlines go through a Sophistry pipeline with a
+ * resampling stage, which decodes on its own thread while the calling
+ * thread resamples and encodes.  When reducing by a large
+ * ratio without linear light, the reader first reduces the image by an
+ * integer factor, so that the resampler is left with a ratio between
+ * four and eight, which is much faster and keeps the filter precise.
+ * Any blur or sharpening of pResize is applied after resizing, as
+ * further stages of the pipeline, and any gamma adjustment is applied
+ * by the reader while decoding.
+ * 
+ * pTrial is optionally a trial whose compression parameters are used
+ * for the output image.  If NULL, the default parameters are used.  The
+ * result fields of the trial are not modified.
+ * 
+ * pKeep is optionally a structure that receives a decoded copy of the
+ * output image, so that it can be encoded again without decoding the
+ * input.  The scanlines are copied into a buffer by a last stage of
+ * the pipeline while they are encoded.  If the buffer can't be
+ * allocated, or if the function fails, the pPixels field of pKeep is
+ * NULL.  Otherwise, the caller must free() it.
+ * 
+ * pError is optionally a pointer to an integer that receives an error
+ * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
+ * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).
+ * 
+ * The input image is read by Sophistry and a copy is written to the
+ * output image using Sophistry.  This can be used to strip unnecessary
+ * metadata and apply down-conversion.  The image will be completely
+ * re-encoded.
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   pInPath - the input image file path
+ *  
+ *   dconv - the down-conversion setting
+ * 
+ *   pResize - the resize to apply, or NULL
+ * 
+ *   pTrial - the compression parameters, or NULL
+ * 
+ *   pKeep - receives a copy of the output image, or NULL
+ * 
+ *   pError - pointer to the error code return, or NULL
+ */
+static int pngcopy(
+    const char           * pOutPath,
+    const char           * pInPath,
+          int              dconv,
+    const PNGCOPY_RESIZE * pResize,
+    const PNGCOPY_TRIAL  * pTrial,
+          PNGCOPY_IMAGE  * pKeep,
+          int            * pError) {
+  
+  int status = 1;
+  int filtered = 0;
+  int32_t sw = 0;
+  int32_t sh = 0;
+  int32_t w = 0;
+  int32_t h = 0;
+  int32_t y = 0;
+  int32_t factor = 0;
+  int64_t lv = 0;
+  SPH_IMAGE_READER *pr = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  SPH_IMAGE_PIPELINE *pp = NULL;
+  SPH_IMAGE_STAGE st;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(SPH_IMAGE_STAGE));
+
+  /* Check parameters */
+  if ((pOutPath == NULL) || (pInPath == NULL)) {
+    abort();
+  }
+  if (((dconv & ~SPH_IMAGE_DOWN_QUANTIZE) < SPH_IMAGE_DOWN_NONE) ||
+      ((dconv & ~SPH_IMAGE_DOWN_QUANTIZE) > SPH_IMAGE_DOWN_GRAY4)) {
+    abort();
+  }
+  
+  /* Clear error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Nothing kept yet */
+  if (pKeep != NULL) {
+    memset(pKeep, 0, sizeof(PNGCOPY_IMAGE));
+  }
+  
+  /* Allocate reader */
+  pr = sph_image_reader_newFromPath(pInPath, pError);
+  if (pr == NULL) {
+    status = 0;
+  }
+  
+  /* Adjust gamma while decoding if requested */
+  if (status && (pResize != NULL) && (pResize->gamma > 0.0)) {
+    pngcopy_setGamma(pr, pResize);
+  }
+  
+  /* Determine the output size */
+  if (status) {
+    sw = sph_image_reader_width(pr);
+    sh = sph_image_reader_height(pr);
+    w = sw;
+    h = sh;
+    if ((pResize != NULL) && ((pResize->w > 0) || (pResize->h > 0))) {
+      w = pResize->w;
+      h = pResize->h;
+      if (w < 1) {
+        lv = (((int64_t) sw) * h + (sh / 2)) / sh;
+        w = (int32_t) ((lv < 1) ? 1 :
+                        ((lv > SPH_IMAGE_MAXDIM) ? SPH_IMAGE_MAXDIM : lv));
+      } else if (h < 1) {
+        lv = (((int64_t) sh) * w + (sw / 2)) / sw;
+        h = (int32_t) ((lv < 1) ? 1 :
+                        ((lv > SPH_IMAGE_MAXDIM) ? SPH_IMAGE_MAXDIM : lv));
+      }
+    }
+  }
+  
+  /* Allocate the buffer that keeps the image if requested; if the image
+   * is too large for memory, it just isn't kept */
+  if (status && (pKeep != NULL)) {
+    pKeep->w = w;
+    pKeep->h = h;
+    if (((uint64_t) w) * ((uint64_t) h) <=
+          ((uint64_t) (SIZE_MAX / sizeof(uint32_t)))) {
+      pKeep->pPixels = (uint32_t *) malloc(
+                          ((size_t) w) * ((size_t) h) * sizeof(uint32_t));
+    }
+  }
+  
+  /* Set up the pipeline if the size changes, there are filters, or the
+   * image is kept, reducing while decoding first if the ratio is large */
+  if (status && (pResize != NULL) &&
+      ((pResize->blur > 0.0) || (pResize->sharpen > 0.0))) {
+    filtered = 1;
+  }
+  if (status && ((w != sw) || (h != sh) || filtered ||
+                  ((pKeep != NULL) && (pKeep->pPixels != NULL)))) {
+    if (((w != sw) || (h != sh)) &&
+        (!(pResize->flags & SPH_IMAGE_RESAMPLE_LINEAR))) {
+      factor = sw / w;
+      if (sh / h < factor) {
+        factor = sh / h;
+      }
+      factor = factor / 4;
+      if (factor >= 2) {
+        sph_image_reader_setReduce(pr, factor);
+        sw = sph_image_reader_width(pr);
+        sh = sph_image_reader_height(pr);
+      }
+    }
+    pp = sph_image_pipeline_new(pr);
+    if ((w != sw) || (h != sh)) {
+      sph_image_pipeline_addResampler(
+        pp, w, h, pResize->kernel, pResize->flags);
+    }
+    if (filtered) {
+      pngcopy_addFilters(pp, pResize);
+    }
+    if ((pKeep != NULL) && (pKeep->pPixels != NULL)) {
+      st.w = w;
+      st.h = h;
+      st.window = 1;
+      st.lastFn = NULL;
+      st.rowFn = &pngcopy_keepRow;
+      st.pParam = pKeep;
+      sph_image_pipeline_addStage(pp, &st);
+    }
+    sph_image_pipeline_setThreaded(pp, 1);
+  }
+  
+  /* Allocate writer */
+  if (status) {
+    pw = sph_image_writer_newFromPath(
+        pOutPath,
+        w,
+        h,
+        dconv,
+        0,
+        pError);
+    if (pw == NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Apply compression parameters if given */
+  if (status && (pTrial != NULL)) {
+    sph_image_writer_setCompression(
+      pw, pTrial->level, pTrial->strategy, pTrial->filters);
+  }
+  
+  /* Transfer each row */
+  if (status && (pp != NULL)) {
+    /* Resizing or filtering -- run the pipeline */
+    if (!sph_image_pipeline_run(pp, pw, pError)) {
+      status = 0;
+    }
+  
+  } else if (status) {
+    /* Same size -- go row by row */
+    for(y = 0; y < h; y++) {
+      /* Read a row straight into the scanline buffer of the writer */
+      if (!sph_image_reader_readInto(
+              pr, sph_image_writer_ptr(pw), pError)) {
+        status = 0;
+        break;
+      }
+      
+      /* Write the scanline */
+      if (!sph_image_writer_writeEx(pw, pError)) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  /* Close objects if open */
+  sph_image_pipeline_free(pp);
+  sph_image_writer_close(pw);
+  sph_image_reader_close(pr);
+  
+  /* Drop the kept image if there was an error */
+  if ((!status) && (pKeep != NULL)) {
+    free(pKeep->pPixels);
+    pKeep->pPixels = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Encode a decoded image to an output file.
+ * 
+ * This is the encoding step of pngcopy(), for an image that it kept.
+ * pOutPath, dconv, pTrial, and pError are the same as for pngcopy().
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   pImage - the image to encode
+ * 
+ *   dconv - the down-conversion setting
+ * 
+ *   pTrial - the compression parameters, or NULL
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngcopy_encode(
+    const char          * pOutPath,
+    const PNGCOPY_IMAGE * pImage,
+          int             dconv,
+    const PNGCOPY_TRIAL * pTrial,
+          int           * pError) {
+  
+  int status = 1;
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if ((pOutPath == NULL) || (pImage == NULL) ||
+      (pImage->pPixels == NULL)) {
+    abort();
+  }
+  
+  /* Clear error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Allocate writer */
+  pw = sph_image_writer_newFromPath(
+      pOutPath,
+      pImage->w,
+      pImage->h,
+      dconv,
+      0,
+      pError);
+  if (pw == NULL) {
+    status = 0;
+  }
+  
+  /* Apply compression parameters if given */
+  if (status && (pTrial != NULL)) {
+    sph_image_writer_setCompression(
+      pw, pTrial->level, pTrial->strategy, pTrial->filters);
+  }
+  
+  /* Write all the scanlines in one batch */
+  if (status) {
+    if (!sph_image_writer_writeRows(
+            pw, pImage->pPixels, pImage->w, pImage->h, pError)) {
+      status = 0;
+    }
+  }
+  
+  /* Close writer if open */
+  sph_image_writer_close(pw);
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Perform the image copy operation, trimming away the background
+ * around the image.
+ * 
+ * pOutPath and pInPath specify the output and input image paths,
+ * respectively, and dconv is the down-conversion to use, as for
+ * pngcopy().  mode is the SPH_IMAGE_TRIM background mode.
+ * 
+ * The input image is decoded once to find the bounding box of the
+ * pixels that aren't background, and only that box is written to the
+ * output.  On success, the offsets of the box within the input image
+ * are written to pX and pY, so that the trimmed image can be put back
+ * in place.
+ * 
+ * pError is optionally a pointer to an integer that receives an error
+ * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
+ * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   pInPath - the input image file path
+ *  
+ *   dconv - the down-conversion setting
+ * 
+ *   mode - the background mode
+ * 
+ *   pX - receives the left offset of the box
+ * 
+ *   pY - receives the top offset of the box
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngcopy_trim(
+    const char    * pOutPath,
+    const char    * pInPath,
+          int       dconv,
+          int       mode,
+          int32_t * pX,
+          int32_t * pY,
+          int     * pError) {
+  
+  int status = 1;
+  SPH_IMAGE_TRIM *pt = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if ((pOutPath == NULL) || (pInPath == NULL) ||
+      (pX == NULL) || (pY == NULL)) {
+    abort();
+  }
+  
+  /* Clear error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Find the bounding box */
+  pt = sph_image_trim_new(pInPath);
+  sph_image_trim_setBackground(pt, mode, 0);
+  if (!sph_image_trim_measure(pt, pError)) {
+    status = 0;
+  }
+  
+  /* Allocate writer */
+  if (status) {
+    pw = sph_image_writer_newFromPath(
+        pOutPath,
+        sph_image_trim_width(pt),
+        sph_image_trim_height(pt),
+        dconv,
+        0,
+        pError);
+    if (pw == NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Write the box */
+  if (status) {
+    if (!sph_image_trim_run(pt, pw, pError)) {
+      status = 0;
+    }
+  }
+  
+  if (status) {
+    *pX = sph_image_trim_x(pt);
+    *pY = sph_image_trim_y(pt);
+  }
+  
+  /* Close objects if open */
+  sph_image_writer_close(pw);
+  sph_image_trim_free(pt);
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Form the path of the temporary output file of a trial.
+ * 
+ * The path is the output path followed by ".trial", the trial index,
+ * and ".png", so that Sophistry still recognizes the file type.  The
+ * returned string is dynamically allocated and must be freed by the
+ * caller.
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   i - the trial index
+ * 
+ * Return:
+ * 
+ *   the temporary file path
+ */
+static char *pngcopy_trialPath(const char *pOutPath, int i) {
+  
+  char *pPath = NULL;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if ((pOutPath == NULL) || (i < 0)) {
+    abort();
+  }
+  
+  /* Allocate and form the path */
+  len = strlen(pOutPath) + 32;
+  pPath = (char *) malloc(len);
+  if (pPath == NULL) {
+    abort();
+  }
+  sprintf(pPath, "%s.trial%d.png", pOutPath, i);
+  
+  /* Return path */
+  return pPath;
+}
+
+/*
+ * Record the size of the temporary output file of a trial.
+ * 
+ * If the size can't be determined, the trial fails.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trial, which must have succeeded
+ * 
+ *   pPath - the temporary file path
+ */
+static void pngcopy_measure(PNGCOPY_TRIAL *pt, const char *pPath) {
+  
+  FILE *fh = NULL;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Measure the output */
+  fh = fopen(pPath, "rb");
+  if (fh != NULL) {
+    if (fseek(fh, 0, SEEK_END) == 0) {
+      pt->size = ftell(fh);
+    } else {
+      pt->size = -1;
+    }
+    fclose(fh);
+    fh = NULL;
+  } else {
+    pt->size = -1;
+  }
+  if (pt->size < 0) {
+    pt->status = 0;
+    pt->errcode = SPH_IMAGE_ERR_UNKNOWN;
+  }
+}
+
 /*
- * Perform the image copy operation.
+ * Trial worker thread.
  * 
- * pOutPath and pInPath specify the output and input image paths,
- * respectively.
+ * Each worker repeatedly claims the next trial that hasn't been run,
+ * encodes the kept image to that trial's temporary file with its
+ * compression parameters, and records the result in the trial
+ * structure.  If no image was kept, the whole copy is done instead.
+ * The worker returns when there are no more trials.
  * 
- * dconv is the down-conversion to use.  It must be one of the constants
- * SPH_IMAGE_DOWN defined by Sophistry.
+ * Parameters:
  * 
- * pError is optionally a pointer to an integer that receives an error
- * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
- * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).
+ *   pParam - the PNGCOPY_POOL structure
  * 
- * The input image is read by Sophistry and a copy is written to the
- * output image using Sophistry.  This can be used to strip unnecessary
- * metadata and apply down-conversion.  The image will be completely
- * re-encoded.
+ * Return:
+ * 
+ *   NULL
+ */
+static void *pngcopy_worker(void *pParam) {
+  
+  PNGCOPY_POOL *pp = NULL;
+  PNGCOPY_TRIAL *pt = NULL;
+  char *pPath = NULL;
+  int i = 0;
+  
+  /* Check parameter */
+  if (pParam == NULL) {
+    abort();
+  }
+  pp = (PNGCOPY_POOL *) pParam;
+  
+  /* Run trials until there are none left */
+  for( ; ; ) {
+    /* Claim the next trial */
+    if (pthread_mutex_lock(&(pp->lock))) {
+      abort();
+    }
+    i = pp->next;
+    if (i < pp->count) {
+      (pp->next)++;
+    }
+    if (pthread_mutex_unlock(&(pp->lock))) {
+      abort();
+    }
+    if (i >= pp->count) {
+      break;
+    }
+    
+    /* Run the trial */
+    pt = &((pp->pTrials)[i]);
+    pPath = pngcopy_trialPath(pp->pOutPath, i);
+    if (pp->pImage->pPixels != NULL) {
+      pt->status = pngcopy_encode(pPath, pp->pImage, pp->dconv,
+                                  pt, &(pt->errcode));
+    } else {
+      pt->status = pngcopy(pPath, pp->pInPath, pp->dconv, pp->pResize,
+                            pt, NULL, &(pt->errcode));
+    }
+    
+    /* Measure the output */
+    if (pt->status) {
+      pngcopy_measure(pt, pPath);
+    }
+    
+    free(pPath);
+    pPath = NULL;
+  }
+  
+  /* Return */
+  return NULL;
+}
+
+/*
+ * Perform the image copy operation with several compression trials.
+ * 
+ * Each trial encodes the image to a temporary file next to the output
+ * file with its own compression parameters.  The input is only decoded
+ * once, by the first trial, which keeps a copy of the decoded and
+ * resized image in memory.  The other trials then just encode that
+ * copy, concurrently on a pool of threads.  If the image is too large
+ * to keep, each of the other trials copies the input in full instead.
+ * The smallest successful result
+ * is renamed to the output path and all other temporary files are
+ * removed.
+ * 
+ * The result fields of each trial are filled in.  If at least one
+ * trial succeeds, *pBest receives the index of the winning trial.
+ * Otherwise, the function fails with the error of the first trial.
  * 
  * Parameters:
  * 
@@ -36,29 +958,54 @@
  *  
  *   dconv - the down-conversion setting
  * 
+ *   pResize - the resize to apply, or NULL
+ * 
+ *   pTrials - the trials to run
+ * 
+ *   count - the number of trials
+ * 
+ *   threads - the number of worker threads
+ * 
+ *   pBest - receives the index of the winning trial
+ * 
  *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if all trials failed
  */
-static int pngcopy(
-    const char * pOutPath,
-    const char * pInPath,
-           int   dconv,
-           int * pError) {
+static int pngcopy_trials(
+    const char           * pOutPath,
+    const char           * pInPath,
+          int              dconv,
+    const PNGCOPY_RESIZE * pResize,
+          PNGCOPY_TRIAL  * pTrials,
+          int              count,
+          int              threads,
+          int            * pBest,
+          int            * pError) {
   
   int status = 1;
-  int32_t h = 0;
-  int32_t y = 0;
-  int32_t w = 0;
-  uint32_t *ps = NULL;
-  SPH_IMAGE_READER *pr = NULL;
-  SPH_IMAGE_WRITER *pw = NULL;
-
+  int i = 0;
+  int best = -1;
+  int copied = 0;
+  char *pPath = NULL;
+  PNGCOPY_POOL pool;
+  PNGCOPY_IMAGE image;
+  pthread_t tids[PNGCOPY_MAX_THREADS];
+  
+  /* Initialize structures */
+  memset(&pool, 0, sizeof(PNGCOPY_POOL));
+  memset(&image, 0, sizeof(PNGCOPY_IMAGE));
+  memset(tids, 0, sizeof(tids));
+  
   /* Check parameters */
-  if ((pOutPath == NULL) || (pInPath == NULL)) {
+  if ((pOutPath == NULL) || (pInPath == NULL) ||
+      (pTrials == NULL) || (pBest == NULL)) {
     abort();
   }
-  if ((dconv != SPH_IMAGE_DOWN_NONE) &&
-      (dconv != SPH_IMAGE_DOWN_RGB) &&
-      (dconv != SPH_IMAGE_DOWN_GRAY)) {
+  if ((count < 1) || (count > PNGCOPY_MAX_TRIALS) ||
+      (threads < 1) || (threads > PNGCOPY_MAX_THREADS)) {
     abort();
   }
   
@@ -67,60 +1014,294 @@ static int pngcopy(
     *pError = SPH_IMAGE_ERR_NONE;
   }
   
-  /* Allocate reader */
-  pr = sph_image_reader_newFromPath(pInPath, pError);
-  if (pr == NULL) {
-    status = 0;
+  /* The first trial runs on its own, so there is no point in having
+   * more threads than the other trials */
+  if (threads > count - 1) {
+    threads = count - 1;
   }
   
-  /* Allocate writer */
-  if (status) {
-    pw = sph_image_writer_newFromPath(
-        pOutPath,
-        sph_image_reader_width(pr),
-        sph_image_reader_height(pr),
-        dconv,
-        0,
-        pError);
-    if (pw == NULL) {
-      status = 0;
+  for(i = 0; i < count; i++) {
+    pTrials[i].status = 0;
+    pTrials[i].errcode = SPH_IMAGE_ERR_NONE;
+    pTrials[i].size = 0;
+  }
+  
+  /* Run the first trial, decoding the input and keeping the image */
+  pPath = pngcopy_trialPath(pOutPath, 0);
+  copied = pngcopy(pPath, pInPath, dconv, pResize,
+                    &(pTrials[0]), &image, &(pTrials[0].errcode));
+  pTrials[0].status = copied;
+  if (copied) {
+    pngcopy_measure(&(pTrials[0]), pPath);
+  }
+  free(pPath);
+  pPath = NULL;
+  
+  /* If the input can't be copied, the other trials would fail the same
+   * way, so they are skipped; otherwise, they share the kept image */
+  if (!copied) {
+    threads = 0;
+  }
+  
+  /* Set up the shared pool */
+  if (pthread_mutex_init(&(pool.lock), NULL)) {
+    abort();
+  }
+  pool.next = 1;
+  pool.pTrials = pTrials;
+  pool.count = count;
+  pool.pOutPath = pOutPath;
+  pool.pInPath = pInPath;
+  pool.dconv = dconv;
+  pool.pResize = pResize;
+  pool.pImage = &image;
+  
+  /* Run the trials on the worker threads */
+  for(i = 0; i < threads; i++) {
+    if (pthread_create(&(tids[i]), NULL, &pngcopy_worker, &pool)) {
+      abort();
+    }
+  }
+  for(i = 0; i < threads; i++) {
+    if (pthread_join(tids[i], NULL)) {
+      abort();
     }
   }
   
-  /* Transfer each row */
+  if (pthread_mutex_destroy(&(pool.lock))) {
+    abort();
+  }
+  
+  /* Release the kept image */
+  free(image.pPixels);
+  image.pPixels = NULL;
+  
+  /* Find the smallest result; on ties, the earliest trial wins */
+  for(i = 0; i < count; i++) {
+    if (pTrials[i].status) {
+      if ((best < 0) || (pTrials[i].size < pTrials[best].size)) {
+        best = i;
+      }
+    }
+  }
+  
+  /* Keep the winner and remove the other temporary files */
+  for(i = 0; i < count; i++) {
+    pPath = pngcopy_trialPath(pOutPath, i);
+    if (i == best) {
+      if (rename(pPath, pOutPath)) {
+        remove(pPath);
+        status = 0;
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_OPEN;
+        }
+      }
+    } else {
+      remove(pPath);
+    }
+    free(pPath);
+    pPath = NULL;
+  }
+  
+  /* Report the result */
+  if (best < 0) {
+    status = 0;
+    if (pError != NULL) {
+      *pError = pTrials[0].errcode;
+    }
+  }
   if (status) {
-    /* Get width and height */
-    w = sph_image_reader_width(pr);
-    h = sph_image_reader_height(pr);
+    *pBest = best;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse a trial set specification.
+ * 
+ * The specification is either "default" for the built-in trial set, or
+ * a comma-separated list of trials.  Each trial has the form
+ * 
+ *   level/strategy/filters
+ * 
+ * where level is -1 or 0-9, strategy is the name of a compression
+ * strategy (auto, default, filtered, huffman, rle, fixed), and filters
+ * is auto, all, or one or more of none, sub, up, avg, and paeth joined
+ * with "+".  For example:
+ * 
+ *   9/filtered/all,9/default/none,6/rle/sub+up
+ * 
+ * Parameters:
+ * 
+ *   pSpec - the trial set specification
+ * 
+ *   pTrials - array of PNGCOPY_MAX_TRIALS trials to fill in
+ * 
+ *   pCount - receives the number of trials
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the specification is invalid
+ */
+static int pngcopy_parseTrials(
+    const char          * pSpec,
+          PNGCOPY_TRIAL * pTrials,
+          int           * pCount) {
+  
+  int status = 1;
+  int count = 0;
+  int field = 0;
+  int i = 0;
+  int found = 0;
+  size_t len = 0;
+  long lv = 0;
+  char *pEnd = NULL;
+  const char *pc = NULL;
+  PNGCOPY_TRIAL *pt = NULL;
+  
+  /* Check parameters */
+  if ((pSpec == NULL) || (pTrials == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  
+  /* Handle the default trial set */
+  if (strcmp(pSpec, "default") == 0) {
+    count = (int) (sizeof(m_default_trials) / sizeof(PNGCOPY_TRIAL));
+    memcpy(pTrials, m_default_trials, sizeof(m_default_trials));
+    pc = NULL;
+  } else {
+    pc = pSpec;
+  }
+  
+  /* Parse each trial */
+  while (status && (pc != NULL)) {
+    if (count >= PNGCOPY_MAX_TRIALS) {
+      status = 0;
+      break;
+    }
+    pt = &(pTrials[count]);
+    memset(pt, 0, sizeof(PNGCOPY_TRIAL));
+    count++;
     
-    /* Go row by row */
-    for(y = 0; y < h; y++) {
-      /* Read a row */
-      ps = sph_image_reader_read(pr, pError);
-      if (ps == NULL) {
+    /* Parse the level */
+    lv = strtol(pc, &pEnd, 10);
+    if ((pEnd == pc) || (*pEnd != '/') || (lv < -1) || (lv > 9)) {
+      status = 0;
+      break;
+    }
+    pt->level = (int) lv;
+    pc = pEnd + 1;
+    
+    /* Parse the strategy */
+    len = strcspn(pc, "/");
+    found = 0;
+    for(i = 0; i <= SPH_IMAGE_STRATEGY_FIXED; i++) {
+      if ((strlen(m_strategy_names[i]) == len) &&
+          (strncmp(pc, m_strategy_names[i], len) == 0)) {
+        pt->strategy = i;
+        found = 1;
+        break;
+      }
+    }
+    if ((!found) || (pc[len] != '/')) {
+      status = 0;
+      break;
+    }
+    pc = pc + len + 1;
+    
+    /* Parse the filters, which are joined with "+" */
+    for(field = 0; ; field++) {
+      len = strcspn(pc, "+,");
+      found = 0;
+      if ((field == 0) && (pc[len] != '+') && (len == 4) &&
+          (strncmp(pc, "auto", len) == 0)) {
+        pt->filters = 0;
+        found = 1;
+      } else if ((len == 3) && (strncmp(pc, "all", len) == 0)) {
+        pt->filters |= SPH_IMAGE_FILTER_ALL;
+        found = 1;
+      } else {
+        for(i = 0; i < 5; i++) {
+          if ((strlen(m_filter_names[i]) == len) &&
+              (strncmp(pc, m_filter_names[i], len) == 0)) {
+            pt->filters |= (1 << i);
+            found = 1;
+            break;
+          }
+        }
+      }
+      if (!found) {
         status = 0;
         break;
       }
-      
-      /* Transfer scanline to output */
-      memcpy(
-        sph_image_writer_ptr(pw),
-        ps,
-        ((size_t) w) * sizeof(uint32_t));
-      
-      /* Write the scanline */
-      sph_image_writer_write(pw);
+      pc = pc + len;
+      if (*pc != '+') {
+        break;
+      }
+      pc++;
+    }
+    
+    /* Move to the next trial, if any */
+    if (status) {
+      if (*pc == ',') {
+        pc++;
+      } else if (*pc == 0) {
+        pc = NULL;
+      } else {
+        status = 0;
+      }
     }
   }
   
-  /* Close objects if open */
-  sph_image_writer_close(pw);
-  sph_image_reader_close(pr);
+  /* Return the count */
+  if (status) {
+    *pCount = count;
+  }
   
   /* Return status */
   return status;
 }
 
+/*
+ * Print the compression parameters of a trial to an output stream.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the output stream
+ * 
+ *   pt - the trial
+ */
+static void pngcopy_printTrial(FILE *pOut, const PNGCOPY_TRIAL *pt) {
+  
+  int i = 0;
+  int first = 1;
+  
+  /* Check parameters */
+  if ((pOut == NULL) || (pt == NULL)) {
+    abort();
+  }
+  
+  /* Print level and strategy */
+  fprintf(pOut, "level %d, strategy %s, filters ",
+    pt->level, m_strategy_names[pt->strategy]);
+  
+  /* Print filters */
+  if (pt->filters == 0) {
+    fprintf(pOut, "auto");
+  } else if (pt->filters == SPH_IMAGE_FILTER_ALL) {
+    fprintf(pOut, "all");
+  } else {
+    for(i = 0; i < 5; i++) {
+      if (pt->filters & (1 << i)) {
+        fprintf(pOut, "%s%s", first ? "" : "+", m_filter_names[i]);
+        first = 0;
+      }
+    }
+  }
+}
+
 /*
  * Program entrypoint.
  */
@@ -130,8 +1311,27 @@ int main(int argc, char *argv[]) {
   int errcode = 0;
   int x = 0;
   int dconv = 0;
+  int trial_count = 0;
+  int threads = 0;
+  int best = 0;
+  int trim = -1;
+  int i = 0;
+  int32_t tx = 0;
+  int32_t ty = 0;
+  long lv = 0;
+  long lv2 = 0;
+  double dv = 0.0;
+  char *pEnd = NULL;
+  PNGCOPY_TRIAL trials[PNGCOPY_MAX_TRIALS];
+  PNGCOPY_RESIZE resize;
   
   const char *pModuleName = NULL;
+  const char *pDconv = NULL;
+  
+  /* Initialize structures */
+  memset(trials, 0, sizeof(trials));
+  memset(&resize, 0, sizeof(PNGCOPY_RESIZE));
+  resize.kernel = SPH_IMAGE_KERNEL_LANCZOS;
   
   /* Determine the module name */
   if (argc >= 1) {
@@ -143,8 +1343,8 @@ int main(int argc, char *argv[]) {
     pModuleName = "pngcopy";
   }
   
-  /* We must have 2-3 parameters (plus the module name) */
-  if ((argc < 3) || (argc > 4)) {
+  /* We must have at least 2 parameters (plus the module name) */
+  if (argc < 3) {
     fprintf(stderr, "%s: Unexpected number of parameters!\n",
       pModuleName);
     status = 0;
@@ -162,16 +1362,156 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* If 3rd parameter exists, determine the down-conversion type; else,
-   * set it to NONE */
-  if (status && (argc >= 4)) {
-    /* Parse 3rd parameter */
-    if (strcmp(argv[3], "rgb") == 0) {
+  /* The 3rd parameter is the down-conversion type if it exists and
+   * isn't an option; options follow */
+  x = 3;
+  if (status && (argc > x)) {
+    if (argv[x][0] != '-') {
+      pDconv = argv[x];
+      x++;
+    }
+  }
+  while (status && (x < argc)) {
+    if ((strcmp(argv[x], "-trials") == 0) && (x + 1 < argc)) {
+      if (!pngcopy_parseTrials(argv[x + 1], trials, &trial_count)) {
+        fprintf(stderr, "%s: Invalid trial specification!\n",
+          pModuleName);
+        status = 0;
+      }
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-threads") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 1) || (lv > PNGCOPY_MAX_THREADS)) {
+        fprintf(stderr, "%s: Invalid thread count!\n", pModuleName);
+        status = 0;
+      }
+      threads = (int) lv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-resize") == 0) && (x + 1 < argc)) {
+      /* Size is WxH, where either one may be zero */
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd != argv[x + 1]) && (*pEnd == 'x')) {
+        lv2 = strtol(pEnd + 1, &pEnd, 10);
+      } else {
+        lv2 = -1;
+      }
+      if ((*pEnd != 0) || (lv < 0) || (lv > SPH_IMAGE_MAXDIM) ||
+          (lv2 < 0) || (lv2 > SPH_IMAGE_MAXDIM) ||
+          ((lv == 0) && (lv2 == 0))) {
+        fprintf(stderr, "%s: Invalid resize dimensions!\n", pModuleName);
+        status = 0;
+      }
+      resize.w = (int32_t) lv;
+      resize.h = (int32_t) lv2;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-kernel") == 0) && (x + 1 < argc)) {
+      for(i = 0; i < 4; i++) {
+        if (strcmp(argv[x + 1], m_kernel_names[i]) == 0) {
+          resize.kernel = i + 1;
+          break;
+        }
+      }
+      if (i >= 4) {
+        fprintf(stderr, "%s: Unrecognized resampling kernel!\n",
+          pModuleName);
+        status = 0;
+      }
+      x += 2;
+    
+    } else if (strcmp(argv[x], "-linear") == 0) {
+      resize.flags |= SPH_IMAGE_RESAMPLE_LINEAR;
+      x++;
+    
+    } else if ((strcmp(argv[x], "-blur") == 0) && (x + 1 < argc)) {
+      dv = strtod(argv[x + 1], &pEnd);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (!(dv > 0.0)) || (dv > PNGCOPY_MAX_BLUR)) {
+        fprintf(stderr, "%s: Invalid blur radius!\n", pModuleName);
+        status = 0;
+      }
+      resize.blur = dv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-sharpen") == 0) && (x + 1 < argc)) {
+      dv = strtod(argv[x + 1], &pEnd);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (!(dv > 0.0)) || (dv > PNGCOPY_MAX_SHARPEN)) {
+        fprintf(stderr, "%s: Invalid sharpening amount!\n", pModuleName);
+        status = 0;
+      }
+      resize.sharpen = dv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-gamma") == 0) && (x + 1 < argc)) {
+      dv = strtod(argv[x + 1], &pEnd);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (!(dv >= PNGCOPY_MIN_GAMMA)) || (dv > PNGCOPY_MAX_GAMMA)) {
+        fprintf(stderr, "%s: Invalid gamma!\n", pModuleName);
+        status = 0;
+      }
+      resize.gamma = dv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-trim") == 0) && (x + 1 < argc)) {
+      if (strcmp(argv[x + 1], "alpha") == 0) {
+        trim = SPH_IMAGE_TRIM_ALPHA;
+      } else if (strcmp(argv[x + 1], "corner") == 0) {
+        trim = SPH_IMAGE_TRIM_CORNER;
+      } else {
+        fprintf(stderr, "%s: Unrecognized trim mode!\n", pModuleName);
+        status = 0;
+      }
+      x += 2;
+    
+    } else {
+      fprintf(stderr, "%s: Unrecognized option %s!\n",
+        pModuleName, argv[x]);
+      status = 0;
+    }
+  }
+  
+  /* Trimming only copies the image as it is */
+  if (status && (trim >= 0) &&
+      ((trial_count > 0) || (resize.w > 0) || (resize.h > 0) ||
+        (resize.blur > 0.0) || (resize.sharpen > 0.0) ||
+        (resize.gamma > 0.0))) {
+    fprintf(stderr, "%s: Can't trim while resizing or filtering!\n",
+      pModuleName);
+    status = 0;
+  }
+  
+  /* If a down-conversion type was given, determine it; else, set it to
+   * NONE */
+  if (status && (pDconv != NULL)) {
+    /* Parse down-conversion parameter */
+    if (strcmp(pDconv, "rgb") == 0) {
       dconv = SPH_IMAGE_DOWN_RGB;
     
-    } else if (strcmp(argv[3], "gray") == 0) {
+    } else if (strcmp(pDconv, "gray") == 0) {
       dconv = SPH_IMAGE_DOWN_GRAY;
       
+    } else if (strcmp(pDconv, "gray1") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY1;
+      
+    } else if (strcmp(pDconv, "gray2") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY2;
+      
+    } else if (strcmp(pDconv, "gray4") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY4;
+      
+    } else if (strcmp(pDconv, "gray1q") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY1 | SPH_IMAGE_DOWN_QUANTIZE;
+      
+    } else if (strcmp(pDconv, "gray2q") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY2 | SPH_IMAGE_DOWN_QUANTIZE;
+      
+    } else if (strcmp(pDconv, "gray4q") == 0) {
+      dconv = SPH_IMAGE_DOWN_GRAY4 | SPH_IMAGE_DOWN_QUANTIZE;
+      
     } else {
       fprintf(stderr, "%s: Unrecognized down-conversion type!\n",
         pModuleName);
@@ -179,13 +1519,48 @@ int main(int argc, char *argv[]) {
     }
     
   } else if (status) {
-    /* No 3rd parameter */
+    /* No down-conversion parameter */
     dconv = SPH_IMAGE_DOWN_NONE;
   }
   
+  /* If no thread count was given, use one thread per processor */
+  if (status && (threads < 1)) {
+    lv = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lv < 1) {
+      lv = 1;
+    } else if (lv > PNGCOPY_MAX_THREADS) {
+      lv = PNGCOPY_MAX_THREADS;
+    }
+    threads = (int) lv;
+  }
+  
   /* Call through to program function */
-  if (status) {
-    if (!pngcopy(argv[1], argv[2], dconv, &errcode)) {
+  if (status && (trim >= 0)) {
+    if (pngcopy_trim(argv[1], argv[2], dconv, trim, &tx, &ty, &errcode)) {
+      printf("%s: trimmed at offset %ld,%ld\n",
+        pModuleName, (long) tx, (long) ty);
+    } else {
+      fprintf(stderr, "%s: %s!\n", 
+        pModuleName,
+        sph_image_errorString(errcode));
+      status = 0;
+    }
+  
+  } else if (status && (trial_count > 0)) {
+    if (pngcopy_trials(argv[1], argv[2], dconv, &resize,
+                        trials, trial_count, threads, &best, &errcode)) {
+      printf("%s: best of %d trials: ", pModuleName, trial_count);
+      pngcopy_printTrial(stdout, &(trials[best]));
+      printf(" (%ld bytes)\n", trials[best].size);
+    } else {
+      fprintf(stderr, "%s: %s!\n", 
+        pModuleName,
+        sph_image_errorString(errcode));
+      status = 0;
+    }
+  
+  } else if (status) {
+    if (!pngcopy(argv[1], argv[2], dconv, &resize, NULL, NULL, &errcode)) {
       fprintf(stderr, "%s: %s!\n", 
         pModuleName,
         sph_image_errorString(errcode));
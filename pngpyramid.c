@@ -0,0 +1,951 @@
+/*
+ * pngpyramid.c
+ * 
+ * See the README file for further information.
+ */
+
+/* Needed for mkdir() */
+#define _POSIX_C_SOURCE 200112L
+
+#include "sophistry.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * The width and height in pixels of the tiles.  This must be even, so
+ * that each pair of scanlines that is halved into the next level lies
+ * within the same band.
+ */
+#define PNGPYRAMID_TILE (256)
+
+/*
+ * The maximum number of encoding threads.
+ */
+#define PNGPYRAMID_MAX_THREADS (64)
+
+/*
+ * The maximum number of levels, which is enough for the largest images
+ * that Sophistry supports.
+ */
+#define PNGPYRAMID_MAX_LEVELS (32)
+
+/*
+ * Structure describing one level of the pyramid.
+ */
+typedef struct {
+  
+  /*
+   * The width and height of the level in pixels, and the number of
+   * columns of tiles.
+   */
+  int32_t w;
+  int32_t h;
+  int32_t cols;
+  
+  /*
+   * The two band buffers, each holding PNGPYRAMID_TILE scanlines that
+   * are pitch pixels apart, and the index of the buffer being filled.
+   * Each band becomes one row of tiles.
+   */
+  uint32_t *pBuf[2];
+  int32_t pitch;
+  int cur;
+  
+  /*
+   * The number of tiles of each buffer that haven't been encoded yet.
+   * A buffer can only be filled again once this is zero.
+   */
+  int pending[2];
+
+} PNGPYRAMID_LEVEL;
+
+/*
+ * Structure describing a band waiting in the encoding queue.
+ */
+typedef struct {
+  
+  /*
+   * The level, the band buffer, the row of tiles, and the number of
+   * scanlines in the band.
+   */
+  int32_t level;
+  int buf;
+  int32_t row;
+  int32_t rows;
+  
+  /*
+   * The next column of tiles that no thread has claimed.
+   */
+  int32_t next;
+
+} PNGPYRAMID_BAND;
+
+/*
+ * Structure holding the state of the pyramid generator.
+ */
+typedef struct {
+  
+  /*
+   * The directory that receives the level directories.
+   */
+  const char *pDir;
+  
+  /*
+   * The levels, from level zero, which is a single pixel, up to the
+   * full image.
+   */
+  PNGPYRAMID_LEVEL levels[PNGPYRAMID_MAX_LEVELS];
+  int32_t count;
+  
+  /*
+   * Non-zero if tiles are encoded by worker threads.  Otherwise, each
+   * band is encoded on the calling thread as soon as it is complete.
+   */
+  int threaded;
+  
+  /*
+   * Lock and condition protecting the queue, the pending counts of the
+   * levels, and the stop state.  The condition is broadcast whenever
+   * any of them changes.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * The queue of bands with tiles left to claim, as a ring.  Each
+   * level has at most two bands in the queue.
+   */
+  PNGPYRAMID_BAND queue[2 * PNGPYRAMID_MAX_LEVELS];
+  int qhead;
+  int qlen;
+  
+  /*
+   * Non-zero once no more bands will be queued.
+   */
+  int done;
+  
+  /*
+   * Non-zero once anything has failed, and the error code of the first
+   * failure.
+   */
+  int stop;
+  int errcode;
+
+} PNGPYRAMID;
+
+/*
+ * Lock the pyramid state.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ */
+static void pngpyramid_lock(PNGPYRAMID *pp) {
+  if (pthread_mutex_lock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Unlock the pyramid state.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ */
+static void pngpyramid_unlock(PNGPYRAMID *pp) {
+  if (pthread_mutex_unlock(&(pp->lock))) {
+    abort();
+  }
+}
+
+/*
+ * Record a failure and wake up all waiting threads.
+ * 
+ * Only the first error is kept.  The caller must hold the lock.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ * 
+ *   errcode - the error code
+ */
+static void pngpyramid_fail(PNGPYRAMID *pp, int errcode) {
+  if (!(pp->stop)) {
+    pp->stop = 1;
+    pp->errcode = errcode;
+  }
+  if (pthread_cond_broadcast(&(pp->cond))) {
+    abort();
+  }
+}
+
+/*
+ * Encode one tile to its file.
+ * 
+ * The tile is written straight from the band buffer of its level.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ * 
+ *   pb - the band of the tile
+ * 
+ *   col - the column of the tile
+ * 
+ *   pError - pointer to the error code return
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngpyramid_encode(
+    PNGPYRAMID      * pp,
+    PNGPYRAMID_BAND * pb,
+    int32_t           col,
+    int             * pError) {
+  
+  int status = 1;
+  int32_t tw = 0;
+  char *pPath = NULL;
+  PNGPYRAMID_LEVEL *pl = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pb == NULL) || (pError == NULL)) {
+    abort();
+  }
+  pl = &((pp->levels)[pb->level]);
+  if ((col < 0) || (col >= pl->cols)) {
+    abort();
+  }
+  
+  /* Form the path, level/col_row.png */
+  pPath = (char *) malloc(strlen(pp->pDir) + 64);
+  if (pPath == NULL) {
+    abort();
+  }
+  sprintf(pPath, "%s/%ld/%ld_%ld.png", pp->pDir,
+    (long) pb->level, (long) col, (long) pb->row);
+  
+  /* Write the tile */
+  tw = pl->w - col * PNGPYRAMID_TILE;
+  if (tw > PNGPYRAMID_TILE) {
+    tw = PNGPYRAMID_TILE;
+  }
+  pw = sph_image_writer_newFromPath(
+          pPath, tw, pb->rows, SPH_IMAGE_DOWN_NONE, 0, pError);
+  if (pw == NULL) {
+    status = 0;
+  }
+  if (status) {
+    if (!sph_image_writer_writeRows(
+            pw,
+            (pl->pBuf)[pb->buf] + ((size_t) col) * PNGPYRAMID_TILE,
+            pl->pitch,
+            pb->rows,
+            pError)) {
+      status = 0;
+    }
+  }
+  
+  sph_image_writer_close(pw);
+  free(pPath);
+  
+  return status;
+}
+
+/*
+ * Encoding worker thread.
+ * 
+ * Each worker repeatedly claims the next tile of the band at the head
+ * of the queue and encodes it.  The worker returns once the queue is
+ * empty and no more bands will come, or when anything fails.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the PNGPYRAMID structure
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *pngpyramid_worker(void *pParam) {
+  
+  int ok = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t col = 0;
+  PNGPYRAMID *pp = NULL;
+  PNGPYRAMID_BAND band;
+  
+  /* Initialize structures */
+  memset(&band, 0, sizeof(PNGPYRAMID_BAND));
+  
+  /* Check parameter */
+  if (pParam == NULL) {
+    abort();
+  }
+  pp = (PNGPYRAMID *) pParam;
+  
+  pngpyramid_lock(pp);
+  for( ; ; ) {
+    /* Wait for a tile */
+    while ((!(pp->stop)) && (pp->qlen < 1) && (!(pp->done))) {
+      if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+        abort();
+      }
+    }
+    if (pp->stop || (pp->qlen < 1)) {
+      break;
+    }
+    
+    /* Claim the next tile of the head band, removing the band once all
+     * of its tiles are claimed */
+    memcpy(&band, &((pp->queue)[pp->qhead]), sizeof(PNGPYRAMID_BAND));
+    col = ((pp->queue)[pp->qhead].next)++;
+    if ((pp->queue)[pp->qhead].next >=
+          (pp->levels)[band.level].cols) {
+      pp->qhead = (pp->qhead + 1) % (2 * PNGPYRAMID_MAX_LEVELS);
+      (pp->qlen)--;
+    }
+    pngpyramid_unlock(pp);
+    
+    /* Encode it */
+    ok = pngpyramid_encode(pp, &band, col, &err);
+    
+    /* Report it */
+    pngpyramid_lock(pp);
+    if (!ok) {
+      pngpyramid_fail(pp, err);
+    }
+    ((pp->levels)[band.level].pending[band.buf])--;
+    if (pthread_cond_broadcast(&(pp->cond))) {
+      abort();
+    }
+  }
+  pngpyramid_unlock(pp);
+  
+  return NULL;
+}
+
+/*
+ * Get the band buffer slot of a scanline of a level, waiting for the
+ * buffer to be free first if the scanline starts a new band.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ * 
+ *   level - the level
+ * 
+ *   y - the scanline
+ * 
+ * Return:
+ * 
+ *   the slot, or NULL if the generator has stopped
+ */
+static uint32_t *pngpyramid_slot(PNGPYRAMID *pp, int32_t level, int32_t y) {
+  
+  int stop = 0;
+  PNGPYRAMID_LEVEL *pl = NULL;
+  uint32_t *pSlot = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (level < 0) || (level >= pp->count)) {
+    abort();
+  }
+  pl = &((pp->levels)[level]);
+  
+  /* Wait until the encoders are done with the buffer */
+  if (pp->threaded && (y % PNGPYRAMID_TILE == 0)) {
+    pngpyramid_lock(pp);
+    while ((!(pp->stop)) && ((pl->pending)[pl->cur] > 0)) {
+      if (pthread_cond_wait(&(pp->cond), &(pp->lock))) {
+        abort();
+      }
+    }
+    stop = pp->stop;
+    pngpyramid_unlock(pp);
+  }
+  
+  if (!stop) {
+    pSlot = (pl->pBuf)[pl->cur] +
+              ((size_t) (y % PNGPYRAMID_TILE)) * pl->pitch;
+  }
+  
+  return pSlot;
+}
+
+/*
+ * Halve one or two scanlines of a level into a scanline of the next
+ * smaller level.
+ * 
+ * Each output pixel is the average of the two by two block of input
+ * pixels that it covers, or of the part of the block inside the image
+ * at the right and bottom edges.  Colors are weighted by alpha, so that
+ * transparent pixels don't bleed into their neighbors.
+ * 
+ * Parameters:
+ * 
+ *   pA - the first input scanline
+ * 
+ *   pB - the second input scanline, or NULL at the bottom edge
+ * 
+ *   w - the width of the input scanlines in pixels
+ * 
+ *   pOut - the output scanline of (w + 1) / 2 pixels
+ */
+static void pngpyramid_halve(
+    const uint32_t * pA,
+    const uint32_t * pB,
+          int32_t    w,
+          uint32_t * pOut) {
+  
+  int32_t x = 0;
+  int32_t i = 0;
+  int c = 0;
+  int n = 0;
+  uint32_t a = 0;
+  uint32_t p = 0;
+  uint32_t sa = 0;
+  uint32_t sc[3];
+  const uint32_t *ppIn[4];
+  
+  /* Check parameters */
+  if ((pA == NULL) || (w < 1) || (pOut == NULL)) {
+    abort();
+  }
+  
+  for(x = 0; x < (w + 1) / 2; x++) {
+    /* Gather the input pixels of the block */
+    n = 0;
+    for(i = 2 * x; (i < 2 * x + 2) && (i < w); i++) {
+      ppIn[n++] = &(pA[i]);
+      if (pB != NULL) {
+        ppIn[n++] = &(pB[i]);
+      }
+    }
+    
+    /* Add them up, weighting colors by alpha */
+    sa = 0;
+    memset(sc, 0, sizeof(sc));
+    for(i = 0; i < n; i++) {
+      p = *(ppIn[i]);
+      a = p >> 24;
+      sa += a;
+      for(c = 0; c < 3; c++) {
+        sc[c] += ((p >> (16 - 8 * c)) & 0xff) * a;
+      }
+    }
+    
+    /* Average */
+    if (sa > 0) {
+      p = ((sa + (n / 2)) / n) << 24;
+      for(c = 0; c < 3; c++) {
+        p |= ((sc[c] + (sa / 2)) / sa) << (16 - 8 * c);
+      }
+    } else {
+      p = 0;
+    }
+    pOut[x] = p;
+  }
+}
+
+/*
+ * Handle a scanline that has just been stored in the band buffer of a
+ * level.
+ * 
+ * Every second scanline, and the last one, is halved into the next
+ * smaller level, which is handled in turn.  When the band is complete,
+ * its tiles are encoded, either right away or by queueing the band for
+ * the workers, and the level moves on to its other buffer.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pyramid state
+ * 
+ *   level - the level
+ * 
+ *   y - the scanline
+ * 
+ *   pError - pointer to the error code return
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngpyramid_row(
+    PNGPYRAMID * pp,
+    int32_t      level,
+    int32_t      y,
+    int        * pError) {
+  
+  int status = 1;
+  int32_t col = 0;
+  uint32_t *pRow = NULL;
+  uint32_t *pOut = NULL;
+  PNGPYRAMID_LEVEL *pl = NULL;
+  PNGPYRAMID_BAND band;
+  
+  /* Initialize structures */
+  memset(&band, 0, sizeof(PNGPYRAMID_BAND));
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pError == NULL)) {
+    abort();
+  }
+  if ((level < 0) || (level >= pp->count)) {
+    abort();
+  }
+  pl = &((pp->levels)[level]);
+  pRow = (pl->pBuf)[pl->cur] +
+          ((size_t) (y % PNGPYRAMID_TILE)) * pl->pitch;
+  
+  /* Halve into the next level after each pair of scanlines */
+  if ((level > 0) && ((y % 2 == 1) || (y == pl->h - 1))) {
+    pOut = pngpyramid_slot(pp, level - 1, y / 2);
+    if (pOut == NULL) {
+      status = 0;
+    }
+    if (status) {
+      if (y % 2 == 1) {
+        pngpyramid_halve(pRow - pl->pitch, pRow, pl->w, pOut);
+      } else {
+        pngpyramid_halve(pRow, NULL, pl->w, pOut);
+      }
+      status = pngpyramid_row(pp, level - 1, y / 2, pError);
+    }
+  }
+  
+  /* Encode the band once it is complete */
+  if (status && ((y % PNGPYRAMID_TILE == PNGPYRAMID_TILE - 1) ||
+                  (y == pl->h - 1))) {
+    band.level = level;
+    band.buf = pl->cur;
+    band.row = y / PNGPYRAMID_TILE;
+    band.rows = (y % PNGPYRAMID_TILE) + 1;
+    band.next = 0;
+    
+    if (pp->threaded) {
+      pngpyramid_lock(pp);
+      if (pp->qlen >= 2 * PNGPYRAMID_MAX_LEVELS) {
+        abort();
+      }
+      memcpy(&((pp->queue)[(pp->qhead + pp->qlen) %
+                            (2 * PNGPYRAMID_MAX_LEVELS)]),
+              &band, sizeof(PNGPYRAMID_BAND));
+      (pp->qlen)++;
+      (pl->pending)[pl->cur] = pl->cols;
+      if (pthread_cond_broadcast(&(pp->cond))) {
+        abort();
+      }
+      pngpyramid_unlock(pp);
+    
+    } else {
+      for(col = 0; col < pl->cols; col++) {
+        if (!pngpyramid_encode(pp, &band, col, pError)) {
+          status = 0;
+          break;
+        }
+      }
+    }
+    
+    pl->cur = 1 - pl->cur;
+  }
+  
+  return status;
+}
+
+/*
+ * Create a directory if it doesn't exist yet.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the directory path
+ * 
+ * Return:
+ * 
+ *   non-zero if the directory exists now, zero if not
+ */
+static int pngpyramid_mkdir(const char *pPath) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  if (mkdir(pPath, 0777) != 0) {
+    if (errno != EEXIST) {
+      status = 0;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Generate the tile pyramid of an image.
+ * 
+ * The input image is read once, from top to bottom.  Each scanline goes
+ * into the band buffer of the largest level, and is halved into the
+ * smaller levels as it arrives, so all levels are built at the same
+ * time from a single decode.  Only two bands of each level are held in
+ * memory.
+ * 
+ * The tiles of level n are written to pDir/n/col_row.png, where level
+ * zero is a single pixel and each level doubles the size of the one
+ * before, up to the full image.  The directories are created as
+ * needed.  A Deep Zoom descriptor is written to pDziPath.
+ * 
+ * pError is optionally a pointer to an integer that receives an error
+ * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
+ * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).
+ * 
+ * Parameters:
+ * 
+ *   pDziPath - the path of the descriptor file
+ * 
+ *   pDir - the directory that receives the tiles
+ * 
+ *   pInPath - the input image file path
+ * 
+ *   threads - the number of encoding threads
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngpyramid(
+    const char * pDziPath,
+    const char * pDir,
+    const char * pInPath,
+          int    threads,
+          int  * pError) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int started = 0;
+  int i = 0;
+  int32_t level = 0;
+  int32_t w = 0;
+  int32_t h = 0;
+  int32_t y = 0;
+  char *pPath = NULL;
+  uint32_t *pSlot = NULL;
+  FILE *fh = NULL;
+  SPH_IMAGE_READER *pr = NULL;
+  PNGPYRAMID *pp = NULL;
+  PNGPYRAMID_LEVEL *pl = NULL;
+  pthread_t tids[PNGPYRAMID_MAX_THREADS];
+  
+  /* Initialize structures */
+  memset(tids, 0, sizeof(tids));
+  
+  /* Check parameters */
+  if ((pDziPath == NULL) || (pDir == NULL) || (pInPath == NULL)) {
+    abort();
+  }
+  if ((threads < 1) || (threads > PNGPYRAMID_MAX_THREADS)) {
+    abort();
+  }
+  
+  /* Allocate the state */
+  pp = (PNGPYRAMID *) malloc(sizeof(PNGPYRAMID));
+  if (pp == NULL) {
+    abort();
+  }
+  memset(pp, 0, sizeof(PNGPYRAMID));
+  if (pthread_mutex_init(&(pp->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pp->cond), NULL)) {
+    abort();
+  }
+  pp->pDir = pDir;
+  pp->threaded = (threads > 1) ? 1 : 0;
+  
+  pPath = (char *) malloc(strlen(pDir) + 64);
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Allocate reader */
+  pr = sph_image_reader_newFromPath(pInPath, &err);
+  if (pr == NULL) {
+    status = 0;
+  }
+  
+  /* Lay out the levels, halving until a single pixel is left */
+  if (status) {
+    w = sph_image_reader_width(pr);
+    h = sph_image_reader_height(pr);
+    pp->count = 1;
+    while ((w > 1) || (h > 1)) {
+      w = (w + 1) / 2;
+      h = (h + 1) / 2;
+      (pp->count)++;
+    }
+    
+    w = sph_image_reader_width(pr);
+    h = sph_image_reader_height(pr);
+    for(level = pp->count - 1; level >= 0; level--) {
+      pl = &((pp->levels)[level]);
+      pl->w = w;
+      pl->h = h;
+      pl->cols = (w + PNGPYRAMID_TILE - 1) / PNGPYRAMID_TILE;
+      pl->pitch = pl->cols * PNGPYRAMID_TILE;
+      for(i = 0; i < 2; i++) {
+        (pl->pBuf)[i] = (uint32_t *) malloc(
+            ((size_t) pl->pitch) * PNGPYRAMID_TILE * sizeof(uint32_t));
+        if ((pl->pBuf)[i] == NULL) {
+          abort();
+        }
+      }
+      w = (w + 1) / 2;
+      h = (h + 1) / 2;
+    }
+  }
+  
+  /* Create the directories */
+  if (status) {
+    if (!pngpyramid_mkdir(pDir)) {
+      err = SPH_IMAGE_ERR_OPEN;
+      status = 0;
+    }
+  }
+  for(level = 0; status && (level < pp->count); level++) {
+    sprintf(pPath, "%s/%ld", pDir, (long) level);
+    if (!pngpyramid_mkdir(pPath)) {
+      err = SPH_IMAGE_ERR_OPEN;
+      status = 0;
+    }
+  }
+  
+  /* Start the workers; if none can be started, encode on this thread */
+  if (status && pp->threaded) {
+    for(i = 0; i < threads; i++) {
+      if (pthread_create(&(tids[i]), NULL, &pngpyramid_worker, pp)) {
+        break;
+      }
+      started++;
+    }
+    if (started < 1) {
+      pp->threaded = 0;
+    }
+  }
+  
+  /* Read each scanline into the largest level and build the others
+   * from it */
+  for(y = 0; status && (y < (pp->levels)[pp->count - 1].h); y++) {
+    pSlot = pngpyramid_slot(pp, pp->count - 1, y);
+    if (pSlot == NULL) {
+      status = 0;
+      break;
+    }
+    if (!sph_image_reader_readInto(pr, pSlot, &err)) {
+      status = 0;
+      break;
+    }
+    if (!pngpyramid_row(pp, pp->count - 1, y, &err)) {
+      status = 0;
+      break;
+    }
+  }
+  
+  /* Let the workers finish, or stop them on error */
+  if (started > 0) {
+    pngpyramid_lock(pp);
+    if (!status) {
+      pngpyramid_fail(pp, err);
+    }
+    pp->done = 1;
+    if (pthread_cond_broadcast(&(pp->cond))) {
+      abort();
+    }
+    pngpyramid_unlock(pp);
+    
+    for(i = 0; i < started; i++) {
+      if (pthread_join(tids[i], NULL)) {
+        abort();
+      }
+    }
+  }
+  if (pp->stop) {
+    status = 0;
+    err = pp->errcode;
+  }
+  
+  /* Write the descriptor */
+  if (status) {
+    fh = fopen(pDziPath, "w");
+    if (fh == NULL) {
+      err = SPH_IMAGE_ERR_OPEN;
+      status = 0;
+    }
+  }
+  if (status) {
+    fprintf(fh, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(fh, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\""
+      " TileSize=\"%d\" Overlap=\"0\" Format=\"png\">\n",
+      PNGPYRAMID_TILE);
+    fprintf(fh, "  <Size Width=\"%ld\" Height=\"%ld\"/>\n",
+      (long) sph_image_reader_width(pr),
+      (long) sph_image_reader_height(pr));
+    fprintf(fh, "</Image>\n");
+    if (fclose(fh) != 0) {
+      err = SPH_IMAGE_ERR_WRITEDATA;
+      status = 0;
+    }
+    fh = NULL;
+  }
+  
+  /* Release everything */
+  sph_image_reader_close(pr);
+  for(level = 0; level < pp->count; level++) {
+    free((pp->levels)[level].pBuf[0]);
+    free((pp->levels)[level].pBuf[1]);
+  }
+  if (pthread_cond_destroy(&(pp->cond))) {
+    abort();
+  }
+  if (pthread_mutex_destroy(&(pp->lock))) {
+    abort();
+  }
+  free(pp);
+  free(pPath);
+  
+  /* Set error code if provided */
+  if (pError != NULL) {
+    if (status) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    } else {
+      *pError = err;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Program entrypoint.
+ */
+int main(int argc, char *argv[]) {
+  
+  int status = 1;
+  int errcode = 0;
+  int x = 0;
+  int threads = 0;
+  long lv = 0;
+  size_t len = 0;
+  char *pEnd = NULL;
+  char *pDziPath = NULL;
+  char *pDir = NULL;
+  
+  const char *pModuleName = NULL;
+  
+  /* Determine the module name */
+  if (argc >= 1) {
+    if (argv != NULL) {
+      pModuleName = argv[0];
+    }
+  }
+  if (pModuleName == NULL) {
+    pModuleName = "pngpyramid";
+  }
+  
+  /* We must have at least 2 parameters (plus the module name) */
+  if (argc < 3) {
+    fprintf(stderr, "%s: Unexpected number of parameters!\n",
+      pModuleName);
+    status = 0;
+  }
+  
+  /* Verify all parameters exist */
+  if (status) {
+    if (argv == NULL) {
+      abort();
+    }
+    for(x = 0; x < argc; x++) {
+      if (argv[x] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* Options follow the paths */
+  x = 3;
+  while (status && (x < argc)) {
+    if ((strcmp(argv[x], "-threads") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 1) || (lv > PNGPYRAMID_MAX_THREADS)) {
+        fprintf(stderr, "%s: Invalid thread count!\n", pModuleName);
+        status = 0;
+      }
+      threads = (int) lv;
+      x += 2;
+    
+    } else {
+      fprintf(stderr, "%s: Unrecognized option %s!\n",
+        pModuleName, argv[x]);
+      status = 0;
+    }
+  }
+  
+  /* If no thread count was given, use one thread per processor */
+  if (status && (threads < 1)) {
+    lv = sysconf(_SC_NPROCESSORS_ONLN);
+    if (lv < 1) {
+      lv = 1;
+    } else if (lv > PNGPYRAMID_MAX_THREADS) {
+      lv = PNGPYRAMID_MAX_THREADS;
+    }
+    threads = (int) lv;
+  }
+  
+  /* Form the descriptor path and the tile directory from the output
+   * name */
+  if (status) {
+    len = strlen(argv[1]);
+    pDziPath = (char *) malloc(len + 8);
+    pDir = (char *) malloc(len + 8);
+    if ((pDziPath == NULL) || (pDir == NULL)) {
+      abort();
+    }
+    sprintf(pDziPath, "%s.dzi", argv[1]);
+    sprintf(pDir, "%s_files", argv[1]);
+  }
+  
+  /* Call through to program function */
+  if (status) {
+    if (!pngpyramid(pDziPath, pDir, argv[2], threads, &errcode)) {
+      fprintf(stderr, "%s: %s!\n",
+        pModuleName,
+        sph_image_errorString(errcode));
+      status = 0;
+    }
+  }
+  
+  free(pDziPath);
+  free(pDir);
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,388 @@
+/*
+ * pngstitch.c
+ * 
+ * See the README file for further information.
+ */
+#include "sophistry.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The maximum length in bytes of a line in a tile list file, including
+ * the line break.
+ */
+#define PNGSTITCH_MAX_LINE (4096)
+
+/*
+ * The maximum number of decoding threads.
+ */
+#define PNGSTITCH_MAX_THREADS (64)
+
+/*
+ * Structure holding the list of tiles in row-major order.
+ */
+typedef struct {
+  
+  /*
+   * The tile paths, each dynamically allocated, or NULL for blank
+   * tiles.
+   */
+  char **ppPaths;
+  
+  /*
+   * The number of tiles, and the allocated capacity of the array.
+   */
+  int32_t count;
+  int32_t cap;
+
+} PNGSTITCH_TILES;
+
+/*
+ * Add a tile to the end of a tile list.
+ * 
+ * The path is copied.  The path "-" adds a blank tile.
+ * 
+ * Parameters:
+ * 
+ *   pl - the tile list
+ * 
+ *   pPath - the tile path
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if there are too many tiles
+ */
+static int pngstitch_add(PNGSTITCH_TILES *pl, const char *pPath) {
+  
+  int status = 1;
+  int32_t ncap = 0;
+  char **ppNew = NULL;
+  char *pCopy = NULL;
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Grow the array if needed */
+  if (pl->count >= pl->cap) {
+    if (pl->cap >= SPH_IMAGE_MAXDIM) {
+      status = 0;
+    } else {
+      ncap = (pl->cap > 0) ? (pl->cap * 2) : 64;
+      if (ncap > SPH_IMAGE_MAXDIM) {
+        ncap = SPH_IMAGE_MAXDIM;
+      }
+      ppNew = (char **) realloc(
+                pl->ppPaths, ((size_t) ncap) * sizeof(char *));
+      if (ppNew == NULL) {
+        abort();
+      }
+      pl->ppPaths = ppNew;
+      pl->cap = ncap;
+    }
+  }
+  
+  /* Copy the path, unless the tile is blank */
+  if (status) {
+    if (strcmp(pPath, "-") != 0) {
+      pCopy = (char *) malloc(strlen(pPath) + 1);
+      if (pCopy == NULL) {
+        abort();
+      }
+      strcpy(pCopy, pPath);
+    }
+    (pl->ppPaths)[pl->count] = pCopy;
+    (pl->count)++;
+  }
+  
+  return status;
+}
+
+/*
+ * Add the tiles of a tile list file to the end of a tile list.
+ * 
+ * The file has one tile path per line, with "-" for blank tiles.  Empty
+ * lines are skipped.
+ * 
+ * Parameters:
+ * 
+ *   pl - the tile list
+ * 
+ *   pListPath - the path to the tile list file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the file can't be read or has too
+ *   many tiles or too long a line
+ */
+static int pngstitch_readList(PNGSTITCH_TILES *pl, const char *pListPath) {
+  
+  int status = 1;
+  size_t len = 0;
+  FILE *fh = NULL;
+  char line[PNGSTITCH_MAX_LINE];
+  
+  /* Initialize buffers */
+  memset(line, 0, sizeof(line));
+  
+  /* Check parameters */
+  if ((pl == NULL) || (pListPath == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  fh = fopen(pListPath, "r");
+  if (fh == NULL) {
+    status = 0;
+  }
+  
+  /* Add each line */
+  while (status && (fgets(line, sizeof(line), fh) != NULL)) {
+    len = strlen(line);
+    if ((len > 0) && (line[len - 1] == '\n')) {
+      line[len - 1] = 0;
+      len--;
+    } else if (!feof(fh)) {
+      status = 0;
+      break;
+    }
+    if ((len > 0) && (line[len - 1] == '\r')) {
+      line[len - 1] = 0;
+      len--;
+    }
+    if (len > 0) {
+      status = pngstitch_add(pl, line);
+    }
+  }
+  if (status && ferror(fh)) {
+    status = 0;
+  }
+  
+  /* Close the file if open */
+  if (fh != NULL) {
+    fclose(fh);
+  }
+  
+  return status;
+}
+
+/*
+ * Perform the stitching operation.
+ * 
+ * pOutPath is the output image path.  The tiles are given in row-major
+ * order, cols tiles per row.  threads is the number of decoding threads
+ * passed to sph_image_mosaic_setThreads().
+ * 
+ * pError is optionally a pointer to an integer that receives an error
+ * code.  On error, this will be set to one of the SPH_IMAGE_ERR codes.
+ * On success, this will be set to zero (SPH_IMAGE_ERR_NONE).
+ * 
+ * Parameters:
+ * 
+ *   pOutPath - the output image file path
+ * 
+ *   pl - the tiles
+ * 
+ *   cols - the number of columns of tiles
+ * 
+ *   threads - the number of decoding threads, or zero for automatic
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pngstitch(
+    const char            * pOutPath,
+    const PNGSTITCH_TILES * pl,
+          int32_t           cols,
+          int               threads,
+          int             * pError) {
+  
+  int status = 1;
+  int32_t i = 0;
+  SPH_IMAGE_MOSAIC *pm = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Check parameters */
+  if ((pOutPath == NULL) || (pl == NULL) || (threads < 0)) {
+    abort();
+  }
+  if ((cols < 1) || (pl->count < cols) || (pl->count % cols != 0)) {
+    abort();
+  }
+  
+  /* Clear error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Set up the mosaic and measure the tiles */
+  pm = sph_image_mosaic_new(cols, pl->count / cols);
+  for(i = 0; i < pl->count; i++) {
+    sph_image_mosaic_setTile(pm, i % cols, i / cols, (pl->ppPaths)[i]);
+  }
+  sph_image_mosaic_setThreads(pm, threads);
+  if (!sph_image_mosaic_measure(pm, pError)) {
+    status = 0;
+  }
+  
+  /* Allocate writer */
+  if (status) {
+    pw = sph_image_writer_newFromPath(
+        pOutPath,
+        sph_image_mosaic_width(pm),
+        sph_image_mosaic_height(pm),
+        SPH_IMAGE_DOWN_NONE,
+        0,
+        pError);
+    if (pw == NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Stitch the tiles */
+  if (status) {
+    if (!sph_image_mosaic_run(pm, pw, pError)) {
+      status = 0;
+    }
+  }
+  
+  /* Close objects if open */
+  sph_image_writer_close(pw);
+  sph_image_mosaic_free(pm);
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Program entrypoint.
+ */
+int main(int argc, char *argv[]) {
+  
+  int status = 1;
+  int errcode = 0;
+  int x = 0;
+  int threads = 0;
+  int32_t i = 0;
+  int32_t cols = 0;
+  long lv = 0;
+  char *pEnd = NULL;
+  PNGSTITCH_TILES tiles;
+  
+  const char *pModuleName = NULL;
+  
+  /* Initialize structures */
+  memset(&tiles, 0, sizeof(PNGSTITCH_TILES));
+  
+  /* Determine the module name */
+  if (argc >= 1) {
+    if (argv != NULL) {
+      pModuleName = argv[0];
+    }
+  }
+  if (pModuleName == NULL) {
+    pModuleName = "pngstitch";
+  }
+  
+  /* We must have at least 2 parameters (plus the module name) */
+  if (argc < 3) {
+    fprintf(stderr, "%s: Unexpected number of parameters!\n",
+      pModuleName);
+    status = 0;
+  }
+  
+  /* Verify all parameters exist */
+  if (status) {
+    if (argv == NULL) {
+      abort();
+    }
+    for(x = 0; x < argc; x++) {
+      if (argv[x] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* The 2nd parameter is the number of columns */
+  if (status) {
+    lv = strtol(argv[2], &pEnd, 10);
+    if ((pEnd == argv[2]) || (*pEnd != 0) ||
+        (lv < 1) || (lv > SPH_IMAGE_MAXDIM)) {
+      fprintf(stderr, "%s: Invalid column count!\n", pModuleName);
+      status = 0;
+    }
+    cols = (int32_t) lv;
+  }
+  
+  /* Tiles and options follow; a lone "-" is a blank tile */
+  x = 3;
+  while (status && (x < argc)) {
+    if ((strcmp(argv[x], "-threads") == 0) && (x + 1 < argc)) {
+      lv = strtol(argv[x + 1], &pEnd, 10);
+      if ((pEnd == argv[x + 1]) || (*pEnd != 0) ||
+          (lv < 1) || (lv > PNGSTITCH_MAX_THREADS)) {
+        fprintf(stderr, "%s: Invalid thread count!\n", pModuleName);
+        status = 0;
+      }
+      threads = (int) lv;
+      x += 2;
+    
+    } else if ((strcmp(argv[x], "-list") == 0) && (x + 1 < argc)) {
+      if (!pngstitch_readList(&tiles, argv[x + 1])) {
+        fprintf(stderr, "%s: Can't read tile list %s!\n",
+          pModuleName, argv[x + 1]);
+        status = 0;
+      }
+      x += 2;
+    
+    } else if ((argv[x][0] == '-') && (argv[x][1] != 0)) {
+      fprintf(stderr, "%s: Unrecognized option %s!\n",
+        pModuleName, argv[x]);
+      status = 0;
+    
+    } else {
+      if (!pngstitch_add(&tiles, argv[x])) {
+        fprintf(stderr, "%s: Too many tiles!\n", pModuleName);
+        status = 0;
+      }
+      x++;
+    }
+  }
+  
+  /* The tiles must fill whole rows */
+  if (status && ((tiles.count < 1) || (tiles.count % cols != 0))) {
+    fprintf(stderr, "%s: Tile count must be a multiple of columns!\n",
+      pModuleName);
+    status = 0;
+  }
+  
+  /* Call through to program function */
+  if (status) {
+    if (!pngstitch(argv[1], &tiles, cols, threads, &errcode)) {
+      fprintf(stderr, "%s: %s!\n",
+        pModuleName,
+        sph_image_errorString(errcode));
+      status = 0;
+    }
+  }
+  
+  /* Free the tile list */
+  for(i = 0; i < tiles.count; i++) {
+    free((tiles.ppPaths)[i]);
+  }
+  free(tiles.ppPaths);
+  
+  /* Invert status and return */
+  if (status) {
+    status = 0;
+  } else {
+    status = 1;
+  }
+  return status;
+}
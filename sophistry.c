@@ -3,9 +3,19 @@
  * 
  * Implementation of sophistry.h
  */
+
+/* Needed for clock_gettime() */
+#define _POSIX_C_SOURCE 200112L
+
 #include "sophistry.h"
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
 
 /* Older versions of libpng complain if we include this for some reason,
  * because they already included it */
@@ -13,1534 +23,14995 @@
 
 /* Include <stdio.h> and <stddef.h> before png.h! */
 #include "png.h"
+#include "zlib.h"
 
 /*
- * SPH_IMAGE_WRITER structure.
+ * The name of the ancillary chunk that stores the restart index.
  * 
- * Prototype given in header.
+ * The lowercase first letter marks the chunk as ancillary, so other
+ * decoders ignore it.  The lowercase second letter marks it as private.
+ * The uppercase fourth letter marks it as unsafe to copy, since editors
+ * that change the image data would make the stored offsets wrong.
  */
-struct SPH_IMAGE_WRITER_TAG {
+#define SPH_RESTART_CHUNK "spIX"
+
+/*
+ * The size in bytes of the compressed data buffer used by the native
+ * IDAT encoder.  Each full buffer becomes one IDAT chunk.
+ */
+#define SPH_IDAT_BUFSIZE (32768)
+
+/*
+ * The number of scanlines a writer with a time budget measures before
+ * deciding whether it is falling behind.
+ */
+#define SPH_BUDGET_ROWS (8)
+
+/*
+ * The deflate level that zlib uses for Z_DEFAULT_COMPRESSION.
+ */
+#define SPH_ZLEVEL_DEFAULT (6)
+
+/*
+ * The maximum number of worker threads chosen automatically for
+ * parallel band decoding.
+ */
+#define SPH_MAX_AUTO_THREADS (8)
+
+/*
+ * The default size in bytes of the blocks that a memory arena requests
+ * from the system.
+ */
+#define SPH_ARENA_BLOCK (1048576)
+
+/*
+ * The alignment in bytes of memory allocated from an arena.  This is
+ * enough for any type on common platforms.
+ */
+#define SPH_ARENA_ALIGN (16)
+
+/*
+ * The default number of scanlines in each strip of an image cache, for
+ * images without restart points.
+ */
+#define SPH_CACHE_STRIP (64)
+
+/*
+ * The default memory limit in bytes for the strips of an image cache.
+ */
+#define SPH_CACHE_MEM (67108864)
+
+/*
+ * The default number of scanlines between the checkpoints of an index.
+ */
+#define SPH_INDEX_ROWS (256)
+
+/*
+ * The size in bytes of a deflate window, which is the most history that
+ * a checkpoint needs to store.
+ */
+#define SPH_INDEX_WINDOW (32768)
+
+/*
+ * The signature at the start of an index file.
+ */
+#define SPH_INDEX_MAGIC "SPHINDX1"
+
+/*
+ * The size in bytes of the compressed data buffer used by the native
+ * serial decoder.
+ */
+#define SPH_NATIVE_BUFSIZE (32768)
+
+/*
+ * The size in bytes of the header that records the size of each block
+ * allocated for an object, so that its memory use can be tracked.  This
+ * keeps the block after the header aligned for any type.
+ */
+#define SPH_MEM_HEAD (16)
+
+/*
+ * Estimates of the memory in bytes used by zlib and libpng, for
+ * objects with a memory limit.
+ * 
+ * SPH_MEM_INFLATE covers an inflate stream with a full 32 KiB window,
+ * along with the compressed input buffer of libpng.
+ * SPH_MEM_DEFLATE covers the state of a deflate stream, to which the
+ * window and hash tables are added according to the stream parameters.
+ * SPH_MEM_PNG covers the structures and I/O buffers of a PNG codec,
+ * apart from its scanline buffers.
+ */
+#define SPH_MEM_INFLATE (49152)
+#define SPH_MEM_DEFLATE (8192)
+#define SPH_MEM_PNG (16384)
+
+/*
+ * Low bit-depth grayscale conversion.
+ * 
+ * SPH_GRAY_CHUNK is the number of pixels converted to levels before
+ * they are packed, which must be a multiple of eight.  SPH_GRAY_INEXACT
+ * is set in the level table entries of gray values that aren't exactly
+ * a level, in the exact modes.
+ */
+#define SPH_GRAY_CHUNK (256)
+#define SPH_GRAY_INEXACT (0x80)
+
+/*
+ * The fixed-point format of a resampler.
+ * 
+ * Filter weights are scaled so that SPH_RESAMPLE_ONE is a weight of
+ * one, and channel values are scaled so that SPH_RESAMPLE_MAX is full
+ * intensity.  SPH_RESAMPLE_MAX is 255 times 64, so that 8-bit values
+ * convert exactly when not working in linear light.
+ */
+#define SPH_RESAMPLE_BITS (14)
+#define SPH_RESAMPLE_ONE (16384)
+#define SPH_RESAMPLE_MAX (16320)
+
+/*
+ * The bias that keeps horizontal filter sums positive before they are
+ * shifted down, so that no negative value is ever shifted.
+ */
+#define SPH_RESAMPLE_BIAS (536870912)
+
+/*
+ * The fixed-point format of a convolution.
+ * 
+ * Kernel weights are scaled so that SPH_CONVOLVE_ONE is a weight of
+ * one, and channel values are scaled so that SPH_CONVOLVE_MAX is full
+ * intensity.  With the absolute weights adding up to at most
+ * SPH_IMAGE_CONVOLVE_MAXGAIN, every sum stays below SPH_RESAMPLE_BIAS
+ * in magnitude.
+ */
+#define SPH_CONVOLVE_BITS (12)
+#define SPH_CONVOLVE_ONE (4096)
+#define SPH_CONVOLVE_MAX (4080)
+
+/*
+ * The number of extra scanlines in each ring of a threaded pipeline, on
+ * top of the window of the stage that reads the ring, so that the
+ * stage writing the ring can work ahead.
+ */
+#define SPH_PIPELINE_SLACK (8)
+
+/*
+ * The number of scanlines in each band of an image mosaic.  The mosaic
+ * holds two bands, one being decoded while the other is encoded.
+ */
+#define SPH_MOSAIC_BAND (16)
+
+/*
+ * The number of pixels an image trim object tests at once when looking
+ * for the edges of the content in a scanline.  The pixels of each chunk
+ * are combined without branches, which the compiler can vectorize, and
+ * only a chunk that has content is searched pixel by pixel.
+ */
+#define SPH_TRIM_CHUNK (16)
+
+/*
+ * The default memory limit in bytes for the scanlines that an image
+ * trim object keeps while measuring.
+ */
+#define SPH_TRIM_MEM (67108864)
+
+/*
+ * SPH_MEM structure.
+ * 
+ * The allocator of an image reader, writer, cache, or index, together
+ * with the memory accounting of the object.  Every block allocated for
+ * the object through sph_mem_alloc() carries a header with its size, so
+ * that the number of bytes in use can be tracked as blocks come and
+ * go, including the blocks of libpng and zlib.
+ * 
+ * The counters are protected by the lock, since worker threads allocate
+ * through the same structure.
+ */
+typedef struct {
   
   /*
-   * The output file handle.
+   * The allocation callbacks.
    * 
-   * This will be closed when the object is released.
+   * The function pointers are NULL if the standard library allocator
+   * is used.
    */
-  FILE *pOut;
+  SPH_IMAGE_ALLOCATOR cb;
   
   /*
-   * The kind of image being written.
-   * 
-   * This must be one of the SPH_IMAGE_TYPE constants.
+   * Lock protecting the counters.
    */
-  int ftype;
+  pthread_mutex_t lock;
   
   /*
-   * The PNG library codec pointer.
-   * 
-   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
-   * 
-   * Remember to set the longjmp location in each function before using
-   * this!
-   * 
-   * This will be closed when the object is released.
+   * The number of bytes currently allocated for the object, and the
+   * most that have been allocated at once since the counters were
+   * last reset.  Both include the block headers.
    */
-  png_structp png_ptr;
+  size_t cur;
+  size_t peak;
   
   /*
-   * The PNG library info pointer.
-   * 
-   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
-   * 
-   * This will be closed when the object is released.
+   * The memory limit in bytes, or zero if there is none.
    */
-  png_infop info_ptr;
+  size_t limit;
+
+} SPH_MEM;
+
+/*
+ * SPH_BANDS structure.
+ * 
+ * Parallel band decoder attached to an image reader.  Worker threads
+ * claim restart bands in order, inflate and unfilter each band
+ * independently, and convert it to ARGB in a ring of band slots.  The
+ * reader consumes the slots in order.
+ * 
+ * In whole-image mode, there is no slot ring.  Workers decode each band
+ * straight into its place in the destination image, and the reader
+ * only waits until all bands are done.
+ * 
+ * The configuration fields are set before the workers start and never
+ * change afterwards.  All other fields, as well as the input file
+ * handle, are protected by the lock.
+ */
+typedef struct {
   
   /*
-   * The width of the image in pixels.
+   * Lock protecting the shared state and the input file handle.
    */
-  int32_t w;
+  pthread_mutex_t lock;
   
   /*
-   * The height of the image in pixels.
+   * Condition signalled whenever a slot becomes ready, the consumer
+   * moves on to a new band, or the workers are asked to stop.
+   */
+  pthread_cond_t cond;
+  
+  /*
+   * The input file handle, shared with the reader.
+   */
+  FILE *pIn;
+  
+  /*
+   * The allocator of the reader.
    */
+  SPH_MEM *pAlloc;
+  
+  /*
+   * Image width and height in pixels.
+   */
+  int32_t w;
   int32_t h;
   
   /*
-   * The number of scanlines that have been written so far.
+   * The number of scanlines in each band and the number of bands.
    */
-  int32_t scan_count;
+  int32_t band;
+  int32_t count;
   
   /*
-   * The down-conversion requested.
-   * 
-   * This must be one of the SPH_IMAGE_DOWN constants.
+   * The bit depth and the number of channels of the stored image.
    */
-  int dconv;
+  int bits;
+  int ccount;
   
   /*
-   * Pointer to the scanline buffer.
+   * The tone curves applied while converting to ARGB, or NULL.
+   */
+  const uint32_t *pCurves;
+  
+  /*
+   * The number of bytes in each unfiltered scanline, and the number of
+   * bytes per complete pixel used by the filters (at least one).
+   */
+  size_t rowbytes;
+  size_t bpp;
+  
+  /*
+   * The distance in pixels between the scanlines in a band slot, which
+   * keeps every scanline aligned.  In whole-image mode, this is the
+   * stride of the destination image instead.
+   */
+  size_t pitch;
+  
+  /*
+   * The destination image in whole-image mode, or NULL if the slot ring
+   * is used.
+   */
+  uint32_t *pImage;
+  
+  /*
+   * The file offset of the first IDAT chunk of each band.
+   */
+  const long *pOff;
+  
+  /*
+   * The number of band slots in the ring.
+   */
+  int nslots;
+  
+  /*
+   * For each slot, the band it currently holds, its state, and its
+   * buffer of (band * w) decoded ARGB pixels.
    * 
-   * This dynamically allocated buffer is freed when the object is 
-   * freed.
+   * State zero means the band is still being decoded, one means the
+   * band is ready, and two means the band failed to decode.
    */
-  uint32_t *pScan;
+  int32_t *pSlotBand;
+  int *pSlotState;
+  uint32_t **ppSlotBuf;
   
   /*
-   * Pointer to the binary I/O buffer.
+   * The next band that a worker will claim.
+   */
+  int32_t next;
+  
+  /*
+   * The band the reader is currently consuming.
    * 
-   * This dynamically allocated buffer is freed when the object is
-   * freed.
+   * Workers may only claim bands that are less than (cons + nslots),
+   * so that they never overwrite a slot that is still in use.
    */
-  uint8_t *pData;
-};
+  int32_t cons;
+  
+  /*
+   * In whole-image mode, the number of bands decoded so far and a flag
+   * set when any band failed to decode.
+   */
+  int32_t done;
+  int failed;
+  
+  /*
+   * Flag set when the workers should exit.
+   */
+  int stop;
+  
+  /*
+   * The worker threads.
+   */
+  int nthreads;
+  pthread_t *pThreads;
+
+} SPH_BANDS;
 
 /*
- * SPH_IMAGE_READER structure.
+ * SPH_AHEAD structure.
  * 
- * Prototype given in header.
+ * Read-ahead decoder attached to an image reader.  A single background
+ * thread decodes scanlines in order with libpng into a ring of scanline
+ * slots, running ahead of the reader by up to the number of slots.  The
+ * reader consumes the slots in order.
+ * 
+ * While the read-ahead decoder is running, only its thread uses the
+ * PNG codec and the data buffer of the reader.  The configuration
+ * fields are set before the thread starts and never change afterwards.
+ * All other fields are protected by the lock.
  */
-struct SPH_IMAGE_READER_TAG {
+typedef struct {
   
   /*
-   * Error flag.
-   * 
-   * If non-zero, a read error was encountered.
+   * Lock protecting the shared state.
    */
-  int err_flag;
+  pthread_mutex_t lock;
   
   /*
-   * The input file handle.
-   * 
-   * This will be closed when the object is released.
+   * Condition signalled whenever a scanline is decoded or fails, the
+   * reader releases a scanline, or the thread is asked to stop.
    */
-  FILE *pIn;
+  pthread_cond_t cond;
   
   /*
-   * The kind of image being read.
-   * 
-   * This must be one of the SPH_IMAGE_TYPE constants.
+   * The image reader whose codec is used.
    */
-  int ftype;
+  SPH_IMAGE_READER *pr;
   
   /*
-   * The PNG library codec pointer.
-   * 
-   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
-   * 
-   * Remember to set the longjmp location in each function before using
-   * this!
-   * 
-   * This will be closed when the object is released.
+   * The number of scanline slots in the ring and the slot buffer of
+   * (nslots * w) decoded ARGB pixels.  Scanline y is held in slot
+   * (y % nslots).
    */
-  png_structp png_ptr;
+  int32_t nslots;
+  uint32_t *pSlots;
   
   /*
-   * The PNG library info pointer.
-   * 
-   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
+   * The number of scanlines decoded so far.
+   */
+  int32_t done;
+  
+  /*
+   * The scanline the reader is currently consuming.
    * 
-   * This will be closed when the object is released.
+   * The thread may only decode scanlines that are less than
+   * (cons + nslots), so that it never overwrites a slot that is still
+   * in use.
    */
-  png_infop info_ptr;
+  int32_t cons;
   
   /*
-   * The width of the image in pixels.
+   * Flag set when decoding scanline done failed.  The thread exits
+   * after setting it.
    */
-  int32_t w;
+  int failed;
   
   /*
-   * The height of the image in pixels.
+   * Flag set when the thread should exit.
    */
-  int32_t h;
+  int stop;
   
   /*
-   * The number of scanlines that have been read so far.
+   * The decoder thread.
    */
-  int32_t scan_count;
+  pthread_t thread;
+
+} SPH_AHEAD;
+
+/*
+ * SPH_WPIPE structure.
+ * 
+ * Pipelined encoder attached to an image writer.  The client fills
+ * scanlines in a ring of scanline slots, and a single worker thread
+ * converts and compresses them in order, so that producing one
+ * scanline overlaps encoding the previous ones.
+ * 
+ * While the pipelined encoder is running, only its thread uses the PNG
+ * codec, the encoder state and the error code of the writer.  The
+ * configuration fields are set before the thread starts and never
+ * change afterwards.  All other fields are protected by the lock.
+ */
+typedef struct {
   
   /*
-   * The number of channels in the input image.
-   * 
-   * The valid values are 1-4.  One means grayscale, two means grayscale
-   * plus alpha, three means RGB, four means RGBA.
+   * Lock protecting the shared state.
    */
-  int ccount;
+  pthread_mutex_t lock;
   
   /*
-   * Pointer to the scanline buffer.
-   * 
-   * This dynamically allocated buffer is freed when the object is 
-   * freed.
+   * Condition signalled whenever a scanline is submitted, encoded or
+   * fails, or the thread is asked to stop.
    */
-  uint32_t *pScan;
+  pthread_cond_t cond;
   
   /*
-   * Pointer to the binary I/O buffer.
+   * The image writer whose codec is used.
+   */
+  SPH_IMAGE_WRITER *pw;
+  
+  /*
+   * The number of scanline slots in the ring and the slot buffer of
+   * (nslots * w) ARGB pixels.  Scanline y is held in slot
+   * (y % nslots).
+   */
+  int32_t nslots;
+  uint32_t *pSlots;
+  
+  /*
+   * The number of scanlines submitted by the client and the number
+   * encoded by the thread.
    * 
-   * This dynamically allocated buffer is freed when the object is
-   * freed.
+   * The client may only fill the slot of scanline sub when it is less
+   * than (done + nslots), so that it never overwrites a slot that the
+   * thread hasn't encoded yet.
    */
-  uint8_t *pData;
-};
+  int32_t sub;
+  int32_t done;
+  
+  /*
+   * The error code of the first scanline that failed to encode, or
+   * SPH_IMAGE_ERR_NONE.  The thread exits after setting it.
+   */
+  int err;
+  
+  /*
+   * Flag set when the thread should exit.
+   */
+  int stop;
+  
+  /*
+   * The encoder thread.
+   */
+  pthread_t thread;
+
+} SPH_WPIPE;
 
 /*
- * Local functions
- * ===============
+ * SPH_WORDER structure.
+ * 
+ * Reorder window attached to an image writer.  Client threads submit
+ * scanlines in any order into a ring of scanline slots, and whichever
+ * thread completes the run of scanlines at the start of the window
+ * writes them in order, so that the rows can come from many producers
+ * without being serialized through one buffer.
+ * 
+ * Each thread fills the slot of a scanline without holding the lock,
+ * since the slot belongs to that scanline alone until it is written.
+ * All other fields except the configuration are protected by the lock.
  */
-
-/* Function prototypes */
-static void sph_png_rowRGBA(
-    const uint32_t * pScan,
-          uint8_t  * pData,
-          int32_t    w);
-static void sph_png_rowRGB(
+typedef struct {
+  
+  /*
+   * Lock protecting the shared state.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * Condition broadcast whenever the window moves or fails.
+   */
+  pthread_cond_t cond;
+  
+  /*
+   * The image writer that the scanlines are written to.
+   */
+  SPH_IMAGE_WRITER *pw;
+  
+  /*
+   * The number of scanline slots in the window and the slot buffer of
+   * nslots scanlines, each sph_row_pitch(w) pixels apart.  Scanline y
+   * is held in slot (y % nslots).  pHave has one flag per slot, which is
+   * non-zero while the slot holds a scanline that hasn't been written.
+   */
+  int32_t nslots;
+  uint32_t *pSlots;
+  uint8_t *pHave;
+  
+  /*
+   * The first scanline that hasn't been written yet, which is the start
+   * of the window.  A scanline y may only be submitted while it is less
+   * than (next + nslots).
+   */
+  int32_t next;
+  
+  /*
+   * Non-zero while a thread is writing the scanlines at the start of
+   * the window.
+   */
+  int busy;
+  
+  /*
+   * The error code of the first failure, or SPH_IMAGE_ERR_NONE.
+   */
+  int err;
+
+} SPH_WORDER;
+
+/*
+ * SPH_CHECKPOINT structure.
+ * 
+ * One checkpoint of an index, which allows inflating the image data to
+ * resume in the middle of the stream.  A checkpoint is always at a
+ * deflate block boundary, which usually falls in the middle of a
+ * scanline.
+ */
+typedef struct {
+  
+  /*
+   * The scanline that is partly decoded at the checkpoint, and the
+   * number of bytes of it (including the filter type byte) that are
+   * already decoded.
+   */
+  int32_t row;
+  uint32_t part;
+  
+  /*
+   * The file offset of the next compressed byte, and the number of data
+   * bytes left in its IDAT chunk from there.
+   */
+  long off;
+  uint32_t left;
+  
+  /*
+   * The number of bits of the previous compressed byte that are still
+   * unused, and the value of that byte.
+   */
+  int bits;
+  int byte;
+  
+  /*
+   * The length in bytes of the stored window.
+   */
+  uint32_t wlen;
+  
+  /*
+   * The deflate window of wlen bytes, followed by the part of the
+   * filtered scanline that is already decoded, followed by the
+   * unfiltered previous scanline of rowbytes bytes.  All three are in
+   * one allocation that starts at pWindow.
+   */
+  uint8_t *pWindow;
+  uint8_t *pPart;
+  uint8_t *pPrev;
+
+} SPH_CHECKPOINT;
+
+/*
+ * SPH_NATIVE structure.
+ * 
+ * Native serial decoder, which reads the IDAT chunks itself and
+ * inflates, unfilters and converts the scanlines without libpng.  It
+ * can start at the top of the image or at a checkpoint of an index,
+ * and it is used for building indices and for reading after a seek.
+ * 
+ * The decoder reads the file sequentially from where it was started,
+ * so nothing else may move the file position in between.
+ */
+typedef struct {
+  
+  /*
+   * The allocator of the object that uses the decoder.
+   */
+  SPH_MEM *pAlloc;
+  
+  /*
+   * The input file handle.
+   */
+  FILE *pIn;
+  
+  /*
+   * The raw inflate stream, and a flag that is set once it has been
+   * initialized.
+   */
+  z_stream z;
+  int z_init;
+  
+  /*
+   * The compressed data buffer of SPH_NATIVE_BUFSIZE bytes, which only
+   * ever holds data from one IDAT chunk.
+   * 
+   * last is the final byte of the previous contents of the buffer,
+   * which is needed if a checkpoint falls right after it.
+   */
+  uint8_t *pBuf;
+  int last;
+  
+  /*
+   * The file offset just past the data in the buffer, and the number of
+   * data bytes of the current IDAT chunk left from there.
+   */
+  long off;
+  uint32_t left;
+  
+  /*
+   * Running CRC of the current IDAT chunk, and a flag that is set if the
+   * chunk was read from its start so that the CRC can be checked.
+   */
+  uint32_t crc;
+  int crc_valid;
+  
+  /*
+   * Flag set once a chunk other than IDAT is reached.
+   */
+  int end;
+  
+  /*
+   * Image geometry: width, height, bit depth, number of channels, bytes
+   * per unfiltered scanline, and bytes per complete pixel.
+   */
+  int32_t w;
+  int32_t h;
+  int bits;
+  int ccount;
+  size_t rowbytes;
+  size_t bpp;
+  
+  /*
+   * Scanline buffers of (rowbytes + 1) bytes.
+   * 
+   * pCur receives the filtered scanline that is being inflated, of which
+   * part bytes are done.  pPrev holds a zero byte followed by the
+   * previous unfiltered scanline, and after each scanline is complete,
+   * it holds that scanline.
+   */
+  uint8_t *pCur;
+  uint8_t *pPrev;
+  uint32_t part;
+  
+  /*
+   * The number of scanlines completely decoded so far.
+   */
+  int32_t row;
+
+} SPH_NATIVE;
+
+/*
+ * SPH_ARENA_CHUNK structure.
+ * 
+ * Header of one block of memory that an arena got from the system.  The
+ * usable memory of the block follows the header, starting at offset
+ * SPH_ARENA_HDR.
+ */
+typedef struct SPH_ARENA_CHUNK_TAG SPH_ARENA_CHUNK;
+struct SPH_ARENA_CHUNK_TAG {
+  
+  /*
+   * The next block in the arena, or NULL if this is the last one.
+   */
+  SPH_ARENA_CHUNK *pNext;
+  
+  /*
+   * The number of usable bytes in this block, and the number of them
+   * that have been handed out.
+   */
+  size_t size;
+  size_t used;
+};
+
+/*
+ * The offset of the usable memory within an arena block, which is the
+ * size of the block header rounded up to the arena alignment.
+ */
+#define SPH_ARENA_HDR ((((sizeof(SPH_ARENA_CHUNK)) + SPH_ARENA_ALIGN - 1) \
+                        / SPH_ARENA_ALIGN) * SPH_ARENA_ALIGN)
+
+/*
+ * SPH_IMAGE_ARENA structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_ARENA_TAG {
+  
+  /*
+   * Lock protecting the block list, since readers and writers may
+   * allocate from worker threads.
+   */
+  pthread_mutex_t lock;
+  
+  /*
+   * The size in bytes of the blocks requested from the system.
+   */
+  size_t block;
+  
+  /*
+   * The first block, which is kept when the arena is reset, and the
+   * last block, which new allocations come from.  Both are NULL until
+   * the first allocation.
+   */
+  SPH_ARENA_CHUNK *pFirst;
+  SPH_ARENA_CHUNK *pLast;
+};
+
+/*
+ * SPH_IMAGE_WRITER structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_WRITER_TAG {
+  
+  /*
+   * The output file handle.
+   * 
+   * This will be closed when the object is released.
+   */
+  FILE *pOut;
+  
+  /*
+   * The kind of image being written.
+   * 
+   * This must be one of the SPH_IMAGE_TYPE constants.
+   */
+  int ftype;
+  
+  /*
+   * The PNG library codec pointer.
+   * 
+   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
+   * 
+   * Remember to set the longjmp location in each function before using
+   * this!
+   * 
+   * This will be closed when the object is released.
+   */
+  png_structp png_ptr;
+  
+  /*
+   * The PNG library info pointer.
+   * 
+   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
+   * 
+   * This will be closed when the object is released.
+   */
+  png_infop info_ptr;
+  
+  /*
+   * The width of the image in pixels.
+   */
+  int32_t w;
+  
+  /*
+   * The height of the image in pixels.
+   */
+  int32_t h;
+  
+  /*
+   * The number of scanlines that have been written so far.
+   */
+  int32_t scan_count;
+  
+  /*
+   * The down-conversion requested.
+   * 
+   * This must be one of the SPH_IMAGE_DOWN constants.  The
+   * SPH_IMAGE_DOWN_QUANTIZE flag is not included here; see quant.
+   */
+  int dconv;
+  
+  /*
+   * Quantization flag.
+   * 
+   * If non-zero, low bit-depth grayscale modes round gray values to the
+   * nearest level instead of requiring exact values.
+   */
+  int quant;
+  
+  /*
+   * The level of each gray value for the low bit-depth grayscale modes.
+   * 
+   * In the exact modes, gray values that aren't exactly a level also
+   * have SPH_GRAY_INEXACT set.  Unused in other modes.
+   */
+  uint8_t gray_lut[256];
+  
+  /*
+   * Error code.
+   * 
+   * If not SPH_IMAGE_ERR_NONE, a write error was encountered and all
+   * further writes will fail with this code.
+   */
+  int err_code;
+  
+  /*
+   * Pointer to the scanline buffer.
+   * 
+   * This dynamically allocated buffer is freed when the object is 
+   * freed.
+   */
+  uint32_t *pScan;
+  
+  /*
+   * Pointer to the binary I/O buffer.
+   * 
+   * This dynamically allocated buffer is freed when the object is
+   * freed.
+   */
+  uint8_t *pData;
+  
+  /*
+   * The number of bytes written to the output file so far.
+   * 
+   * This is maintained by the PNG write callback, so it is always the
+   * file offset of the next byte that will be written.
+   */
+  uint64_t fpos;
+  
+  /*
+   * The number of scanlines in each restart band, or zero if restart
+   * points are disabled.
+   * 
+   * When restart points are enabled, the IDAT chunks are produced by
+   * the native IDAT encoder below instead of by libpng.
+   */
+  int32_t band;
+  
+  /*
+   * The file offset of the first IDAT chunk of each restart band.
+   * 
+   * Only allocated when restart points are enabled.
+   */
+  uint64_t *pBandOff;
+  
+  /*
+   * The buffer for the serialized restart index, of (12 + 8 * count)
+   * bytes, where count is the number of bands.
+   * 
+   * Only allocated when restart points are enabled.
+   */
+  uint8_t *pIndex;
+  
+  /*
+   * Native IDAT encoder state.
+   * 
+   * The deflate stream has been allocated if z_alloc is non-zero, and
+   * it has been started for the current image if z_init is non-zero.
+   * z_alloc stays set when the writer is reset, so that the stream can
+   * be reset instead of allocated again.  pPrev holds the previous
+   * unfiltered scanline, pTry and pBest each hold a filter type byte
+   * followed by a filtered scanline, and pZBuf is the compressed output
+   * buffer of SPH_IDAT_BUFSIZE bytes.  The buffers are only allocated
+   * when the native encoder is in use, and idat_cap is the size in
+   * bytes of each of the three scanline buffers.
+   * 
+   * zwbits and zmem are the window bits and memory level of the deflate
+   * stream, which are used by libpng as well.  They are 15 and 8 unless
+   * there is a memory limit.  zfit is non-zero once they have been
+   * chosen for the current image, just before the first scanline.
+   */
+  int z_alloc;
+  int zwbits;
+  int zmem;
+  int zfit;
+  int z_init;
+  z_stream z;
+  size_t rowbytes;
+  size_t bpp;
+  uint8_t *pPrev;
+  uint8_t *pTry;
+  uint8_t *pBest;
+  uint8_t *pZBuf;
+  size_t idat_cap;
+  
+  /*
+   * The compression parameters.
+   * 
+   * zlevel is the deflate level or -1 for the default, zstrategy is one
+   * of the SPH_IMAGE_STRATEGY constants, and filters is a combination
+   * of SPH_IMAGE_FILTER flags or zero for automatic.
+   */
+  int zlevel;
+  int zstrategy;
+  int filters;
+  
+  /*
+   * The time budget state.
+   * 
+   * budget is the budget in milliseconds, or zero if there is none.
+   * t_start is the clock time in milliseconds when the budget was set,
+   * and t_end is the time the last scanline was written, or negative
+   * until then.  t_mark and mark_row are the time and scanline count at
+   * the start of the current measurement.  zcur is the deflate level in
+   * use, and fast is non-zero once the filter search is turned off.
+   * changes and change_row are reported by sph_image_writer_budget().
+   */
+  int32_t budget;
+  double t_start;
+  double t_end;
+  double t_mark;
+  int32_t mark_row;
+  int zcur;
+  int fast;
+  int32_t changes;
+  int32_t change_row;
+  
+  /*
+   * The number of scanlines that have been compressed.
+   * 
+   * This is the same as scan_count except in pipelined mode, where
+   * scan_count counts the scanlines handed to the worker thread, which
+   * may not have compressed them yet.
+   */
+  int32_t enc_count;
+  
+  /*
+   * The requested number of pipeline slots, or zero if pipelining is
+   * disabled.
+   */
+  int32_t pipe_rows;
+  
+  /*
+   * The pipelined encoder, or NULL if it is not running.
+   * 
+   * It is started on the first request for a scanline buffer or the
+   * first write if pipelining was requested.
+   */
+  SPH_WPIPE *pPipe;
+  
+  /*
+   * The reorder window, or NULL if scanlines are written in order.
+   * 
+   * It is set up by sph_image_writer_setReorder() and released along
+   * with the image.
+   */
+  SPH_WORDER *pOrder;
+  
+  /*
+   * Tone curves, as set with sph_image_writer_setCurves().
+   * 
+   * curves is non-zero if the curves are applied.  pCurves holds the
+   * tables of the alpha, red, green, and blue channels, 256 entries
+   * each, with every result already shifted into its place in an ARGB
+   * pixel, and curves_cap is its allocated size in bytes.  The buffer is
+   * kept when the writer is reset, but the curves are turned off.
+   */
+  int curves;
+  uint32_t *pCurves;
+  size_t curves_cap;
+  
+  /*
+   * The allocated sizes in bytes of the scanline buffer and the binary
+   * I/O buffer.
+   * 
+   * When the writer is reset, buffers that are already large enough
+   * for the next image are kept.
+   */
+  size_t scan_cap;
+  size_t data_cap;
+  
+  /*
+   * The allocator, with the memory limit and the memory use of the
+   * object.
+   * 
+   * The callback pointers are NULL if the standard library allocator
+   * is used.  This is also the memory pointer of the PNG codec and the
+   * opaque pointer of the deflate stream.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_IMAGE_READER structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_READER_TAG {
+  
+  /*
+   * Error flag.
+   * 
+   * If non-zero, a read error was encountered.
+   */
+  int err_flag;
+  
+  /*
+   * The input file handle.
+   * 
+   * This will be closed when the object is released.
+   */
+  FILE *pIn;
+  
+  /*
+   * The kind of image being read.
+   * 
+   * This must be one of the SPH_IMAGE_TYPE constants.
+   */
+  int ftype;
+  
+  /*
+   * The PNG library codec pointer.
+   * 
+   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
+   * 
+   * Remember to set the longjmp location in each function before using
+   * this!
+   * 
+   * This will be closed when the object is released.
+   */
+  png_structp png_ptr;
+  
+  /*
+   * The PNG library info pointer.
+   * 
+   * Only valid if ftype is SPH_IMAGE_TYPE_PNG.
+   * 
+   * This will be closed when the object is released.
+   */
+  png_infop info_ptr;
+  
+  /*
+   * The width of the image in pixels.
+   */
+  int32_t w;
+  
+  /*
+   * The height of the image in pixels.
+   */
+  int32_t h;
+  
+  /*
+   * The number of scanlines that have been read so far.
+   */
+  int32_t scan_count;
+  
+  /*
+   * The number of channels in the input image.
+   * 
+   * The valid values are 1-4.  One means grayscale, two means grayscale
+   * plus alpha, three means RGB, four means RGBA.
+   */
+  int ccount;
+  
+  /*
+   * Pointer to the scanline buffer.
+   * 
+   * This dynamically allocated buffer is freed when the object is 
+   * freed.
+   */
+  uint32_t *pScan;
+  
+  /*
+   * Pointer to the binary I/O buffer.
+   * 
+   * This dynamically allocated buffer is freed when the object is
+   * freed.
+   */
+  uint8_t *pData;
+  
+  /*
+   * The bit depth of the stored image.
+   */
+  int bits;
+  
+  /*
+   * The number of scanlines in each restart band, or zero if the input
+   * has no usable restart index.
+   */
+  int32_t band;
+  
+  /*
+   * The number of restart bands.
+   */
+  int32_t band_count;
+  
+  /*
+   * The file offset of the first IDAT chunk of each restart band.
+   * 
+   * Only allocated if a usable restart index was found.
+   */
+  long *pBandOff;
+  
+  /*
+   * The requested number of worker threads for parallel band decoding.
+   * 
+   * Zero means automatic.  One means no worker threads.
+   */
+  int threads;
+  
+  /*
+   * The parallel band decoder, or NULL if it is not running.
+   * 
+   * It is started on the first read if a restart index was found and
+   * more than one thread is in use.
+   */
+  SPH_BANDS *pBands;
+  
+  /*
+   * The requested number of read-ahead scanlines, or zero if read-ahead
+   * is disabled.
+   */
+  int32_t ahead;
+  
+  /*
+   * The read-ahead decoder, or NULL if it is not running.
+   * 
+   * It is started on the first read if read-ahead was requested and the
+   * parallel band decoder isn't running.
+   */
+  SPH_AHEAD *pAhead;
+  
+  /*
+   * Non-zero if the image is in a format that Sophistry can decode
+   * natively, without libpng: 8-bit grayscale, grayscale plus alpha,
+   * RGB, or RGBA, or 1-bit, 2-bit, or 4-bit grayscale, in each case
+   * without a transparency chunk.  Only such images can have restart
+   * bands or be indexed.
+   */
+  int native;
+  
+  /*
+   * The file offset of the first IDAT chunk.
+   */
+  long idat_off;
+  
+  /*
+   * The native serial decoder, or NULL if libpng is decoding.
+   * 
+   * It is started by a seek, and from then on it decodes all scanlines.
+   */
+  SPH_NATIVE *pNative;
+  
+  /*
+   * Downscaling state.
+   * 
+   * reduce is the reduction factor, or 1 if scanlines are returned at
+   * full size.  rw and rh are the width and height of the returned
+   * image, and out_count is the number of reduced scanlines returned so
+   * far; scan_count still counts the scanlines of the source image.
+   * pSum holds four running sums for each reduced pixel, as described
+   * at sph_reduce_addBytes(), and sum_cap is its allocated size in
+   * bytes.
+   */
+  int32_t reduce;
+  int32_t rw;
+  int32_t rh;
+  int32_t out_count;
+  uint64_t *pSum;
+  size_t sum_cap;
+  
+  /*
+   * Tone curves, as set with sph_image_reader_setCurves().
+   * 
+   * curves is non-zero if the curves are applied.  pCurves holds the
+   * tables of the alpha, red, green, and blue channels, 256 entries
+   * each, with every result already shifted into its place in an ARGB
+   * pixel, and curves_cap is its allocated size in bytes.  The buffer is
+   * kept when the reader is reset, but the curves are turned off.
+   */
+  int curves;
+  uint32_t *pCurves;
+  size_t curves_cap;
+  
+  /*
+   * The allocated sizes in bytes of the scanline buffer and the binary
+   * I/O buffer.
+   * 
+   * When the reader is reset, buffers that are already large enough
+   * for the next image are kept.
+   */
+  size_t scan_cap;
+  size_t data_cap;
+  
+  /*
+   * The allocator, with the memory limit and the memory use of the
+   * object.
+   * 
+   * The callback pointers are NULL if the standard library allocator
+   * is used.  This is also the memory pointer of the PNG codec and the
+   * opaque pointer of the deflate stream.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_IMAGE_CACHE structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_CACHE_TAG {
+  
+  /*
+   * Copy of the path of the image file.
+   * 
+   * Without restart points, the reader is reset from this path whenever
+   * an earlier strip has to be decoded again.
+   */
+  char *pPath;
+  
+  /*
+   * The image reader that decodes the strips.
+   */
+  SPH_IMAGE_READER *pr;
+  
+  /*
+   * Image width and height in pixels.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * Non-zero if the image has restart points.
+   * 
+   * In that case, each strip is one restart band, which is decoded
+   * directly with the band decoder configuration in bands, and the
+   * reader is only used for its file handle and restart index.
+   * Otherwise, the reader decodes the image serially.
+   */
+  int restart;
+  SPH_BANDS bands;
+  
+  /*
+   * Work buffers for decoding restart bands.
+   * 
+   * pComp holds the compressed data of a band and has a capacity of
+   * comp_cap bytes.  pCur and pPrev each have (rowbytes + 1) bytes.
+   * Only allocated if the image has restart points.
+   */
+  uint8_t *pComp;
+  size_t comp_cap;
+  uint8_t *pCur;
+  uint8_t *pPrev;
+  
+  /*
+   * The number of scanlines in each strip and the number of strips.
+   */
+  int32_t strip;
+  int32_t strip_count;
+  
+  /*
+   * The distance in pixels between the scanlines in a strip buffer.
+   */
+  size_t pitch;
+  
+  /*
+   * The number of strip buffers, which is the most strips held in
+   * memory at the same time.
+   */
+  int nslots;
+  
+  /*
+   * For each slot, the strip it holds or -1 if it is empty, the value
+   * of the use counter when it was last used, and its buffer.
+   * 
+   * The buffers are allocated on first use, so memory is only taken up
+   * by strips that are actually needed.
+   */
+  int32_t *pSlotStrip;
+  uint64_t *pSlotUse;
+  uint32_t **ppSlotBuf;
+  
+  /*
+   * For each strip, the slot holding it, or -1 if it isn't cached.
+   */
+  int *pStripSlot;
+  
+  /*
+   * Use counter, incremented on each strip access.
+   */
+  uint64_t use;
+  
+  /*
+   * Error flag.
+   * 
+   * If non-zero, a read error was encountered and all further reads
+   * fail.
+   */
+  int err_flag;
+  
+  /*
+   * The checkpoint index used for seeking, or NULL.
+   * 
+   * Only used for images without restart points.  The index belongs to
+   * the client.
+   */
+  const SPH_IMAGE_INDEX *pIndex;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_IMAGE_INDEX structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_INDEX_TAG {
+  
+  /*
+   * The geometry of the indexed image: width, height, bit depth, and
+   * number of channels, as well as the bytes per unfiltered scanline.
+   */
+  int32_t w;
+  int32_t h;
+  int bits;
+  int ccount;
+  size_t rowbytes;
+  
+  /*
+   * The size in bytes of the indexed file and the file offset of its
+   * first IDAT chunk, which are checked before the index is used.
+   */
+  long fsize;
+  long idat_off;
+  
+  /*
+   * The requested number of scanlines between checkpoints.
+   */
+  int32_t spacing;
+  
+  /*
+   * The checkpoints in order of position, the number of checkpoints,
+   * and the allocated capacity of the array.
+   */
+  SPH_CHECKPOINT *pPoints;
+  int32_t count;
+  int32_t cap;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_IMAGE_RESAMPLER structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_RESAMPLER_TAG {
+  
+  /*
+   * Source and destination dimensions in pixels.
+   */
+  int32_t sw;
+  int32_t sh;
+  int32_t dw;
+  int32_t dh;
+  
+  /*
+   * The SPH_IMAGE_KERNEL constant of the filter, and non-zero if
+   * filtering happens in linear light.
+   */
+  int kernel;
+  int linear;
+  
+  /*
+   * The number of source pixels that each destination pixel is
+   * computed from horizontally, and the number of source scanlines
+   * that each destination scanline is computed from vertically.
+   * 
+   * These are the widest filter windows over the whole image, and every
+   * window has exactly this many taps, with zero weights as padding.
+   */
+  int32_t xtaps;
+  int32_t ytaps;
+  
+  /*
+   * Precomputed horizontal filter.
+   * 
+   * For each destination pixel, pXStart has the first source pixel of
+   * its window, and pXWeight has xtaps weights in a row.
+   */
+  int32_t *pXStart;
+  int16_t *pXWeight;
+  
+  /*
+   * Vertical filter of the next destination scanline.
+   * 
+   * ystart is the first source scanline of its window, and pYWeight
+   * has ytaps weights.  These are computed as each destination scanline
+   * is produced, so that nothing is stored per scanline.
+   */
+  int32_t ystart;
+  int16_t *pYWeight;
+  
+  /*
+   * Conversion tables.
+   * 
+   * pToLin converts 8-bit color channel values to the fixed-point
+   * scale, and pFromLin, which has (SPH_RESAMPLE_MAX + 1) entries,
+   * converts back.  pFromLin is only allocated in linear light, where
+   * the conversions include the sRGB transfer function; otherwise the
+   * conversion back is a shift.
+   */
+  uint16_t *pToLin;
+  uint8_t *pFromLin;
+  
+  /*
+   * The source scanline buffer handed to the client, with room for sw
+   * pixels, and the converted source scanline, with four premultiplied
+   * channel values per pixel in order alpha, red, green, blue.
+   */
+  uint32_t *pSrc;
+  int16_t *pConv;
+  
+  /*
+   * Ring of horizontally filtered source scanlines.
+   * 
+   * There are ytaps scanlines of dw pixels with four channel values
+   * each, ring_pitch values apart.  Source scanline y is in ring slot
+   * (y % ytaps).
+   */
+  int16_t *pRing;
+  size_t ring_pitch;
+  
+  /*
+   * Accumulator for the vertical filter, with four values per
+   * destination pixel.
+   */
+  int32_t *pAcc;
+  
+  /*
+   * The number of source scanlines pushed and the number of destination
+   * scanlines produced so far.
+   */
+  int32_t in_count;
+  int32_t out_count;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_CONVOLVE structure.
+ * 
+ * The state of a convolution stage added with
+ * sph_image_pipeline_addConvolution() or
+ * sph_image_pipeline_addSeparable().
+ */
+typedef struct {
+  
+  /*
+   * The width and height in pixels of the scanlines.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The kernel width and height, both odd.
+   */
+  int32_t kw;
+  int32_t kh;
+  
+  /*
+   * Non-zero if the kernel is separable, and non-zero if color is
+   * filtered without alpha weighting (SPH_IMAGE_CONVOLVE_STRAIGHT).
+   */
+  int separable;
+  int straight;
+  
+  /*
+   * The value added to each color channel of the result, in 8-bit
+   * levels.
+   */
+  int32_t bias;
+  
+  /*
+   * The fixed-point weights.  A full kernel has kh rows of kw weights.
+   * A separable kernel has the kw horizontal weights followed by the kh
+   * vertical weights.
+   */
+  int32_t *pKernel;
+  
+  /*
+   * Buffer of (w + kw - 1) pixels holding a converted scanline, padded
+   * on both sides by repeating the edge pixels.  Only used by separable
+   * kernels, since full kernels keep padded scanlines in the ring.
+   */
+  int32_t *pPad;
+  
+  /*
+   * The ring of kh converted scanlines, which are ring_pitch values
+   * apart.  Input scanline y is in slot (y % kh).  Full kernels keep
+   * padded scanlines here, and separable kernels keep scanlines that
+   * are already filtered horizontally.
+   */
+  int32_t *pRing;
+  size_t ring_pitch;
+  
+  /*
+   * Sums for the output scanline, with four values per pixel.
+   */
+  int32_t *pAcc;
+  
+  /*
+   * The next input scanline to convert into the ring.
+   */
+  int32_t next;
+
+} SPH_CONVOLVE;
+
+/*
+ * SPH_PIPE_LINK structure.
+ * 
+ * The ring of scanlines between two neighboring parts of a pipeline:
+ * the reader or a stage that writes the ring, and the stage that reads
+ * it.
+ */
+typedef struct {
+  
+  /*
+   * The width and height in pixels of the scanlines that go through
+   * the ring.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The ring buffer, which has cap scanlines that are pitch pixels
+   * apart.  Scanline y is in slot (y % cap).
+   */
+  uint32_t *pBuf;
+  int32_t cap;
+  size_t pitch;
+  
+  /*
+   * The number of scanlines written into the ring so far.
+   */
+  int32_t produced;
+  
+  /*
+   * The first scanline that the reading stage still needs.  Scanlines
+   * before it may be overwritten.  Only used by threaded pipelines.
+   */
+  int32_t released;
+  
+  /*
+   * Non-zero once the reading stage has produced all of its output, so
+   * that the writing side can stop early.  Only used by threaded
+   * pipelines.
+   */
+  int done;
+
+} SPH_PIPE_LINK;
+
+/*
+ * SPH_PIPE_STAGE structure.
+ * 
+ * A stage of a pipeline, along with its state while running.
+ */
+typedef struct {
+  
+  /*
+   * The pipeline that the stage belongs to, and the index of the stage.
+   * Stage s reads link s of the pipeline.
+   */
+  SPH_IMAGE_PIPELINE *pp;
+  int32_t index;
+  
+  /*
+   * Copy of the definition of the stage given by the client.
+   */
+  SPH_IMAGE_STAGE def;
+  
+  /*
+   * The width and height in pixels of the input of the stage.
+   */
+  int32_t in_w;
+  int32_t in_h;
+  
+  /*
+   * The resampler of a stage added with
+   * sph_image_pipeline_addResampler(), which the pipeline owns, or
+   * NULL.
+   */
+  SPH_IMAGE_RESAMPLER *ps;
+  
+  /*
+   * The state of a stage added with sph_image_pipeline_addConvolution()
+   * or sph_image_pipeline_addSeparable(), which the pipeline owns, or
+   * NULL.
+   */
+  SPH_CONVOLVE *pc;
+  
+  /*
+   * The window pointers passed to the row function, with window
+   * entries.
+   */
+  const uint32_t **ppIn;
+  
+  /*
+   * The last input scanline of the previous output scanline, or -1.
+   */
+  int32_t last;
+  
+  /*
+   * The thread running the stage, valid if has_thread is non-zero.
+   */
+  pthread_t thread;
+  int has_thread;
+
+} SPH_PIPE_STAGE;
+
+/*
+ * SPH_IMAGE_PIPELINE structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_PIPELINE_TAG {
+  
+  /*
+   * The reader at the start of the pipeline, which belongs to the
+   * client.
+   */
+  SPH_IMAGE_READER *pr;
+  
+  /*
+   * The width and height in pixels of the output of the last stage, or
+   * of the reader if there are no stages.
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The stages in order, the number of stages, and the allocated
+   * capacity of the array.
+   */
+  SPH_PIPE_STAGE *pStages;
+  int32_t count;
+  int32_t cap;
+  
+  /*
+   * The rings in front of each stage, with count entries, allocated
+   * when the pipeline runs.
+   */
+  SPH_PIPE_LINK *pLinks;
+  
+  /*
+   * Non-zero if stages run on separate threads, and non-zero once the
+   * pipeline has run.
+   */
+  int threaded;
+  int ran;
+  
+  /*
+   * Lock and condition protecting the ring counters and the stop
+   * state of a threaded pipeline.  The condition is broadcast whenever
+   * any of them changes.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * Non-zero once any part of the pipeline has failed, and the error
+   * code of the first failure.
+   */
+  int stop;
+  int err_code;
+  
+  /*
+   * The source thread of a threaded pipeline, valid if has_source is
+   * non-zero.
+   */
+  pthread_t source;
+  int has_source;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_MOSAIC_WORKER structure.
+ * 
+ * A worker thread of an image mosaic.
+ */
+typedef struct {
+  
+  /*
+   * The mosaic, and the index of the worker.  Worker i decodes the tiles
+   * in columns i, i + n, i + 2n, and so on, where n is the number of
+   * workers.
+   */
+  SPH_IMAGE_MOSAIC *pm;
+  int index;
+  
+  /*
+   * The thread, valid if has_thread is non-zero.
+   */
+  pthread_t thread;
+  int has_thread;
+
+} SPH_MOSAIC_WORKER;
+
+/*
+ * SPH_IMAGE_MOSAIC structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_MOSAIC_TAG {
+  
+  /*
+   * The number of columns and rows of tiles.
+   */
+  int32_t cols;
+  int32_t rows;
+  
+  /*
+   * The tile paths in row-major order, with NULL for blank tiles.
+   */
+  char **ppPaths;
+  
+  /*
+   * The left edge of each column in the output, with one more entry at
+   * the end that holds the output width, and the height of each row.
+   * Only valid once measured is non-zero.
+   */
+  int32_t *pColX;
+  int32_t *pRowH;
+  
+  /*
+   * The output width and height in pixels, and the total number of
+   * bands in the output.  Bands never cross rows of tiles.
+   */
+  int32_t w;
+  int32_t h;
+  int32_t band_count;
+  
+  /*
+   * Non-zero once the mosaic has been measured successfully, and
+   * non-zero once it has run.
+   */
+  int measured;
+  int ran;
+  
+  /*
+   * The requested number of threads, or zero for automatic.
+   */
+  int threads;
+  
+  /*
+   * The open reader of each column in the current row of tiles, or NULL
+   * for blank tiles and between rows.  Each entry is only used by the
+   * worker that owns the column.
+   */
+  SPH_IMAGE_READER **ppReaders;
+  
+  /*
+   * The two band buffers, each holding SPH_MOSAIC_BAND scanlines that
+   * are pitch pixels apart.  Band k goes into buffer (k % 2).
+   */
+  uint32_t *pBuf;
+  size_t pitch;
+  
+  /*
+   * The worker threads, and the number of workers.
+   */
+  SPH_MOSAIC_WORKER *pWorkers;
+  int nworkers;
+  
+  /*
+   * Lock and condition protecting the band counters and the stop state.
+   * The condition is broadcast whenever any of them changes.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  /*
+   * The number of bands written so far, and the number of workers that
+   * have finished the band in each buffer.
+   */
+  int32_t written;
+  int ready[2];
+  
+  /*
+   * Non-zero once any part of the mosaic has failed, and the error code
+   * of the first failure.
+   */
+  int stop;
+  int err_code;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * SPH_IMAGE_TRIM structure.
+ * 
+ * Prototype given in header.
+ */
+struct SPH_IMAGE_TRIM_TAG {
+  
+  /*
+   * The path to the image file.
+   */
+  char *pPath;
+  
+  /*
+   * The SPH_IMAGE_TRIM background mode, and the background color for
+   * SPH_IMAGE_TRIM_COLOR.
+   */
+  int mode;
+  uint32_t color;
+  
+  /*
+   * A pixel p is background if (p & mask) == value.  Only valid while
+   * and after measuring.
+   */
+  uint32_t mask;
+  uint32_t value;
+  
+  /*
+   * The memory limit in bytes for the kept scanlines.
+   */
+  size_t limit;
+  
+  /*
+   * The width and height of the image in pixels.
+   */
+  int32_t iw;
+  int32_t ih;
+  
+  /*
+   * The bounding box.  While measuring, w and h hold the right and
+   * bottom edges of the box, exclusive, and found is non-zero once any
+   * content has been seen.
+   */
+  int32_t x;
+  int32_t y;
+  int32_t w;
+  int32_t h;
+  int found;
+  
+  /*
+   * Non-zero once the trim object has been measured successfully, and
+   * non-zero once it has run.
+   */
+  int measured;
+  int ran;
+  
+  /*
+   * The kept scanlines from scanline y to the bottom of the image, each
+   * pitch pixels apart, or NULL if they are not kept.
+   */
+  uint32_t *pBuf;
+  size_t pitch;
+  
+  /*
+   * The allocator, which always uses the standard library.
+   */
+  SPH_MEM alloc;
+};
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Function prototypes */
+static void sph_png_rowRGBA(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+    const uint32_t * pCurves);
+static void sph_png_rowRGB(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+    const uint32_t * pCurves);
+static void sph_png_rowGray(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+    const uint32_t * pCurves);
+static int sph_png_rowGrayBits(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+          int        bits,
+    const uint8_t  * pLut,
+    const uint32_t * pCurves);
+
+static void sph_gray_lut(uint8_t *pLut, int bits, int quant);
+static int sph_gray_opaque(uint32_t c);
+static int sph_gray_value(uint32_t c);
+static void sph_curves_build(uint32_t *pCurves, const uint8_t *pTables);
+static uint32_t sph_curves_apply(const uint32_t *pCurves, uint32_t c);
+static int sph_down_bits(int dconv);
+
+static void sph_png_decodeRow(
+    const uint8_t  * pData,
+          uint32_t * pScan,
+          int        ccount,
+          int32_t    w,
+    const uint32_t * pCurves);
+
+static void sph_png_decodeRowBits(
+    const uint8_t  * pData,
+          uint32_t * pScan,
+          int        bits,
+          int32_t    w,
+    const uint32_t * pCurves);
+
+static void sph_reduce_addBytes(
+          uint64_t * pSum,
+    const uint8_t  * pData,
+          int        ccount,
+          int32_t    w,
+          int32_t    f);
+static void sph_reduce_addARGB(
+          uint64_t * pSum,
+    const uint32_t * pRow,
+          int        ccount,
+          int32_t    w,
+          int32_t    f);
+static void sph_reduce_emit(
+    const uint64_t * pSum,
+          uint32_t * pDst,
+          int        ccount,
+          int32_t    w,
+          int32_t    f,
+          int32_t    rows,
+    const uint32_t * pCurves);
+static int sph_reader_reduceRows(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int32_t            n);
+
+static void sph_png_writeFn(
+    png_structp   png_ptr,
+    png_bytep     pData,
+    png_size_t    len);
+static void sph_png_flushFn(png_structp png_ptr);
+static void sph_png_errorFn(png_structp png_ptr, png_const_charp pMsg);
+static void sph_png_warningFn(png_structp png_ptr, png_const_charp pMsg);
+
+static void *sph_mem_alloc(SPH_MEM *pAlloc, size_t len);
+static void sph_mem_free(SPH_MEM *pAlloc, void *p);
+static void *sph_mem_allocAligned(SPH_MEM *pAlloc, size_t len);
+static void sph_mem_freeAligned(SPH_MEM *pAlloc, void *p);
+static void sph_mem_init(
+          SPH_MEM             * pm,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit);
+static void sph_mem_destroy(SPH_MEM *pm);
+static void sph_mem_move(SPH_MEM *pDest, SPH_MEM *pSrc);
+static int sph_mem_fits(SPH_MEM *pm, size_t len);
+static int32_t sph_mem_fitRows(
+    SPH_MEM * pm,
+    int32_t   rows,
+    size_t    len,
+    size_t    extra);
+static size_t sph_mem_peak(SPH_MEM *pm, int restart);
+static size_t sph_mem_alignedSize(size_t len);
+static size_t sph_row_pitch(int32_t w);
+static png_voidp sph_png_mallocFn(png_structp png_ptr, png_alloc_size_t len);
+static void sph_png_freeFn(png_structp png_ptr, png_voidp p);
+static voidpf sph_zallocFn(voidpf opaque, uInt items, uInt size);
+static void sph_zfreeFn(voidpf opaque, voidpf p);
+static void *sph_arena_allocFn(void *pCustom, size_t len);
+static void sph_arena_freeFn(void *pCustom, void *p);
+
+static int sph_paeth(int a, int b, int c);
+static void sph_filter_row(
+          int       ftype,
+    const uint8_t * pRaw,
+    const uint8_t * pPrev,
+          uint8_t * pOut,
+          size_t    rowbytes,
+          size_t    bpp);
+static uint32_t sph_filter_cost(const uint8_t *pOut, size_t rowbytes);
+static int sph_unfilter_row(
+          uint8_t * pRow,
+    const uint8_t * pPrev,
+          size_t    rowbytes,
+          size_t    bpp);
+
+static int sph_zstrategy(const SPH_IMAGE_WRITER *pw);
+static int sph_png_filters(const SPH_IMAGE_WRITER *pw);
+static double sph_clock_ms(void);
+static int sph_idat_active(const SPH_IMAGE_WRITER *pw);
+static void sph_idat_alloc(SPH_IMAGE_WRITER *pw);
+static size_t sph_writer_need(SPH_IMAGE_WRITER *pw);
+static int sph_writer_fitDeflate(SPH_IMAGE_WRITER *pw);
+static void sph_idat_emit(SPH_IMAGE_WRITER *pw);
+static void sph_idat_deflate(SPH_IMAGE_WRITER *pw, int flush);
+static void sph_idat_row(SPH_IMAGE_WRITER *pw);
+static void sph_idat_finish(SPH_IMAGE_WRITER *pw);
+static void sph_budget_check(SPH_IMAGE_WRITER *pw);
+
+static uint32_t sph_be32(const uint8_t *p);
+static int sph_restart_scan(SPH_IMAGE_READER *pr);
+
+static int sph_bands_fetch(
+    SPH_BANDS  * pb,
+    int32_t      b,
+    uint8_t   ** ppComp,
+    size_t     * pCap,
+    size_t     * pLen);
+static void sph_bands_config(SPH_BANDS *pb, SPH_IMAGE_READER *pr);
+static int sph_bands_inflate(
+          SPH_BANDS * pb,
+          int32_t     b,
+    const uint8_t   * pComp,
+          size_t      len,
+          uint8_t   * pCur,
+          uint8_t   * pPrev,
+          uint32_t  * pOut);
+static void *sph_bands_worker(void *pArg);
+static size_t sph_bands_need(
+    SPH_IMAGE_READER * pr,
+    int                nthreads,
+    int                image);
+static SPH_BANDS *sph_bands_start(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pImage,
+    size_t             stride);
+static int sph_bands_finish(SPH_BANDS *pb);
+static void sph_bands_stop(SPH_BANDS *pb);
+static const uint32_t *sph_bands_row(SPH_BANDS *pb, int32_t y);
+
+static int sph_ahead_decode(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int                last);
+static void *sph_ahead_worker(void *pArg);
+static SPH_AHEAD *sph_ahead_start(SPH_IMAGE_READER *pr);
+static void sph_ahead_stop(SPH_AHEAD *pa);
+static uint32_t *sph_ahead_row(SPH_AHEAD *pa, int32_t y);
+
+static void sph_put_be32(uint8_t *p, uint32_t v);
+static void sph_put_be64(uint8_t *p, uint64_t v);
+static uint64_t sph_be64(const uint8_t *p);
+
+static SPH_NATIVE *sph_native_new(
+    SPH_MEM          * pAlloc,
+    SPH_IMAGE_READER * pr);
+static void sph_native_free(SPH_NATIVE *pn);
+static int sph_native_start(
+          SPH_NATIVE     * pn,
+          long             idat_off,
+    const SPH_CHECKPOINT * pc);
+static int sph_native_input(SPH_NATIVE *pn);
+static int sph_native_row(
+    SPH_NATIVE      * pn,
+    SPH_IMAGE_INDEX * px,
+    int32_t         * pNext);
+
+static void sph_index_add(SPH_IMAGE_INDEX *px, SPH_NATIVE *pn);
+static int sph_index_match(
+    const SPH_IMAGE_INDEX  * px,
+          SPH_IMAGE_READER * pr);
+static int sph_index_put(
+          FILE     * pOut,
+    const uint8_t  * pData,
+          size_t     len,
+          uint32_t * pCrc);
+static int sph_index_get(
+    FILE     * pIn,
+    uint8_t  * pData,
+    size_t     len,
+    uint32_t * pCrc);
+
+static void sph_reader_begin(SPH_IMAGE_READER *pr);
+static const uint32_t *sph_reader_curves(const SPH_IMAGE_READER *pr);
+
+static int sph_writer_encode(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n);
+static void *sph_wpipe_worker(void *pArg);
+static SPH_WPIPE *sph_wpipe_start(SPH_IMAGE_WRITER *pw);
+static void sph_wpipe_stop(SPH_WPIPE *pp);
+static uint32_t *sph_wpipe_slot(SPH_WPIPE *pp);
+static int sph_wpipe_submit(SPH_WPIPE *pp, int *pError);
+static SPH_WORDER *sph_worder_new(SPH_IMAGE_WRITER *pw, int32_t rows);
+static void sph_worder_free(SPH_WORDER *po);
+static uint32_t *sph_worder_slot(SPH_WORDER *po, int32_t y);
+static void sph_writer_begin(SPH_IMAGE_WRITER *pw);
+static int sph_writer_rows(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError);
+static int sph_auto_threads(void);
+
+static void *sph_buf_fit(
+    SPH_MEM * pAlloc,
+    void    * pBuf,
+    size_t  * pCap,
+    size_t    len);
+static void sph_writer_init(
+    SPH_IMAGE_WRITER * pw,
+    FILE             * pOut,
+    int                ftype,
+    int32_t            w,
+    int32_t            h,
+    int                dconv,
+    int                q);
+static void sph_writer_release(SPH_IMAGE_WRITER *pw);
+static int sph_reader_init(
+    SPH_IMAGE_READER * pr,
+    FILE             * pIn,
+    int                ftype,
+    int              * pError);
+static void sph_reader_release(SPH_IMAGE_READER *pr);
+
+static int sph_cache_load(SPH_IMAGE_CACHE *pc, int32_t st, int *pError);
+
+static double sph_resampler_support(int kernel);
+static double sph_resampler_kernel(int kernel, double x);
+static void sph_resampler_window(
+    int       kernel,
+    int32_t   srclen,
+    int32_t   dstlen,
+    int32_t   i,
+    int32_t * pFirst,
+    int32_t * pLast);
+static int32_t sph_resampler_weights(
+    int       kernel,
+    int32_t   srclen,
+    int32_t   dstlen,
+    int32_t   taps,
+    int32_t   i,
+    int16_t * pWeight);
+static void sph_resampler_push(
+          SPH_IMAGE_RESAMPLER * ps,
+    const uint32_t            * pRow);
+
+static int32_t sph_pipeline_resampleLast(void *pParam, int32_t y);
+static int sph_pipeline_resampleRow(
+          void            * pParam,
+          int32_t           y,
+          int32_t           first,
+    const uint32_t *const * ppIn,
+          uint32_t        * pOut);
+static void sph_pipeline_add(
+          SPH_IMAGE_PIPELINE  * pp,
+    const SPH_IMAGE_STAGE     * pStage,
+          SPH_IMAGE_RESAMPLER * ps,
+          SPH_CONVOLVE        * pc);
+static uint32_t *sph_pipeline_slot(SPH_PIPE_LINK *pl, int32_t y);
+static void sph_pipeline_fail(SPH_IMAGE_PIPELINE *pp, int code);
+static void sph_pipeline_window(
+    SPH_PIPE_STAGE * pst,
+    int32_t          y,
+    int32_t        * pFirst,
+    int32_t        * pLast);
+static int sph_pipeline_apply(
+    SPH_PIPE_STAGE * pst,
+    int32_t          y,
+    int32_t          first,
+    uint32_t       * pOut);
+static int sph_pipeline_pull(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              s,
+    int32_t              y,
+    uint32_t           * pOut);
+static void *sph_pipeline_source(void *pArg);
+static int sph_pipeline_stage(SPH_PIPE_STAGE *pst, SPH_IMAGE_WRITER *pw);
+static void *sph_pipeline_worker(void *pArg);
+
+static int32_t sph_convolve_weights(
+    const double  * pSrc,
+          int32_t   n,
+          int32_t * pDst);
+static void sph_convolve_load(
+          SPH_CONVOLVE * pc,
+    const uint32_t     * pRow,
+          int32_t      * pDst);
+static int sph_convolve_row(
+          void            * pParam,
+          int32_t           y,
+          int32_t           first,
+    const uint32_t *const * ppIn,
+          uint32_t        * pOut);
+static SPH_CONVOLVE *sph_pipeline_convolve(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              kw,
+    int32_t              kh,
+    int                  separable,
+    int32_t              bias,
+    int                  flags);
+
+static int32_t sph_mosaic_band(SPH_IMAGE_MOSAIC *pm, int32_t r, int32_t y);
+static void sph_mosaic_next(
+    SPH_IMAGE_MOSAIC * pm,
+    int32_t          * pRow,
+    int32_t          * pY,
+    int32_t            n);
+static uint32_t *sph_mosaic_slot(SPH_IMAGE_MOSAIC *pm, int32_t k);
+static void sph_mosaic_fail(SPH_IMAGE_MOSAIC *pm, int code);
+static int sph_mosaic_decode(
+    SPH_IMAGE_MOSAIC * pm,
+    int                first,
+    int                step,
+    int32_t            r,
+    int32_t            y,
+    int32_t            n,
+    uint32_t         * pDst,
+    int              * pError);
+static void *sph_mosaic_worker(void *pArg);
+static void sph_mosaic_closeAll(SPH_IMAGE_MOSAIC *pm);
+
+static int32_t sph_trim_first(
+    const SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          a,
+          int32_t          b);
+static int32_t sph_trim_last(
+    const SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          a,
+          int32_t          b);
+static void sph_trim_row(
+          SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          y);
+
+static int sph_path_getImageType(const char *pPath);
+
+/*
+ * Convert a scanline row to the PNG RGBA format.
+ * 
+ * pScan points to the scanline to convert.  On input it holds packed
+ * ARGB color values.  Its length is w pixels.  w must be in range
+ * [1, SPH_IMAGE_MAXDIM].  If pCurves is not NULL, each pixel is first
+ * passed through the tone curves, as by sph_curves_apply().
+ * 
+ * RGBA binary values that can be passed to the PNG codec will be
+ * written to pData.  The length of this buffer must be (w * 4) bytes.
+ * 
+ * Parameters:
+ * 
+ *   pScan - pointer to the scanline buffer
+ * 
+ *   pData - pointer to the data buffer
+ * 
+ *   w - width of the scanline buffer in pixels
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_png_rowRGBA(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+    const uint32_t * pCurves) {
+  
+  SPH_ARGB argb;
+  
+  /* Clear structure */
+  memset(&argb, 0, sizeof(SPH_ARGB));
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Convert scanline */
+  for( ; w > 0; w--) {
+    sph_argb_unpack(sph_curves_apply(pCurves, *pScan), &argb);
+    pData[0] = (unsigned char) argb.r;
+    pData[1] = (unsigned char) argb.g;
+    pData[2] = (unsigned char) argb.b;
+    pData[3] = (unsigned char) argb.a;
+    pData += 4;
+    pScan++;
+  }
+}
+
+/*
+ * Convert a scanline row to the PNG RGB format.
+ * 
+ * pScan points to the scanline to convert.  On input it holds packed
+ * ARGB color values.  Its length is w pixels.  w must be in range
+ * [1, SPH_IMAGE_MAXDIM].  If pCurves is not NULL, each pixel is first
+ * passed through the tone curves, as by sph_curves_apply().
+ * 
+ * RGB binary values that can be passed to the PNG codec will be written
+ * to pData.  The length of this buffer must be (w * 3) bytes.
+ * 
+ * Parameters:
+ * 
+ *   pScan - pointer to the scanline buffer
+ * 
+ *   pData - pointer to the data buffer
+ * 
+ *   w - width of the scanline buffer in pixels
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_png_rowRGB(
+    const uint32_t * pScan,
+          uint8_t  * pData,
+          int32_t    w,
+    const uint32_t * pCurves) {
+  
+  SPH_ARGB argb;
+  
+  /* Clear structure */
+  memset(&argb, 0, sizeof(SPH_ARGB));
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Convert scanline */
+  for( ; w > 0; w--) {
+    sph_argb_unpack(sph_curves_apply(pCurves, *pScan), &argb);
+    sph_argb_downRGB(&argb);
+    pData[0] = (unsigned char) argb.r;
+    pData[1] = (unsigned char) argb.g;
+    pData[2] = (unsigned char) argb.b;
+    pData += 3;
+    pScan++;
+  }
+}
+
+/*
+ * Convert a scanline row to the PNG grayscale format.
+ * 
+ * pScan points to the scanline to convert.  On input it holds packed
+ * ARGB color values.  Its length is w pixels.  w must be in range
+ * [1, SPH_IMAGE_MAXDIM].  If pCurves is not NULL, each pixel is first
+ * passed through the tone curves, as by sph_curves_apply().
+ * 
+ * Grayscale binary values that can be passed to the PNG codec will be
+ * written to pData.  The length of this buffer must be (w) bytes.
+ * 
+ * Parameters:
+ * 
+ *   pScan - pointer to the scanline buffer
+ * 
+ *   pData - pointer to the data buffer
+ * 
+ *   w - width of the scanline buffer in pixels
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_png_rowGray(
     const uint32_t * pScan,
           uint8_t  * pData,
-          int32_t    w);
-static void sph_png_rowGray(
+          int32_t    w,
+    const uint32_t * pCurves) {
+  
+  SPH_ARGB argb;
+  
+  /* Clear structure */
+  memset(&argb, 0, sizeof(SPH_ARGB));
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Convert scanline */
+  for( ; w > 0; w--) {
+    sph_argb_unpack(sph_curves_apply(pCurves, *pScan), &argb);
+    sph_argb_downGray(&argb);
+    *pData = (unsigned char) argb.b;
+    pData++;
+    pScan++;
+  }
+}
+
+/*
+ * Convert a scanline row to a packed PNG grayscale format with a bit
+ * depth less than eight.
+ * 
+ * pScan points to the scanline to convert.  On input it holds packed
+ * ARGB color values.  Its length is w pixels.  w must be in range
+ * [1, SPH_IMAGE_MAXDIM].  If pCurves is not NULL, each pixel is first
+ * passed through the tone curves, as by sph_curves_apply().
+ * 
+ * bits is the bit depth, which must be 1, 2, or 4.  Each pixel is
+ * down-converted to gray and then mapped to a level through pLut, the
+ * table built by sph_gray_lut() for the same bit depth.  Levels are
+ * packed into bytes starting with the most significant bits, as PNG
+ * requires, and any unused bits at the end of the last byte are zero.
+ * The length of pData must be ((w * bits + 7) / 8) bytes.
+ * 
+ * The function fails if any gray value maps to an entry with
+ * SPH_GRAY_INEXACT set.  The contents of pData are undefined on
+ * failure.
+ * 
+ * Opaque scanlines without tone curves, which include every scanline
+ * that came from an image without alpha, are converted straight from
+ * the color channels.  Pixels are converted to levels in chunks, and
+ * each chunk is then packed a whole byte at a time.
+ * 
+ * Parameters:
+ * 
+ *   pScan - pointer to the scanline buffer
+ * 
+ *   pData - pointer to the data buffer
+ * 
+ *   w - width of the scanline buffer in pixels
+ * 
+ *   bits - the output bit depth
+ * 
+ *   pLut - the level table
+ * 
+ *   pCurves - the tone curves, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if a gray value was not exact
+ */
+static int sph_png_rowGrayBits(
     const uint32_t * pScan,
           uint8_t  * pData,
-          int32_t    w);
+          int32_t    w,
+          int        bits,
+    const uint8_t  * pLut,
+    const uint32_t * pCurves) {
+  
+  int status = 1;
+  int opaque = 0;
+  int32_t i = 0;
+  int32_t n = 0;
+  int32_t nb = 0;
+  uint32_t all = 0;
+  uint8_t bad = 0;
+  const uint8_t *pv = NULL;
+  uint8_t lv[SPH_GRAY_CHUNK];
+  
+  /* Initialize buffers */
+  memset(lv, 0, sizeof(lv));
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL) || (pLut == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((bits != 1) && (bits != 2) && (bits != 4)) {
+    abort();
+  }
+  
+  /* Check whether the whole scanline is opaque */
+  if (pCurves == NULL) {
+    all = UINT32_C(0xff000000);
+    for(i = 0; i < w; i++) {
+      all &= pScan[i];
+    }
+    if (all == UINT32_C(0xff000000)) {
+      opaque = 1;
+    }
+  }
+  
+  /* Convert and pack a chunk at a time */
+  while (w > 0) {
+    
+    /* Convert to levels, noting any inexact gray value */
+    n = (w < SPH_GRAY_CHUNK) ? w : SPH_GRAY_CHUNK;
+    if (opaque) {
+      for(i = 0; i < n; i++) {
+        lv[i] = pLut[sph_gray_opaque(pScan[i])];
+      }
+    } else {
+      for(i = 0; i < n; i++) {
+        lv[i] = pLut[sph_gray_value(sph_curves_apply(pCurves, pScan[i]))];
+      }
+    }
+    for(i = 0; i < n; i++) {
+      bad |= lv[i];
+    }
+    
+    /* Pad the last chunk with zero levels to a whole byte */
+    for(i = n; (i % 8) != 0; i++) {
+      lv[i] = 0;
+    }
+    
+    /* Pack whole bytes */
+    pv = lv;
+    if (bits == 4) {
+      nb = (n + 1) / 2;
+      for(i = 0; i < nb; i++) {
+        pData[i] = (uint8_t) ((pv[0] << 4) | pv[1]);
+        pv += 2;
+      }
+    
+    } else if (bits == 2) {
+      nb = (n + 3) / 4;
+      for(i = 0; i < nb; i++) {
+        pData[i] = (uint8_t) ((pv[0] << 6) | (pv[1] << 4) |
+                              (pv[2] << 2) | pv[3]);
+        pv += 4;
+      }
+    
+    } else {
+      nb = (n + 7) / 8;
+      for(i = 0; i < nb; i++) {
+        pData[i] = (uint8_t) ((pv[0] << 7) | (pv[1] << 6) |
+                              (pv[2] << 5) | (pv[3] << 4) |
+                              (pv[4] << 3) | (pv[5] << 2) |
+                              (pv[6] << 1) | pv[7]);
+        pv += 8;
+      }
+    }
+    
+    pScan += n;
+    pData += nb;
+    w -= n;
+  }
+  
+  /* Fail if any gray value was not exact */
+  if (bad & SPH_GRAY_INEXACT) {
+    status = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Build the level table of a low bit-depth grayscale mode.
+ * 
+ * Entry g of pLut receives the level of gray value g, in range zero up
+ * to and including (2^bits - 1).  If quant is non-zero, each gray value
+ * is rounded to the nearest level.  Otherwise, gray values that aren't
+ * exactly a level get SPH_GRAY_INEXACT added to their entry, which
+ * makes sph_png_rowGrayBits() fail.
+ * 
+ * Parameters:
+ * 
+ *   pLut - receives the 256 table entries
+ * 
+ *   bits - the bit depth, which must be 1, 2, or 4
+ * 
+ *   quant - non-zero to quantize, zero to require exact values
+ */
+static void sph_gray_lut(uint8_t *pLut, int bits, int quant) {
+  
+  int maxv = 0;
+  int step = 0;
+  int g = 0;
+  int v = 0;
+  
+  /* Check parameters */
+  if (pLut == NULL) {
+    abort();
+  }
+  if ((bits != 1) && (bits != 2) && (bits != 4)) {
+    abort();
+  }
+  
+  /* Determine the maximum level and the gray distance between levels */
+  maxv = (1 << bits) - 1;
+  step = 255 / maxv;
+  
+  /* Fill in each entry */
+  for(g = 0; g < 256; g++) {
+    if (quant) {
+      v = ((g * maxv) + 127) / 255;
+    } else {
+      v = g / step;
+      if (v * step != g) {
+        v |= SPH_GRAY_INEXACT;
+      }
+    }
+    pLut[g] = (uint8_t) v;
+  }
+}
+
+/*
+ * Compute the grayscale down-conversion of a fully opaque packed ARGB
+ * color.
+ * 
+ * This is the same as sph_gray_value() for colors whose alpha channel
+ * is 255, without unpacking the color.  The weighted sum of gray
+ * channels is the gray value itself, so gray colors need no separate
+ * case.
+ * 
+ * Parameters:
+ * 
+ *   c - the packed ARGB color, which must be opaque
+ * 
+ * Return:
+ * 
+ *   the gray value, in range [0, 255]
+ */
+static int sph_gray_opaque(uint32_t c) {
+  return (int) ((2126 * ((c >> 16) & 0xff) +
+                  7152 * ((c >> 8) & 0xff) +
+                   722 * (c & 0xff)) / 10000);
+}
+
+/*
+ * Compute the grayscale down-conversion of a packed ARGB color.
+ * 
+ * The result is the same as unpacking the color, passing it through
+ * sph_argb_downGray(), and taking any of the color channels, but fully
+ * opaque pixels take the fast path of sph_gray_opaque().
+ * 
+ * Parameters:
+ * 
+ *   c - the packed ARGB color
+ * 
+ * Return:
+ * 
+ *   the gray value, in range [0, 255]
+ */
+static int sph_gray_value(uint32_t c) {
+  
+  SPH_ARGB argb;
+  int result = 0;
+  
+  /* Fast path for opaque pixels, else the general case */
+  if ((c & UINT32_C(0xff000000)) == UINT32_C(0xff000000)) {
+    result = sph_gray_opaque(c);
+  
+  } else {
+    sph_argb_unpack(c, &argb);
+    sph_argb_downGray(&argb);
+    result = argb.b;
+  }
+  
+  return result;
+}
+
+/*
+ * Determine the number of bits per gray sample for a down-conversion.
+ * 
+ * dconv is one of the SPH_IMAGE_DOWN constants, without the
+ * SPH_IMAGE_DOWN_QUANTIZE flag.  The return value is 1, 2, or 4 for
+ * the low bit-depth grayscale modes and zero for all other modes.
+ * 
+ * Parameters:
+ * 
+ *   dconv - the down-conversion
+ * 
+ * Return:
+ * 
+ *   the low bit depth, or zero
+ */
+static int sph_down_bits(int dconv) {
+  
+  int result = 0;
+  
+  if (dconv == SPH_IMAGE_DOWN_GRAY1) {
+    result = 1;
+  } else if (dconv == SPH_IMAGE_DOWN_GRAY2) {
+    result = 2;
+  } else if (dconv == SPH_IMAGE_DOWN_GRAY4) {
+    result = 4;
+  } else {
+    result = 0;
+  }
+  
+  return result;
+}
+
+/*
+ * Build the tone curve tables of a reader or writer.
+ * 
+ * pTables holds the 256-byte tables of the alpha, red, green, and blue
+ * channels, in that order, as given to sph_image_reader_setCurves() or
+ * sph_image_writer_setCurves().  Each entry is shifted into the place
+ * of its channel in an ARGB pixel, so that a whole pixel is converted
+ * with four lookups ORed together.
+ * 
+ * Parameters:
+ * 
+ *   pCurves - receives the (4 * 256) shifted entries
+ * 
+ *   pTables - the (4 * 256) table bytes
+ */
+static void sph_curves_build(uint32_t *pCurves, const uint8_t *pTables) {
+  
+  int c = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pCurves == NULL) || (pTables == NULL)) {
+    abort();
+  }
+  
+  /* Shift each channel table into place */
+  for(c = 0; c < 4; c++) {
+    for(i = 0; i < 256; i++) {
+      pCurves[c * 256 + i] = ((uint32_t) pTables[c * 256 + i]) <<
+                              (8 * (3 - c));
+    }
+  }
+}
+
+/*
+ * Pass a packed ARGB color through tone curves.
+ * 
+ * Parameters:
+ * 
+ *   pCurves - the tables built by sph_curves_build(), or NULL
+ * 
+ *   c - the packed ARGB color
+ * 
+ * Return:
+ * 
+ *   the color with each channel looked up in its table, or the color
+ *   unchanged if pCurves is NULL
+ */
+static uint32_t sph_curves_apply(const uint32_t *pCurves, uint32_t c) {
+  
+  uint32_t result = 0;
+  
+  if (pCurves != NULL) {
+    result = pCurves[c >> 24] |
+              pCurves[256 + ((c >> 16) & 0xff)] |
+              pCurves[512 + ((c >> 8) & 0xff)] |
+              pCurves[768 + (c & 0xff)];
+  } else {
+    result = c;
+  }
+  
+  return result;
+}
+
+/*
+ * Given binary scanline data from a PNG file, decode it into a scanline
+ * buffer.
+ * 
+ * ccount is the number of color channels, which must be in range
+ * [1, 4].  One channel is grayscale, two is grayscale plus alpha, three
+ * is RGB, four is RGB plus alpha.  w is the width in pixels.  w must be
+ * in range [1, SPH_IMAGE_MAXDIM].
+ * 
+ * pData points to the bytes to decode.  Its length is (w * ccount)
+ * bytes.
+ * 
+ * Packed ARGB pixels will be written to pScan.  If pCurves is not
+ * NULL, each pixel is passed through the tone curves, as by
+ * sph_curves_apply().
+ * 
+ * Parameters:
+ * 
+ *   pData - pointer to the bytes to decode
+ * 
+ *   pScan - pointer to the output scanline
+ * 
+ *   ccount - the number of color channels
+ * 
+ *   w - the width of the scanline in pixels
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_png_decodeRow(
+    const uint8_t  * pData,
+          uint32_t * pScan,
+          int        ccount,
+          int32_t    w,
+    const uint32_t * pCurves) {
+  
+  SPH_ARGB argb;
+  
+  /* Clear structure */
+  memset(&argb, 0, sizeof(SPH_ARGB));
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((ccount < 1) || (ccount > 4)) {
+    abort();
+  }
+  
+  /* Decode scanline */
+  for( ; w > 0; w--) {
+    
+    /* Decode input */
+    if (ccount == 1) {
+      /* Grayscale */
+      argb.a = 255;
+      argb.r = *pData;
+      argb.g = argb.r;
+      argb.b = argb.r;
+    
+    } else if (ccount == 2) {
+      /* Grayscale plus alpha */
+      argb.a = pData[1];
+      argb.r = pData[0];
+      argb.g = argb.r;
+      argb.b = argb.r;
+    
+    } else if (ccount == 3) {
+      /* RGB */
+      argb.a = 255;
+      argb.r = pData[0];
+      argb.g = pData[1];
+      argb.b = pData[2];
+    
+    } else if (ccount == 4) {
+      /* RGBA */
+      argb.a = pData[3];
+      argb.r = pData[0];
+      argb.g = pData[1];
+      argb.b = pData[2];
+    
+    } else {
+      abort();  /* shouldn't happen */
+    }
+    
+    /* Write packed result to output, through the tone curves if
+     * any */
+    if (pCurves != NULL) {
+      *pScan = pCurves[argb.a] | pCurves[256 + argb.r] |
+                pCurves[512 + argb.g] | pCurves[768 + argb.b];
+    } else {
+      *pScan = sph_argb_pack(&argb);
+    }
+    
+    /* Advance pointers */
+    pData += ccount;
+    pScan++;
+  }
+}
+
+/*
+ * Given packed low bit-depth grayscale scanline data from a PNG file,
+ * decode it into a scanline buffer.
+ * 
+ * bits is the bit depth, which must be 1, 2, or 4.  w is the width in
+ * pixels, which must be in range [1, SPH_IMAGE_MAXDIM].
+ * 
+ * pData points to the bytes to decode.  Its length is
+ * ((w * bits + 7) / 8) bytes, with the first pixel in the most
+ * significant bits of the first byte.
+ * 
+ * Packed ARGB pixels will be written to pScan.  Each level is scaled up
+ * to the full [0, 255] range in the same way as libpng does, and then
+ * passed through the tone curves if pCurves is not NULL.
+ * 
+ * Parameters:
+ * 
+ *   pData - pointer to the bytes to decode
+ * 
+ *   pScan - pointer to the output scanline
+ * 
+ *   bits - the bit depth
+ * 
+ *   w - the width of the scanline in pixels
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_png_decodeRowBits(
+    const uint8_t  * pData,
+          uint32_t * pScan,
+          int        bits,
+          int32_t    w,
+    const uint32_t * pCurves) {
+  
+  uint32_t step = 0;
+  uint32_t mask = 0;
+  uint32_t v = 0;
+  int shift = 0;
+  
+  /* Check parameters */
+  if ((pScan == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((bits != 1) && (bits != 2) && (bits != 4)) {
+    abort();
+  }
+  
+  /* Determine level scale and mask */
+  mask = (((uint32_t) 1) << bits) - 1;
+  step = 255 / mask;
+  
+  /* Decode scanline */
+  shift = 8 - bits;
+  for( ; w > 0; w--) {
+    v = ((((uint32_t) *pData) >> shift) & mask) * step;
+    if (pCurves != NULL) {
+      *pScan = pCurves[255] | pCurves[256 + v] | pCurves[512 + v] |
+                pCurves[768 + v];
+    } else {
+      *pScan = UINT32_C(0xff000000) | (v << 16) | (v << 8) | v;
+    }
+    pScan++;
+    
+    shift -= bits;
+    if (shift < 0) {
+      shift = 8 - bits;
+      pData++;
+    }
+  }
+}
+
+/*
+ * Add a scanline of decoded PNG bytes to the running sums of a reduced
+ * scanline.
+ * 
+ * Each reduced pixel covers f source pixels across, or fewer at the
+ * right edge, and has four sums in pSum.  The first sum is the total
+ * alpha, and the other three are the totals of the red, green, and
+ * blue channels.  For images with an alpha channel, each color value
+ * is weighted by its alpha, so that transparent pixels don't bleed
+ * into the result.  Grayscale images only use the second sum for the
+ * gray channel, and images without alpha don't use the first.
+ * 
+ * pData holds w pixels of ccount 8-bit channels each, as produced by
+ * libpng, so no ARGB conversion is needed for source pixels.
+ * 
+ * Parameters:
+ * 
+ *   pSum - the running sums
+ * 
+ *   pData - the decoded scanline
+ * 
+ *   ccount - the number of channels
+ * 
+ *   w - the width of the source scanline in pixels
+ * 
+ *   f - the reduction factor
+ */
+static void sph_reduce_addBytes(
+          uint64_t * pSum,
+    const uint8_t  * pData,
+          int        ccount,
+          int32_t    w,
+          int32_t    f) {
+  
+  int32_t x = 0;
+  int32_t k = 0;
+  uint32_t a = 0;
+  
+  /* Check parameters */
+  if ((pSum == NULL) || (pData == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (f < 1) || (ccount < 1) || (ccount > 4)) {
+    abort();
+  }
+  
+  /* Add each box of f pixels to the sums of its reduced pixel */
+  for(x = 0; x < w; pSum += 4) {
+    for(k = 0; (k < f) && (x < w); k++) {
+      
+      if (ccount == 1) {
+        /* Grayscale */
+        pSum[1] += pData[0];
+      
+      } else if (ccount == 2) {
+        /* Grayscale plus alpha */
+        a = pData[1];
+        pSum[0] += a;
+        pSum[1] += ((uint32_t) pData[0]) * a;
+      
+      } else if (ccount == 3) {
+        /* RGB */
+        pSum[1] += pData[0];
+        pSum[2] += pData[1];
+        pSum[3] += pData[2];
+      
+      } else {
+        /* RGBA */
+        a = pData[3];
+        pSum[0] += a;
+        pSum[1] += ((uint32_t) pData[0]) * a;
+        pSum[2] += ((uint32_t) pData[1]) * a;
+        pSum[3] += ((uint32_t) pData[2]) * a;
+      }
+      
+      pData += ccount;
+      x++;
+    }
+  }
+}
+
+/*
+ * Add a scanline of ARGB pixels to the running sums of a reduced
+ * scanline.
+ * 
+ * This is the same as sph_reduce_addBytes(), except that the source
+ * scanline was already converted to ARGB, as it is by the background
+ * decoders.  ccount is still the number of channels of the image, which
+ * selects how the sums are kept.
+ * 
+ * Parameters:
+ * 
+ *   pSum - the running sums
+ * 
+ *   pRow - the ARGB scanline
+ * 
+ *   ccount - the number of channels of the image
+ * 
+ *   w - the width of the source scanline in pixels
+ * 
+ *   f - the reduction factor
+ */
+static void sph_reduce_addARGB(
+          uint64_t * pSum,
+    const uint32_t * pRow,
+          int        ccount,
+          int32_t    w,
+          int32_t    f) {
+  
+  int32_t x = 0;
+  int32_t k = 0;
+  uint32_t c = 0;
+  uint32_t a = 0;
+  
+  /* Check parameters */
+  if ((pSum == NULL) || (pRow == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (f < 1) || (ccount < 1) || (ccount > 4)) {
+    abort();
+  }
+  
+  /* Add each box of f pixels to the sums of its reduced pixel */
+  for(x = 0; x < w; pSum += 4) {
+    for(k = 0; (k < f) && (x < w); k++) {
+      
+      c = *pRow;
+      if (ccount == 1) {
+        /* Grayscale */
+        pSum[1] += (c >> 16) & 0xff;
+      
+      } else if (ccount == 2) {
+        /* Grayscale plus alpha */
+        a = c >> 24;
+        pSum[0] += a;
+        pSum[1] += ((c >> 16) & 0xff) * a;
+      
+      } else if (ccount == 3) {
+        /* RGB */
+        pSum[1] += (c >> 16) & 0xff;
+        pSum[2] += (c >> 8) & 0xff;
+        pSum[3] += c & 0xff;
+      
+      } else {
+        /* RGBA */
+        a = c >> 24;
+        pSum[0] += a;
+        pSum[1] += ((c >> 16) & 0xff) * a;
+        pSum[2] += ((c >> 8) & 0xff) * a;
+        pSum[3] += (c & 0xff) * a;
+      }
+      
+      pRow++;
+      x++;
+    }
+  }
+}
+
+/*
+ * Turn the running sums of a reduced scanline into ARGB pixels.
+ * 
+ * Each reduced pixel is the rounded average of its box of source
+ * pixels.  The box is f pixels wide, or less at the right edge, and
+ * rows scanlines high.  With alpha, the color is the alpha-weighted
+ * average, and fully transparent boxes come out as transparent black.
+ * Each average is then passed through the tone curves, if any, so that
+ * the curves apply to the reduced image.
+ * 
+ * Parameters:
+ * 
+ *   pSum - the running sums
+ * 
+ *   pDst - receives the reduced ARGB scanline
+ * 
+ *   ccount - the number of channels of the image
+ * 
+ *   w - the width of the source scanline in pixels
+ * 
+ *   f - the reduction factor
+ * 
+ *   rows - the number of source scanlines that were added
+ * 
+ *   pCurves - the tone curves, or NULL
+ */
+static void sph_reduce_emit(
+    const uint64_t * pSum,
+          uint32_t * pDst,
+          int        ccount,
+          int32_t    w,
+          int32_t    f,
+          int32_t    rows,
+    const uint32_t * pCurves) {
+  
+  int32_t x = 0;
+  uint64_t n = 0;
+  uint64_t sa = 0;
+  SPH_ARGB argb;
+  
+  /* Clear structure */
+  memset(&argb, 0, sizeof(SPH_ARGB));
+  
+  /* Check parameters */
+  if ((pSum == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  if ((w < 1) || (f < 1) || (rows < 1) || (ccount < 1) || (ccount > 4)) {
+    abort();
+  }
+  
+  /* Average each box */
+  for(x = 0; x < w; x += f) {
+    
+    /* Get the number of source pixels in the box */
+    if (w - x < f) {
+      n = ((uint64_t) (w - x)) * ((uint64_t) rows);
+    } else {
+      n = ((uint64_t) f) * ((uint64_t) rows);
+    }
+    
+    if ((ccount == 1) || (ccount == 3)) {
+      /* Opaque -- plain averages */
+      argb.a = 255;
+      argb.r = (int) ((pSum[1] + (n / 2)) / n);
+      if (ccount == 1) {
+        argb.g = argb.r;
+        argb.b = argb.r;
+      } else {
+        argb.g = (int) ((pSum[2] + (n / 2)) / n);
+        argb.b = (int) ((pSum[3] + (n / 2)) / n);
+      }
+    
+    } else {
+      /* Alpha -- average the alpha, and weight the colors by it */
+      sa = pSum[0];
+      argb.a = (int) ((sa + (n / 2)) / n);
+      if (sa > 0) {
+        argb.r = (int) ((pSum[1] + (sa / 2)) / sa);
+        if (ccount == 2) {
+          argb.g = argb.r;
+          argb.b = argb.r;
+        } else {
+          argb.g = (int) ((pSum[2] + (sa / 2)) / sa);
+          argb.b = (int) ((pSum[3] + (sa / 2)) / sa);
+        }
+      } else {
+        argb.r = 0;
+        argb.g = 0;
+        argb.b = 0;
+      }
+    }
+    
+    *pDst = sph_curves_apply(pCurves, sph_argb_pack(&argb));
+    pDst++;
+    pSum += 4;
+  }
+}
+
+/*
+ * PNG write callback used by image writers.
+ * 
+ * The I/O pointer of the PNG codec must be the image writer object.
+ * The data is written to the output file, and the count of bytes
+ * written is updated so that the writer always knows the file offset
+ * of the next byte.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ * 
+ *   pData - the data to write
+ * 
+ *   len - the number of bytes to write
+ */
+static void sph_png_writeFn(
+    png_structp   png_ptr,
+    png_bytep     pData,
+    png_size_t    len) {
+  
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Get writer */
+  pw = (SPH_IMAGE_WRITER *) png_get_io_ptr(png_ptr);
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Write data and update position */
+  if (len > 0) {
+    if (fwrite(pData, 1, (size_t) len, pw->pOut) != (size_t) len) {
+      png_error(png_ptr, "Write error");
+    }
+    pw->fpos += (uint64_t) len;
+  }
+}
+
+/*
+ * PNG flush callback used by image writers.
+ * 
+ * A failure to flush is raised as a PNG error, so that errors that the
+ * file buffer held back are still reported.  The writer calls this
+ * directly after the end of the image, since png_write_flush() does
+ * nothing once all rows have been written.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ */
+static void sph_png_flushFn(png_structp png_ptr) {
+  
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Get writer and flush its file */
+  pw = (SPH_IMAGE_WRITER *) png_get_io_ptr(png_ptr);
+  if (pw == NULL) {
+    abort();
+  }
+  if (fflush(pw->pOut)) {
+    png_error(png_ptr, "Write error");
+  }
+}
+
+/*
+ * PNG error callback used by image readers and writers.
+ * 
+ * Instead of printing the message, this jumps straight back to the
+ * longjmp location of the codec, where the error is turned into one of
+ * the SPH_IMAGE_ERR codes.  Since nothing is printed and no global
+ * state is touched, codecs on different threads don't interfere.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ * 
+ *   pMsg - the error message, which is ignored
+ */
+static void sph_png_errorFn(png_structp png_ptr, png_const_charp pMsg) {
+  
+  (void) pMsg;
+  png_longjmp(png_ptr, 1);
+}
+
+/*
+ * PNG warning callback used by image readers and writers.
+ * 
+ * Warnings are ignored, so that libpng never prints anything.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ * 
+ *   pMsg - the warning message, which is ignored
+ */
+static void sph_png_warningFn(png_structp png_ptr, png_const_charp pMsg) {
+  
+  (void) png_ptr;
+  (void) pMsg;
+}
+
+/*
+ * Allocate memory for an image reader or writer.
+ * 
+ * The block is preceded by a header of SPH_MEM_HEAD bytes that records
+ * its size, and the size is added to the memory use of the object.  The
+ * memory limit is not enforced here; objects with a limit check their
+ * needs up front instead.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator of the object
+ * 
+ *   len - the number of bytes to allocate
+ * 
+ * Return:
+ * 
+ *   the new block, or NULL if it couldn't be allocated
+ */
+static void *sph_mem_alloc(SPH_MEM *pAlloc, size_t len) {
+  
+  uint8_t *pRaw = NULL;
+  
+  /* Check parameter */
+  if (pAlloc == NULL) {
+    abort();
+  }
+  
+  /* Leave room for the header, failing if the size is out of range */
+  if (len <= SIZE_MAX - SPH_MEM_HEAD) {
+    len += SPH_MEM_HEAD;
+    
+    /* Use the callback if there is one */
+    if (pAlloc->cb.allocFn != NULL) {
+      pRaw = (uint8_t *) pAlloc->cb.allocFn(pAlloc->cb.pCustom, len);
+    } else {
+      pRaw = (uint8_t *) malloc(len);
+    }
+  }
+  
+  /* Record the size and count the block */
+  if (pRaw != NULL) {
+    memcpy(pRaw, &len, sizeof(size_t));
+    
+    pthread_mutex_lock(&(pAlloc->lock));
+    pAlloc->cur += len;
+    if (pAlloc->cur > pAlloc->peak) {
+      pAlloc->peak = pAlloc->cur;
+    }
+    pthread_mutex_unlock(&(pAlloc->lock));
+    
+    pRaw += SPH_MEM_HEAD;
+  }
+  
+  return (void *) pRaw;
+}
+
+/*
+ * Free memory allocated with sph_mem_alloc().
+ * 
+ * If NULL is passed as the block, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator of the object
+ * 
+ *   p - the block to free, or NULL
+ */
+static void sph_mem_free(SPH_MEM *pAlloc, void *p) {
+  
+  uint8_t *pRaw = NULL;
+  size_t len = 0;
+  
+  /* Check parameter */
+  if (pAlloc == NULL) {
+    abort();
+  }
+  
+  if (p != NULL) {
+    
+    /* Find the header and stop counting the block */
+    pRaw = ((uint8_t *) p) - SPH_MEM_HEAD;
+    memcpy(&len, pRaw, sizeof(size_t));
+    
+    pthread_mutex_lock(&(pAlloc->lock));
+    if (len > pAlloc->cur) {
+      abort();
+    }
+    pAlloc->cur -= len;
+    pthread_mutex_unlock(&(pAlloc->lock));
+    
+    /* Use the callback if there is one */
+    if (pAlloc->cb.freeFn != NULL) {
+      pAlloc->cb.freeFn(pAlloc->cb.pCustom, pRaw);
+    } else {
+      free(pRaw);
+    }
+  }
+}
+
+/*
+ * Allocate an aligned and padded buffer for an image reader or writer.
+ * 
+ * The buffer starts at a multiple of SPH_IMAGE_ALIGN bytes, and its size
+ * is rounded up to a multiple of SPH_IMAGE_ALIGN bytes, so that vector
+ * code can process it in whole blocks.  The padding bytes belong to the
+ * buffer, but their contents are unspecified.  The address of the
+ * underlying allocation is stored just before the buffer.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator of the object
+ * 
+ *   len - the number of bytes needed
+ * 
+ * Return:
+ * 
+ *   the new buffer, or NULL if it couldn't be allocated
+ */
+static void *sph_mem_allocAligned(SPH_MEM *pAlloc, size_t len) {
+  
+  uint8_t *pRaw = NULL;
+  uint8_t *p = NULL;
+  uintptr_t addr = 0;
+  
+  /* Check parameter */
+  if (pAlloc == NULL) {
+    abort();
+  }
+  if (len > SIZE_MAX - (2 * SPH_IMAGE_ALIGN) - sizeof(void *)) {
+    abort();
+  }
+  
+  /* Round the size up to whole blocks */
+  len = ((len + SPH_IMAGE_ALIGN - 1) / SPH_IMAGE_ALIGN) * SPH_IMAGE_ALIGN;
+  
+  /* Allocate with room for the alignment and the stored address */
+  pRaw = (uint8_t *) sph_mem_alloc(
+                      pAlloc,
+                      len + SPH_IMAGE_ALIGN + sizeof(void *));
+  if (pRaw != NULL) {
+    addr = (uintptr_t) (pRaw + sizeof(void *));
+    addr = ((addr + SPH_IMAGE_ALIGN - 1) / SPH_IMAGE_ALIGN) *
+              SPH_IMAGE_ALIGN;
+    p = (uint8_t *) addr;
+    memcpy(p - sizeof(void *), &pRaw, sizeof(void *));
+  }
+  
+  return (void *) p;
+}
+
+/*
+ * Free a buffer allocated with sph_mem_allocAligned().
+ * 
+ * If NULL is passed as the buffer, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator of the object
+ * 
+ *   p - the buffer to free, or NULL
+ */
+static void sph_mem_freeAligned(SPH_MEM *pAlloc, void *p) {
+  
+  uint8_t *pRaw = NULL;
+  
+  if (p != NULL) {
+    memcpy(&pRaw, ((uint8_t *) p) - sizeof(void *), sizeof(void *));
+    sph_mem_free(pAlloc, pRaw);
+  }
+}
+
+/*
+ * Initialize the allocator of an object.
+ * 
+ * Parameters:
+ * 
+ *   pm - the allocator structure to initialize
+ * 
+ *   pAlloc - the allocation callbacks, or NULL for the standard library
+ *   allocator
+ * 
+ *   limit - the memory limit in bytes, or zero for none
+ */
+static void sph_mem_init(
+          SPH_MEM             * pm,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit) {
+  
+  /* Check parameters */
+  if (pm == NULL) {
+    abort();
+  }
+  if (pAlloc != NULL) {
+    if ((pAlloc->allocFn == NULL) || (pAlloc->freeFn == NULL)) {
+      abort();
+    }
+  }
+  
+  /* Initialize the structure */
+  memset(pm, 0, sizeof(SPH_MEM));
+  if (pAlloc != NULL) {
+    memcpy(&(pm->cb), pAlloc, sizeof(SPH_IMAGE_ALLOCATOR));
+  }
+  if (pthread_mutex_init(&(pm->lock), NULL)) {
+    abort();
+  }
+  pm->cur = 0;
+  pm->peak = 0;
+  pm->limit = limit;
+}
+
+/*
+ * Release the lock of an allocator.  The blocks allocated through it
+ * are not affected.
+ * 
+ * Parameters:
+ * 
+ *   pm - the allocator
+ */
+static void sph_mem_destroy(SPH_MEM *pm) {
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  pthread_mutex_destroy(&(pm->lock));
+}
+
+/*
+ * Move an allocator to a new location.
+ * 
+ * This is how an object takes over the allocator that allocated its
+ * own structure, and how it hands the allocator back before freeing
+ * the structure.  pDest is initialized with the callbacks, limit, and
+ * counters of pSrc, and pSrc is destroyed.  No other thread may be
+ * using pSrc.
+ * 
+ * Parameters:
+ * 
+ *   pDest - the uninitialized destination
+ * 
+ *   pSrc - the allocator to move
+ */
+static void sph_mem_move(SPH_MEM *pDest, SPH_MEM *pSrc) {
+  
+  /* Check parameters */
+  if ((pDest == NULL) || (pSrc == NULL)) {
+    abort();
+  }
+  
+  /* Copy everything except the lock */
+  sph_mem_init(pDest, NULL, pSrc->limit);
+  memcpy(&(pDest->cb), &(pSrc->cb), sizeof(SPH_IMAGE_ALLOCATOR));
+  pDest->cur = pSrc->cur;
+  pDest->peak = pSrc->peak;
+  
+  sph_mem_destroy(pSrc);
+}
+
+/*
+ * Determine whether an object has room under its memory limit for
+ * more memory.
+ * 
+ * Parameters:
+ * 
+ *   pm - the allocator of the object
+ * 
+ *   len - the number of bytes the object wants to allocate
+ * 
+ * Return:
+ * 
+ *   non-zero if there is no limit or the memory fits, zero otherwise
+ */
+static int sph_mem_fits(SPH_MEM *pm, size_t len) {
+  
+  int result = 1;
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  if (pm->limit > 0) {
+    pthread_mutex_lock(&(pm->lock));
+    if ((pm->cur > pm->limit) || (len > pm->limit - pm->cur)) {
+      result = 0;
+    }
+    pthread_mutex_unlock(&(pm->lock));
+  }
+  
+  return result;
+}
+
+/*
+ * Determine how many scanline slots an object can allocate under its
+ * memory limit.
+ * 
+ * The slots are assumed to be one aligned allocation, which comes
+ * along with extra bytes of other allocations.
+ * 
+ * Parameters:
+ * 
+ *   pm - the allocator of the object
+ * 
+ *   rows - the number of slots wanted
+ * 
+ *   len - the size in bytes of each slot
+ * 
+ *   extra - the number of other bytes that will be allocated
+ * 
+ * Return:
+ * 
+ *   rows if there is no limit, otherwise the largest number up to rows
+ *   that fits, which may be zero
+ */
+static int32_t sph_mem_fitRows(
+    SPH_MEM * pm,
+    int32_t   rows,
+    size_t    len,
+    size_t    extra) {
+  
+  size_t room = 0;
+  
+  /* Check parameters */
+  if ((pm == NULL) || (rows < 0) || (len < 1)) {
+    abort();
+  }
+  
+  if (pm->limit > 0) {
+    pthread_mutex_lock(&(pm->lock));
+    if (pm->cur < pm->limit) {
+      room = pm->limit - pm->cur;
+    }
+    pthread_mutex_unlock(&(pm->lock));
+    
+    /* Leave room for the other bytes and for the padding and header of
+     * the allocation */
+    extra += sph_mem_alignedSize(0);
+    if (room > extra) {
+      room -= extra;
+    } else {
+      room = 0;
+    }
+    if (room / len < (size_t) rows) {
+      rows = (int32_t) (room / len);
+    }
+  }
+  
+  return rows;
+}
+
+/*
+ * Get the peak memory use of an object, and optionally start measuring
+ * again from the current use.
+ * 
+ * Parameters:
+ * 
+ *   pm - the allocator of the object
+ * 
+ *   restart - non-zero to reset the peak to the current use afterwards
+ * 
+ * Return:
+ * 
+ *   the peak memory use in bytes
+ */
+static size_t sph_mem_peak(SPH_MEM *pm, int restart) {
+  
+  size_t result = 0;
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  pthread_mutex_lock(&(pm->lock));
+  result = pm->peak;
+  if (restart) {
+    pm->peak = pm->cur;
+  }
+  pthread_mutex_unlock(&(pm->lock));
+  
+  return result;
+}
+
+/*
+ * Estimate the memory in bytes of an allocation through
+ * sph_mem_allocAligned(), including its padding and header.
+ * 
+ * Parameters:
+ * 
+ *   len - the number of bytes requested
+ * 
+ * Return:
+ * 
+ *   the estimated memory use
+ */
+static size_t sph_mem_alignedSize(size_t len) {
+  
+  return len + (2 * SPH_IMAGE_ALIGN) + sizeof(void *) + SPH_MEM_HEAD;
+}
+
+/*
+ * Determine the distance in pixels between scanlines that are stored
+ * one after another in an aligned buffer.
+ * 
+ * This is the width rounded up so that every scanline starts at a
+ * multiple of SPH_IMAGE_ALIGN bytes.
+ * 
+ * Parameters:
+ * 
+ *   w - the width of the scanlines in pixels
+ * 
+ * Return:
+ * 
+ *   the distance between scanlines in pixels
+ */
+static size_t sph_row_pitch(int32_t w) {
+  
+  size_t px = 0;
+  
+  px = SPH_IMAGE_ALIGN / sizeof(uint32_t);
+  return ((((size_t) w) + px - 1) / px) * px;
+}
+
+/*
+ * PNG memory allocation callback used by image readers and writers.
+ * 
+ * The memory pointer of the codec is the allocator of the object.  This
+ * also serves the zlib streams inside libpng.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ * 
+ *   len - the number of bytes to allocate
+ * 
+ * Return:
+ * 
+ *   the new block, or NULL if it couldn't be allocated
+ */
+static png_voidp sph_png_mallocFn(png_structp png_ptr, png_alloc_size_t len) {
+  
+  png_voidp p = NULL;
+  
+  /* Allocate through the object, unless the size is out of range */
+  if (len <= (png_alloc_size_t) SIZE_MAX) {
+    p = (png_voidp) sph_mem_alloc(
+          (SPH_MEM *) png_get_mem_ptr(png_ptr),
+          (size_t) len);
+  }
+  
+  return p;
+}
+
+/*
+ * PNG memory free callback used by image readers and writers.
+ * 
+ * Parameters:
+ * 
+ *   png_ptr - the PNG codec
+ * 
+ *   p - the block to free, or NULL
+ */
+static void sph_png_freeFn(png_structp png_ptr, png_voidp p) {
+  
+  sph_mem_free((SPH_MEM *) png_get_mem_ptr(png_ptr), p);
+}
+
+/*
+ * zlib allocation callback for the deflate and inflate streams that
+ * Sophistry runs itself.
+ * 
+ * The opaque pointer of the stream is the allocator of the object.
+ * 
+ * Parameters:
+ * 
+ *   opaque - the allocator
+ * 
+ *   items - the number of items
+ * 
+ *   size - the size of each item in bytes
+ * 
+ * Return:
+ * 
+ *   the new block, or Z_NULL if it couldn't be allocated
+ */
+static voidpf sph_zallocFn(voidpf opaque, uInt items, uInt size) {
+  
+  voidpf p = Z_NULL;
+  
+  /* Allocate through the object, unless the size overflows */
+  if ((size < 1) || (items <= SIZE_MAX / size)) {
+    p = (voidpf) sph_mem_alloc(
+          (SPH_MEM *) opaque,
+          ((size_t) items) * ((size_t) size));
+  }
+  
+  return p;
+}
+
+/*
+ * zlib free callback for the deflate and inflate streams that Sophistry
+ * runs itself.
+ * 
+ * Parameters:
+ * 
+ *   opaque - the allocator
+ * 
+ *   p - the block to free
+ */
+static void sph_zfreeFn(voidpf opaque, voidpf p) {
+  
+  sph_mem_free((SPH_MEM *) opaque, (void *) p);
+}
+
+/*
+ * Allocation callback that allocates from a memory arena.
+ * 
+ * Parameters:
+ * 
+ *   pCustom - the arena
+ * 
+ *   len - the number of bytes to allocate
+ * 
+ * Return:
+ * 
+ *   the new block, or NULL if the system is out of memory
+ */
+static void *sph_arena_allocFn(void *pCustom, size_t len) {
+  
+  SPH_IMAGE_ARENA *pa = NULL;
+  SPH_ARENA_CHUNK *pc = NULL;
+  size_t size = 0;
+  void *p = NULL;
+  
+  /* Get the arena */
+  pa = (SPH_IMAGE_ARENA *) pCustom;
+  if (pa == NULL) {
+    abort();
+  }
+  
+  /* Round the size up to the alignment */
+  if (len <= SIZE_MAX - SPH_ARENA_HDR - SPH_ARENA_ALIGN) {
+    len = ((len + SPH_ARENA_ALIGN - 1) / SPH_ARENA_ALIGN) *
+            SPH_ARENA_ALIGN;
+    
+    pthread_mutex_lock(&(pa->lock));
+    
+    /* Start a new block if the last one is missing or too full */
+    if ((pa->pLast == NULL) ||
+        (pa->pLast->size - pa->pLast->used < len)) {
+      size = pa->block;
+      if (size < len) {
+        size = len;
+      }
+      pc = (SPH_ARENA_CHUNK *) malloc(SPH_ARENA_HDR + size);
+      if (pc != NULL) {
+        pc->pNext = NULL;
+        pc->size = size;
+        pc->used = 0;
+        if (pa->pLast == NULL) {
+          pa->pFirst = pc;
+        } else {
+          pa->pLast->pNext = pc;
+        }
+        pa->pLast = pc;
+      }
+    }
+    
+    /* Hand out memory from the last block */
+    if ((pa->pLast != NULL) && (pa->pLast->size - pa->pLast->used >= len)) {
+      p = (void *) (((uint8_t *) pa->pLast) + SPH_ARENA_HDR +
+                      pa->pLast->used);
+      pa->pLast->used += len;
+    }
+    
+    pthread_mutex_unlock(&(pa->lock));
+  }
+  
+  return p;
+}
+
+/*
+ * Free callback for a memory arena.
+ * 
+ * Memory in an arena is only released when the arena is reset, so this
+ * does nothing.
+ * 
+ * Parameters:
+ * 
+ *   pCustom - the arena
+ * 
+ *   p - the block
+ */
+static void sph_arena_freeFn(void *pCustom, void *p) {
+  
+  (void) pCustom;
+  (void) p;
+}
+
+/*
+ * The PNG Paeth predictor.
+ * 
+ * a is the byte to the left, b is the byte above, and c is the byte
+ * above and to the left.
+ * 
+ * Parameters:
+ * 
+ *   a - the left byte
+ * 
+ *   b - the upper byte
+ * 
+ *   c - the upper left byte
+ * 
+ * Return:
+ * 
+ *   the predicted byte
+ */
+static int sph_paeth(int a, int b, int c) {
+  
+  int pa = 0;
+  int pb = 0;
+  int pc = 0;
+  int result = 0;
+  
+  /* Compute distances from the initial estimate (a + b - c) */
+  pa = b - c;
+  pb = a - c;
+  pc = pa + pb;
+  
+  if (pa < 0) {
+    pa = -pa;
+  }
+  if (pb < 0) {
+    pb = -pb;
+  }
+  if (pc < 0) {
+    pc = -pc;
+  }
+  
+  /* Choose the nearest, breaking ties in order a, b, c */
+  if ((pa <= pb) && (pa <= pc)) {
+    result = a;
+  } else if (pb <= pc) {
+    result = b;
+  } else {
+    result = c;
+  }
+  
+  return result;
+}
+
+/*
+ * Apply a PNG filter to a scanline.
+ * 
+ * ftype is the PNG filter type, in range [0, 4].  pRaw is the
+ * unfiltered scanline and pPrev is the unfiltered previous scanline,
+ * which should be all zero for the first scanline of the image.  Both
+ * have a length of rowbytes.  bpp is the number of bytes per complete
+ * pixel, which is at least one.
+ * 
+ * pOut receives the filter type byte followed by the filtered scanline,
+ * so its length must be (rowbytes + 1).
+ * 
+ * Parameters:
+ * 
+ *   ftype - the filter type
+ * 
+ *   pRaw - the unfiltered scanline
+ * 
+ *   pPrev - the unfiltered previous scanline
+ * 
+ *   pOut - the buffer to receive the filtered scanline
+ * 
+ *   rowbytes - the length of a scanline in bytes
+ * 
+ *   bpp - bytes per complete pixel
+ */
+static void sph_filter_row(
+          int       ftype,
+    const uint8_t * pRaw,
+    const uint8_t * pPrev,
+          uint8_t * pOut,
+          size_t    rowbytes,
+          size_t    bpp) {
+  
+  size_t i = 0;
+  
+  /* Check parameters */
+  if ((pRaw == NULL) || (pPrev == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((rowbytes < 1) || (bpp < 1) || (bpp > 8)) {
+    abort();
+  }
+  
+  /* Write filter type byte */
+  *pOut = (uint8_t) ftype;
+  pOut++;
+  
+  /* Filter the bytes */
+  if (ftype == 0) {
+    /* None */
+    memcpy(pOut, pRaw, rowbytes);
+  
+  } else if (ftype == 1) {
+    /* Sub */
+    for(i = 0; (i < bpp) && (i < rowbytes); i++) {
+      pOut[i] = pRaw[i];
+    }
+    for( ; i < rowbytes; i++) {
+      pOut[i] = (uint8_t) (pRaw[i] - pRaw[i - bpp]);
+    }
+  
+  } else if (ftype == 2) {
+    /* Up */
+    for(i = 0; i < rowbytes; i++) {
+      pOut[i] = (uint8_t) (pRaw[i] - pPrev[i]);
+    }
+  
+  } else if (ftype == 3) {
+    /* Average */
+    for(i = 0; (i < bpp) && (i < rowbytes); i++) {
+      pOut[i] = (uint8_t) (pRaw[i] - (pPrev[i] >> 1));
+    }
+    for( ; i < rowbytes; i++) {
+      pOut[i] = (uint8_t) (pRaw[i] -
+                  ((((unsigned int) pRaw[i - bpp]) +
+                    ((unsigned int) pPrev[i])) >> 1));
+    }
+  
+  } else if (ftype == 4) {
+    /* Paeth */
+    for(i = 0; (i < bpp) && (i < rowbytes); i++) {
+      pOut[i] = (uint8_t) (pRaw[i] - pPrev[i]);
+    }
+    for( ; i < rowbytes; i++) {
+      pOut[i] = (uint8_t) (pRaw[i] -
+                  sph_paeth(pRaw[i - bpp], pPrev[i], pPrev[i - bpp]));
+    }
+  
+  } else {
+    /* Unrecognized filter type */
+    abort();
+  }
+}
+
+/*
+ * Compute the cost of a filtered scanline for filter selection.
+ * 
+ * pOut is a filtered scanline as produced by sph_filter_row(), with
+ * the filter type byte first.  The cost is the sum of the absolute
+ * values of the filtered bytes taken as signed values, which is the
+ * same heuristic that libpng uses.  Lower costs usually compress
+ * better.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the filtered scanline
+ * 
+ *   rowbytes - the length of the scanline in bytes, not including the
+ *   filter type byte
+ * 
+ * Return:
+ * 
+ *   the cost of the scanline
+ */
+static uint32_t sph_filter_cost(const uint8_t *pOut, size_t rowbytes) {
+  
+  uint32_t cost = 0;
+  size_t i = 0;
+  uint32_t v = 0;
+  
+  /* Check parameters */
+  if (pOut == NULL) {
+    abort();
+  }
+  
+  /* Sum the costs, skipping the filter type byte */
+  pOut++;
+  for(i = 0; i < rowbytes; i++) {
+    v = pOut[i];
+    if (v < 128) {
+      cost += v;
+    } else {
+      cost += 256 - v;
+    }
+  }
+  
+  return cost;
+}
+
+/*
+ * Reverse a PNG filter on a scanline in place.
+ * 
+ * pRow holds a filter type byte followed by rowbytes bytes of filtered
+ * scanline data.  On return, the bytes after the filter type byte hold
+ * the unfiltered scanline.  pPrev is the unfiltered previous scanline,
+ * which must be all zero for the first scanline of the image.  bpp is
+ * the number of bytes per complete pixel, which is at least one.
+ * 
+ * Parameters:
+ * 
+ *   pRow - the scanline to unfilter
+ * 
+ *   pPrev - the unfiltered previous scanline
+ * 
+ *   rowbytes - the length of a scanline in bytes
+ * 
+ *   bpp - bytes per complete pixel
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the filter type is invalid
+ */
+static int sph_unfilter_row(
+          uint8_t * pRow,
+    const uint8_t * pPrev,
+          size_t    rowbytes,
+          size_t    bpp) {
+  
+  int status = 1;
+  int ftype = 0;
+  size_t i = 0;
+  
+  /* Check parameters */
+  if ((pRow == NULL) || (pPrev == NULL)) {
+    abort();
+  }
+  if ((rowbytes < 1) || (bpp < 1) || (bpp > 8)) {
+    abort();
+  }
+  
+  /* Get the filter type and skip to the data */
+  ftype = pRow[0];
+  pRow++;
+  
+  /* Unfilter the bytes */
+  if (ftype == 0) {
+    /* None -- nothing to do */
+  
+  } else if (ftype == 1) {
+    /* Sub */
+    for(i = bpp; i < rowbytes; i++) {
+      pRow[i] = (uint8_t) (pRow[i] + pRow[i - bpp]);
+    }
+  
+  } else if (ftype == 2) {
+    /* Up */
+    for(i = 0; i < rowbytes; i++) {
+      pRow[i] = (uint8_t) (pRow[i] + pPrev[i]);
+    }
+  
+  } else if (ftype == 3) {
+    /* Average */
+    for(i = 0; (i < bpp) && (i < rowbytes); i++) {
+      pRow[i] = (uint8_t) (pRow[i] + (pPrev[i] >> 1));
+    }
+    for( ; i < rowbytes; i++) {
+      pRow[i] = (uint8_t) (pRow[i] +
+                  ((((unsigned int) pRow[i - bpp]) +
+                    ((unsigned int) pPrev[i])) >> 1));
+    }
+  
+  } else if (ftype == 4) {
+    /* Paeth */
+    for(i = 0; (i < bpp) && (i < rowbytes); i++) {
+      pRow[i] = (uint8_t) (pRow[i] + pPrev[i]);
+    }
+    for( ; i < rowbytes; i++) {
+      pRow[i] = (uint8_t) (pRow[i] +
+                  sph_paeth(pRow[i - bpp], pPrev[i], pPrev[i - bpp]));
+    }
+  
+  } else {
+    /* Invalid filter type */
+    status = 0;
+  }
+  
+  return status;
+}
+
+/*
+ * Read the monotonic clock.
+ * 
+ * Return:
+ * 
+ *   the current time in milliseconds from an arbitrary starting point
+ */
+static double sph_clock_ms(void) {
+  
+  struct timespec ts;
+  
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+    abort();
+  }
+  
+  return (((double) ts.tv_sec) * 1000.0) +
+          (((double) ts.tv_nsec) / 1000000.0);
+}
+
+/*
+ * Determine whether an image writer uses the native IDAT encoder.
+ * 
+ * The native encoder is used when restart points are enabled or when
+ * there is a time budget, since libpng can't do either.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   non-zero if the native IDAT encoder is used, zero if libpng is
+ */
+static int sph_idat_active(const SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  return ((pw->band > 0) || (pw->budget > 0));
+}
+
+/*
+ * Estimate the memory in bytes that an image writer allocates once it
+ * starts compressing, with its current deflate parameters.
+ * 
+ * This covers the deflate stream and, if libpng compresses the image,
+ * the output buffers of libpng and the up to four scanlines that it
+ * keeps for the filter search.  The buffers of the native IDAT encoder
+ * are not included, since they are allocated up front.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   the estimated memory use
+ */
+static size_t sph_writer_need(SPH_IMAGE_WRITER *pw) {
+  
+  int bits = 0;
+  size_t need = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Count the buffers of libpng if it compresses the image */
+  if (!sph_idat_active(pw)) {
+    bits = sph_down_bits(pw->dconv);
+    if (bits == 0) {
+      if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
+        bits = 32;
+      } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
+        bits = 24;
+      } else {
+        bits = 8;
+      }
+    }
+    need = SPH_MEM_PNG + (4 * sph_mem_alignedSize(
+                (((((size_t) pw->w) * ((size_t) bits)) + 7) / 8) + 1));
+  }
+  
+  /* Count the deflate stream */
+  need += SPH_MEM_DEFLATE + (((size_t) 1) << (pw->zwbits + 2)) +
+            (((size_t) 1) << (pw->zmem + 9));
+  
+  return need;
+}
+
+/*
+ * Choose the deflate parameters of an image writer so that the image
+ * fits under the memory limit of the writer.
+ * 
+ * The window bits and memory level start at the zlib defaults of 15
+ * and 8, and whichever of the two costs more memory is lowered step by
+ * step until sph_writer_need() fits, down to 9 and 1.  This must be
+ * done just before the first scanline, once the buffers of the native
+ * IDAT encoder are allocated if it is used.  Without a memory limit,
+ * the defaults are always chosen.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   non-zero if the image fits, zero if it doesn't fit even with the
+ *   smallest parameters
+ */
+static int sph_writer_fitDeflate(SPH_IMAGE_WRITER *pw) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Start from the zlib defaults */
+  pw->zwbits = 15;
+  pw->zmem = 8;
+  
+  /* Lower the parameters until everything fits */
+  if (pw->alloc.limit > 0) {
+    while (!sph_mem_fits(&(pw->alloc), sph_writer_need(pw))) {
+      if ((pw->zwbits > 9) && (pw->zwbits + 2 >= pw->zmem + 9)) {
+        pw->zwbits--;
+      } else if (pw->zmem > 1) {
+        pw->zmem--;
+      } else if (pw->zwbits > 9) {
+        pw->zwbits--;
+      } else {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Allocate the buffers of the native IDAT encoder of an image writer,
+ * unless buffers that are large enough are already allocated.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_idat_alloc(SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Determine the scanline size of the image */
+  if (sph_down_bits(pw->dconv) > 0) {
+    pw->rowbytes = ((((size_t) pw->w) *
+                ((size_t) sph_down_bits(pw->dconv))) + 7) / 8;
+    pw->bpp = 1;
+  } else if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
+    pw->rowbytes = ((size_t) pw->w) * 4;
+    pw->bpp = 4;
+  } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
+    pw->rowbytes = ((size_t) pw->w) * 3;
+    pw->bpp = 3;
+  } else {
+    pw->rowbytes = (size_t) pw->w;
+    pw->bpp = 1;
+  }
+  
+  /* Allocate the output buffer if necessary */
+  if (pw->pZBuf == NULL) {
+    pw->pZBuf = (uint8_t *) sph_mem_allocAligned(
+                              &(pw->alloc),
+                              SPH_IDAT_BUFSIZE);
+    if (pw->pZBuf == NULL) {
+      abort();
+    }
+  }
+  
+  /* Replace the scanline buffers if they are too small */
+  if (pw->rowbytes + 1 > pw->idat_cap) {
+    sph_mem_freeAligned(&(pw->alloc), pw->pPrev);
+    sph_mem_freeAligned(&(pw->alloc), pw->pTry);
+    sph_mem_freeAligned(&(pw->alloc), pw->pBest);
+    
+    pw->pPrev = (uint8_t *) sph_mem_allocAligned(
+                    &(pw->alloc),
+                    pw->rowbytes + 1);
+    pw->pTry = (uint8_t *) sph_mem_allocAligned(
+                    &(pw->alloc),
+                    pw->rowbytes + 1);
+    pw->pBest = (uint8_t *) sph_mem_allocAligned(
+                    &(pw->alloc),
+                    pw->rowbytes + 1);
+    if ((pw->pPrev == NULL) || (pw->pTry == NULL) ||
+        (pw->pBest == NULL)) {
+      abort();
+    }
+    pw->idat_cap = pw->rowbytes + 1;
+  }
+}
+
+/*
+ * Write any compressed data waiting in the native IDAT encoder buffer
+ * to the output file as an IDAT chunk.
+ * 
+ * The caller must have set the longjmp location of the PNG codec.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_idat_emit(SPH_IMAGE_WRITER *pw) {
+  
+  size_t len = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Write the pending data, if any, and reset the buffer */
+  len = SPH_IDAT_BUFSIZE - (size_t) pw->z.avail_out;
+  if (len > 0) {
+    png_write_chunk(
+        pw->png_ptr,
+        (png_const_bytep) "IDAT",
+        (png_const_bytep) pw->pZBuf,
+        len);
+  }
+  
+  pw->z.next_out = (Bytef *) pw->pZBuf;
+  pw->z.avail_out = (uInt) SPH_IDAT_BUFSIZE;
+}
+
+/*
+ * Run the native IDAT encoder's deflate stream.
+ * 
+ * All input currently given to the stream is compressed, and each time
+ * the output buffer fills up it is written as an IDAT chunk.  flush is
+ * the zlib flush mode.  For any mode other than Z_NO_FLUSH, all the
+ * output is also written, so that the next chunk begins after the
+ * flush point.
+ * 
+ * The caller must have set the longjmp location of the PNG codec.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   flush - the zlib flush mode
+ */
+static void sph_idat_deflate(SPH_IMAGE_WRITER *pw, int flush) {
+  
+  int retval = 0;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if (!(pw->z_init)) {
+    abort();
+  }
+  
+  /* Deflate until all input is used and, when flushing, until deflate
+   * has room left over in the output buffer */
+  for(;;) {
+    retval = deflate(&(pw->z), flush);
+    if ((retval != Z_OK) && (retval != Z_STREAM_END) &&
+        (retval != Z_BUF_ERROR)) {
+      png_error(pw->png_ptr, "Deflate error");
+    }
+    
+    if (pw->z.avail_out == 0) {
+      sph_idat_emit(pw);
+    
+    } else if ((flush == Z_NO_FLUSH) || (flush == Z_FINISH)) {
+      if ((pw->z.avail_in == 0) &&
+          ((flush == Z_NO_FLUSH) || (retval == Z_STREAM_END))) {
+        break;
+      }
+    
+    } else {
+      break;
+    }
+  }
+  
+  /* When flushing, write everything out */
+  if (flush != Z_NO_FLUSH) {
+    sph_idat_emit(pw);
+  }
+}
+
+/*
+ * Determine the zlib compression strategy of an image writer.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   the zlib strategy constant
+ */
+static int sph_zstrategy(const SPH_IMAGE_WRITER *pw) {
+  
+  int result = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Map the strategy */
+  if (pw->zstrategy == SPH_IMAGE_STRATEGY_DEFAULT) {
+    result = Z_DEFAULT_STRATEGY;
+  
+  } else if (pw->zstrategy == SPH_IMAGE_STRATEGY_FILTERED) {
+    result = Z_FILTERED;
+  
+  } else if (pw->zstrategy == SPH_IMAGE_STRATEGY_HUFFMAN) {
+    result = Z_HUFFMAN_ONLY;
+  
+  } else if (pw->zstrategy == SPH_IMAGE_STRATEGY_RLE) {
+    result = Z_RLE;
+  
+  } else if (pw->zstrategy == SPH_IMAGE_STRATEGY_FIXED) {
+    result = Z_FIXED;
+  
+  } else if (sph_down_bits(pw->dconv) > 0) {
+    result = Z_DEFAULT_STRATEGY;
+  
+  } else {
+    result = Z_FILTERED;
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Determine the libpng filter flags of an image writer.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   the libpng filter flags for png_set_filter()
+ */
+static int sph_png_filters(const SPH_IMAGE_WRITER *pw) {
+  
+  int result = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Translate the filter flags */
+  if (pw->filters == 0) {
+    if (sph_down_bits(pw->dconv) > 0) {
+      result = PNG_FILTER_NONE;
+    } else {
+      result = PNG_ALL_FILTERS;
+    }
+  } else {
+    if (pw->filters & SPH_IMAGE_FILTER_NONE) {
+      result |= PNG_FILTER_NONE;
+    }
+    if (pw->filters & SPH_IMAGE_FILTER_SUB) {
+      result |= PNG_FILTER_SUB;
+    }
+    if (pw->filters & SPH_IMAGE_FILTER_UP) {
+      result |= PNG_FILTER_UP;
+    }
+    if (pw->filters & SPH_IMAGE_FILTER_AVG) {
+      result |= PNG_FILTER_AVG;
+    }
+    if (pw->filters & SPH_IMAGE_FILTER_PAETH) {
+      result |= PNG_FILTER_PAETH;
+    }
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Compress the serialized scanline in the data buffer of an image
+ * writer with the native IDAT encoder.
+ * 
+ * The first scanline of each restart band starts a new IDAT chunk
+ * after a full flush of the deflate stream, so that it can be inflated
+ * without any earlier data, and it only uses the None or Sub filter,
+ * so that it can be unfiltered without the previous scanline.  Other
+ * scanlines use whichever allowed filter has the lowest cost.  Unless
+ * the filters were chosen explicitly, packed low bit-depth scanlines
+ * always use the None filter, as recommended by the PNG specification.
+ * 
+ * The caller must have set the longjmp location of the PNG codec.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_idat_row(SPH_IMAGE_WRITER *pw) {
+  
+  int ftype = 0;
+  int fmask = 0;
+  int fcount = 0;
+  int first = 1;
+  uint32_t cost = 0;
+  uint32_t best = 0;
+  uint8_t *pSwap = NULL;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  if (!sph_idat_active(pw)) {
+    abort();
+  }
+  
+  /* Start the deflate stream on the first scanline */
+  if (!(pw->z_init)) {
+    if (pw->zlevel < 0) {
+      pw->zcur = SPH_ZLEVEL_DEFAULT;
+    } else {
+      pw->zcur = pw->zlevel;
+    }
+    if (pw->z_alloc) {
+      /* Reuse the stream left over from an earlier image */
+      pw->z.next_out = (Bytef *) pw->pZBuf;
+      pw->z.avail_out = (uInt) SPH_IDAT_BUFSIZE;
+      if ((deflateReset(&(pw->z)) != Z_OK) ||
+          (deflateParams(
+              &(pw->z),
+              pw->zcur,
+              sph_zstrategy(pw)) != Z_OK)) {
+        png_error(pw->png_ptr, "Deflate initialization error");
+      }
+    } else {
+      memset(&(pw->z), 0, sizeof(z_stream));
+      pw->z.zalloc = &sph_zallocFn;
+      pw->z.zfree = &sph_zfreeFn;
+      pw->z.opaque = (voidpf) &(pw->alloc);
+      if (deflateInit2(
+            &(pw->z),
+            pw->zcur,
+            Z_DEFLATED,
+            pw->zwbits,
+            pw->zmem,
+            sph_zstrategy(pw)) != Z_OK) {
+        png_error(pw->png_ptr, "Deflate initialization error");
+      }
+      pw->z_alloc = 1;
+    }
+    pw->z_init = 1;
+    memset(pw->pPrev, 0, pw->rowbytes);
+    pw->z.next_out = (Bytef *) pw->pZBuf;
+    pw->z.avail_out = (uInt) SPH_IDAT_BUFSIZE;
+  }
+  
+  /* Move to faster settings if the time budget requires it */
+  if (pw->budget > 0) {
+    sph_budget_check(pw);
+  }
+  
+  /* At the start of each band, flush everything so far and record the
+   * offset of the chunk that will start the band */
+  if (pw->band > 0) {
+    if ((pw->enc_count % pw->band) == 0) {
+      if (pw->enc_count > 0) {
+        sph_idat_deflate(pw, Z_FULL_FLUSH);
+      }
+      pw->pBandOff[pw->enc_count / pw->band] = pw->fpos;
+    }
+  }
+  
+  /* Determine the set of filters to try */
+  fmask = pw->filters;
+  if (fmask == 0) {
+    if (sph_down_bits(pw->dconv) > 0) {
+      fmask = SPH_IMAGE_FILTER_NONE;
+    } else {
+      fmask = SPH_IMAGE_FILTER_ALL;
+    }
+  }
+  if (pw->band > 0) {
+    if ((pw->enc_count % pw->band) == 0) {
+      fmask &= (SPH_IMAGE_FILTER_NONE | SPH_IMAGE_FILTER_SUB);
+      if (fmask == 0) {
+        fmask = SPH_IMAGE_FILTER_NONE;
+      }
+    }
+  }
+  
+  /* When the time budget has turned off the filter search, use a
+   * single filter: None for stored data, otherwise Sub if allowed, or
+   * else the first allowed filter */
+  if (pw->fast) {
+    if ((pw->zcur == 0) && (fmask & SPH_IMAGE_FILTER_NONE)) {
+      fmask = SPH_IMAGE_FILTER_NONE;
+    } else if (fmask & SPH_IMAGE_FILTER_SUB) {
+      fmask = SPH_IMAGE_FILTER_SUB;
+    } else {
+      fmask = fmask & (-fmask);
+    }
+  }
+  for(ftype = 0; ftype <= 4; ftype++) {
+    if (fmask & (1 << ftype)) {
+      fcount++;
+    }
+  }
+  
+  /* Find the allowed filter with the lowest cost */
+  for(ftype = 0; ftype <= 4; ftype++) {
+    if (!(fmask & (1 << ftype))) {
+      continue;
+    }
+    sph_filter_row(ftype, pw->pData, pw->pPrev, pw->pTry,
+                    pw->rowbytes, pw->bpp);
+    if (fcount > 1) {
+      cost = sph_filter_cost(pw->pTry, pw->rowbytes);
+    }
+    if (first || (cost < best)) {
+      first = 0;
+      best = cost;
+      pSwap = pw->pBest;
+      pw->pBest = pw->pTry;
+      pw->pTry = pSwap;
+    }
+  }
+  
+  /* Compress the filtered scanline */
+  pw->z.next_in = (Bytef *) pw->pBest;
+  pw->z.avail_in = (uInt) (pw->rowbytes + 1);
+  sph_idat_deflate(pw, Z_NO_FLUSH);
+  
+  /* Remember this scanline for the next one */
+  memcpy(pw->pPrev, pw->pData, pw->rowbytes);
+}
+
+/*
+ * Finish the native IDAT encoder after the last scanline.
+ * 
+ * The deflate stream is finished, the restart index chunk is written,
+ * and the PNG file is ended with an IEND chunk.
+ * 
+ * The caller must have set the longjmp location of the PNG codec.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_idat_finish(SPH_IMAGE_WRITER *pw) {
+  
+  int32_t count = 0;
+  int32_t i = 0;
+  int j = 0;
+  size_t len = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((!sph_idat_active(pw)) || (!(pw->z_init))) {
+    abort();
+  }
+  
+  /* Finish the deflate stream */
+  sph_idat_deflate(pw, Z_FINISH);
+  
+  /* Restart index only if restart points are enabled */
+  if (pw->band > 0) {
+  
+    /* Serialize the restart index: band height, band count, the 64-bit
+     * file offset of each band, and the length of the index itself, all
+     * big-endian; the trailing length lets readers find the index from
+     * the end of the file */
+    count = ((pw->h - 1) / pw->band) + 1;
+    len = ((size_t) 12) + (((size_t) count) * 8);
+  
+    png_save_uint_32(pw->pIndex, (png_uint_32) pw->band);
+    png_save_uint_32(pw->pIndex + 4, (png_uint_32) count);
+    for(i = 0; i < count; i++) {
+      for(j = 0; j < 8; j++) {
+        pw->pIndex[8 + (i * 8) + j] =
+          (uint8_t) ((pw->pBandOff[i] >> (56 - (j * 8))) & 0xff);
+      }
+    }
+    png_save_uint_32(pw->pIndex + len - 4, (png_uint_32) len);
+    
+    /* Write the index right before IEND */
+    png_write_chunk(
+        pw->png_ptr,
+        (png_const_bytep) SPH_RESTART_CHUNK,
+        (png_const_bytep) pw->pIndex,
+        len);
+  }
+  
+  /* Write the end of the file */
+  png_write_chunk(pw->png_ptr, (png_const_bytep) "IEND", NULL, 0);
+  sph_png_flushFn(pw->png_ptr);
+  
+  /* Record the finishing time for the time budget report */
+  if (pw->budget > 0) {
+    pw->t_end = sph_clock_ms();
+  }
+}
+
+/*
+ * Check the time budget of an image writer before compressing the next
+ * scanline, and move to faster settings if it is falling behind.
+ * 
+ * Every SPH_BUDGET_ROWS scanlines, the time taken per scanline since
+ * the last check is used to project when the image will be finished.
+ * If that is over budget, the writer takes one step down the ladder of
+ * faster settings: deflate level 6, 3 and then 1, then a single filter
+ * per scanline, and finally level 0 (stored).  The new level applies
+ * from a new deflate block.
+ * 
+ * The caller must have set the longjmp location of the PNG codec.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_budget_check(SPH_IMAGE_WRITER *pw) {
+  
+  double now = 0.0;
+  double projected = 0.0;
+  int32_t rows = 0;
+  int level = 0;
+  int fast = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((pw->budget < 1) || (!(pw->z_init))) {
+    abort();
+  }
+  
+  /* Only check once enough scanlines have been measured */
+  rows = pw->enc_count - pw->mark_row;
+  if (rows >= SPH_BUDGET_ROWS) {
+    now = sph_clock_ms();
+    projected = (now - pw->t_start) +
+                (((now - pw->t_mark) / ((double) rows)) *
+                  ((double) (pw->h - pw->enc_count)));
+    
+    /* Find the next faster settings if behind */
+    level = pw->zcur;
+    fast = pw->fast;
+    if (projected > (double) pw->budget) {
+      if (level > 6) {
+        level = 6;
+      } else if (level > 3) {
+        level = 3;
+      } else if (level > 1) {
+        level = 1;
+      } else if (!fast) {
+        fast = 1;
+      } else if (level > 0) {
+        level = 0;
+      }
+    }
+    
+    /* Apply the new settings from a new deflate block */
+    if ((level != pw->zcur) || (fast != pw->fast)) {
+      if (level != pw->zcur) {
+        sph_idat_deflate(pw, Z_BLOCK);
+        if (deflateParams(&(pw->z), level, sph_zstrategy(pw)) != Z_OK) {
+          png_error(pw->png_ptr, "Deflate parameter error");
+        }
+      }
+      pw->zcur = level;
+      pw->fast = fast;
+      (pw->changes)++;
+      if (pw->change_row < 0) {
+        pw->change_row = pw->enc_count;
+      }
+    }
+    
+    /* Start the next measurement */
+    pw->t_mark = now;
+    pw->mark_row = pw->enc_count;
+  }
+}
+
+/*
+ * Decode a big-endian 32-bit unsigned integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the four bytes
+ * 
+ * Return:
+ * 
+ *   the decoded integer
+ */
+static uint32_t sph_be32(const uint8_t *p) {
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  return (((uint32_t) p[0]) << 24) |
+         (((uint32_t) p[1]) << 16) |
+         (((uint32_t) p[2]) <<  8) |
+          ((uint32_t) p[3]);
+}
+
+/*
+ * Look for a usable restart index in the PNG file of an image reader.
+ * 
+ * This must be called right after the PNG headers have been read, when
+ * the file position is just after the type of the first IDAT chunk.
+ * Writers put the restart index right before IEND and end it with its
+ * own length, so it is found with a few reads from the end of the file,
+ * whatever the size of the image.  Files that don't end that way are
+ * taken to have no restart index, without walking their chunks.  The
+ * file position is then restored so that libpng can continue as if
+ * nothing happened.
+ * 
+ * If a restart index is found and it is consistent with the image, the
+ * band, band_count, and pBandOff fields of the reader are filled in and
+ * the function succeeds.  Otherwise, the reader is unchanged and the
+ * function fails.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   non-zero if a usable restart index was found, zero otherwise
+ */
+static int sph_restart_scan(SPH_IMAGE_READER *pr) {
+  
+  int status = 1;
+  long start = 0;
+  long end = 0;
+  long pos = 0;
+  uint32_t len = 0;
+  uint32_t crc = 0;
+  uint32_t band = 0;
+  uint32_t count = 0;
+  uint32_t i = 0;
+  int j = 0;
+  uint64_t off = 0;
+  uint8_t tail[20];
+  uint8_t hdr[8];
+  uint8_t *pIndex = NULL;
+  long *pOff = NULL;
+  
+  /* Initialize buffers */
+  memset(tail, 0, sizeof(tail));
+  memset(hdr, 0, sizeof(hdr));
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Get the current position, just after the start of the first IDAT,
+   * and the end of the file */
+  start = ftell(pr->pIn);
+  if (start < 8 + 8) {
+    status = 0;
+  }
+  if (status) {
+    if (fseek(pr->pIn, 0, SEEK_END)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    end = ftell(pr->pIn);
+    if (end < start + 20) {
+      status = 0;
+    }
+  }
+  
+  /* Read the trailing length of the index and the CRC of its chunk,
+   * which must be followed by an IEND chunk that ends the file */
+  if (status) {
+    if (fseek(pr->pIn, end - 20, SEEK_SET)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fread(tail, 1, 20, pr->pIn) != 20) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if ((sph_be32(tail + 8) != 0) || (memcmp(tail + 12, "IEND", 4) != 0)) {
+      status = 0;
+    }
+  }
+  
+  /* Find the start of the index chunk from its length, and check that
+   * its header matches */
+  if (status) {
+    len = sph_be32(tail);
+    if ((len < 12) || (len > 12 + (8 * SPH_IMAGE_MAXDIM))) {
+      status = 0;
+    }
+  }
+  if (status) {
+    pos = end - 12 - 4 - ((long) len) - 8;
+    if (pos < start) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fseek(pr->pIn, pos, SEEK_SET)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fread(hdr, 1, 8, pr->pIn) != 8) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if ((sph_be32(hdr) != len) ||
+        (memcmp(hdr + 4, SPH_RESTART_CHUNK, 4) != 0)) {
+      status = 0;
+    }
+  }
+  
+  /* Read the index payload and check its CRC */
+  if (status) {
+    pIndex = (uint8_t *) sph_mem_alloc(&(pr->alloc), (size_t) len + 4);
+    if (pIndex == NULL) {
+      abort();
+    }
+    if (fread(pIndex, 1, (size_t) len + 4, pr->pIn) != (size_t) len + 4) {
+      status = 0;
+    }
+  }
+  if (status) {
+    crc = (uint32_t) crc32(0L, (const Bytef *) (hdr + 4), 4);
+    crc = (uint32_t) crc32(crc, (const Bytef *) pIndex, (uInt) len);
+    if (crc != sph_be32(pIndex + len)) {
+      status = 0;
+    }
+  }
+  
+  /* Parse and check the band geometry */
+  if (status) {
+    band = sph_be32(pIndex);
+    count = sph_be32(pIndex + 4);
+    if ((band < 1) || (band > (uint32_t) pr->h)) {
+      status = 0;
+    } else if (count != (((uint32_t) pr->h) - 1) / band + 1) {
+      status = 0;
+    } else if (len != 12 + (count * 8)) {
+      status = 0;
+    }
+  }
+  
+  /* Parse the offsets, which must start at the first IDAT and strictly
+   * increase up to the index */
+  if (status) {
+    pOff = (long *) sph_mem_alloc(
+                      &(pr->alloc),
+                      ((size_t) count) * sizeof(long));
+    if (pOff == NULL) {
+      abort();
+    }
+    for(i = 0; i < count; i++) {
+      off = 0;
+      for(j = 0; j < 8; j++) {
+        off = (off << 8) | ((uint64_t) pIndex[8 + (i * 8) + j]);
+      }
+      if (off > (uint64_t) LONG_MAX) {
+        status = 0;
+        break;
+      }
+      pOff[i] = (long) off;
+      if (i == 0) {
+        if (pOff[i] != start - 8) {
+          status = 0;
+          break;
+        }
+      } else if (pOff[i] <= pOff[i - 1]) {
+        status = 0;
+        break;
+      }
+      if (pOff[i] >= pos) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  /* Transfer results to the reader if successful */
+  if (status) {
+    pr->band = (int32_t) band;
+    pr->band_count = (int32_t) count;
+    pr->pBandOff = pOff;
+    pOff = NULL;
+  }
+  
+  /* Restore the file position for libpng */
+  if (start >= 0) {
+    clearerr(pr->pIn);
+    if (fseek(pr->pIn, start, SEEK_SET)) {
+      abort();
+    }
+  }
+  
+  /* Free buffers */
+  sph_mem_free(&(pr->alloc), pIndex);
+  sph_mem_free(&(pr->alloc), pOff);
+  
+  return status;
+}
+
+/*
+ * Read the compressed data of one band for the parallel band decoder.
+ * 
+ * The IDAT chunks starting at the band offset are read up to the next
+ * band offset, or up to the first chunk that is not IDAT for the last
+ * band.  The CRC of each chunk is checked.  The chunk data is
+ * concatenated into the buffer *ppComp, which has a capacity of *pCap
+ * bytes and is grown as necessary.  The total length is written to
+ * *pLen.
+ * 
+ * The caller must hold the lock of the band decoder.
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder
+ * 
+ *   b - the band to read
+ * 
+ *   ppComp - pointer to the compressed data buffer pointer
+ * 
+ *   pCap - pointer to the buffer capacity
+ * 
+ *   pLen - pointer to the variable receiving the data length
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the data couldn't be read
+ */
+static int sph_bands_fetch(
+    SPH_BANDS  * pb,
+    int32_t      b,
+    uint8_t   ** ppComp,
+    size_t     * pCap,
+    size_t     * pLen) {
+  
+  int status = 1;
+  long pos = 0;
+  long limit = 0;
+  uint32_t len = 0;
+  uint32_t crc = 0;
+  size_t newcap = 0;
+  uint8_t *pNew = NULL;
+  uint8_t hdr[8];
+  uint8_t tail[4];
+  
+  /* Check parameters */
+  if ((pb == NULL) || (ppComp == NULL) || (pCap == NULL) ||
+      (pLen == NULL)) {
+    abort();
+  }
+  if ((b < 0) || (b >= pb->count)) {
+    abort();
+  }
+  
+  /* Start at the band offset and stop at the next band, if any */
+  pos = pb->pOff[b];
+  if (b < pb->count - 1) {
+    limit = pb->pOff[b + 1];
+  } else {
+    limit = LONG_MAX;
+  }
+  *pLen = 0;
+  
+  if (fseek(pb->pIn, pos, SEEK_SET)) {
+    status = 0;
+  }
+  
+  /* Read chunks */
+  while (status && (pos < limit)) {
+    
+    /* Read chunk header */
+    if (fread(hdr, 1, 8, pb->pIn) != 8) {
+      status = 0;
+      break;
+    }
+    len = sph_be32(hdr);
+    if (len > UINT32_C(0x7fffffff)) {
+      status = 0;
+      break;
+    }
+    
+    /* The last band ends at the first chunk that is not IDAT; any other
+     * band must consist only of IDAT chunks */
+    if (memcmp(hdr + 4, "IDAT", 4) != 0) {
+      if ((limit == LONG_MAX) && (*pLen > 0)) {
+        break;
+      }
+      status = 0;
+      break;
+    }
+    
+    /* Grow the buffer if necessary */
+    if (*pLen + (size_t) len > *pCap) {
+      newcap = *pCap * 2;
+      if (newcap < *pLen + (size_t) len) {
+        newcap = *pLen + (size_t) len;
+      }
+      pNew = (uint8_t *) sph_mem_alloc(pb->pAlloc, newcap);
+      if (pNew == NULL) {
+        abort();
+      }
+      if (*pLen > 0) {
+        memcpy(pNew, *ppComp, *pLen);
+      }
+      sph_mem_free(pb->pAlloc, *ppComp);
+      *ppComp = pNew;
+      *pCap = newcap;
+    }
+    
+    /* Read chunk data and CRC */
+    if (fread(*ppComp + *pLen, 1, (size_t) len, pb->pIn) != (size_t) len) {
+      status = 0;
+      break;
+    }
+    if (fread(tail, 1, 4, pb->pIn) != 4) {
+      status = 0;
+      break;
+    }
+    crc = (uint32_t) crc32(0L, (const Bytef *) (hdr + 4), 4);
+    crc = (uint32_t) crc32(crc, (const Bytef *) (*ppComp + *pLen),
+                            (uInt) len);
+    if (crc != sph_be32(tail)) {
+      status = 0;
+      break;
+    }
+    
+    *pLen += (size_t) len;
+    pos += 12 + (long) len;
+  }
+  
+  /* The next band must start exactly at a chunk boundary */
+  if (status && (limit != LONG_MAX) && (pos != limit)) {
+    status = 0;
+  }
+  
+  return status;
+}
+
+/*
+ * Fill in the configuration fields of a band decoder from an image
+ * reader that has a restart index.
+ * 
+ * The scanlines of a band are stored with the aligned row pitch, and
+ * the decoder is not in whole-image mode.  The shared state, the slot
+ * ring, and the threads are left alone.
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder
+ * 
+ *   pr - the image reader object
+ */
+static void sph_bands_config(SPH_BANDS *pb, SPH_IMAGE_READER *pr) {
+  
+  /* Check parameters */
+  if ((pb == NULL) || (pr == NULL)) {
+    abort();
+  }
+  if ((pr->band < 1) || (pr->pBandOff == NULL)) {
+    abort();
+  }
+  
+  /* Copy the configuration */
+  pb->pIn = pr->pIn;
+  pb->pAlloc = &(pr->alloc);
+  pb->w = pr->w;
+  pb->h = pr->h;
+  pb->band = pr->band;
+  pb->count = pr->band_count;
+  pb->bits = pr->bits;
+  pb->ccount = pr->ccount;
+  pb->pCurves = sph_reader_curves(pr);
+  pb->rowbytes = ((((size_t) pr->w) * ((size_t) pr->ccount) *
+                    ((size_t) pr->bits)) + 7) / 8;
+  pb->bpp = (((size_t) pr->ccount) * ((size_t) pr->bits)) / 8;
+  if (pb->bpp < 1) {
+    pb->bpp = 1;
+  }
+  pb->pitch = sph_row_pitch(pr->w);
+  pb->pImage = NULL;
+  pb->pOff = pr->pBandOff;
+}
+
+/*
+ * Inflate, unfilter, and convert one band for the parallel band
+ * decoder.
+ * 
+ * pComp holds the compressed data of the band, as read by
+ * sph_bands_fetch().  For the first band, this begins with the zlib
+ * stream header, which is checked and skipped.  The rest of the data is
+ * raw deflate data that starts after a full flush, so it does not need
+ * any earlier data.
+ * 
+ * pCur and pPrev are work buffers of (rowbytes + 1) bytes each.  pOut
+ * receives the decoded ARGB scanlines of the band.
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder
+ * 
+ *   b - the band to decode
+ * 
+ *   pComp - the compressed data
+ * 
+ *   len - the length of the compressed data
+ * 
+ *   pCur - work buffer
+ * 
+ *   pPrev - work buffer
+ * 
+ *   pOut - buffer receiving the decoded band
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the data is invalid
+ */
+static int sph_bands_inflate(
+          SPH_BANDS * pb,
+          int32_t     b,
+    const uint8_t   * pComp,
+          size_t      len,
+          uint8_t   * pCur,
+          uint8_t   * pPrev,
+          uint32_t  * pOut) {
+  
+  int status = 1;
+  int retval = 0;
+  int z_init = 0;
+  int32_t rows = 0;
+  int32_t y = 0;
+  uint8_t *pSwap = NULL;
+  z_stream z;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (pComp == NULL) || (pCur == NULL) ||
+      (pPrev == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((b < 0) || (b >= pb->count)) {
+    abort();
+  }
+  
+  /* Determine the number of rows in this band */
+  rows = pb->h - (b * pb->band);
+  if (rows > pb->band) {
+    rows = pb->band;
+  }
+  
+  /* For the first band, check and skip the zlib header */
+  if (b == 0) {
+    if (len < 2) {
+      status = 0;
+    } else if (((pComp[0] & 0x0f) != 8) || ((pComp[0] >> 4) > 7) ||
+                (pComp[1] & 0x20) ||
+                (((((unsigned int) pComp[0]) << 8) |
+                    ((unsigned int) pComp[1])) % 31 != 0)) {
+      status = 0;
+    } else {
+      pComp += 2;
+      len -= 2;
+    }
+  }
+  
+  /* Start a raw inflate stream */
+  if (status) {
+    memset(&z, 0, sizeof(z_stream));
+    z.zalloc = &sph_zallocFn;
+    z.zfree = &sph_zfreeFn;
+    z.opaque = (voidpf) pb->pAlloc;
+    if (inflateInit2(&z, -15) != Z_OK) {
+      abort();
+    }
+    z_init = 1;
+    z.next_in = (Bytef *) pComp;
+    z.avail_in = (uInt) len;
+  }
+  
+  /* The band starts without a previous scanline */
+  if (status) {
+    memset(pPrev, 0, pb->rowbytes + 1);
+  }
+  
+  /* Decode each row */
+  for(y = 0; status && (y < rows); y++) {
+    
+    /* Inflate the filtered row */
+    z.next_out = (Bytef *) pCur;
+    z.avail_out = (uInt) (pb->rowbytes + 1);
+    while (z.avail_out > 0) {
+      retval = inflate(&z, Z_SYNC_FLUSH);
+      if ((retval == Z_STREAM_END) && (z.avail_out > 0)) {
+        status = 0;
+        break;
+      } else if ((retval != Z_OK) && (retval != Z_STREAM_END)) {
+        status = 0;
+        break;
+      }
+    }
+    
+    /* Only the first band may use filters that need the previous
+     * scanline on its first row */
+    if (status && (y == 0) && (b > 0) && (pCur[0] > 1)) {
+      status = 0;
+    }
+    
+    /* Unfilter */
+    if (status) {
+      if (!sph_unfilter_row(pCur, pPrev + 1, pb->rowbytes, pb->bpp)) {
+        status = 0;
+      }
+    }
+    
+    /* Convert to ARGB */
+    if (status) {
+      if (pb->bits < 8) {
+        sph_png_decodeRowBits(pCur + 1, pOut, pb->bits, pb->w,
+                              pb->pCurves);
+      } else {
+        sph_png_decodeRow(pCur + 1, pOut, pb->ccount, pb->w,
+                          pb->pCurves);
+      }
+      pOut += pb->pitch;
+      
+      pSwap = pPrev;
+      pPrev = pCur;
+      pCur = pSwap;
+    }
+  }
+  
+  /* Release inflate stream */
+  if (z_init) {
+    inflateEnd(&z);
+  }
+  
+  return status;
+}
+
+/*
+ * Thread function of a parallel band decoder worker.
+ * 
+ * Each worker repeatedly claims the next band that fits in the slot
+ * ring, reads its compressed data while holding the lock, and then
+ * decodes it into its slot without holding the lock.  Workers exit
+ * when all bands have been claimed or when asked to stop.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the band decoder
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_bands_worker(void *pArg) {
+  
+  SPH_BANDS *pb = NULL;
+  int32_t b = 0;
+  int s = 0;
+  int ok = 0;
+  uint8_t *pComp = NULL;
+  size_t cap = 0;
+  size_t len = 0;
+  uint8_t *pCur = NULL;
+  uint8_t *pPrev = NULL;
+  uint32_t *pOut = NULL;
+  
+  /* Get the band decoder */
+  pb = (SPH_BANDS *) pArg;
+  if (pb == NULL) {
+    abort();
+  }
+  
+  /* Allocate work buffers */
+  pCur = (uint8_t *) sph_mem_allocAligned(pb->pAlloc, pb->rowbytes + 1);
+  pPrev = (uint8_t *) sph_mem_allocAligned(pb->pAlloc, pb->rowbytes + 1);
+  if ((pCur == NULL) || (pPrev == NULL)) {
+    abort();
+  }
+  
+  /* Decode bands until done */
+  for(;;) {
+    
+    /* Wait for a band that fits in the ring, then claim it and read
+     * its compressed data; in whole-image mode, every band fits */
+    pthread_mutex_lock(&(pb->lock));
+    while ((!(pb->stop)) && (pb->next < pb->count) &&
+            (pb->pImage == NULL) &&
+            (pb->next >= pb->cons + pb->nslots)) {
+      pthread_cond_wait(&(pb->cond), &(pb->lock));
+    }
+    if (pb->stop || (pb->next >= pb->count)) {
+      pthread_mutex_unlock(&(pb->lock));
+      break;
+    }
+    
+    b = pb->next;
+    (pb->next)++;
+    if (pb->pImage != NULL) {
+      pOut = pb->pImage + (((size_t) b) * ((size_t) pb->band) * pb->pitch);
+    } else {
+      s = (int) (b % pb->nslots);
+      pb->pSlotBand[s] = b;
+      pb->pSlotState[s] = 0;
+      pOut = pb->ppSlotBuf[s];
+    }
+    
+    ok = sph_bands_fetch(pb, b, &pComp, &cap, &len);
+    pthread_mutex_unlock(&(pb->lock));
+    
+    /* Decode the band */
+    if (ok) {
+      ok = sph_bands_inflate(pb, b, pComp, len, pCur, pPrev, pOut);
+    }
+    
+    /* Publish the result; in whole-image mode, a failure also stops
+     * the other workers since the image is lost anyway */
+    pthread_mutex_lock(&(pb->lock));
+    if (pb->pImage != NULL) {
+      (pb->done)++;
+      if (!ok) {
+        pb->failed = 1;
+        pb->stop = 1;
+      }
+    } else if (ok) {
+      pb->pSlotState[s] = 1;
+    } else {
+      pb->pSlotState[s] = 2;
+    }
+    pthread_cond_broadcast(&(pb->cond));
+    pthread_mutex_unlock(&(pb->lock));
+  }
+  
+  /* Free work buffers */
+  sph_mem_free(pb->pAlloc, pComp);
+  sph_mem_freeAligned(pb->pAlloc, pCur);
+  sph_mem_freeAligned(pb->pAlloc, pPrev);
+  
+  return NULL;
+}
+
+/*
+ * Estimate the memory in bytes that the parallel band decoder of an
+ * image reader needs for a given number of threads.
+ * 
+ * Each thread needs an inflate stream, two work scanlines, and a
+ * compressed data buffer, which may briefly exist alongside the next
+ * larger buffer while it grows.  The size of the compressed data of a
+ * band is taken to be the largest distance between the restart points.
+ * Outside whole-image mode, each thread also has two band slots.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   nthreads - the number of threads
+ * 
+ *   image - non-zero for whole-image mode
+ * 
+ * Return:
+ * 
+ *   the estimated memory use
+ */
+static size_t sph_bands_need(
+    SPH_IMAGE_READER * pr,
+    int                nthreads,
+    int                image) {
+  
+  size_t rowbytes = 0;
+  size_t comp = 0;
+  size_t per = 0;
+  int32_t b = 0;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (nthreads < 1)) {
+    abort();
+  }
+  if ((pr->band < 1) || (pr->pBandOff == NULL)) {
+    abort();
+  }
+  
+  /* Find the largest band */
+  for(b = 1; b < pr->band_count; b++) {
+    if (pr->pBandOff[b] - pr->pBandOff[b - 1] > (long) comp) {
+      comp = (size_t) (pr->pBandOff[b] - pr->pBandOff[b - 1]);
+    }
+  }
+  
+  /* Add up the memory of one thread */
+  rowbytes = ((((size_t) pr->w) * ((size_t) pr->ccount) *
+                ((size_t) pr->bits)) + 7) / 8;
+  per = SPH_MEM_INFLATE + (2 * sph_mem_alignedSize(rowbytes + 1)) +
+          (3 * (comp + SPH_MEM_HEAD));
+  if (!image) {
+    per += 2 * sph_mem_alignedSize(
+                  ((size_t) pr->band) * sph_row_pitch(pr->w) *
+                  sizeof(uint32_t));
+  }
+  per += sizeof(pthread_t) +
+          (2 * (sizeof(int32_t) + sizeof(int) + sizeof(uint32_t *)));
+  
+  /* Add the structure, and the headers of it and its four arrays */
+  return (((size_t) nthreads) * per) + sizeof(SPH_BANDS) +
+            (5 * SPH_MEM_HEAD);
+}
+
+/*
+ * Start the parallel band decoder of an image reader.
+ * 
+ * The reader must have a restart index, and reading must not have
+ * started yet.  If fewer than two threads are requested or available,
+ * or if the threads can't be started, NULL is returned and the reader
+ * should decode serially with libpng instead.  In that case, the file
+ * position of the reader is unchanged.
+ * 
+ * If pImage is NULL, the decoder uses a ring of band slots that the
+ * reader consumes with sph_bands_row().  Otherwise, the decoder runs in
+ * whole-image mode, decoding every scanline straight into pImage with
+ * the given stride in pixels, and the reader waits for it with
+ * sph_bands_finish().  stride is ignored if pImage is NULL.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pImage - the destination image, or NULL
+ * 
+ *   stride - the distance in pixels between scanlines of pImage
+ * 
+ * Return:
+ * 
+ *   the running band decoder, or NULL
+ */
+static SPH_BANDS *sph_bands_start(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pImage,
+    size_t             stride) {
+  
+  SPH_BANDS *pb = NULL;
+  int status = 1;
+  int nthreads = 0;
+  int started = 0;
+  int i = 0;
+  long start = 0;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((pr->band < 1) || (pr->pBandOff == NULL)) {
+    abort();
+  }
+  
+  /* Determine the number of threads */
+  nthreads = pr->threads;
+  if (nthreads < 1) {
+    nthreads = sph_auto_threads();
+  }
+  if (nthreads > pr->band_count) {
+    nthreads = (int) pr->band_count;
+  }
+  
+  /* Use fewer threads if the memory limit requires it */
+  if (pr->alloc.limit > 0) {
+    while ((nthreads >= 2) &&
+            (!sph_mem_fits(
+                &(pr->alloc),
+                sph_bands_need(pr, nthreads, (pImage != NULL))))) {
+      nthreads--;
+    }
+  }
+  if (nthreads < 2) {
+    status = 0;
+  }
+  
+  /* Remember where libpng left the file */
+  if (status) {
+    start = ftell(pr->pIn);
+    if (start < 0) {
+      status = 0;
+    }
+  }
+  
+  /* Allocate and initialize the structure */
+  if (status) {
+    pb = (SPH_BANDS *) sph_mem_alloc(&(pr->alloc), sizeof(SPH_BANDS));
+    if (pb == NULL) {
+      abort();
+    }
+    memset(pb, 0, sizeof(SPH_BANDS));
+    
+    if (pthread_mutex_init(&(pb->lock), NULL)) {
+      abort();
+    }
+    if (pthread_cond_init(&(pb->cond), NULL)) {
+      abort();
+    }
+    
+    sph_bands_config(pb, pr);
+    if (pImage != NULL) {
+      pb->pitch = stride;
+      pb->pImage = pImage;
+    }
+    
+    pb->next = 0;
+    pb->cons = 0;
+    pb->done = 0;
+    pb->failed = 0;
+    pb->stop = 0;
+  }
+  
+  /* Allocate the slot ring, with two slots per thread so that workers
+   * can keep going while the reader consumes a band */
+  if (status && (pImage == NULL)) {
+    pb->nslots = 2 * nthreads;
+    if (pb->nslots > pb->count) {
+      pb->nslots = (int) pb->count;
+    }
+    
+    pb->pSlotBand = (int32_t *) sph_mem_alloc(
+                      &(pr->alloc),
+                      ((size_t) pb->nslots) * sizeof(int32_t));
+    pb->pSlotState = (int *) sph_mem_alloc(
+                      &(pr->alloc),
+                      ((size_t) pb->nslots) * sizeof(int));
+    pb->ppSlotBuf = (uint32_t **) sph_mem_alloc(
+                      &(pr->alloc),
+                      ((size_t) pb->nslots) * sizeof(uint32_t *));
+    if ((pb->pSlotBand == NULL) || (pb->pSlotState == NULL) ||
+        (pb->ppSlotBuf == NULL)) {
+      abort();
+    }
+    for(i = 0; i < pb->nslots; i++) {
+      pb->pSlotBand[i] = -1;
+      pb->pSlotState[i] = 0;
+      pb->ppSlotBuf[i] = (uint32_t *) sph_mem_allocAligned(
+                            &(pr->alloc),
+                            ((size_t) pb->band) * pb->pitch *
+                            sizeof(uint32_t));
+      if (pb->ppSlotBuf[i] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* Start the threads */
+  if (status) {
+    pb->pThreads = (pthread_t *) sph_mem_alloc(
+                      &(pr->alloc),
+                      ((size_t) nthreads) * sizeof(pthread_t));
+    if (pb->pThreads == NULL) {
+      abort();
+    }
+    for(started = 0; started < nthreads; started++) {
+      if (pthread_create(&(pb->pThreads[started]), NULL,
+                          &sph_bands_worker, pb)) {
+        break;
+      }
+    }
+    pb->nthreads = started;
+    
+    /* If not all threads could be started, shut down and restore the
+     * file position for serial decoding */
+    if (started < nthreads) {
+      sph_bands_stop(pb);
+      pb = NULL;
+      clearerr(pr->pIn);
+      if (fseek(pr->pIn, start, SEEK_SET)) {
+        abort();
+      }
+    }
+  }
+  
+  return pb;
+}
+
+/*
+ * Wait until a parallel band decoder in whole-image mode is done.
+ * 
+ * This returns once every band has been decoded into the destination
+ * image, or as soon as any band fails.  The decoder must still be
+ * stopped afterwards with sph_bands_stop().
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder
+ * 
+ * Return:
+ * 
+ *   non-zero if all bands were decoded, zero if any band failed
+ */
+static int sph_bands_finish(SPH_BANDS *pb) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pb == NULL) {
+    abort();
+  }
+  if (pb->pImage == NULL) {
+    abort();
+  }
+  
+  /* Wait for the workers */
+  pthread_mutex_lock(&(pb->lock));
+  while ((!(pb->failed)) && (pb->done < pb->count)) {
+    pthread_cond_wait(&(pb->cond), &(pb->lock));
+  }
+  if (pb->failed) {
+    status = 0;
+  }
+  pthread_mutex_unlock(&(pb->lock));
+  
+  return status;
+}
+
+/*
+ * Stop a parallel band decoder and release it.
+ * 
+ * All worker threads are asked to stop and joined.  If NULL is passed,
+ * the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder, or NULL
+ */
+static void sph_bands_stop(SPH_BANDS *pb) {
+  
+  int i = 0;
+  
+  if (pb != NULL) {
+    
+    /* Stop and join the workers */
+    pthread_mutex_lock(&(pb->lock));
+    pb->stop = 1;
+    pthread_cond_broadcast(&(pb->cond));
+    pthread_mutex_unlock(&(pb->lock));
+    
+    for(i = 0; i < pb->nthreads; i++) {
+      pthread_join(pb->pThreads[i], NULL);
+    }
+    
+    /* Release everything */
+    for(i = 0; i < pb->nslots; i++) {
+      sph_mem_freeAligned(pb->pAlloc, pb->ppSlotBuf[i]);
+    }
+    sph_mem_free(pb->pAlloc, pb->ppSlotBuf);
+    sph_mem_free(pb->pAlloc, pb->pSlotBand);
+    sph_mem_free(pb->pAlloc, pb->pSlotState);
+    sph_mem_free(pb->pAlloc, pb->pThreads);
+    
+    pthread_cond_destroy(&(pb->cond));
+    pthread_mutex_destroy(&(pb->lock));
+    
+    sph_mem_free(pb->pAlloc, pb);
+  }
+}
+
+/*
+ * Get a decoded scanline from a parallel band decoder.
+ * 
+ * y is the scanline to get.  Scanlines must be requested in order from
+ * top to bottom.  Requesting a scanline in a new band releases the slot
+ * of the previous band, so pointers to scanlines of earlier bands
+ * become invalid.  This function blocks until the band is ready.
+ * 
+ * Parameters:
+ * 
+ *   pb - the band decoder
+ * 
+ *   y - the scanline to get
+ * 
+ * Return:
+ * 
+ *   pointer to the decoded scanline, or NULL if the band failed to
+ *   decode
+ */
+static const uint32_t *sph_bands_row(SPH_BANDS *pb, int32_t y) {
+  
+  int32_t b = 0;
+  int s = 0;
+  int state = 0;
+  const uint32_t *pResult = NULL;
+  
+  /* Check parameters */
+  if (pb == NULL) {
+    abort();
+  }
+  if ((y < 0) || (y >= pb->h)) {
+    abort();
+  }
+  
+  /* Determine band and slot */
+  b = y / pb->band;
+  s = (int) (b % pb->nslots);
+  
+  /* Move on to the band if necessary and wait until it is decoded */
+  pthread_mutex_lock(&(pb->lock));
+  if (b != pb->cons) {
+    pb->cons = b;
+    pthread_cond_broadcast(&(pb->cond));
+  }
+  while ((pb->pSlotBand[s] != b) || (pb->pSlotState[s] == 0)) {
+    pthread_cond_wait(&(pb->cond), &(pb->lock));
+  }
+  state = pb->pSlotState[s];
+  pthread_mutex_unlock(&(pb->lock));
+  
+  /* Return the scanline if the band was decoded */
+  if (state == 1) {
+    pResult = pb->ppSlotBuf[s] +
+                (((size_t) (y - (b * pb->band))) * pb->pitch);
+  } else {
+    pResult = NULL;
+  }
+  
+  return pResult;
+}
+
+/*
+ * Decode the next scanline of an image reader serially with libpng.
+ * 
+ * If last is non-zero, this is the last scanline, and the end of the
+ * image is also read.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pDst - receives the decoded ARGB scanline
+ * 
+ *   last - non-zero if this is the last scanline
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+static int sph_ahead_decode(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int                last) {
+  
+  /* Volatile, since it is changed by the error handler */
+  volatile int status = 1;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  
+  /* Register error handler */
+  if (setjmp(png_jmpbuf(pr->png_ptr))) {
+    status = 0;
+  }
+  
+  /* Read and decode the scanline */
+  if (status) {
+    png_read_row(
+        pr->png_ptr,
+        (png_bytep) pr->pData,
+        NULL);
+    sph_png_decodeRow(pr->pData, pDst, pr->ccount, pr->w,
+                      sph_reader_curves(pr));
+  }
+  
+  /* Read the end of the image after the last scanline */
+  if (status && last) {
+    png_read_end(pr->png_ptr, (png_infop)NULL);
+  }
+  
+  return status;
+}
+
+/*
+ * Thread function of a read-ahead decoder.
+ * 
+ * The thread decodes scanlines in order into the slot ring, waiting
+ * whenever the ring is full.  It exits when all scanlines have been
+ * decoded, when a scanline fails to decode, or when asked to stop.
+ * After the last scanline, the end of the image is read as well.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the read-ahead decoder
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_ahead_worker(void *pArg) {
+  
+  SPH_AHEAD *pa = NULL;
+  int32_t y = 0;
+  int ok = 0;
+  
+  /* Get the read-ahead decoder */
+  pa = (SPH_AHEAD *) pArg;
+  if (pa == NULL) {
+    abort();
+  }
+  
+  /* Decode scanlines until done */
+  for(;;) {
+    
+    /* Wait for room in the ring */
+    pthread_mutex_lock(&(pa->lock));
+    while ((!(pa->stop)) && (pa->done < pa->pr->h) &&
+            (pa->done >= pa->cons + pa->nslots)) {
+      pthread_cond_wait(&(pa->cond), &(pa->lock));
+    }
+    if (pa->stop || (pa->done >= pa->pr->h)) {
+      pthread_mutex_unlock(&(pa->lock));
+      break;
+    }
+    y = pa->done;
+    pthread_mutex_unlock(&(pa->lock));
+    
+    /* Decode the scanline */
+    ok = sph_ahead_decode(pa->pr,
+            pa->pSlots + (((size_t) (y % pa->nslots)) *
+                            sph_row_pitch(pa->pr->w)),
+            (y == pa->pr->h - 1));
+    
+    /* Publish the result */
+    pthread_mutex_lock(&(pa->lock));
+    if (ok) {
+      (pa->done)++;
+    } else {
+      pa->failed = 1;
+    }
+    pthread_cond_broadcast(&(pa->cond));
+    pthread_mutex_unlock(&(pa->lock));
+    
+    if (!ok) {
+      break;
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Start the read-ahead decoder of an image reader.
+ * 
+ * Reading must not have started yet.  If the thread can't be started,
+ * NULL is returned and the reader should decode on the calling thread
+ * instead.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   the running read-ahead decoder, or NULL
+ */
+static SPH_AHEAD *sph_ahead_start(SPH_IMAGE_READER *pr) {
+  
+  SPH_AHEAD *pa = NULL;
+  int32_t nslots = 0;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((pr->ahead < 1) || (pr->scan_count > 0)) {
+    abort();
+  }
+  
+  /* Determine the number of slots, keeping under the memory limit along
+   * with the inflate stream that libpng allocates on the first read */
+  nslots = pr->ahead;
+  if (nslots > pr->h) {
+    nslots = pr->h;
+  }
+  if (pr->alloc.limit > 0) {
+    nslots = sph_mem_fitRows(
+                &(pr->alloc),
+                nslots,
+                sph_row_pitch(pr->w) * sizeof(uint32_t),
+                sizeof(SPH_AHEAD) + SPH_MEM_HEAD + SPH_MEM_INFLATE);
+  }
+  
+  /* Start the decoder if there is room for at least one slot */
+  if (nslots > 0) {
+    
+    /* Allocate and initialize the structure */
+    pa = (SPH_AHEAD *) sph_mem_alloc(&(pr->alloc), sizeof(SPH_AHEAD));
+    if (pa == NULL) {
+      abort();
+    }
+    memset(pa, 0, sizeof(SPH_AHEAD));
+    
+    if (pthread_mutex_init(&(pa->lock), NULL)) {
+      abort();
+    }
+    if (pthread_cond_init(&(pa->cond), NULL)) {
+      abort();
+    }
+    
+    pa->pr = pr;
+    pa->nslots = nslots;
+    pa->pSlots = (uint32_t *) sph_mem_allocAligned(
+                    &(pr->alloc),
+                    ((size_t) pa->nslots) * sph_row_pitch(pr->w) *
+                    sizeof(uint32_t));
+    if (pa->pSlots == NULL) {
+      abort();
+    }
+    
+    pa->done = 0;
+    pa->cons = 0;
+    pa->failed = 0;
+    pa->stop = 0;
+    
+    /* Start the thread, falling back to serial decoding if it fails */
+    if (pthread_create(&(pa->thread), NULL, &sph_ahead_worker, pa)) {
+      sph_mem_freeAligned(&(pr->alloc), pa->pSlots);
+      pthread_cond_destroy(&(pa->cond));
+      pthread_mutex_destroy(&(pa->lock));
+      sph_mem_free(&(pr->alloc), pa);
+      pa = NULL;
+    }
+  }
+  
+  return pa;
+}
+
+/*
+ * Stop a read-ahead decoder and release it.
+ * 
+ * The thread is asked to stop and joined.  If NULL is passed, the call
+ * is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read-ahead decoder, or NULL
+ */
+static void sph_ahead_stop(SPH_AHEAD *pa) {
+  
+  if (pa != NULL) {
+    
+    /* Stop and join the thread */
+    pthread_mutex_lock(&(pa->lock));
+    pa->stop = 1;
+    pthread_cond_broadcast(&(pa->cond));
+    pthread_mutex_unlock(&(pa->lock));
+    
+    pthread_join(pa->thread, NULL);
+    
+    /* Release everything */
+    sph_mem_freeAligned(&(pa->pr->alloc), pa->pSlots);
+    pthread_cond_destroy(&(pa->cond));
+    pthread_mutex_destroy(&(pa->lock));
+    
+    sph_mem_free(&(pa->pr->alloc), pa);
+  }
+}
+
+/*
+ * Get a decoded scanline from a read-ahead decoder.
+ * 
+ * y is the scanline to get.  Scanlines must be requested in order from
+ * top to bottom.  Requesting a scanline releases the slots of all
+ * earlier scanlines, so pointers to them become invalid.  This function
+ * blocks until the scanline is decoded.
+ * 
+ * If a scanline fails to decode, all earlier scanlines are still
+ * returned normally, and the failure is reported when the failed
+ * scanline is requested.
+ * 
+ * Parameters:
+ * 
+ *   pa - the read-ahead decoder
+ * 
+ *   y - the scanline to get
+ * 
+ * Return:
+ * 
+ *   pointer to the decoded scanline, or NULL if it failed to decode
+ */
+static uint32_t *sph_ahead_row(SPH_AHEAD *pa, int32_t y) {
+  
+  int ok = 0;
+  uint32_t *pResult = NULL;
+  
+  /* Check parameters */
+  if (pa == NULL) {
+    abort();
+  }
+  if ((y < 0) || (y >= pa->pr->h)) {
+    abort();
+  }
+  
+  /* Release earlier scanlines and wait until this one is decoded */
+  pthread_mutex_lock(&(pa->lock));
+  if (y != pa->cons) {
+    pa->cons = y;
+    pthread_cond_broadcast(&(pa->cond));
+  }
+  while ((pa->done <= y) && (!(pa->failed))) {
+    pthread_cond_wait(&(pa->cond), &(pa->lock));
+  }
+  ok = (pa->done > y);
+  pthread_mutex_unlock(&(pa->lock));
+  
+  /* Return the scanline if it was decoded */
+  if (ok) {
+    pResult = pa->pSlots +
+                (((size_t) (y % pa->nslots)) * sph_row_pitch(pa->pr->w));
+  } else {
+    pResult = NULL;
+  }
+  
+  return pResult;
+}
+
+/*
+ * Encode a big-endian 32-bit unsigned integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the four bytes to write
+ * 
+ *   v - the integer to encode
+ */
+static void sph_put_be32(uint8_t *p, uint32_t v) {
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  p[0] = (uint8_t) ((v >> 24) & 0xff);
+  p[1] = (uint8_t) ((v >> 16) & 0xff);
+  p[2] = (uint8_t) ((v >>  8) & 0xff);
+  p[3] = (uint8_t) ( v        & 0xff);
+}
+
+/*
+ * Encode a big-endian 64-bit unsigned integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the eight bytes to write
+ * 
+ *   v - the integer to encode
+ */
+static void sph_put_be64(uint8_t *p, uint64_t v) {
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  sph_put_be32(p, (uint32_t) (v >> 32));
+  sph_put_be32(p + 4, (uint32_t) (v & UINT32_C(0xffffffff)));
+}
+
+/*
+ * Decode a big-endian 64-bit unsigned integer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the eight bytes
+ * 
+ * Return:
+ * 
+ *   the decoded integer
+ */
+static uint64_t sph_be64(const uint8_t *p) {
+  
+  /* Check parameter */
+  if (p == NULL) {
+    abort();
+  }
+  
+  return (((uint64_t) sph_be32(p)) << 32) | ((uint64_t) sph_be32(p + 4));
+}
+
+/*
+ * Allocate a native serial decoder for the image of a reader.
+ * 
+ * The decoder reads the file of the reader, but it has its own
+ * allocator, which must stay valid until it is freed.  It
+ * must be started with sph_native_start() before use.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator to use
+ * 
+ *   pr - the image reader object, which must have a native format
+ * 
+ * Return:
+ * 
+ *   the new decoder
+ */
+static SPH_NATIVE *sph_native_new(
+    SPH_MEM          * pAlloc,
+    SPH_IMAGE_READER * pr) {
+  
+  SPH_NATIVE *pn = NULL;
+  
+  /* Check parameters */
+  if ((pAlloc == NULL) || (pr == NULL)) {
+    abort();
+  }
+  if (!(pr->native)) {
+    abort();
+  }
+  
+  /* Allocate and initialize the structure */
+  pn = (SPH_NATIVE *) sph_mem_alloc(pAlloc, sizeof(SPH_NATIVE));
+  if (pn == NULL) {
+    abort();
+  }
+  memset(pn, 0, sizeof(SPH_NATIVE));
+  
+  pn->pAlloc = pAlloc;
+  pn->pIn = pr->pIn;
+  pn->z_init = 0;
+  pn->w = pr->w;
+  pn->h = pr->h;
+  pn->bits = pr->bits;
+  pn->ccount = pr->ccount;
+  pn->rowbytes = ((((size_t) pr->w) * ((size_t) pr->ccount) *
+                    ((size_t) pr->bits)) + 7) / 8;
+  pn->bpp = (((size_t) pr->ccount) * ((size_t) pr->bits)) / 8;
+  if (pn->bpp < 1) {
+    pn->bpp = 1;
+  }
+  
+  /* Allocate the buffers */
+  pn->pBuf = (uint8_t *) sph_mem_alloc(pAlloc, SPH_NATIVE_BUFSIZE);
+  pn->pCur = (uint8_t *) sph_mem_allocAligned(pAlloc, pn->rowbytes + 1);
+  pn->pPrev = (uint8_t *) sph_mem_allocAligned(pAlloc, pn->rowbytes + 1);
+  if ((pn->pBuf == NULL) || (pn->pCur == NULL) || (pn->pPrev == NULL)) {
+    abort();
+  }
+  
+  return pn;
+}
+
+/*
+ * Free a native serial decoder.
+ * 
+ * If NULL is passed, the call is ignored.  The file is not closed.
+ * 
+ * Parameters:
+ * 
+ *   pn - the decoder, or NULL
+ */
+static void sph_native_free(SPH_NATIVE *pn) {
+  
+  if (pn != NULL) {
+    if (pn->z_init) {
+      inflateEnd(&(pn->z));
+      pn->z_init = 0;
+    }
+    sph_mem_free(pn->pAlloc, pn->pBuf);
+    sph_mem_freeAligned(pn->pAlloc, pn->pCur);
+    sph_mem_freeAligned(pn->pAlloc, pn->pPrev);
+    sph_mem_free(pn->pAlloc, pn);
+  }
+}
+
+/*
+ * Start or restart a native serial decoder.
+ * 
+ * If pc is NULL, decoding starts at the top of the image, with the
+ * first IDAT chunk at file offset idat_off.  Otherwise, decoding
+ * resumes at the checkpoint pc, and idat_off is ignored.  The file
+ * position is moved to where the decoder starts reading.
+ * 
+ * Parameters:
+ * 
+ *   pn - the decoder
+ * 
+ *   idat_off - the file offset of the first IDAT chunk
+ * 
+ *   pc - the checkpoint to resume at, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the data is invalid
+ */
+static int sph_native_start(
+          SPH_NATIVE     * pn,
+          long             idat_off,
+    const SPH_CHECKPOINT * pc) {
+  
+  int status = 1;
+  uint32_t len = 0;
+  uint8_t hdr[8];
+  
+  /* Check parameter */
+  if (pn == NULL) {
+    abort();
+  }
+  
+  /* Shut down any earlier stream */
+  if (pn->z_init) {
+    inflateEnd(&(pn->z));
+    pn->z_init = 0;
+  }
+  
+  pn->last = 0;
+  pn->end = 0;
+  pn->crc = 0;
+  pn->crc_valid = 0;
+  pn->part = 0;
+  pn->row = 0;
+  
+  memset(&(pn->z), 0, sizeof(z_stream));
+  pn->z.zalloc = &sph_zallocFn;
+  pn->z.zfree = &sph_zfreeFn;
+  pn->z.opaque = (voidpf) pn->pAlloc;
+  pn->z.next_in = (Bytef *) pn->pBuf;
+  pn->z.avail_in = 0;
+  
+  if (pc == NULL) {
+    /* Start at the header of the first IDAT chunk */
+    if (fseek(pn->pIn, idat_off, SEEK_SET)) {
+      status = 0;
+    }
+    if (status) {
+      if (fread(hdr, 1, 8, pn->pIn) != 8) {
+        status = 0;
+      }
+    }
+    if (status) {
+      len = sph_be32(hdr);
+      if ((len > UINT32_C(0x7fffffff)) ||
+          (memcmp(hdr + 4, "IDAT", 4) != 0)) {
+        status = 0;
+      }
+    }
+    if (status) {
+      pn->off = idat_off + 8;
+      pn->left = len;
+      pn->crc = (uint32_t) crc32(0L, (const Bytef *) (hdr + 4), 4);
+      pn->crc_valid = 1;
+      
+      if (inflateInit2(&(pn->z), 15) != Z_OK) {
+        abort();
+      }
+      pn->z_init = 1;
+      
+      memset(pn->pPrev, 0, pn->rowbytes + 1);
+    }
+  
+  } else {
+    /* Resume at the checkpoint, in the middle of the stream */
+    if (fseek(pn->pIn, pc->off, SEEK_SET)) {
+      status = 0;
+    }
+    if (status) {
+      pn->off = pc->off;
+      pn->left = pc->left;
+      
+      if (inflateInit2(&(pn->z), -15) != Z_OK) {
+        abort();
+      }
+      pn->z_init = 1;
+      
+      if (pc->bits > 0) {
+        if (inflatePrime(&(pn->z), pc->bits,
+                          pc->byte >> (8 - pc->bits)) != Z_OK) {
+          status = 0;
+        }
+      }
+    }
+    if (status && (pc->wlen > 0)) {
+      if (inflateSetDictionary(&(pn->z), pc->pWindow,
+                                (uInt) pc->wlen) != Z_OK) {
+        status = 0;
+      }
+    }
+    if (status) {
+      pn->pPrev[0] = 0;
+      memcpy(pn->pPrev + 1, pc->pPrev, pn->rowbytes);
+      memcpy(pn->pCur, pc->pPart, (size_t) pc->part);
+      pn->part = pc->part;
+      pn->row = pc->row;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Refill the compressed data buffer of a native serial decoder.
+ * 
+ * This must only be called when the buffer is empty.  If the current
+ * IDAT chunk is used up, its CRC is checked where possible and the
+ * decoder moves on to the next chunk.  Once a chunk other than IDAT is
+ * reached, the end flag is set and the buffer stays empty.
+ * 
+ * Parameters:
+ * 
+ *   pn - the decoder
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the file couldn't be read or is
+ *   invalid
+ */
+static int sph_native_input(SPH_NATIVE *pn) {
+  
+  int status = 1;
+  uint32_t len = 0;
+  size_t n = 0;
+  uint8_t hdr[8];
+  
+  /* Check parameter */
+  if (pn == NULL) {
+    abort();
+  }
+  if (pn->z.avail_in > 0) {
+    abort();
+  }
+  
+  /* Move on to the next IDAT chunk if the current one is used up */
+  while (status && (!(pn->end)) && (pn->left < 1)) {
+    if (fread(hdr, 1, 4, pn->pIn) != 4) {
+      status = 0;
+    }
+    if (status && pn->crc_valid) {
+      if (pn->crc != sph_be32(hdr)) {
+        status = 0;
+      }
+    }
+    if (status) {
+      if (fread(hdr, 1, 8, pn->pIn) != 8) {
+        status = 0;
+      }
+    }
+    if (status) {
+      pn->off += 12;
+      len = sph_be32(hdr);
+      if (len > UINT32_C(0x7fffffff)) {
+        status = 0;
+      } else if (memcmp(hdr + 4, "IDAT", 4) != 0) {
+        pn->end = 1;
+      } else {
+        pn->left = len;
+        pn->crc = (uint32_t) crc32(0L, (const Bytef *) (hdr + 4), 4);
+        pn->crc_valid = 1;
+      }
+    }
+  }
+  
+  /* Read as much of the chunk as fits in the buffer */
+  if (status && (!(pn->end))) {
+    if (pn->z.next_in > pn->pBuf) {
+      pn->last = pn->z.next_in[-1];
+    }
+    
+    n = (size_t) pn->left;
+    if (n > SPH_NATIVE_BUFSIZE) {
+      n = SPH_NATIVE_BUFSIZE;
+    }
+    if (fread(pn->pBuf, 1, n, pn->pIn) != n) {
+      status = 0;
+    }
+    if (status) {
+      pn->crc = (uint32_t) crc32(pn->crc, (const Bytef *) pn->pBuf,
+                                  (uInt) n);
+      pn->off += (long) n;
+      pn->left -= (uint32_t) n;
+      pn->z.next_in = (Bytef *) pn->pBuf;
+      pn->z.avail_in = (uInt) n;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Decode the next scanline with a native serial decoder.
+ * 
+ * The scanline is inflated and unfiltered.  Afterwards, the unfiltered
+ * scanline is at (pPrev + 1) in the decoder.
+ * 
+ * If px is not NULL, an index is being built.  A checkpoint is then
+ * added at the first deflate block boundary found once the row counter
+ * of the decoder reaches *pNext, and *pNext is advanced by the spacing
+ * of the index.
+ * 
+ * Parameters:
+ * 
+ *   pn - the decoder
+ * 
+ *   px - the index being built, or NULL
+ * 
+ *   pNext - the row where the next checkpoint is due, or NULL if px is
+ *   NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the data is invalid
+ */
+static int sph_native_row(
+    SPH_NATIVE      * pn,
+    SPH_IMAGE_INDEX * px,
+    int32_t         * pNext) {
+  
+  int status = 1;
+  int retval = 0;
+  uint8_t *pSwap = NULL;
+  
+  /* Check parameters */
+  if (pn == NULL) {
+    abort();
+  }
+  if ((px != NULL) && (pNext == NULL)) {
+    abort();
+  }
+  if ((!(pn->z_init)) || (pn->row >= pn->h)) {
+    abort();
+  }
+  
+  /* Inflate the filtered scanline, stopping at each block boundary */
+  while (status && (pn->part < pn->rowbytes + 1)) {
+    
+    if (pn->z.avail_in < 1) {
+      status = sph_native_input(pn);
+      if (status && (pn->z.avail_in < 1)) {
+        status = 0;
+      }
+    }
+    
+    if (status) {
+      pn->z.next_out = (Bytef *) (pn->pCur + pn->part);
+      pn->z.avail_out = (uInt) (pn->rowbytes + 1 - pn->part);
+      retval = inflate(&(pn->z), Z_BLOCK);
+      pn->part = (uint32_t) (pn->rowbytes + 1 - pn->z.avail_out);
+      
+      if ((retval == Z_STREAM_END) && (pn->part < pn->rowbytes + 1)) {
+        status = 0;
+      } else if ((retval != Z_OK) && (retval != Z_STREAM_END) &&
+                  (retval != Z_BUF_ERROR)) {
+        status = 0;
+      }
+    }
+    
+    /* Record a checkpoint at a block boundary that isn't in the final
+     * block, once one is due */
+    if (status && (px != NULL) && (retval == Z_OK) &&
+        (pn->row >= *pNext) &&
+        (pn->z.data_type & 128) && (!(pn->z.data_type & 64))) {
+      sph_index_add(px, pn);
+      *pNext = pn->row + px->spacing;
+    }
+  }
+  
+  /* Unfilter */
+  if (status) {
+    if (!sph_unfilter_row(pn->pCur, pn->pPrev + 1, pn->rowbytes,
+                          pn->bpp)) {
+      status = 0;
+    }
+  }
+  
+  /* The scanline becomes the previous one */
+  if (status) {
+    pSwap = pn->pPrev;
+    pn->pPrev = pn->pCur;
+    pn->pCur = pSwap;
+    pn->part = 0;
+    (pn->row)++;
+  }
+  
+  return status;
+}
+
+/*
+ * Add a checkpoint to an index at the current position of a native
+ * serial decoder.
+ * 
+ * The decoder must have just stopped at a deflate block boundary.
+ * 
+ * Parameters:
+ * 
+ *   px - the index being built
+ * 
+ *   pn - the decoder
+ */
+static void sph_index_add(SPH_IMAGE_INDEX *px, SPH_NATIVE *pn) {
+  
+  int32_t newcap = 0;
+  SPH_CHECKPOINT *pNew = NULL;
+  SPH_CHECKPOINT *pc = NULL;
+  uInt wlen = 0;
+  
+  /* Check parameters */
+  if ((px == NULL) || (pn == NULL)) {
+    abort();
+  }
+  
+  /* Grow the array if necessary */
+  if (px->count >= px->cap) {
+    newcap = px->cap * 2;
+    if (newcap < 16) {
+      newcap = 16;
+    }
+    pNew = (SPH_CHECKPOINT *) sph_mem_alloc(
+              &(px->alloc),
+              ((size_t) newcap) * sizeof(SPH_CHECKPOINT));
+    if (pNew == NULL) {
+      abort();
+    }
+    if (px->count > 0) {
+      memcpy(pNew, px->pPoints,
+              ((size_t) px->count) * sizeof(SPH_CHECKPOINT));
+    }
+    sph_mem_free(&(px->alloc), px->pPoints);
+    px->pPoints = pNew;
+    px->cap = newcap;
+  }
+  
+  /* Allocate the checkpoint data */
+  if (inflateGetDictionary(&(pn->z), NULL, &wlen) != Z_OK) {
+    abort();
+  }
+  pc = &(px->pPoints[px->count]);
+  pc->pWindow = (uint8_t *) sph_mem_alloc(
+                  &(px->alloc),
+                  ((size_t) wlen) + (2 * pn->rowbytes) + 1);
+  if (pc->pWindow == NULL) {
+    abort();
+  }
+  pc->pPart = pc->pWindow + wlen;
+  pc->pPrev = pc->pPart + pn->rowbytes + 1;
+  
+  /* Record the state */
+  if (inflateGetDictionary(&(pn->z), pc->pWindow, &wlen) != Z_OK) {
+    abort();
+  }
+  pc->wlen = (uint32_t) wlen;
+  pc->row = pn->row;
+  pc->part = pn->part;
+  memcpy(pc->pPart, pn->pCur, (size_t) pn->part);
+  memcpy(pc->pPrev, pn->pPrev + 1, pn->rowbytes);
+  
+  pc->off = pn->off - (long) pn->z.avail_in;
+  pc->left = pn->left + (uint32_t) pn->z.avail_in;
+  pc->bits = pn->z.data_type & 7;
+  if (pn->z.next_in > pn->pBuf) {
+    pc->byte = pn->z.next_in[-1];
+  } else {
+    pc->byte = pn->last;
+  }
+  
+  (px->count)++;
+}
+
+/*
+ * Check whether an index belongs to the image of a reader.
+ * 
+ * The image geometry, the file size and the position of the first IDAT
+ * chunk must all match.  The file position is left unchanged.
+ * 
+ * Parameters:
+ * 
+ *   px - the index
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   non-zero if the index matches, zero if not
+ */
+static int sph_index_match(
+    const SPH_IMAGE_INDEX  * px,
+          SPH_IMAGE_READER * pr) {
+  
+  int status = 1;
+  long pos = 0;
+  long fsize = 0;
+  
+  /* Check parameters */
+  if ((px == NULL) || (pr == NULL)) {
+    abort();
+  }
+  
+  /* Check the geometry */
+  if ((!(pr->native)) || (px->w != pr->w) || (px->h != pr->h) ||
+      (px->bits != pr->bits) || (px->ccount != pr->ccount) ||
+      (px->idat_off != pr->idat_off)) {
+    status = 0;
+  }
+  
+  /* Check the file size */
+  if (status) {
+    pos = ftell(pr->pIn);
+    if (pos < 0) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fseek(pr->pIn, 0, SEEK_END)) {
+      status = 0;
+    } else {
+      fsize = ftell(pr->pIn);
+      if (fsize != px->fsize) {
+        status = 0;
+      }
+    }
+    clearerr(pr->pIn);
+    if (fseek(pr->pIn, pos, SEEK_SET)) {
+      abort();
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Write bytes of an index file and update its running CRC.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the index file
+ * 
+ *   pData - the bytes to write
+ * 
+ *   len - the number of bytes
+ * 
+ *   pCrc - the running CRC
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if write error
+ */
+static int sph_index_put(
+          FILE     * pOut,
+    const uint8_t  * pData,
+          size_t     len,
+          uint32_t * pCrc) {
+  
+  int status = 1;
+  
+  /* Check parameters */
+  if ((pOut == NULL) || (pData == NULL) || (pCrc == NULL)) {
+    abort();
+  }
+  
+  /* Write the bytes */
+  if (len > 0) {
+    if (fwrite(pData, 1, len, pOut) != len) {
+      status = 0;
+    } else {
+      *pCrc = (uint32_t) crc32(*pCrc, (const Bytef *) pData, (uInt) len);
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Read bytes of an index file and update its running CRC.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the index file
+ * 
+ *   pData - receives the bytes
+ * 
+ *   len - the number of bytes
+ * 
+ *   pCrc - the running CRC
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+static int sph_index_get(
+    FILE     * pIn,
+    uint8_t  * pData,
+    size_t     len,
+    uint32_t * pCrc) {
+  
+  int status = 1;
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pData == NULL) || (pCrc == NULL)) {
+    abort();
+  }
+  
+  /* Read the bytes */
+  if (len > 0) {
+    if (fread(pData, 1, len, pIn) != len) {
+      status = 0;
+    } else {
+      *pCrc = (uint32_t) crc32(*pCrc, (const Bytef *) pData, (uInt) len);
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Start the background decoder of an image reader, if any, before the
+ * first read.
+ * 
+ * If the file has a restart index, the parallel band decoder is
+ * started.  Otherwise, if read-ahead was requested, the read-ahead
+ * decoder is started.  If neither applies or neither can be started,
+ * the reader decodes serially on the calling thread.  This function
+ * does nothing once reading has started.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ */
+static void sph_reader_begin(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Start a decoder on the first read */
+  if ((pr->scan_count == 0) && (pr->pNative == NULL) &&
+      (pr->pBands == NULL) && (pr->pAhead == NULL)) {
+    if (pr->band > 0) {
+      pr->pBands = sph_bands_start(pr, NULL, 0);
+    }
+    if ((pr->pBands == NULL) && (pr->ahead > 0)) {
+      pr->pAhead = sph_ahead_start(pr);
+    }
+  }
+}
+
+/*
+ * Get the tone curves that an image reader applies while converting
+ * source scanlines to ARGB.
+ * 
+ * When the image is downscaled, the curves apply to the averages of the
+ * reduction instead (see sph_reduce_emit()), so source scanlines are
+ * converted without them.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   the curve tables, or NULL if there are none to apply
+ */
+static const uint32_t *sph_reader_curves(const SPH_IMAGE_READER *pr) {
+  
+  const uint32_t *pResult = NULL;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  if (pr->curves && (pr->reduce < 2)) {
+    pResult = pr->pCurves;
+  }
+  
+  return pResult;
+}
+
+/*
+ * Read reduced scanlines from an image reader.
+ * 
+ * For each reduced scanline, the next reduce source scanlines, or fewer
+ * at the bottom of the image, are added to the running sums, which are
+ * then averaged into the destination.  pDst points to the first
+ * reduced scanline, stride is the distance in pixels between reduced
+ * scanlines, and n is the number of reduced scanlines.  When libpng
+ * decodes on the calling thread, its bytes are summed directly, without
+ * converting each source pixel to ARGB.  The end of the image is read
+ * after the last source scanline.
+ * 
+ * The reader must not be in error mode, the background decoder, if
+ * any, must already be running, and the reader must not have seeked.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pDst - the first reduced scanline
+ * 
+ *   stride - the distance in pixels between reduced scanlines
+ * 
+ *   n - the number of reduced scanlines
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+static int sph_reader_reduceRows(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int32_t            n) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t k = 0;
+  int32_t rows = 0;
+  const uint32_t *pRow = NULL;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  if ((pr->reduce < 2) || (pr->pSum == NULL) || (pr->pNative != NULL) ||
+      (stride < pr->rw) || (n < 1) || (n > pr->rh - pr->out_count)) {
+    abort();
+  }
+  
+  /* Register error handler once for the whole batch, in case libpng
+   * decodes */
+  if (setjmp(png_jmpbuf(pr->png_ptr))) {
+    /* Careful -- local variables may be in uncertain state? */
+    status = 0;
+  }
+  
+  for(i = 0; (i < n) && status; i++) {
+    
+    /* Get the number of source scanlines in this box */
+    rows = pr->h - pr->scan_count;
+    if (rows > pr->reduce) {
+      rows = pr->reduce;
+    }
+    
+    /* Add up the source scanlines */
+    memset(pr->pSum, 0,
+            ((size_t) pr->rw) * ((size_t) 4) * sizeof(uint64_t));
+    for(k = 0; k < rows; k++) {
+      if (pr->pBands != NULL) {
+        /* Parallel band decoder */
+        pRow = sph_bands_row(pr->pBands, pr->scan_count);
+        if (pRow == NULL) {
+          status = 0;
+          break;
+        }
+        sph_reduce_addARGB(pr->pSum, pRow, pr->ccount, pr->w,
+                            pr->reduce);
+      
+      } else if (pr->pAhead != NULL) {
+        /* Read-ahead decoder */
+        pRow = sph_ahead_row(pr->pAhead, pr->scan_count);
+        if (pRow == NULL) {
+          status = 0;
+          break;
+        }
+        sph_reduce_addARGB(pr->pSum, pRow, pr->ccount, pr->w,
+                            pr->reduce);
+      
+      } else {
+        /* Serial libpng decoding */
+        png_read_row(
+            pr->png_ptr,
+            (png_bytep) pr->pData,
+            NULL);
+        sph_reduce_addBytes(pr->pSum, pr->pData, pr->ccount, pr->w,
+                            pr->reduce);
+      }
+      (pr->scan_count)++;
+    }
+    
+    /* Average the box into the destination */
+    if (status) {
+      sph_reduce_emit(pr->pSum, pDst + ((size_t) i) * ((size_t) stride),
+                      pr->ccount, pr->w, pr->reduce,
+                      rows, pr->curves ? pr->pCurves : NULL);
+      (pr->out_count)++;
+    }
+  }
+  
+  /* If libpng just read the last scanline, finish reading */
+  if (status && (pr->scan_count >= pr->h) && (pr->pBands == NULL) &&
+      (pr->pAhead == NULL)) {
+    png_read_end(pr->png_ptr, (png_infop)NULL);
+  }
+  
+  return status;
+}
+
+/*
+ * Convert and compress scanlines of an image writer.
+ * 
+ * pSrc points to the first pixel of the first scanline, stride is the
+ * distance in pixels between scanlines, and n is the number of
+ * scanlines.  The end of the image is written after the last
+ * scanline.  If the writer is already in error mode, nothing is done
+ * and the function fails.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pSrc - the first scanline
+ * 
+ *   stride - the distance in pixels between scanlines
+ * 
+ *   n - the number of scanlines
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error, in which case the error
+ *   code of the writer is set
+ */
+static int sph_writer_encode(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n) {
+  
+  /* Volatile, since it is changed by the error handler */
+  volatile int status = 1;
+  int bits = 0;
+  int32_t i = 0;
+  const uint32_t *pRow = NULL;
+  const uint32_t *pCurves = NULL;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pSrc == NULL)) {
+    abort();
+  }
+  if ((stride < pw->w) || (n < 1) || (n > pw->h - pw->enc_count)) {
+    abort();
+  }
+  
+  /* Handle based on image type, unless in error mode */
+  if (pw->err_code != SPH_IMAGE_ERR_NONE) {
+    /* In error mode -- fail with the same error */
+    status = 0;
+  
+  } else if (pw->ftype == SPH_IMAGE_TYPE_PNG) {
+    
+    /* PNG -- first of all, register error handler once for the whole
+     * batch; a PNG error puts the writer into error mode */
+    if (setjmp(png_jmpbuf(pw->png_ptr))) {
+      /* Careful -- local variables may be in uncertain state? */
+      pw->err_code = SPH_IMAGE_ERR_WRITEDATA;
+      status = 0;
+    }
+    
+    /* Get the low bit depth and the tone curves, if any */
+    bits = sph_down_bits(pw->dconv);
+    pCurves = pw->curves ? pw->pCurves : NULL;
+    
+    /* Write each scanline */
+    for(i = 0; (i < n) && status; i++) {
+      
+      /* Get the source scanline */
+      pRow = pSrc + ((size_t) i) * ((size_t) stride);
+      
+      /* Serialize into bytes */
+      if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
+        /* No down-conversion, so full RGBA */
+        sph_png_rowRGBA(pRow, pw->pData, pw->w, pCurves);
+      
+      } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
+        /* RGB down-conversion */
+        sph_png_rowRGB(pRow, pw->pData, pw->w, pCurves);
+      
+      } else if (pw->dconv == SPH_IMAGE_DOWN_GRAY) {
+        /* Grayscale down-conversion */
+        sph_png_rowGray(pRow, pw->pData, pw->w, pCurves);
+      
+      } else if (bits > 0) {
+        /* Low bit-depth grayscale down-conversion */
+        if (!sph_png_rowGrayBits(pRow, pw->pData, pw->w,
+                bits, pw->gray_lut, pCurves)) {
+          pw->err_code = SPH_IMAGE_ERR_GRAYDEPTH;
+          status = 0;
+          break;
+        }
+      
+      } else {
+        /* Unrecognized down-conversion setting */
+        abort();
+      }
+      
+      /* Write the serialized scanline */
+      if (sph_idat_active(pw)) {
+        sph_idat_row(pw);
+      } else {
+        png_write_row(
+            pw->png_ptr,
+            (png_bytep) pw->pData);
+      }
+      
+      /* Increase the scanline count */
+      (pw->enc_count)++;
+    }
+    
+    /* If we just wrote the last scanline, finish writing */
+    if (status) {
+      if (pw->enc_count >= pw->h) {
+        if (sph_idat_active(pw)) {
+          sph_idat_finish(pw);
+        } else {
+          png_write_end(pw->png_ptr, pw->info_ptr);
+          sph_png_flushFn(pw->png_ptr);
+        }
+      }
+    }
+  
+  } else {
+    /* Unrecognized image type */
+    abort();
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Thread function of a pipelined encoder.
+ * 
+ * The thread encodes submitted scanlines in order, waiting whenever
+ * there are none.  It exits when all scanlines have been encoded, when
+ * a scanline fails to encode, or when asked to stop.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the pipelined encoder
+ * 
+ * Return:
+ * 
+ *   always NULL
+ */
+static void *sph_wpipe_worker(void *pArg) {
+  
+  SPH_WPIPE *pp = NULL;
+  int32_t y = 0;
+  int ok = 0;
+  
+  /* Get the pipelined encoder */
+  pp = (SPH_WPIPE *) pArg;
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Encode scanlines until done */
+  for(;;) {
+    
+    /* Wait for a submitted scanline */
+    pthread_mutex_lock(&(pp->lock));
+    while ((!(pp->stop)) && (pp->done < pp->pw->h) &&
+            (pp->done >= pp->sub)) {
+      pthread_cond_wait(&(pp->cond), &(pp->lock));
+    }
+    if (pp->stop || (pp->done >= pp->pw->h)) {
+      pthread_mutex_unlock(&(pp->lock));
+      break;
+    }
+    y = pp->done;
+    pthread_mutex_unlock(&(pp->lock));
+    
+    /* Encode the scanline */
+    ok = sph_writer_encode(pp->pw,
+            pp->pSlots + (((size_t) (y % pp->nslots)) *
+                            sph_row_pitch(pp->pw->w)),
+            pp->pw->w,
+            1);
+    
+    /* Publish the result */
+    pthread_mutex_lock(&(pp->lock));
+    if (ok) {
+      (pp->done)++;
+    } else {
+      pp->err = pp->pw->err_code;
+    }
+    pthread_cond_broadcast(&(pp->cond));
+    pthread_mutex_unlock(&(pp->lock));
+    
+    if (!ok) {
+      break;
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Start the pipelined encoder of an image writer.
+ * 
+ * Writing must not have started yet.  If the thread can't be started,
+ * NULL is returned and the writer should encode on the calling thread
+ * instead.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   the running pipelined encoder, or NULL
+ */
+static SPH_WPIPE *sph_wpipe_start(SPH_IMAGE_WRITER *pw) {
+  
+  SPH_WPIPE *pp = NULL;
+  int32_t nslots = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((pw->pipe_rows < 1) || (pw->scan_count > 0)) {
+    abort();
+  }
+  
+  /* Determine the number of slots, keeping under the memory limit along
+   * with the memory that compression will allocate */
+  nslots = pw->pipe_rows;
+  if (nslots > pw->h) {
+    nslots = pw->h;
+  }
+  if (pw->alloc.limit > 0) {
+    nslots = sph_mem_fitRows(
+                &(pw->alloc),
+                nslots,
+                sph_row_pitch(pw->w) * sizeof(uint32_t),
+                sizeof(SPH_WPIPE) + SPH_MEM_HEAD + sph_writer_need(pw));
+  }
+  
+  /* Start the encoder if there is room for at least one slot */
+  if (nslots > 0) {
+    
+    /* Allocate and initialize the structure */
+    pp = (SPH_WPIPE *) sph_mem_alloc(&(pw->alloc), sizeof(SPH_WPIPE));
+    if (pp == NULL) {
+      abort();
+    }
+    memset(pp, 0, sizeof(SPH_WPIPE));
+    
+    if (pthread_mutex_init(&(pp->lock), NULL)) {
+      abort();
+    }
+    if (pthread_cond_init(&(pp->cond), NULL)) {
+      abort();
+    }
+    
+    pp->pw = pw;
+    pp->nslots = nslots;
+    pp->pSlots = (uint32_t *) sph_mem_allocAligned(
+                    &(pw->alloc),
+                    ((size_t) pp->nslots) * sph_row_pitch(pw->w) *
+                    sizeof(uint32_t));
+    if (pp->pSlots == NULL) {
+      abort();
+    }
+    memset(pp->pSlots, 0,
+      ((size_t) pp->nslots) * sph_row_pitch(pw->w) * sizeof(uint32_t));
+    
+    pp->sub = 0;
+    pp->done = 0;
+    pp->err = SPH_IMAGE_ERR_NONE;
+    pp->stop = 0;
+    
+    /* Start the thread, falling back to encoding on the calling thread
+     * if it fails */
+    if (pthread_create(&(pp->thread), NULL, &sph_wpipe_worker, pp)) {
+      sph_mem_freeAligned(&(pw->alloc), pp->pSlots);
+      pthread_cond_destroy(&(pp->cond));
+      pthread_mutex_destroy(&(pp->lock));
+      sph_mem_free(&(pw->alloc), pp);
+      pp = NULL;
+    }
+  }
+  
+  return pp;
+}
+
+/*
+ * Stop a pipelined encoder and release it.
+ * 
+ * The thread is asked to stop and joined.  Scanlines that were
+ * submitted but not yet encoded are discarded.  If NULL is passed, the
+ * call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipelined encoder, or NULL
+ */
+static void sph_wpipe_stop(SPH_WPIPE *pp) {
+  
+  if (pp != NULL) {
+    
+    /* Stop and join the thread */
+    pthread_mutex_lock(&(pp->lock));
+    pp->stop = 1;
+    pthread_cond_broadcast(&(pp->cond));
+    pthread_mutex_unlock(&(pp->lock));
+    
+    pthread_join(pp->thread, NULL);
+    
+    /* Release everything */
+    sph_mem_freeAligned(&(pp->pw->alloc), pp->pSlots);
+    pthread_cond_destroy(&(pp->cond));
+    pthread_mutex_destroy(&(pp->lock));
+    
+    sph_mem_free(&(pp->pw->alloc), pp);
+  }
+}
+
+/*
+ * Get the slot of the next scanline to submit to a pipelined encoder.
+ * 
+ * This blocks until the slot is no longer in use by the encoder
+ * thread.  If the encoder has failed, the slot is returned at once,
+ * since the thread no longer uses any slot.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipelined encoder
+ * 
+ * Return:
+ * 
+ *   pointer to the slot
+ */
+static uint32_t *sph_wpipe_slot(SPH_WPIPE *pp) {
+  
+  int32_t y = 0;
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  /* Wait until the slot is free */
+  pthread_mutex_lock(&(pp->lock));
+  while ((pp->sub >= pp->done + pp->nslots) &&
+          (pp->err == SPH_IMAGE_ERR_NONE)) {
+    pthread_cond_wait(&(pp->cond), &(pp->lock));
+  }
+  y = pp->sub;
+  pthread_mutex_unlock(&(pp->lock));
+  
+  return pp->pSlots + (((size_t) (y % pp->nslots)) *
+                        sph_row_pitch(pp->pw->w));
+}
+
+/*
+ * Submit the scanline in the next slot to a pipelined encoder.
+ * 
+ * The caller must have filled the slot returned by sph_wpipe_slot().
+ * The submitted scanline count of the writer is increased.  If this is
+ * the last scanline of the image, this blocks until the encoder has
+ * finished the image, so that all errors are reported by the time the
+ * last scanline has been written.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipelined encoder
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the encoder has failed
+ */
+static int sph_wpipe_submit(SPH_WPIPE *pp, int *pError) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  pthread_mutex_lock(&(pp->lock));
+  
+  /* The slot must be free, which sph_wpipe_slot() ensured */
+  if ((pp->err == SPH_IMAGE_ERR_NONE) &&
+      (pp->sub >= pp->done + pp->nslots)) {
+    abort();
+  }
+  
+  /* Submit the scanline unless the encoder has failed */
+  if (pp->err == SPH_IMAGE_ERR_NONE) {
+    (pp->sub)++;
+    (pp->pw->scan_count)++;
+    pthread_cond_broadcast(&(pp->cond));
+    
+    /* After the last scanline, wait for the encoder to finish */
+    if (pp->sub >= pp->pw->h) {
+      while ((pp->done < pp->sub) && (pp->err == SPH_IMAGE_ERR_NONE)) {
+        pthread_cond_wait(&(pp->cond), &(pp->lock));
+      }
+    }
+  }
+  err = pp->err;
+  
+  pthread_mutex_unlock(&(pp->lock));
+  
+  /* Report error if there was one */
+  if (err != SPH_IMAGE_ERR_NONE) {
+    status = 0;
+    if (pError != NULL) {
+      *pError = err;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Allocate the reorder window of an image writer.
+ * 
+ * Writing must not have started yet.  Under a memory limit, the window
+ * gets only as many slots as fit along with the memory that compression
+ * will allocate.  If no slot fits, the window is returned in error mode
+ * with SPH_IMAGE_ERR_MEMORY, so that every submission fails.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   rows - the number of slots wanted
+ * 
+ * Return:
+ * 
+ *   the new reorder window
+ */
+static SPH_WORDER *sph_worder_new(SPH_IMAGE_WRITER *pw, int32_t rows) {
+  
+  SPH_WORDER *po = NULL;
+  int32_t nslots = 0;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((rows < 1) || (pw->scan_count > 0)) {
+    abort();
+  }
+  
+  /* Determine the number of slots */
+  nslots = rows;
+  if (nslots > pw->h) {
+    nslots = pw->h;
+  }
+  if (pw->alloc.limit > 0) {
+    nslots = sph_mem_fitRows(
+                &(pw->alloc),
+                nslots,
+                sph_row_pitch(pw->w) * sizeof(uint32_t) + 1,
+                sizeof(SPH_WORDER) + 2 * SPH_MEM_HEAD +
+                  sph_writer_need(pw));
+  }
+  
+  /* Allocate and initialize the structure */
+  po = (SPH_WORDER *) sph_mem_alloc(&(pw->alloc), sizeof(SPH_WORDER));
+  if (po == NULL) {
+    abort();
+  }
+  memset(po, 0, sizeof(SPH_WORDER));
+  
+  if (pthread_mutex_init(&(po->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(po->cond), NULL)) {
+    abort();
+  }
+  
+  po->pw = pw;
+  po->nslots = nslots;
+  po->pSlots = NULL;
+  po->pHave = NULL;
+  po->next = 0;
+  po->busy = 0;
+  po->err = SPH_IMAGE_ERR_NONE;
+  
+  /* Allocate the slots, or fail every submission if none fit */
+  if (nslots > 0) {
+    po->pSlots = (uint32_t *) sph_mem_allocAligned(
+                    &(pw->alloc),
+                    ((size_t) nslots) * sph_row_pitch(pw->w) *
+                    sizeof(uint32_t));
+    po->pHave = (uint8_t *) sph_mem_alloc(&(pw->alloc), (size_t) nslots);
+    if ((po->pSlots == NULL) || (po->pHave == NULL)) {
+      abort();
+    }
+    memset(po->pHave, 0, (size_t) nslots);
+  } else {
+    po->err = SPH_IMAGE_ERR_MEMORY;
+  }
+  
+  return po;
+}
+
+/*
+ * Release the reorder window of an image writer.
+ * 
+ * No thread may be submitting to the window.  If NULL is passed, the
+ * call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   po - the reorder window, or NULL
+ */
+static void sph_worder_free(SPH_WORDER *po) {
+  
+  if (po != NULL) {
+    sph_mem_freeAligned(&(po->pw->alloc), po->pSlots);
+    sph_mem_free(&(po->pw->alloc), po->pHave);
+    pthread_cond_destroy(&(po->cond));
+    pthread_mutex_destroy(&(po->lock));
+    sph_mem_free(&(po->pw->alloc), po);
+  }
+}
+
+/*
+ * Get the slot of a scanline in a reorder window.
+ * 
+ * Parameters:
+ * 
+ *   po - the reorder window
+ * 
+ *   y - the scanline
+ * 
+ * Return:
+ * 
+ *   pointer to the slot
+ */
+static uint32_t *sph_worder_slot(SPH_WORDER *po, int32_t y) {
+  
+  /* Check parameters */
+  if ((po == NULL) || (y < 0) || (po->nslots < 1)) {
+    abort();
+  }
+  
+  return po->pSlots + (((size_t) (y % po->nslots)) *
+                        sph_row_pitch(po->pw->w));
+}
+
+/*
+ * Prepare an image writer before the first scanline is written.
+ * 
+ * The deflate parameters are chosen for the memory limit, and then the
+ * pipelined encoder is started if pipelining was requested.  If the
+ * encoder can't be started, the writer encodes on the calling thread.
+ * This function does nothing once writing has started.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ */
+static void sph_writer_begin(SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Choose the deflate parameters before the first scanline; if the
+   * image can't fit under the memory limit, the writer enters error
+   * mode */
+  if ((pw->scan_count == 0) && (!(pw->zfit)) &&
+      (pw->err_code == SPH_IMAGE_ERR_NONE)) {
+    pw->zfit = 1;
+    if (!sph_writer_fitDeflate(pw)) {
+      pw->err_code = SPH_IMAGE_ERR_MEMORY;
+    
+    } else if ((pw->alloc.limit > 0) &&
+                (pw->ftype == SPH_IMAGE_TYPE_PNG)) {
+      png_set_compression_window_bits(pw->png_ptr, pw->zwbits);
+      png_set_compression_mem_level(pw->png_ptr, pw->zmem);
+    }
+  }
+  
+  /* Start the encoder before the first scanline */
+  if ((pw->scan_count == 0) && (pw->pPipe == NULL) &&
+      (pw->pipe_rows > 0) && (pw->err_code == SPH_IMAGE_ERR_NONE)) {
+    pw->pPipe = sph_wpipe_start(pw);
+  }
+}
+
+/*
+ * Write a batch of scanlines to an image writer in order.
+ * 
+ * This does the work of sph_image_writer_writeRows(), and it is also
+ * used to write the scanlines of a reorder window.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pSrc - the first scanline
+ * 
+ *   stride - the distance in pixels between scanlines
+ * 
+ *   n - the number of scanlines
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sph_writer_rows(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError) {
+  
+  int status = 1;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pSrc == NULL)) {
+    abort();
+  }
+  if ((stride < pw->w) || (n < 1)) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Check that there are enough scanlines left to write */
+  if (n > pw->h - pw->scan_count) {
+    abort();
+  }
+  
+  /* Start the pipelined encoder on the first write if requested */
+  sph_writer_begin(pw);
+  
+  if (pw->pPipe != NULL) {
+    /* Pipelined -- copy each scanline into a slot and submit it */
+    for(i = 0; i < n; i++) {
+      memcpy(
+        sph_wpipe_slot(pw->pPipe),
+        pSrc,
+        ((size_t) pw->w) * sizeof(uint32_t));
+      if (!sph_wpipe_submit(pw->pPipe, pError)) {
+        status = 0;
+        break;
+      }
+      pSrc += stride;
+    }
+  
+  } else {
+    /* Encode on the calling thread */
+    status = sph_writer_encode(pw, pSrc, stride, n);
+    pw->scan_count = pw->enc_count;
+    
+    /* Report error if there was one */
+    if ((!status) && (pError != NULL)) {
+      *pError = pw->err_code;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Determine the number of worker threads to use automatically.
+ * 
+ * Return:
+ * 
+ *   the number of online processors, limited to SPH_MAX_AUTO_THREADS,
+ *   or one if it can't be determined
+ */
+static int sph_auto_threads(void) {
+  
+  long n = 0;
+  
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    n = 1;
+  } else if (n > SPH_MAX_AUTO_THREADS) {
+    n = SPH_MAX_AUTO_THREADS;
+  }
+  
+  return (int) n;
+}
+
+/*
+ * Make sure that a reusable buffer holds at least a given number of
+ * bytes.
+ * 
+ * If the buffer is NULL or smaller than len bytes, it is freed and
+ * replaced with a new aligned buffer from sph_mem_allocAligned(), and
+ * *pCap is updated to the new size.  The contents of the buffer are not
+ * preserved.
+ * 
+ * Parameters:
+ * 
+ *   pAlloc - the allocator of the object
+ * 
+ *   pBuf - the current buffer, or NULL
+ * 
+ *   pCap - pointer to the size of the current buffer in bytes
+ * 
+ *   len - the required size in bytes, at least one
+ * 
+ * Return:
+ * 
+ *   the buffer to use from now on
+ */
+static void *sph_buf_fit(
+    SPH_MEM * pAlloc,
+    void    * pBuf,
+    size_t  * pCap,
+    size_t    len) {
+  
+  /* Check parameters */
+  if ((pCap == NULL) || (len < 1)) {
+    abort();
+  }
+  
+  /* Replace the buffer if it is too small */
+  if ((pBuf == NULL) || (*pCap < len)) {
+    sph_mem_freeAligned(pAlloc, pBuf);
+    pBuf = sph_mem_allocAligned(pAlloc, len);
+    if (pBuf == NULL) {
+      abort();
+    }
+    *pCap = len;
+  }
+  
+  return pBuf;
+}
+
+/*
+ * Start a new image in an image writer object.
+ * 
+ * This does the work of sph_image_writer_new() on a writer structure
+ * that has no image open.  The scanline buffer and binary I/O buffer of
+ * the structure are kept if they are already large enough, the native
+ * IDAT encoder buffers and deflate stream are kept for reuse, and all
+ * other fields are initialized.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer structure
+ * 
+ *   pOut - the handle to the output file
+ * 
+ *   ftype - the type of image to write
+ * 
+ *   w - the width of the image in pixels
+ * 
+ *   h - the height of the image in pixels
+ * 
+ *   dconv - the down-conversion requested
+ * 
+ *   q - reserved, set to zero
+ */
+static void sph_writer_init(
+    SPH_IMAGE_WRITER * pw,
+    FILE             * pOut,
+    int                ftype,
+    int32_t            w,
+    int32_t            h,
+    int                dconv,
+    int                q) {
+  
+  int quant = 0;
+  int bits = 0;
+  size_t dlen = 0;
+  
+  /* Ignore the q parameter */
+  (void) q;
+  
+  /* Split the quantization flag from the down-conversion */
+  if (dconv & SPH_IMAGE_DOWN_QUANTIZE) {
+    quant = 1;
+    dconv &= ~SPH_IMAGE_DOWN_QUANTIZE;
+  }
+  bits = sph_down_bits(dconv);
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if (ftype != SPH_IMAGE_TYPE_PNG) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((h < 1) || (h > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((dconv != SPH_IMAGE_DOWN_NONE) &&
+      (dconv != SPH_IMAGE_DOWN_RGB) &&
+      (dconv != SPH_IMAGE_DOWN_GRAY) &&
+      (bits == 0)) {
+    abort();
+  }
+  if (quant && (bits == 0)) {
+    abort();
+  }
+  
+  /* Make sure the scanline buffer is large enough */
+  pw->pScan = (uint32_t *) sph_buf_fit(
+                &(pw->alloc),
+                pw->pScan,
+                &(pw->scan_cap),
+                ((size_t) w) * sizeof(uint32_t));
+  memset(pw->pScan, 0, ((size_t) w) * sizeof(uint32_t));
+  
+  /* Determine the size of the data buffer */
+  if (dconv == SPH_IMAGE_DOWN_NONE) {
+    /* RGBA */
+    dlen = ((size_t) w) * ((size_t) 4);
+  
+  } else if (dconv == SPH_IMAGE_DOWN_RGB) {
+    /* RGB */
+    dlen = ((size_t) w) * ((size_t) 3);
+  
+  } else if (dconv == SPH_IMAGE_DOWN_GRAY) {
+    /* Grayscale */
+    dlen = (size_t) w;
+  
+  } else if (bits > 0) {
+    /* Packed low bit-depth grayscale */
+    dlen = ((((size_t) w) * ((size_t) bits)) + 7) / 8;
+  
+  } else {
+    /* Unrecognized down-conversion */
+    abort();
+  }
+  
+  /* Make sure the data buffer is large enough */
+  pw->pData = (uint8_t *) sph_buf_fit(
+                &(pw->alloc),
+                pw->pData,
+                &(pw->data_cap),
+                dlen);
+  memset(pw->pData, 0, dlen);
+  
+  /* Initialize all general fields */
+  pw->pOut = pOut;
+  pw->ftype = ftype;
+  pw->w = w;
+  pw->h = h;
+  pw->scan_count = 0;
+  pw->dconv = dconv;
+  pw->quant = quant;
+  if (bits > 0) {
+    sph_gray_lut(pw->gray_lut, bits, quant);
+  }
+  pw->err_code = SPH_IMAGE_ERR_NONE;
+  pw->fpos = 0;
+  pw->band = 0;
+  pw->z_init = 0;
+  pw->zlevel = -1;
+  pw->zstrategy = SPH_IMAGE_STRATEGY_AUTO;
+  pw->filters = 0;
+  pw->budget = 0;
+  pw->t_start = 0.0;
+  pw->t_end = -1.0;
+  pw->t_mark = 0.0;
+  pw->mark_row = 0;
+  pw->zcur = SPH_ZLEVEL_DEFAULT;
+  pw->fast = 0;
+  pw->changes = 0;
+  pw->change_row = -1;
+  pw->enc_count = 0;
+  pw->pipe_rows = 0;
+  pw->pPipe = NULL;
+  pw->pOrder = NULL;
+  pw->curves = 0;
+  
+  /* With a memory limit, free the deflate stream of the last image so
+   * that its parameters can be chosen again for this one */
+  if ((pw->alloc.limit > 0) && pw->z_alloc) {
+    deflateEnd(&(pw->z));
+    pw->z_alloc = 0;
+  }
+  
+  /* Measure the peak memory use from here, and use the default deflate
+   * parameters until the first write chooses them */
+  sph_mem_peak(&(pw->alloc), 1);
+  pw->zwbits = 15;
+  pw->zmem = 8;
+  pw->zfit = 0;
+  
+  /* Initialize specific codec */
+  if (ftype == SPH_IMAGE_TYPE_PNG) {
+    /* Initialize PNG codec */
+    pw->png_ptr = png_create_write_struct_2(
+                PNG_LIBPNG_VER_STRING,
+                NULL,
+                &sph_png_errorFn,
+                &sph_png_warningFn,
+                (png_voidp) &(pw->alloc),
+                &sph_png_mallocFn,
+                &sph_png_freeFn);
+    if (pw->png_ptr == NULL) {
+      /* Error initializing PNG codec */
+      abort();
+    }
+    
+    pw->info_ptr = png_create_info_struct(pw->png_ptr);
+    if (pw->info_ptr == NULL) {
+      /* Error creating information structure */
+      abort();
+    }
+  
+    /* Establish error handler for PNG; if writing the headers fails,
+     * the writer starts out in error mode */
+    if (setjmp(png_jmpbuf(pw->png_ptr))) {
+      /* Careful -- local variables may be in uncertain state? */
+      pw->err_code = SPH_IMAGE_ERR_WRITEDATA;
+    }
+  }
+  
+  /* Write the PNG headers unless that already failed */
+  if ((ftype == SPH_IMAGE_TYPE_PNG) &&
+      (pw->err_code == SPH_IMAGE_ERR_NONE)) {
+  
+    /* Initialize PNG I/O through the callbacks that track the file
+     * offset */
+    png_set_write_fn(pw->png_ptr, pw, &sph_png_writeFn, &sph_png_flushFn);
+    
+    /* Get the low bit depth again, since locals that are live across
+     * setjmp() may be clobbered */
+    bits = sph_down_bits(pw->dconv);
+    
+    /* Initialize writing information */
+    if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
+      /* No down-conversion, so full ARGB */
+      png_set_IHDR(pw->png_ptr, pw->info_ptr,
+          pw->w, pw->h,   /* Width and height */
+          8,              /* Bits per channel */
+          PNG_COLOR_TYPE_RGB_ALPHA,
+          PNG_INTERLACE_NONE,
+          PNG_COMPRESSION_TYPE_DEFAULT,
+          PNG_FILTER_TYPE_DEFAULT);
+    
+    } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
+      /* RGB down-conversion */
+      png_set_IHDR(pw->png_ptr, pw->info_ptr,
+          pw->w, pw->h,   /* Width and height */
+          8,              /* Bits per channel */
+          PNG_COLOR_TYPE_RGB,
+          PNG_INTERLACE_NONE,
+          PNG_COMPRESSION_TYPE_DEFAULT,
+          PNG_FILTER_TYPE_DEFAULT);
+    
+    } else if (pw->dconv == SPH_IMAGE_DOWN_GRAY) {
+      /* Grayscale down-conversion */
+      png_set_IHDR(pw->png_ptr, pw->info_ptr,
+          pw->w, pw->h,   /* Width and height */
+          8,              /* Bits per channel */
+          PNG_COLOR_TYPE_GRAY,
+          PNG_INTERLACE_NONE,
+          PNG_COMPRESSION_TYPE_DEFAULT,
+          PNG_FILTER_TYPE_DEFAULT);
+    
+    } else if (bits > 0) {
+      /* Low bit-depth grayscale down-conversion */
+      png_set_IHDR(pw->png_ptr, pw->info_ptr,
+          pw->w, pw->h,   /* Width and height */
+          bits,           /* Bits per channel */
+          PNG_COLOR_TYPE_GRAY,
+          PNG_INTERLACE_NONE,
+          PNG_COMPRESSION_TYPE_DEFAULT,
+          PNG_FILTER_TYPE_DEFAULT);
+    
+    } else {
+      /* Unrecognized down-conversion */
+      abort();
+    }
+    
+    /* Write PNG headers to output */
+    png_write_info(pw->png_ptr, pw->info_ptr);
+  
+  } else if (ftype != SPH_IMAGE_TYPE_PNG) {
+    /* Unrecognized image file type */
+    abort();
+  }
+}
+
+/*
+ * Close the image that is open in an image writer object, keeping the
+ * buffers and deflate stream for reuse.
+ * 
+ * The pipelined encoder is stopped, the codec is destroyed, and the
+ * output file is closed.  Afterwards, the structure has no image open,
+ * and it may either be given a new image with sph_writer_init() or be
+ * freed.  Calling this on a structure that has no image open does
+ * nothing.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer structure
+ */
+static void sph_writer_release(SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Stop the pipelined encoder before the codec is destroyed */
+  sph_wpipe_stop(pw->pPipe);
+  pw->pPipe = NULL;
+  
+  /* Release the reorder window */
+  sph_worder_free(pw->pOrder);
+  pw->pOrder = NULL;
+  
+  /* Shut down codecs */
+  if (pw->ftype == SPH_IMAGE_TYPE_PNG) {
+  
+    /* Free PNG structures; this never raises a PNG error, so no error
+     * handler is needed */
+    png_destroy_write_struct(&(pw->png_ptr), &(pw->info_ptr));
+  
+  } else {
+    /* Unrecognized image type */
+    abort();
+  }
+  
+  /* Close file */
+  if (pw->pOut != NULL) {
+    fclose(pw->pOut);
+    pw->pOut = NULL;
+  }
+  
+  /* Free the restart index, which depends on the image height */
+  sph_mem_free(&(pw->alloc), pw->pBandOff);
+  pw->pBandOff = NULL;
+  sph_mem_free(&(pw->alloc), pw->pIndex);
+  pw->pIndex = NULL;
+  
+  /* The deflate stream must be reset before it is used again */
+  pw->z_init = 0;
+}
+
+/*
+ * Open an image in an image reader object.
+ * 
+ * This does the work of sph_image_reader_new() on a reader structure
+ * that has no image open.  The scanline buffer and binary I/O buffer of
+ * the structure are kept if they are already large enough, and all
+ * other fields are initialized.
+ * 
+ * If there is an error, the file handle is closed and the structure is
+ * left without an image.  If pError is not NULL, then an error code
+ * will be written there on failure, or a zero error (SPH_IMAGE_ERR_NONE)
+ * on success.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader structure
+ * 
+ *   pIn - the handle to the input file
+ * 
+ *   ftype - the type of image to read
+ * 
+ *   pError - pointer to the error return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int sph_reader_init(
+    SPH_IMAGE_READER * pr,
+    FILE             * pIn,
+    int                ftype,
+    int              * pError) {
+  
+  int status = 1;
+  
+  uint32_t w = 0;
+  uint32_t h = 0;
+  int bdepth = 0;
+  int ctype = 0;
+  int imethod = 0;
+  int ccount = 0;
+  int alpha_flag = 0;
+  size_t need = 0;
+  
+  png_uint_32 w_png = 0;
+  png_uint_32 h_png = 0;
+  
+  png_structp png_ptr = NULL;
+  png_infop info_ptr = NULL;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pIn == NULL)) {
+    abort();
+  }
+  if (ftype != SPH_IMAGE_TYPE_PNG) {
+    abort();
+  }
+  
+  /* Set error to unknown in case we need to leave from a longjmp */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_UNKNOWN;
+  }
+  
+  /* Measure the peak memory use from here */
+  sph_mem_peak(&(pr->alloc), 1);
+  
+  /* Read header information and initialize codecs */
+  if (ftype == SPH_IMAGE_TYPE_PNG) {
+    
+    /* Initialize PNG codec */
+    png_ptr = png_create_read_struct_2(
+                PNG_LIBPNG_VER_STRING,
+                NULL,
+                &sph_png_errorFn,
+                &sph_png_warningFn,
+                (png_voidp) &(pr->alloc),
+                &sph_png_mallocFn,
+                &sph_png_freeFn);
+    if (png_ptr == NULL) {
+      /* Error initializing PNG codec */
+      abort();
+    }
+    
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+      /* Error creating information structure */
+      abort();
+    }
+    
+    /* Establish error handler for PNG */
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      /* Careful -- local variables may be in uncertain state? */
+      status = 0;
+    }
+    
+    /* Initialize PNG I/O */
+    if (status) {
+      png_init_io(png_ptr, pIn);
+    }
+    
+    /* Read the headers of the input file */
+    if (status) {
+      png_read_info(png_ptr, info_ptr);
+    }
+    
+    /* Get information about the input file format */
+    if (status) {
+      png_get_IHDR(png_ptr, info_ptr,
+        &w_png, &h_png,
+        &bdepth,
+        &ctype,
+        &imethod,
+        NULL, NULL);
+      
+      /* Older versions of libpng define png_uint_32 as a long, which
+       * might be 64-bit on some platforms, so we first have to save
+       * the variables to a png_uint_32, then transfer them to w and h
+       * here */
+      w = (uint32_t) w_png;
+      h = (uint32_t) h_png;
+    }
+    
+    /* Make sure dimensions are not too large */
+    if (status) {
+      if ((w > SPH_IMAGE_MAXDIM) || (h > SPH_IMAGE_MAXDIM)) {
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_IMAGEDIM;
+        }
+        status = 0;
+      }
+    }
+    
+    /* Make sure input file is not interlaced */
+    if (status) {
+      if (imethod != PNG_INTERLACE_NONE) {
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_INTERLACED;
+        }
+        status = 0;
+      }
+    }
+    
+    /* Make sure input file is not 16-bit */
+    if (status) {
+      if (bdepth > 8) {
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_BITDEPTH;
+        }
+        status = 0;
+      }
+    }
+    
+    /* Request expansions specific to color spaces */
+    if (status && (ctype == PNG_COLOR_TYPE_PALETTE)) {
+      /* Palette image -- expand to RGB */
+      png_set_palette_to_rgb(png_ptr);
+    
+    } else if (status && ((ctype == PNG_COLOR_TYPE_GRAY) ||
+                          (ctype == PNG_COLOR_TYPE_GRAY_ALPHA))) {
+      /* Grayscale -- expand if less than 8-bit */
+      if (bdepth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+      }
+    
+    } else if (status && ((ctype == PNG_COLOR_TYPE_RGB) ||
+                          (ctype == PNG_COLOR_TYPE_RGB_ALPHA))) {
+      /* RGB -- expand if less than 8-bit */
+      if (bdepth < 8) {
+        png_set_expand(png_ptr);
+      }
+    
+    } else if (status) {
+      /* Unrecognized color space -- shouldn't happen */
+      abort();
+    }
+    
+    /* If there is a transparency chunk and color type doesn't already
+     * have alpha channel, add alpha channel and set alpha flag */
+    if (status) {
+      if ((ctype != PNG_COLOR_TYPE_GRAY_ALPHA) &&
+          (ctype != PNG_COLOR_TYPE_RGB_ALPHA)) {
+        if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+          alpha_flag = 1;
+          png_set_tRNS_to_alpha(png_ptr);
+        }
+      }
+    }
+    
+    /* Determine the number of color channels */
+    if (ctype == PNG_COLOR_TYPE_PALETTE) {
+      /* Palette image has 3 or 4 channels, depending on alpha flag */
+      if (alpha_flag) {
+        ccount = 4;
+      } else {
+        ccount = 3;
+      }
+    
+    } else if (ctype == PNG_COLOR_TYPE_GRAY) {
+      /* Grayscale image has 1 or 2 channels, depending on alpha flag */
+      if (alpha_flag) {
+        ccount = 2;
+      } else {
+        ccount = 1;
+      }
+    
+    } else if (ctype == PNG_COLOR_TYPE_RGB) {
+      /* RGB image has 3 or 4 channels, depending on alpha flag */
+      if (alpha_flag) {
+        ccount = 4;
+      } else {
+        ccount = 3;
+      }
+    
+    } else if (ctype == PNG_COLOR_TYPE_GRAY_ALPHA) {
+      /* Grayscale with alpha has 2 channels */
+      ccount = 2;
+    
+    } else if (ctype == PNG_COLOR_TYPE_RGB_ALPHA) {
+      /* RGB with alpha has 4 channels */
+      ccount = 4;
+    
+    } else {
+      /* Unrecognized color type -- shouldn't happen */
+      abort();
+    }
+    
+    /* Make sure the image fits under the memory limit before any
+     * buffers are allocated for it; libpng keeps two scanlines, and the
+     * reader needs its scanline and data buffers unless the buffers of
+     * the last image are large enough */
+    if (status && (pr->alloc.limit > 0)) {
+      need = SPH_MEM_INFLATE + (2 * sph_mem_alignedSize(
+                                      ((size_t) w) * ((size_t) ccount) +
+                                      64));
+      if (((size_t) w) * sizeof(uint32_t) > pr->scan_cap) {
+        need += sph_mem_alignedSize(((size_t) w) * sizeof(uint32_t));
+      }
+      if (((size_t) w) * ((size_t) ccount) > pr->data_cap) {
+        need += sph_mem_alignedSize(((size_t) w) * ((size_t) ccount));
+      }
+      if (!sph_mem_fits(&(pr->alloc), need)) {
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_MEMORY;
+        }
+        status = 0;
+      }
+    }
+    
+    /* Update reading info */
+    if (status) {
+      png_read_update_info(png_ptr, info_ptr);
+    }
+    
+    /* If there was any problem, free the PNG codec */
+    if (!status) {
+      png_destroy_read_struct(
+        &png_ptr, &info_ptr, (png_infopp)NULL);
+      png_ptr = NULL;
+      info_ptr = NULL;
+    }
+  
+  } else {
+    /* Unrecognized image file type */
+    abort();
+  }
+  
+  /* Initialize all general fields, including transferring the input
+   * file into the structure */
+  if (status) {
+    pr->err_flag = 0;
+    pr->pIn = pIn;
+    pr->ftype = ftype;
+    pr->w = w;
+    pr->h = h;
+    pr->scan_count = 0;
+    pr->ccount = ccount;
+    pr->bits = bdepth;
+    pr->band = 0;
+    pr->band_count = 0;
+    pr->pBandOff = NULL;
+    pr->threads = 0;
+    pr->pBands = NULL;
+    pr->ahead = 0;
+    pr->pAhead = NULL;
+    pr->native = 0;
+    pr->idat_off = 0;
+    pr->pNative = NULL;
+    pr->reduce = 1;
+    pr->rw = w;
+    pr->rh = h;
+    pr->out_count = 0;
+    pr->curves = 0;
+    
+    pIn = NULL;
+  }
+  
+  /* Transfer codec into object */
+  if (status && (ftype == SPH_IMAGE_TYPE_PNG)) {
+    /* PNG codec */
+    pr->png_ptr = png_ptr;
+    pr->info_ptr = info_ptr;
+    
+    png_ptr = NULL;
+    info_ptr = NULL;
+  
+  } else if (status) {
+    /* Unrecognized image type */
+    abort();
+  }
+  
+  /* Make sure the scanline buffer is large enough */
+  if (status) {
+    pr->pScan = (uint32_t *) sph_buf_fit(
+                  &(pr->alloc),
+                  pr->pScan,
+                  &(pr->scan_cap),
+                  ((size_t) w) * sizeof(uint32_t));
+    memset(pr->pScan, 0, ((size_t) w) * sizeof(uint32_t));
+  }
+  
+  /* Make sure the data buffer is large enough */
+  if (status) {
+    pr->pData = (uint8_t *) sph_buf_fit(
+                  &(pr->alloc),
+                  pr->pData,
+                  &(pr->data_cap),
+                  ((size_t) w) * ((size_t) ccount));
+    memset(pr->pData, 0, ((size_t) w) * ((size_t) ccount));
+  }
+  
+  /* If the image is in a format that can be decoded natively, note
+   * where the image data starts and look for a restart index */
+  if (status) {
+    if ((!alpha_flag) && (ctype != PNG_COLOR_TYPE_PALETTE) &&
+        ((bdepth == 8) || (ctype == PNG_COLOR_TYPE_GRAY))) {
+      pr->native = 1;
+      pr->idat_off = ftell(pr->pIn) - 8;
+      if (pr->idat_off < 8) {
+        pr->native = 0;
+      }
+    }
+    if (pr->native) {
+      sph_restart_scan(pr);
+    }
+  }
+  
+  /* If failure, close the file */
+  if (!status) {
+    fclose(pIn);
+  }
+  
+  /* If successful, set error to NONE */
+  if (status) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+
+/*
+ * Close the image that is open in an image reader object, keeping the
+ * buffers for reuse.
+ * 
+ * The read-ahead and parallel band decoders are stopped, the codec is
+ * destroyed, and the input file is closed.  Afterwards, the structure
+ * has no image open, and it may either be given a new image with
+ * sph_reader_init() or be freed.  Calling this on a structure that has
+ * no image open does nothing.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader structure
+ */
+static void sph_reader_release(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Stop the read-ahead decoder before the codec is destroyed */
+  sph_ahead_stop(pr->pAhead);
+  pr->pAhead = NULL;
+  
+  /* Shut down codecs */
+  if (pr->ftype == SPH_IMAGE_TYPE_PNG) {
+    
+    /* Free PNG structures; this never raises a PNG error, so no error
+     * handler is needed */
+    png_destroy_read_struct(
+        &(pr->png_ptr),
+        &(pr->info_ptr),
+        (png_infopp)NULL);
+  
+  } else {
+    /* Unrecognized image type */
+    abort();
+  }
+  
+  /* Stop the parallel band decoder before the file is closed */
+  sph_bands_stop(pr->pBands);
+  pr->pBands = NULL;
+  
+  /* Free the native decoder */
+  sph_native_free(pr->pNative);
+  pr->pNative = NULL;
+  pr->native = 0;
+  
+  /* Close file */
+  if (pr->pIn != NULL) {
+    fclose(pr->pIn);
+    pr->pIn = NULL;
+  }
+  
+  /* Free the restart index */
+  sph_mem_free(&(pr->alloc), pr->pBandOff);
+  pr->pBandOff = NULL;
+  pr->band = 0;
+  pr->band_count = 0;
+}
+
+/*
+ * Make sure that a strip of an image cache is in memory.
+ * 
+ * If the strip is already cached, it just becomes the most recently
+ * used strip.  Otherwise, the least recently used strip is evicted if
+ * all slots are taken, and the strip is decoded into the freed slot.
+ * 
+ * With restart points, the strip is a restart band and is decoded on
+ * its own.  Otherwise, if the cache has an index, the reader seeks to
+ * the strip.  Without an index, the reader decodes forward to the
+ * strip, starting over from the top of the image if the strip lies
+ * before the current position.  The scanlines that are skipped on the
+ * way are decoded into the slot as well, and then overwritten.
+ * 
+ * If the cache is already in error mode, nothing is done and the
+ * function fails.  On failure, the cache enters error mode.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ *   st - the strip to load
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   the slot holding the strip, or -1 if read error
+ */
+static int sph_cache_load(SPH_IMAGE_CACHE *pc, int32_t st, int *pError) {
+  
+  int status = 1;
+  int slot = -1;
+  int i = 0;
+  int32_t y = 0;
+  int32_t rows = 0;
+  int32_t n = 0;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+  if ((st < 0) || (st >= pc->strip_count)) {
+    abort();
+  }
+  
+  /* Fail if in error mode */
+  if (pc->err_flag) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_READDATA;
+    }
+    status = 0;
+  }
+  
+  /* Use the cached strip if there is one */
+  if (status && (pc->pStripSlot[st] >= 0)) {
+    slot = pc->pStripSlot[st];
+    (pc->use)++;
+    pc->pSlotUse[slot] = pc->use;
+  
+  } else if (status) {
+    /* Pick an empty slot, or else the least recently used one */
+    slot = 0;
+    for(i = 0; i < pc->nslots; i++) {
+      if (pc->pSlotStrip[i] < 0) {
+        slot = i;
+        break;
+      }
+      if (pc->pSlotUse[i] < pc->pSlotUse[slot]) {
+        slot = i;
+      }
+    }
+    
+    /* Evict the strip it holds, if any */
+    if (pc->pSlotStrip[slot] >= 0) {
+      pc->pStripSlot[pc->pSlotStrip[slot]] = -1;
+      pc->pSlotStrip[slot] = -1;
+    }
+    
+    /* Allocate the buffer on first use */
+    if (pc->ppSlotBuf[slot] == NULL) {
+      pc->ppSlotBuf[slot] = (uint32_t *) sph_mem_allocAligned(
+                              &(pc->alloc),
+                              ((size_t) pc->strip) * pc->pitch *
+                                sizeof(uint32_t));
+      if (pc->ppSlotBuf[slot] == NULL) {
+        abort();
+      }
+    }
+    
+    /* Determine the number of rows in the strip */
+    y = st * pc->strip;
+    rows = pc->h - y;
+    if (rows > pc->strip) {
+      rows = pc->strip;
+    }
+    
+    if (pc->restart) {
+      /* Decode the restart band on its own */
+      status = sph_bands_fetch(&(pc->bands), st,
+                                &(pc->pComp), &(pc->comp_cap), &len);
+      if (status) {
+        status = sph_bands_inflate(&(pc->bands), st, pc->pComp, len,
+                                    pc->pCur, pc->pPrev,
+                                    pc->ppSlotBuf[slot]);
+      }
+      if ((!status) && (pError != NULL)) {
+        *pError = SPH_IMAGE_ERR_READDATA;
+      }
+    
+    } else if (pc->pIndex != NULL) {
+      /* Seek to the strip from the nearest checkpoint, then decode it */
+      if (pc->pr->scan_count != y) {
+        status = sph_image_reader_seek(pc->pr, pc->pIndex, y, pError);
+      }
+      if (status) {
+        status = sph_image_reader_readRows(pc->pr, pc->ppSlotBuf[slot],
+                    (int32_t) pc->pitch, rows, pError);
+      }
+    
+    } else {
+      /* Start over from the top if the strip was already passed */
+      if (pc->pr->scan_count > y) {
+        status = sph_image_reader_resetFromPath(pc->pr, pc->pPath, pError);
+        if (status && ((pc->pr->w != pc->w) || (pc->pr->h != pc->h))) {
+          if (pError != NULL) {
+            *pError = SPH_IMAGE_ERR_READDATA;
+          }
+          status = 0;
+        }
+      }
+      
+      /* Decode forward through the skipped scanlines */
+      while (status && (pc->pr->scan_count < y)) {
+        n = y - pc->pr->scan_count;
+        if (n > pc->strip) {
+          n = pc->strip;
+        }
+        status = sph_image_reader_readRows(pc->pr, pc->ppSlotBuf[slot],
+                    (int32_t) pc->pitch, n, pError);
+      }
+      
+      /* Decode the strip */
+      if (status) {
+        status = sph_image_reader_readRows(pc->pr, pc->ppSlotBuf[slot],
+                    (int32_t) pc->pitch, rows, pError);
+      }
+    }
+    
+    /* Record the strip, or enter error mode */
+    if (status) {
+      pc->pSlotStrip[slot] = st;
+      pc->pStripSlot[st] = slot;
+      (pc->use)++;
+      pc->pSlotUse[slot] = pc->use;
+    } else {
+      pc->err_flag = 1;
+    }
+  }
+  
+  /* Return the slot if successful */
+  if (!status) {
+    slot = -1;
+  }
+  return slot;
+}
+
+/*
+ * Get the support of a resampling kernel.
+ * 
+ * This is the distance from the center beyond which the kernel is
+ * zero, in units of source pixels when enlarging.
+ * 
+ * Parameters:
+ * 
+ *   kernel - the SPH_IMAGE_KERNEL constant
+ * 
+ * Return:
+ * 
+ *   the support of the kernel
+ */
+static double sph_resampler_support(int kernel) {
+  
+  double result = 0.0;
+  
+  if (kernel == SPH_IMAGE_KERNEL_BOX) {
+    result = 0.5;
+  } else if (kernel == SPH_IMAGE_KERNEL_TRIANGLE) {
+    result = 1.0;
+  } else if (kernel == SPH_IMAGE_KERNEL_CUBIC) {
+    result = 2.0;
+  } else if (kernel == SPH_IMAGE_KERNEL_LANCZOS) {
+    result = 3.0;
+  } else {
+    abort();
+  }
+  
+  return result;
+}
+
+/*
+ * Evaluate a resampling kernel.
+ * 
+ * The cubic kernel is the Catmull-Rom spline, and the Lanczos kernel
+ * has three lobes.  The box kernel includes the left edge of its
+ * support but not the right edge, so that boxes that meet at a pixel
+ * center don't both claim it.
+ * 
+ * Parameters:
+ * 
+ *   kernel - the SPH_IMAGE_KERNEL constant
+ * 
+ *   x - the distance from the center
+ * 
+ * Return:
+ * 
+ *   the value of the kernel
+ */
+static double sph_resampler_kernel(int kernel, double x) {
+  
+  double result = 0.0;
+  double px = 0.0;
+  
+  if (kernel == SPH_IMAGE_KERNEL_BOX) {
+    if ((x >= -0.5) && (x < 0.5)) {
+      result = 1.0;
+    }
+  
+  } else if (kernel == SPH_IMAGE_KERNEL_TRIANGLE) {
+    x = fabs(x);
+    if (x < 1.0) {
+      result = 1.0 - x;
+    }
+  
+  } else if (kernel == SPH_IMAGE_KERNEL_CUBIC) {
+    x = fabs(x);
+    if (x < 1.0) {
+      result = ((1.5 * x - 2.5) * x) * x + 1.0;
+    } else if (x < 2.0) {
+      result = ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+    }
+  
+  } else if (kernel == SPH_IMAGE_KERNEL_LANCZOS) {
+    x = fabs(x);
+    if (x < 1.0e-9) {
+      result = 1.0;
+    } else if (x < 3.0) {
+      px = 3.14159265358979323846 * x;
+      result = 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+    }
+  
+  } else {
+    abort();
+  }
+  
+  return result;
+}
+
+/*
+ * Find the source pixels that a destination pixel is computed from,
+ * along one axis.
+ * 
+ * Source pixel j has its center at (j + 0.5), and destination pixel i
+ * has its center at ((i + 0.5) * srclen / dstlen) in source
+ * coordinates.  When reducing, the kernel is stretched by the reduction
+ * ratio.  The window is clipped to the source, and source pixels at
+ * either end of it that the kernel gives a zero weight are left out.
+ * 
+ * Parameters:
+ * 
+ *   kernel - the SPH_IMAGE_KERNEL constant
+ * 
+ *   srclen - the number of source pixels along the axis
+ * 
+ *   dstlen - the number of destination pixels along the axis
+ * 
+ *   i - the destination pixel
+ * 
+ *   pFirst - receives the first source pixel of the window
+ * 
+ *   pLast - receives the last source pixel of the window
+ */
+static void sph_resampler_window(
+    int       kernel,
+    int32_t   srclen,
+    int32_t   dstlen,
+    int32_t   i,
+    int32_t * pFirst,
+    int32_t * pLast) {
+  
+  double scale = 0.0;
+  double center = 0.0;
+  double radius = 0.0;
+  double fx = 0.0;
+  int32_t first = 0;
+  int32_t last = 0;
+  
+  /* Check parameters */
+  if ((srclen < 1) || (dstlen < 1) || (i < 0) || (i >= dstlen) ||
+      (pFirst == NULL) || (pLast == NULL)) {
+    abort();
+  }
+  
+  /* Get the kernel scale, the center, and the radius of the window */
+  scale = ((double) srclen) / ((double) dstlen);
+  if (scale < 1.0) {
+    scale = 1.0;
+  }
+  center = (((double) i) + 0.5) * ((double) srclen) / ((double) dstlen);
+  radius = sph_resampler_support(kernel) * scale;
+  
+  /* Get the window, clipped to the source */
+  fx = floor(center - radius - 0.5);
+  first = (fx > 0.0) ? ((int32_t) fx) : 0;
+  fx = ceil(center + radius - 0.5);
+  last = (fx < (double) (srclen - 1)) ? ((int32_t) fx) : (srclen - 1);
+  if (first > last) {
+    first = last;
+  }
+  
+  /* Leave out source pixels with zero weight at either end, but only
+   * past the support of the kernel, so that the windows never move back
+   * from one destination pixel to the next even for kernels that cross
+   * zero inside their support */
+  fx = (((double) first) + 0.5 - center) / scale;
+  while ((first < last) && (fabs(fx) >= sph_resampler_support(kernel)) &&
+          (sph_resampler_kernel(kernel, fx) == 0.0)) {
+    first++;
+    fx = (((double) first) + 0.5 - center) / scale;
+  }
+  fx = (((double) last) + 0.5 - center) / scale;
+  while ((last > first) && (fabs(fx) >= sph_resampler_support(kernel)) &&
+          (sph_resampler_kernel(kernel, fx) == 0.0)) {
+    last--;
+    fx = (((double) last) + 0.5 - center) / scale;
+  }
+  
+  *pFirst = first;
+  *pLast = last;
+}
+
+/*
+ * Compute the fixed-point filter weights of a destination pixel along
+ * one axis.
+ * 
+ * The window found by sph_resampler_window() is padded with zero
+ * weights to taps source pixels, moving its start back if needed so
+ * that it stays within the source.  The weights are normalized so that
+ * they add up to exactly SPH_RESAMPLE_ONE, which also makes up for the
+ * part of the kernel that was clipped at the edges of the source.
+ * 
+ * Parameters:
+ * 
+ *   kernel - the SPH_IMAGE_KERNEL constant
+ * 
+ *   srclen - the number of source pixels along the axis
+ * 
+ *   dstlen - the number of destination pixels along the axis
+ * 
+ *   taps - the number of weights, at least the window size and at most
+ *   srclen
+ * 
+ *   i - the destination pixel
+ * 
+ *   pWeight - receives taps weights
+ * 
+ * Return:
+ * 
+ *   the source pixel of the first weight
+ */
+static int32_t sph_resampler_weights(
+    int       kernel,
+    int32_t   srclen,
+    int32_t   dstlen,
+    int32_t   taps,
+    int32_t   i,
+    int16_t * pWeight) {
+  
+  double scale = 0.0;
+  double center = 0.0;
+  double sum = 0.0;
+  double f = 0.0;
+  int32_t first = 0;
+  int32_t last = 0;
+  int32_t start = 0;
+  int32_t t = 0;
+  int32_t best = 0;
+  int32_t isum = 0;
+  int32_t w = 0;
+  
+  /* Check parameters */
+  if ((taps < 1) || (taps > srclen) || (pWeight == NULL)) {
+    abort();
+  }
+  
+  /* Get the window and move it back if the padding doesn't fit */
+  sph_resampler_window(kernel, srclen, dstlen, i, &first, &last);
+  if (last - first + 1 > taps) {
+    abort();
+  }
+  start = first;
+  if (start > srclen - taps) {
+    start = srclen - taps;
+  }
+  
+  /* Get the kernel scale and the center */
+  scale = ((double) srclen) / ((double) dstlen);
+  if (scale < 1.0) {
+    scale = 1.0;
+  }
+  center = (((double) i) + 0.5) * ((double) srclen) / ((double) dstlen);
+  
+  /* Add up the kernel over the window */
+  for(t = 0; t < taps; t++) {
+    sum += sph_resampler_kernel(kernel,
+              (((double) (start + t)) + 0.5 - center) / scale);
+  }
+  
+  /* Compute the normalized weights, and give the rounding error to the
+   * largest weight; if the kernel adds up to nothing, which doesn't
+   * happen with the kernels here, just take the first source pixel of
+   * the window */
+  memset(pWeight, 0, ((size_t) taps) * sizeof(int16_t));
+  if (sum > 0.0) {
+    for(t = 0; t < taps; t++) {
+      f = sph_resampler_kernel(kernel,
+              (((double) (start + t)) + 0.5 - center) / scale);
+      w = (int32_t) floor(f / sum * ((double) SPH_RESAMPLE_ONE) + 0.5);
+      pWeight[t] = (int16_t) w;
+      isum += w;
+      if (w > pWeight[best]) {
+        best = t;
+      }
+    }
+    pWeight[best] = (int16_t) (pWeight[best] + (SPH_RESAMPLE_ONE - isum));
+  } else {
+    pWeight[first - start] = (int16_t) SPH_RESAMPLE_ONE;
+  }
+  
+  return start;
+}
+
+/*
+ * Add a source scanline to a resampler.
+ * 
+ * The scanline is converted to premultiplied fixed-point channel
+ * values, in linear light if requested, filtered horizontally with the
+ * precomputed weights, and stored in the ring.  The filter loops run
+ * over contiguous 16-bit values with 32-bit sums, which compilers turn
+ * into vector code.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ *   pRow - the source scanline of sw pixels
+ */
+static void sph_resampler_push(
+          SPH_IMAGE_RESAMPLER * ps,
+    const uint32_t            * pRow) {
+  
+  int32_t x = 0;
+  int32_t t = 0;
+  int32_t w = 0;
+  int32_t v = 0;
+  int c = 0;
+  uint32_t a = 0;
+  uint32_t pix = 0;
+  int32_t acc[4];
+  const uint16_t *pLin = NULL;
+  const int16_t *pw = NULL;
+  const int16_t *pv = NULL;
+  int16_t *pc = NULL;
+  int16_t *pOut = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pRow == NULL)) {
+    abort();
+  }
+  if (ps->in_count >= ps->ystart + ps->ytaps) {
+    abort();
+  }
+  
+  /* Convert the scanline to premultiplied fixed-point values */
+  pLin = ps->pToLin;
+  pc = ps->pConv;
+  for(x = 0; x < ps->sw; x++) {
+    pix = pRow[x];
+    a = pix >> 24;
+    pc[0] = (int16_t) (a * (SPH_RESAMPLE_MAX / 255));
+    pc[1] = (int16_t) ((((uint32_t) pLin[(pix >> 16) & 0xff]) * a + 127)
+                        / 255);
+    pc[2] = (int16_t) ((((uint32_t) pLin[(pix >>  8) & 0xff]) * a + 127)
+                        / 255);
+    pc[3] = (int16_t) ((((uint32_t) pLin[ pix        & 0xff]) * a + 127)
+                        / 255);
+    pc += 4;
+  }
+  
+  /* Filter horizontally into the ring slot of this scanline; the sums
+   * start out with the bias and half of the rounding unit, and are
+   * clamped to the 16-bit range after shifting */
+  pOut = ps->pRing +
+          ((size_t) (ps->in_count % ps->ytaps)) * ps->ring_pitch;
+  pw = ps->pXWeight;
+  for(x = 0; x < ps->dw; x++) {
+    for(c = 0; c < 4; c++) {
+      acc[c] = SPH_RESAMPLE_BIAS + (SPH_RESAMPLE_ONE / 2);
+    }
+    pv = ps->pConv + ((size_t) ps->pXStart[x]) * 4;
+    for(t = 0; t < ps->xtaps; t++) {
+      w = pw[t];
+      acc[0] += w * pv[0];
+      acc[1] += w * pv[1];
+      acc[2] += w * pv[2];
+      acc[3] += w * pv[3];
+      pv += 4;
+    }
+    for(c = 0; c < 4; c++) {
+      v = (acc[c] >> SPH_RESAMPLE_BITS) -
+            (SPH_RESAMPLE_BIAS >> SPH_RESAMPLE_BITS);
+      if (v < INT16_MIN) {
+        v = INT16_MIN;
+      } else if (v > INT16_MAX) {
+        v = INT16_MAX;
+      }
+      pOut[c] = (int16_t) v;
+    }
+    pw += ps->xtaps;
+    pOut += 4;
+  }
+  
+  (ps->in_count)++;
+}
+
+/*
+ * Get the last input scanline of an output scanline of a resampling
+ * pipeline stage.
+ * 
+ * This is the lastFn callback of the stages that
+ * sph_image_pipeline_addResampler() adds.  Since it is called in order,
+ * right before the scanline is produced, the vertical filter of the
+ * resampler already belongs to output scanline y.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the resampler object
+ * 
+ *   y - the output scanline
+ * 
+ * Return:
+ * 
+ *   the last input scanline of the window
+ */
+static int32_t sph_pipeline_resampleLast(void *pParam, int32_t y) {
+  
+  SPH_IMAGE_RESAMPLER *ps = NULL;
+  
+  /* Check parameters */
+  ps = (SPH_IMAGE_RESAMPLER *) pParam;
+  if (ps == NULL) {
+    abort();
+  }
+  if (y != ps->out_count) {
+    abort();
+  }
+  
+  return ps->ystart + ps->ytaps - 1;
+}
+
+/*
+ * Produce an output scanline of a resampling pipeline stage.
+ * 
+ * This is the rowFn callback of the stages that
+ * sph_image_pipeline_addResampler() adds.  The input scanlines of the
+ * window that the resampler hasn't seen yet are pushed straight from
+ * the ring, and then the output scanline is produced.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the resampler object
+ * 
+ *   y - the output scanline
+ * 
+ *   first - the first input scanline of the window
+ * 
+ *   ppIn - the input scanlines of the window
+ * 
+ *   pOut - the output scanline
+ * 
+ * Return:
+ * 
+ *   non-zero
+ */
+static int sph_pipeline_resampleRow(
+          void            * pParam,
+          int32_t           y,
+          int32_t           first,
+    const uint32_t *const * ppIn,
+          uint32_t        * pOut) {
+  
+  int32_t i = 0;
+  SPH_IMAGE_RESAMPLER *ps = NULL;
+  
+  /* Check parameters */
+  ps = (SPH_IMAGE_RESAMPLER *) pParam;
+  if ((ps == NULL) || (ppIn == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if (y != ps->out_count) {
+    abort();
+  }
+  
+  /* Push the new input scanlines, which are always in the window since
+   * filter windows don't leave gaps */
+  while (sph_image_resampler_needs(ps)) {
+    i = ps->in_count - first;
+    if ((i < 0) || (i >= ps->ytaps) || (ppIn[i] == NULL)) {
+      abort();
+    }
+    sph_resampler_push(ps, ppIn[i]);
+  }
+  
+  sph_image_resampler_row(ps, pOut);
+  return 1;
+}
+
+/*
+ * Add a stage to the end of a pipeline.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   pStage - the stage definition, which is copied
+ * 
+ *   ps - the resampler owned by the stage, or NULL
+ * 
+ *   pc - the convolution owned by the stage, or NULL
+ */
+static void sph_pipeline_add(
+          SPH_IMAGE_PIPELINE  * pp,
+    const SPH_IMAGE_STAGE     * pStage,
+          SPH_IMAGE_RESAMPLER * ps,
+          SPH_CONVOLVE        * pc) {
+  
+  int32_t ncap = 0;
+  SPH_PIPE_STAGE *pNew = NULL;
+  SPH_PIPE_STAGE *pst = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pStage == NULL)) {
+    abort();
+  }
+  if (pp->ran) {
+    abort();
+  }
+  if ((pStage->w < 1) || (pStage->w > SPH_IMAGE_MAXDIM) ||
+      (pStage->h < 1) || (pStage->h > SPH_IMAGE_MAXDIM) ||
+      (pStage->window < 1) || (pStage->window > SPH_IMAGE_MAXDIM) ||
+      (pStage->rowFn == NULL)) {
+    abort();
+  }
+  if ((pStage->lastFn == NULL) && (pStage->h != pp->h)) {
+    abort();
+  }
+  
+  /* Grow the stage array if needed */
+  if (pp->count >= pp->cap) {
+    ncap = (pp->cap > 0) ? (pp->cap * 2) : 4;
+    pNew = (SPH_PIPE_STAGE *) sph_mem_alloc(
+              &(pp->alloc), ((size_t) ncap) * sizeof(SPH_PIPE_STAGE));
+    if (pNew == NULL) {
+      abort();
+    }
+    memset(pNew, 0, ((size_t) ncap) * sizeof(SPH_PIPE_STAGE));
+    if (pp->count > 0) {
+      memcpy(pNew, pp->pStages,
+              ((size_t) pp->count) * sizeof(SPH_PIPE_STAGE));
+    }
+    sph_mem_free(&(pp->alloc), pp->pStages);
+    pp->pStages = pNew;
+    pp->cap = ncap;
+  }
+  
+  /* Fill in the new stage, whose input is the current output */
+  pst = &((pp->pStages)[pp->count]);
+  memset(pst, 0, sizeof(SPH_PIPE_STAGE));
+  pst->pp = pp;
+  pst->index = pp->count;
+  memcpy(&(pst->def), pStage, sizeof(SPH_IMAGE_STAGE));
+  pst->in_w = pp->w;
+  pst->in_h = pp->h;
+  pst->ps = ps;
+  pst->pc = pc;
+  pst->last = -1;
+  pst->ppIn = (const uint32_t **) sph_mem_alloc(
+                  &(pp->alloc),
+                  ((size_t) pStage->window) * sizeof(const uint32_t *));
+  if (pst->ppIn == NULL) {
+    abort();
+  }
+  
+  (pp->count)++;
+  pp->w = pStage->w;
+  pp->h = pStage->h;
+}
+
+/*
+ * Get the slot of a scanline in a pipeline ring.
+ * 
+ * Parameters:
+ * 
+ *   pl - the ring
+ * 
+ *   y - the scanline
+ * 
+ * Return:
+ * 
+ *   the slot buffer
+ */
+static uint32_t *sph_pipeline_slot(SPH_PIPE_LINK *pl, int32_t y) {
+  
+  /* Check parameters */
+  if ((pl == NULL) || (y < 0)) {
+    abort();
+  }
+  
+  return pl->pBuf + ((size_t) (y % pl->cap)) * pl->pitch;
+}
+
+/*
+ * Stop a pipeline because of an error.
+ * 
+ * Only the first error is recorded.  All threads waiting on the
+ * pipeline are woken up so that they can stop.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   code - the error code
+ */
+static void sph_pipeline_fail(SPH_IMAGE_PIPELINE *pp, int code) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  
+  pthread_mutex_lock(&(pp->lock));
+  if (!(pp->stop)) {
+    pp->stop = 1;
+    pp->err_code = code;
+  }
+  pthread_cond_broadcast(&(pp->cond));
+  pthread_mutex_unlock(&(pp->lock));
+}
+
+/*
+ * Get the input window of the next output scanline of a pipeline stage.
+ * 
+ * The lastFn callback of the stage is called, or the default centered
+ * window is used, and the result is checked.
+ * 
+ * Parameters:
+ * 
+ *   pst - the stage
+ * 
+ *   y - the output scanline, which must be the next one
+ * 
+ *   pFirst - receives the first input scanline of the window
+ * 
+ *   pLast - receives the last input scanline of the window
+ */
+static void sph_pipeline_window(
+    SPH_PIPE_STAGE * pst,
+    int32_t          y,
+    int32_t        * pFirst,
+    int32_t        * pLast) {
+  
+  int32_t last = 0;
+  
+  /* Check parameters */
+  if ((pst == NULL) || (pFirst == NULL) || (pLast == NULL)) {
+    abort();
+  }
+  
+  /* Get the end of the window */
+  if (pst->def.lastFn != NULL) {
+    last = pst->def.lastFn(pst->def.pParam, y);
+  } else {
+    last = y + (pst->def.window / 2);
+  }
+  
+  /* Check that the window overlaps the input and doesn't move back */
+  if ((last < 0) || (last < pst->last) ||
+      (last - pst->def.window + 1 >= pst->in_h)) {
+    abort();
+  }
+  pst->last = last;
+  
+  *pFirst = last - pst->def.window + 1;
+  *pLast = last;
+}
+
+/*
+ * Call the row function of a pipeline stage.
+ * 
+ * The window pointers are set up from the ring in front of the stage,
+ * which must hold all scanlines of the window that are in the input.
+ * If the row function fails, the pipeline is stopped.
+ * 
+ * Parameters:
+ * 
+ *   pst - the stage
+ * 
+ *   y - the output scanline
+ * 
+ *   first - the first input scanline of the window
+ * 
+ *   pOut - the output scanline
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the stage failed
+ */
+static int sph_pipeline_apply(
+    SPH_PIPE_STAGE * pst,
+    int32_t          y,
+    int32_t          first,
+    uint32_t       * pOut) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t r = 0;
+  SPH_PIPE_LINK *pl = NULL;
+  
+  /* Check parameters */
+  if ((pst == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  pl = &((pst->pp->pLinks)[pst->index]);
+  
+  /* Point at the scanlines of the window */
+  for(i = 0; i < pst->def.window; i++) {
+    r = first + i;
+    if ((r >= 0) && (r < pst->in_h)) {
+      pst->ppIn[i] = sph_pipeline_slot(pl, r);
+    } else {
+      pst->ppIn[i] = NULL;
+    }
+  }
+  
+  /* Produce the output scanline */
+  if (!(pst->def.rowFn(pst->def.pParam, y, first,
+                        (const uint32_t *const *) pst->ppIn, pOut))) {
+    sph_pipeline_fail(pst->pp, SPH_IMAGE_ERR_STAGE);
+    status = 0;
+  }
+  
+  return status;
+}
+
+/*
+ * Produce an output scanline of a pipeline stage on the calling thread.
+ * 
+ * Input scanlines up to the end of the window are produced first, by
+ * reading them or by pulling them from the previous stage in turn.
+ * Each is produced straight into its slot in the ring in front of the
+ * stage, which has room for exactly one window.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   s - the stage
+ * 
+ *   y - the output scanline, which must be the next one
+ * 
+ *   pOut - the output scanline
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sph_pipeline_pull(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              s,
+    int32_t              y,
+    uint32_t           * pOut) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t first = 0;
+  int32_t last = 0;
+  SPH_PIPE_STAGE *pst = NULL;
+  SPH_PIPE_LINK *pl = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((s < 0) || (s >= pp->count)) {
+    abort();
+  }
+  pst = &((pp->pStages)[s]);
+  pl = &((pp->pLinks)[s]);
+  
+  /* Get the window */
+  sph_pipeline_window(pst, y, &first, &last);
+  if (last >= pl->h) {
+    last = pl->h - 1;
+  }
+  
+  /* Produce the input scanlines up to the end of the window */
+  while (status && (pl->produced <= last)) {
+    if (s == 0) {
+      status = sph_image_reader_readInto(
+                  pp->pr, sph_pipeline_slot(pl, pl->produced), &err);
+      if (!status) {
+        sph_pipeline_fail(pp, err);
+      }
+    } else {
+      status = sph_pipeline_pull(
+                  pp, s - 1, pl->produced,
+                  sph_pipeline_slot(pl, pl->produced));
+    }
+    if (status) {
+      (pl->produced)++;
+    }
+  }
+  
+  /* Produce the output scanline */
+  if (status) {
+    status = sph_pipeline_apply(pst, y, first, pOut);
+  }
+  
+  return status;
+}
+
+/*
+ * Source thread of a threaded pipeline.
+ * 
+ * The reader decodes scanlines in order into the ring in front of the
+ * first stage, waiting whenever the ring is full.  The thread stops
+ * early if the pipeline fails or the first stage is done.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the pipeline object
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *sph_pipeline_source(void *pArg) {
+  
+  int quit = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t y = 0;
+  SPH_IMAGE_PIPELINE *pp = NULL;
+  SPH_PIPE_LINK *pl = NULL;
+  
+  /* Get the pipeline */
+  pp = (SPH_IMAGE_PIPELINE *) pArg;
+  if (pp == NULL) {
+    abort();
+  }
+  pl = &((pp->pLinks)[0]);
+  
+  for(y = 0; y < pl->h; y++) {
+    
+    /* Wait for room in the ring */
+    pthread_mutex_lock(&(pp->lock));
+    while ((!(pp->stop)) && (!(pl->done)) &&
+            (y >= pl->released + pl->cap)) {
+      pthread_cond_wait(&(pp->cond), &(pp->lock));
+    }
+    quit = (pp->stop || pl->done);
+    pthread_mutex_unlock(&(pp->lock));
+    if (quit) {
+      break;
+    }
+    
+    /* Read the scanline into its slot */
+    if (!sph_image_reader_readInto(
+            pp->pr, sph_pipeline_slot(pl, y), &err)) {
+      sph_pipeline_fail(pp, err);
+      break;
+    }
+    
+    /* Publish it */
+    pthread_mutex_lock(&(pp->lock));
+    pl->produced = y + 1;
+    pthread_cond_broadcast(&(pp->cond));
+    pthread_mutex_unlock(&(pp->lock));
+  }
+  
+  return NULL;
+}
+
+/*
+ * Run a stage of a threaded pipeline until all its output is produced.
+ * 
+ * For each output scanline, the stage releases the input scanlines
+ * before its window, waits until the window is in the ring in front of
+ * it, and waits for room in the ring behind it.  The last stage writes
+ * into the writer instead, so it doesn't wait for room.  When the stage
+ * is done, or stops because of an error, the part in front of it is
+ * told to stop as well.
+ * 
+ * Parameters:
+ * 
+ *   pst - the stage
+ * 
+ *   pw - the writer for the last stage, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sph_pipeline_stage(SPH_PIPE_STAGE *pst, SPH_IMAGE_WRITER *pw) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t y = 0;
+  int32_t first = 0;
+  int32_t last = 0;
+  uint32_t *pOut = NULL;
+  SPH_IMAGE_PIPELINE *pp = NULL;
+  SPH_PIPE_LINK *pIn = NULL;
+  SPH_PIPE_LINK *pNext = NULL;
+  
+  /* Check parameters */
+  if (pst == NULL) {
+    abort();
+  }
+  pp = pst->pp;
+  pIn = &((pp->pLinks)[pst->index]);
+  if (pst->index + 1 < pp->count) {
+    pNext = &((pp->pLinks)[pst->index + 1]);
+  } else if (pw == NULL) {
+    abort();
+  }
+  
+  for(y = 0; status && (y < pst->def.h); y++) {
+    
+    /* Get the window */
+    sph_pipeline_window(pst, y, &first, &last);
+    if (last >= pIn->h) {
+      last = pIn->h - 1;
+    }
+    
+    /* Release the input scanlines before the window, then wait for the
+     * window and for room behind the stage */
+    pthread_mutex_lock(&(pp->lock));
+    if (first > pIn->released) {
+      pIn->released = first;
+      pthread_cond_broadcast(&(pp->cond));
+    }
+    while ((!(pp->stop)) && (pIn->produced <= last)) {
+      pthread_cond_wait(&(pp->cond), &(pp->lock));
+    }
+    if (pNext != NULL) {
+      while ((!(pp->stop)) && (!(pNext->done)) &&
+              (y >= pNext->released + pNext->cap)) {
+        pthread_cond_wait(&(pp->cond), &(pp->lock));
+      }
+      if (pNext->done) {
+        status = 0;
+      }
+    }
+    if (pp->stop) {
+      status = 0;
+    }
+    pthread_mutex_unlock(&(pp->lock));
+    if (!status) {
+      break;
+    }
+    
+    /* Produce the output scanline */
+    if (pNext != NULL) {
+      pOut = sph_pipeline_slot(pNext, y);
+    } else {
+      pOut = sph_image_writer_ptr(pw);
+    }
+    status = sph_pipeline_apply(pst, y, first, pOut);
+    
+    /* Publish it, or write it */
+    if (status && (pNext != NULL)) {
+      pthread_mutex_lock(&(pp->lock));
+      pNext->produced = y + 1;
+      pthread_cond_broadcast(&(pp->cond));
+      pthread_mutex_unlock(&(pp->lock));
+    
+    } else if (status) {
+      status = sph_image_writer_writeEx(pw, &err);
+      if (!status) {
+        sph_pipeline_fail(pp, err);
+      }
+    }
+  }
+  
+  /* Let the part in front of the stage stop */
+  pthread_mutex_lock(&(pp->lock));
+  pIn->done = 1;
+  pthread_cond_broadcast(&(pp->cond));
+  pthread_mutex_unlock(&(pp->lock));
+  
+  /* A stage that stopped because the next one was done hasn't failed */
+  if ((!status) && (!(pp->stop))) {
+    status = 1;
+  }
+  
+  return status;
+}
+
+/*
+ * Worker thread running a stage of a threaded pipeline other than the
+ * last.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the SPH_PIPE_STAGE structure
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *sph_pipeline_worker(void *pArg) {
+  
+  /* Check parameter */
+  if (pArg == NULL) {
+    abort();
+  }
+  
+  sph_pipeline_stage((SPH_PIPE_STAGE *) pArg, NULL);
+  return NULL;
+}
+
+/*
+ * Convert kernel weights to fixed point.
+ * 
+ * Each weight is rounded, and the rounding error of the total is given
+ * to the weight of largest magnitude, so that kernels adding up to one
+ * add up to exactly SPH_CONVOLVE_ONE and don't shift the brightness.
+ * A fault occurs if any weight is not a number or has a magnitude above
+ * SPH_IMAGE_CONVOLVE_MAXGAIN.
+ * 
+ * Parameters:
+ * 
+ *   pSrc - the n weights
+ * 
+ *   n - the number of weights
+ * 
+ *   pDst - receives the n fixed-point weights
+ * 
+ * Return:
+ * 
+ *   the sum of the magnitudes of the fixed-point weights
+ */
+static int32_t sph_convolve_weights(
+    const double  * pSrc,
+          int32_t   n,
+          int32_t * pDst) {
+  
+  double sum = 0.0;
+  int32_t i = 0;
+  int32_t best = 0;
+  int32_t isum = 0;
+  int32_t gain = 0;
+  
+  /* Check parameters */
+  if ((pSrc == NULL) || (n < 1) || (pDst == NULL)) {
+    abort();
+  }
+  for(i = 0; i < n; i++) {
+    if (!(fabs(pSrc[i]) <= (double) SPH_IMAGE_CONVOLVE_MAXGAIN)) {
+      abort();
+    }
+    sum += pSrc[i];
+  }
+  
+  /* Round the weights and fix up the total */
+  for(i = 0; i < n; i++) {
+    pDst[i] = (int32_t) floor(pSrc[i] * ((double) SPH_CONVOLVE_ONE) + 0.5);
+    isum += pDst[i];
+    if (abs(pDst[i]) > abs(pDst[best])) {
+      best = i;
+    }
+  }
+  pDst[best] += (int32_t) floor(sum * ((double) SPH_CONVOLVE_ONE) + 0.5)
+                  - isum;
+  
+  /* Add up the magnitudes */
+  for(i = 0; i < n; i++) {
+    gain += abs(pDst[i]);
+  }
+  
+  return gain;
+}
+
+/*
+ * Convert a scanline for a convolution.
+ * 
+ * The scanline is converted to fixed-point channel values, premultiplied
+ * unless the convolution filters straight color, and padded with
+ * (kw / 2) copies of the edge pixels on each side.
+ * 
+ * Parameters:
+ * 
+ *   pc - the convolution
+ * 
+ *   pRow - the scanline of w pixels
+ * 
+ *   pDst - receives (w + kw - 1) pixels of four values each
+ */
+static void sph_convolve_load(
+          SPH_CONVOLVE * pc,
+    const uint32_t     * pRow,
+          int32_t      * pDst) {
+  
+  int32_t x = 0;
+  int32_t r = 0;
+  int c = 0;
+  uint32_t a = 0;
+  uint32_t pix = 0;
+  int32_t *pd = NULL;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (pRow == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  
+  /* Convert the scanline after the left padding */
+  r = pc->kw / 2;
+  pd = pDst + ((size_t) r) * 4;
+  for(x = 0; x < pc->w; x++) {
+    pix = pRow[x];
+    a = pix >> 24;
+    pd[0] = (int32_t) (a * (SPH_CONVOLVE_MAX / 255));
+    if (pc->straight) {
+      pd[1] = (int32_t) (((pix >> 16) & 0xff) * (SPH_CONVOLVE_MAX / 255));
+      pd[2] = (int32_t) (((pix >>  8) & 0xff) * (SPH_CONVOLVE_MAX / 255));
+      pd[3] = (int32_t) (( pix        & 0xff) * (SPH_CONVOLVE_MAX / 255));
+    } else {
+      pd[1] = (int32_t) ((((pix >> 16) & 0xff) * a *
+                  (SPH_CONVOLVE_MAX / 255) + 127) / 255);
+      pd[2] = (int32_t) ((((pix >>  8) & 0xff) * a *
+                  (SPH_CONVOLVE_MAX / 255) + 127) / 255);
+      pd[3] = (int32_t) ((( pix        & 0xff) * a *
+                  (SPH_CONVOLVE_MAX / 255) + 127) / 255);
+    }
+    pd += 4;
+  }
+  
+  /* Repeat the edge pixels into the padding */
+  for(x = 0; x < r; x++) {
+    for(c = 0; c < 4; c++) {
+      pDst[((size_t) x) * 4 + c] = pDst[((size_t) r) * 4 + c];
+      pd[((size_t) x) * 4 + c] = pd[c - 4];
+    }
+  }
+}
+
+/*
+ * Produce an output scanline of a convolution pipeline stage.
+ * 
+ * This is the rowFn callback of the stages that
+ * sph_image_pipeline_addConvolution() and
+ * sph_image_pipeline_addSeparable() add.  The input scanlines of the
+ * window that aren't in the ring yet are converted into it, filtering
+ * them horizontally first for separable kernels.  Scanlines of the
+ * window above or below the input are replaced by the nearest edge
+ * scanline.  The filter loops run over contiguous 32-bit values, which
+ * compilers turn into vector code.
+ * 
+ * Parameters:
+ * 
+ *   pParam - the convolution
+ * 
+ *   y - the output scanline
+ * 
+ *   first - the first input scanline of the window
+ * 
+ *   ppIn - the input scanlines of the window
+ * 
+ *   pOut - the output scanline
+ * 
+ * Return:
+ * 
+ *   non-zero
+ */
+static int sph_convolve_row(
+          void            * pParam,
+          int32_t           y,
+          int32_t           first,
+    const uint32_t *const * ppIn,
+          uint32_t        * pOut) {
+  
+  int32_t x = 0;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t r = 0;
+  int32_t w = 0;
+  int32_t a = 0;
+  int32_t v = 0;
+  int c = 0;
+  size_t k = 0;
+  size_t n = 0;
+  uint32_t pix = 0;
+  SPH_CONVOLVE *pc = NULL;
+  const uint32_t *pCenter = NULL;
+  const int32_t *pr = NULL;
+  int32_t *pd = NULL;
+  int32_t *pa = NULL;
+  
+  /* Check parameters */
+  pc = (SPH_CONVOLVE *) pParam;
+  if ((pc == NULL) || (ppIn == NULL) || (pOut == NULL)) {
+    abort();
+  }
+  if ((y < 0) || (y >= pc->h) || (first != y - (pc->kh / 2))) {
+    abort();
+  }
+  
+  /* Convert the new scanlines of the window into their ring slots */
+  n = ((size_t) pc->w) * 4;
+  for(j = 0; j < pc->kh; j++) {
+    r = first + j;
+    if ((r < pc->next) || (r >= pc->h)) {
+      continue;
+    }
+    if (ppIn[j] == NULL) {
+      abort();
+    }
+    pd = pc->pRing + ((size_t) (r % pc->kh)) * pc->ring_pitch;
+    if (pc->separable) {
+      /* Filter horizontally; the sums start out with the bias and half
+       * of the rounding unit so that only positive values are
+       * shifted */
+      sph_convolve_load(pc, ppIn[j], pc->pPad);
+      for(k = 0; k < n; k++) {
+        pd[k] = SPH_RESAMPLE_BIAS + (SPH_CONVOLVE_ONE / 2);
+      }
+      for(i = 0; i < pc->kw; i++) {
+        w = (pc->pKernel)[i];
+        if (w != 0) {
+          pr = pc->pPad + ((size_t) i) * 4;
+          for(k = 0; k < n; k++) {
+            pd[k] += w * pr[k];
+          }
+        }
+      }
+      for(k = 0; k < n; k++) {
+        pd[k] = (pd[k] >> SPH_CONVOLVE_BITS) -
+                  (SPH_RESAMPLE_BIAS >> SPH_CONVOLVE_BITS);
+      }
+    } else {
+      sph_convolve_load(pc, ppIn[j], pd);
+    }
+    pc->next = r + 1;
+  }
+  
+  /* Filter the window one scanline and one kernel weight at a time, so
+   * that the inner loop runs over whole contiguous scanlines */
+  pa = pc->pAcc;
+  for(k = 0; k < n; k++) {
+    pa[k] = SPH_RESAMPLE_BIAS + (SPH_CONVOLVE_ONE / 2);
+  }
+  for(j = 0; j < pc->kh; j++) {
+    r = first + j;
+    if (r < 0) {
+      r = 0;
+    } else if (r >= pc->h) {
+      r = pc->h - 1;
+    }
+    pr = pc->pRing + ((size_t) (r % pc->kh)) * pc->ring_pitch;
+    if (pc->separable) {
+      w = (pc->pKernel)[pc->kw + j];
+      if (w != 0) {
+        for(k = 0; k < n; k++) {
+          pa[k] += w * pr[k];
+        }
+      }
+    } else {
+      for(i = 0; i < pc->kw; i++) {
+        w = (pc->pKernel)[j * pc->kw + i];
+        if (w != 0) {
+          for(k = 0; k < n; k++) {
+            pa[k] += w * pr[((size_t) i) * 4 + k];
+          }
+        }
+      }
+    }
+  }
+  
+  /* Round each value, undo the premultiplication, add the bias, clamp,
+   * and pack; straight color keeps the alpha of the input */
+  pCenter = ppIn[y - first];
+  if (pCenter == NULL) {
+    abort();
+  }
+  for(x = 0; x < pc->w; x++) {
+    for(c = 0; c < 4; c++) {
+      pa[c] = (pa[c] >> SPH_CONVOLVE_BITS) -
+                (SPH_RESAMPLE_BIAS >> SPH_CONVOLVE_BITS);
+    }
+    
+    if (pc->straight) {
+      a = (int32_t) ((pCenter[x] >> 24) * (SPH_CONVOLVE_MAX / 255));
+    } else {
+      a = pa[0];
+      if (a > SPH_CONVOLVE_MAX) {
+        a = SPH_CONVOLVE_MAX;
+      }
+    }
+    if (a > 0) {
+      pix = ((uint32_t) ((a + (SPH_CONVOLVE_MAX / 510)) /
+                          (SPH_CONVOLVE_MAX / 255))) << 24;
+      for(c = 1; c < 4; c++) {
+        v = pa[c];
+        if (!(pc->straight)) {
+          if (v > a) {
+            v = a;
+          }
+          v = (v * SPH_CONVOLVE_MAX + (a / 2)) / a;
+        }
+        v += pc->bias * (SPH_CONVOLVE_MAX / 255);
+        if (v < 0) {
+          v = 0;
+        } else if (v > SPH_CONVOLVE_MAX) {
+          v = SPH_CONVOLVE_MAX;
+        }
+        v = (v + (SPH_CONVOLVE_MAX / 510)) / (SPH_CONVOLVE_MAX / 255);
+        pix |= ((uint32_t) v) << (8 * (3 - c));
+      }
+    } else {
+      pix = 0;
+    }
+    pOut[x] = pix;
+    pa += 4;
+  }
+  
+  return 1;
+}
+
+/*
+ * Add a convolution stage to the end of a pipeline.
+ * 
+ * The state of the stage is allocated, except for the weights, which
+ * the caller fills in afterwards.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   kw - the kernel width
+ * 
+ *   kh - the kernel height
+ * 
+ *   separable - non-zero if the kernel is separable
+ * 
+ *   bias - the value added to each color channel of the result
+ * 
+ *   flags - the convolution flags
+ * 
+ * Return:
+ * 
+ *   the state of the new stage, with room for kw * kh weights, or for
+ *   kw + kh if separable
+ */
+static SPH_CONVOLVE *sph_pipeline_convolve(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              kw,
+    int32_t              kh,
+    int                  separable,
+    int32_t              bias,
+    int                  flags) {
+  
+  size_t count = 0;
+  SPH_IMAGE_STAGE st;
+  SPH_CONVOLVE *pc = NULL;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(SPH_IMAGE_STAGE));
+  
+  /* Check parameters */
+  if (pp == NULL) {
+    abort();
+  }
+  if (pp->ran) {
+    abort();
+  }
+  if ((kw < 1) || (kw > SPH_IMAGE_CONVOLVE_MAXTAPS) || (kw % 2 == 0) ||
+      (kh < 1) || (kh > SPH_IMAGE_CONVOLVE_MAXTAPS) || (kh % 2 == 0) ||
+      (bias < -255) || (bias > 255)) {
+    abort();
+  }
+  
+  /* Allocate the state */
+  pc = (SPH_CONVOLVE *) sph_mem_alloc(&(pp->alloc), sizeof(SPH_CONVOLVE));
+  if (pc == NULL) {
+    abort();
+  }
+  memset(pc, 0, sizeof(SPH_CONVOLVE));
+  
+  pc->w = pp->w;
+  pc->h = pp->h;
+  pc->kw = kw;
+  pc->kh = kh;
+  pc->separable = separable ? 1 : 0;
+  pc->straight = (flags & SPH_IMAGE_CONVOLVE_STRAIGHT) ? 1 : 0;
+  pc->bias = bias;
+  pc->next = 0;
+  
+  count = separable ? ((size_t) (kw + kh)) : (((size_t) kw) * kh);
+  pc->pKernel = (int32_t *) sph_mem_alloc(
+                  &(pp->alloc), count * sizeof(int32_t));
+  if (pc->pKernel == NULL) {
+    abort();
+  }
+  memset(pc->pKernel, 0, count * sizeof(int32_t));
+  
+  if (separable) {
+    pc->ring_pitch = sph_row_pitch(pc->w);
+    pc->pPad = (int32_t *) sph_mem_allocAligned(
+                  &(pp->alloc),
+                  sph_row_pitch(pc->w + kw - 1) * 4 * sizeof(int32_t));
+    if (pc->pPad == NULL) {
+      abort();
+    }
+  } else {
+    pc->ring_pitch = sph_row_pitch(pc->w + kw - 1);
+  }
+  pc->ring_pitch *= 4;
+  pc->pRing = (int32_t *) sph_mem_allocAligned(
+                &(pp->alloc),
+                ((size_t) kh) * pc->ring_pitch * sizeof(int32_t));
+  pc->pAcc = (int32_t *) sph_mem_allocAligned(
+                &(pp->alloc),
+                sph_row_pitch(pc->w) * 4 * sizeof(int32_t));
+  if ((pc->pRing == NULL) || (pc->pAcc == NULL)) {
+    abort();
+  }
+  
+  /* Wrap the state in a stage with the default centered window */
+  st.w = pc->w;
+  st.h = pc->h;
+  st.window = kh;
+  st.lastFn = NULL;
+  st.rowFn = &sph_convolve_row;
+  st.pParam = pc;
+  
+  sph_pipeline_add(pp, &st, NULL, pc);
+  return pc;
+}
+
+/*
+ * Get the number of scanlines in a band of an image mosaic.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   r - the row of tiles of the band
+ * 
+ *   y - the first scanline of the band within the row of tiles
+ * 
+ * Return:
+ * 
+ *   the number of scanlines in the band
+ */
+static int32_t sph_mosaic_band(SPH_IMAGE_MOSAIC *pm, int32_t r, int32_t y) {
+  
+  int32_t n = 0;
+  
+  /* Check parameters */
+  if (pm == NULL) {
+    abort();
+  }
+  if ((r < 0) || (r >= pm->rows) || (y < 0) || (y >= (pm->pRowH)[r])) {
+    abort();
+  }
+  
+  n = (pm->pRowH)[r] - y;
+  if (n > SPH_MOSAIC_BAND) {
+    n = SPH_MOSAIC_BAND;
+  }
+  
+  return n;
+}
+
+/*
+ * Move on to the next band of an image mosaic.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   pRow - the row of tiles of the current band, which is updated
+ * 
+ *   pY - the first scanline of the current band within the row of
+ *   tiles, which is updated
+ * 
+ *   n - the number of scanlines in the current band
+ */
+static void sph_mosaic_next(
+    SPH_IMAGE_MOSAIC * pm,
+    int32_t          * pRow,
+    int32_t          * pY,
+    int32_t            n) {
+  
+  /* Check parameters */
+  if ((pm == NULL) || (pRow == NULL) || (pY == NULL)) {
+    abort();
+  }
+  
+  *pY = *pY + n;
+  if (*pY >= (pm->pRowH)[*pRow]) {
+    *pY = 0;
+    *pRow = *pRow + 1;
+  }
+}
+
+/*
+ * Get the buffer of a band of an image mosaic.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   k - the index of the band
+ * 
+ * Return:
+ * 
+ *   the first scanline of the band buffer
+ */
+static uint32_t *sph_mosaic_slot(SPH_IMAGE_MOSAIC *pm, int32_t k) {
+  
+  /* Check parameters */
+  if ((pm == NULL) || (k < 0)) {
+    abort();
+  }
+  
+  return pm->pBuf + ((size_t) (k % 2)) * SPH_MOSAIC_BAND * pm->pitch;
+}
+
+/*
+ * Stop an image mosaic because of an error.
+ * 
+ * Only the first error is recorded.  All threads waiting on the mosaic
+ * are woken up so that they can stop.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   code - the error code
+ */
+static void sph_mosaic_fail(SPH_IMAGE_MOSAIC *pm, int code) {
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  pthread_mutex_lock(&(pm->lock));
+  if (!(pm->stop)) {
+    pm->stop = 1;
+    pm->err_code = code;
+  }
+  pthread_cond_broadcast(&(pm->cond));
+  pthread_mutex_unlock(&(pm->lock));
+}
+
+/*
+ * Decode a band of some of the columns of an image mosaic.
+ * 
+ * The columns first, first + step, first + step * 2, and so on are
+ * decoded straight into their place in the band buffer.  The tile of
+ * each column is opened at the start of its row of tiles and closed
+ * after its last band.  Blank tiles are cleared to transparent black.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   first - the first column
+ * 
+ *   step - the distance between columns
+ * 
+ *   r - the row of tiles of the band
+ * 
+ *   y - the first scanline of the band within the row of tiles
+ * 
+ *   n - the number of scanlines in the band
+ * 
+ *   pDst - the band buffer
+ * 
+ *   pError - pointer to the error code return
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sph_mosaic_decode(
+    SPH_IMAGE_MOSAIC * pm,
+    int                first,
+    int                step,
+    int32_t            r,
+    int32_t            y,
+    int32_t            n,
+    uint32_t         * pDst,
+    int              * pError) {
+  
+  int status = 1;
+  int32_t c = 0;
+  int32_t i = 0;
+  int32_t tw = 0;
+  const char *pPath = NULL;
+  SPH_IMAGE_READER **ppr = NULL;
+  
+  /* Check parameters */
+  if ((pm == NULL) || (pDst == NULL) || (pError == NULL)) {
+    abort();
+  }
+  if ((first < 0) || (step < 1) || (n < 1)) {
+    abort();
+  }
+  
+  for(c = first; c < pm->cols; c += step) {
+    pPath = (pm->ppPaths)[((size_t) r) * pm->cols + c];
+    ppr = &((pm->ppReaders)[c]);
+    tw = (pm->pColX)[c + 1] - (pm->pColX)[c];
+    
+    /* Clear blank tiles */
+    if (pPath == NULL) {
+      for(i = 0; i < n; i++) {
+        memset(pDst + ((size_t) i) * pm->pitch + (pm->pColX)[c], 0,
+                ((size_t) tw) * sizeof(uint32_t));
+      }
+      continue;
+    }
+    
+    /* Open the tile at the start of its row, and check that it still
+     * has the measured size; the mosaic does the parallel work, so the
+     * reader doesn't get worker threads of its own */
+    if (y == 0) {
+      *ppr = sph_image_reader_newFromPath(pPath, pError);
+      if (*ppr == NULL) {
+        status = 0;
+        break;
+      }
+      if ((sph_image_reader_width(*ppr) != tw) ||
+          (sph_image_reader_height(*ppr) != (pm->pRowH)[r])) {
+        *pError = SPH_IMAGE_ERR_MOSAIC;
+        status = 0;
+        break;
+      }
+      sph_image_reader_setThreads(*ppr, 1);
+    }
+    
+    /* Decode the band of the tile into place */
+    if (!sph_image_reader_readRows(
+            *ppr, pDst + (pm->pColX)[c], (int32_t) pm->pitch, n,
+            pError)) {
+      status = 0;
+      break;
+    }
+    
+    /* Close the tile after its last band */
+    if (y + n >= (pm->pRowH)[r]) {
+      sph_image_reader_close(*ppr);
+      *ppr = NULL;
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Worker thread of an image mosaic.
+ * 
+ * The worker goes through all bands in order, decoding its columns of
+ * each band into the band buffer as soon as the buffer has been
+ * written, and then tells the writing thread that it is done with the
+ * band.  The worker stops early if the mosaic fails.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the SPH_MOSAIC_WORKER structure
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *sph_mosaic_worker(void *pArg) {
+  
+  int quit = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t k = 0;
+  int32_t r = 0;
+  int32_t y = 0;
+  int32_t n = 0;
+  SPH_MOSAIC_WORKER *pk = NULL;
+  SPH_IMAGE_MOSAIC *pm = NULL;
+  
+  /* Get the worker */
+  pk = (SPH_MOSAIC_WORKER *) pArg;
+  if (pk == NULL) {
+    abort();
+  }
+  pm = pk->pm;
+  
+  for(k = 0; k < pm->band_count; k++) {
+    n = sph_mosaic_band(pm, r, y);
+    
+    /* Wait until the band buffer has been written */
+    pthread_mutex_lock(&(pm->lock));
+    while ((!(pm->stop)) && (k >= pm->written + 2)) {
+      pthread_cond_wait(&(pm->cond), &(pm->lock));
+    }
+    quit = pm->stop;
+    pthread_mutex_unlock(&(pm->lock));
+    if (quit) {
+      break;
+    }
+    
+    /* Decode the columns of this worker */
+    if (!sph_mosaic_decode(pm, pk->index, pm->nworkers, r, y, n,
+                            sph_mosaic_slot(pm, k), &err)) {
+      sph_mosaic_fail(pm, err);
+      break;
+    }
+    
+    /* Report the band as done */
+    pthread_mutex_lock(&(pm->lock));
+    ((pm->ready)[k % 2])++;
+    pthread_cond_broadcast(&(pm->cond));
+    pthread_mutex_unlock(&(pm->lock));
+    
+    sph_mosaic_next(pm, &r, &y, n);
+  }
+  
+  return NULL;
+}
+
+/*
+ * Close all open tiles of an image mosaic.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ */
+static void sph_mosaic_closeAll(SPH_IMAGE_MOSAIC *pm) {
+  
+  int32_t c = 0;
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  if (pm->ppReaders != NULL) {
+    for(c = 0; c < pm->cols; c++) {
+      sph_image_reader_close((pm->ppReaders)[c]);
+      (pm->ppReaders)[c] = NULL;
+    }
+  }
+}
+
+/*
+ * Find the first pixel of a scanline within a range that isn't
+ * background for an image trim object.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   pRow - the scanline
+ * 
+ *   a - the first pixel of the range
+ * 
+ *   b - the pixel after the last pixel of the range
+ * 
+ * Return:
+ * 
+ *   the index of the first pixel in [a, b) that isn't background, or b
+ *   if there is none
+ */
+static int32_t sph_trim_first(
+    const SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          a,
+          int32_t          b) {
+  
+  int i = 0;
+  uint32_t mask = 0;
+  uint32_t value = 0;
+  uint32_t acc = 0;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pRow == NULL)) {
+    abort();
+  }
+  
+  mask = pt->mask;
+  value = pt->value;
+  
+  /* Skip whole chunks of background */
+  while (b - a >= SPH_TRIM_CHUNK) {
+    acc = 0;
+    for(i = 0; i < SPH_TRIM_CHUNK; i++) {
+      acc |= (pRow[a + i] & mask) ^ value;
+    }
+    if (acc != 0) {
+      break;
+    }
+    a += SPH_TRIM_CHUNK;
+  }
+  
+  /* Find the pixel within the chunk or the rest of the range */
+  while ((a < b) && ((pRow[a] & mask) == value)) {
+    a++;
+  }
+  
+  return a;
+}
+
+/*
+ * Find the last pixel of a scanline within a range that isn't
+ * background for an image trim object.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   pRow - the scanline
+ * 
+ *   a - the first pixel of the range
+ * 
+ *   b - the pixel after the last pixel of the range
+ * 
+ * Return:
+ * 
+ *   one more than the index of the last pixel in [a, b) that isn't
+ *   background, or a if there is none
+ */
+static int32_t sph_trim_last(
+    const SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          a,
+          int32_t          b) {
+  
+  int i = 0;
+  uint32_t mask = 0;
+  uint32_t value = 0;
+  uint32_t acc = 0;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pRow == NULL)) {
+    abort();
+  }
+  
+  mask = pt->mask;
+  value = pt->value;
+  
+  /* Skip whole chunks of background */
+  while (b - a >= SPH_TRIM_CHUNK) {
+    acc = 0;
+    for(i = 0; i < SPH_TRIM_CHUNK; i++) {
+      acc |= (pRow[b - SPH_TRIM_CHUNK + i] & mask) ^ value;
+    }
+    if (acc != 0) {
+      break;
+    }
+    b -= SPH_TRIM_CHUNK;
+  }
+  
+  /* Find the pixel within the chunk or the rest of the range */
+  while ((b > a) && ((pRow[b - 1] & mask) == value)) {
+    b--;
+  }
+  
+  return b;
+}
+
+/*
+ * Add a scanline to the bounding box of an image trim object that is
+ * being measured.
+ * 
+ * Once the box has any content, only the parts of the scanline outside
+ * the box need to be searched for its left and right edges.  The part
+ * inside is only searched if nothing is found outside, and only up to
+ * the first pixel of content, to find out whether the box extends down
+ * to this scanline.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   pRow - the scanline
+ * 
+ *   y - the index of the scanline
+ */
+static void sph_trim_row(
+          SPH_IMAGE_TRIM * pt,
+    const uint32_t       * pRow,
+          int32_t          y) {
+  
+  int hit = 0;
+  int32_t i = 0;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pRow == NULL)) {
+    abort();
+  }
+  
+  if (!(pt->found)) {
+    /* No content yet -- search the whole scanline */
+    i = sph_trim_first(pt, pRow, 0, pt->iw);
+    if (i < pt->iw) {
+      pt->found = 1;
+      pt->x = i;
+      pt->y = y;
+      pt->w = sph_trim_last(pt, pRow, i, pt->iw);
+      pt->h = y + 1;
+    }
+  
+  } else {
+    /* Widen the box to the left and right */
+    i = sph_trim_first(pt, pRow, 0, pt->x);
+    if (i < pt->x) {
+      pt->x = i;
+      hit = 1;
+    }
+    i = sph_trim_last(pt, pRow, pt->w, pt->iw);
+    if (i > pt->w) {
+      pt->w = i;
+      hit = 1;
+    }
+    if (!hit) {
+      if (sph_trim_first(pt, pRow, pt->x, pt->w) < pt->w) {
+        hit = 1;
+      }
+    }
+    if (hit) {
+      pt->h = y + 1;
+    }
+  }
+}
+
+/*
+ * Given a file path for an image, determine from the file extension
+ * which image type is meant.
+ * 
+ * If the end of the string is a case-insensitive match for one of the
+ * following:
+ * 
+ *   .PNG
+ * 
+ * Then this function returns the appropriate SPH_IMAGE_TYPE constant.
+ * Otherwise, this function returns -1 to indicate that the file type
+ * could not be determined from the path.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to check
+ * 
+ * Return:
+ * 
+ *   the image type, or -1
+ */
+static int sph_path_getImageType(const char *pPath) {
+  
+  size_t slen = 0;
+  int extlen = 0;
+  uint32_t extcode = 0;
+  int c = 0;
+  int i = 0;
+  int result = 0;
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Get the size of the string, not including the terminating NUL */
+  slen = strlen(pPath);
+  
+  /* If the size of the string is at least four, check whether the
+   * fourth from last character is an ASCII dot; if it is, set extlen to
+   * three to indicate a three-character file extension */
+  if (slen >= 4) {
+    if (pPath[slen - 4] == 0x2e) {
+      extlen = 3;
+    }
+  }
+  
+  /* If the extension length hasn't been set yet and the size of the
+   * string is at least five, check whether the fifth from last
+   * character is an ASCII dot; if it is, set extlen to four to indicate
+   * a four-character file extension */
+  if ((extlen == 0) && (slen >= 5)) {
+    if (pPath[slen - 5] == 0x2e) {
+      extlen = 4;
+    }
+  }
+  
+  /* If extlen is non-zero, form the uppercase extension code; else,
+   * leave extension code set to zero */
+  for(i = extlen; i >= 1; i--) {
+    c = pPath[slen - i];
+    if ((c >= 0x61) && (c <= 0x7a)) {
+      /* Lowercase letter -- make uppercase */
+      c = c - 0x20;
+    }
+    extcode = (extcode << 8) | ((uint32_t) c);
+  }
+  
+  /* Look up extension code */
+  if (extcode == 0x504e47) {
+    result = SPH_IMAGE_TYPE_PNG;
+  
+  } else {
+    /* Unrecognized */
+    result = -1;
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Public function implementations
+ * ===============================
+ * 
+ * See header for specifications.
+ */
+
+/*
+ * sph_argb_pack function.
+ */
+uint32_t sph_argb_pack(const SPH_ARGB *pc) {
+  
+  uint32_t a = 0;
+  uint32_t r = 0;
+  uint32_t g = 0;
+  uint32_t b = 0;
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Get each channel, clamping the ranges */
+  if (pc->a < 0) {
+    a = (uint32_t) 0;
+  } else if (pc->a > 255) {
+    a = (uint32_t) 255;
+  } else {
+    a = (uint32_t) pc->a;
+  }
+  
+  if (pc->r < 0) {
+    r = (uint32_t) 0;
+  } else if (pc->r > 255) {
+    r = (uint32_t) 255;
+  } else {
+    r = (uint32_t) pc->r;
+  }
+  
+  if (pc->g < 0) {
+    g = (uint32_t) 0;
+  } else if (pc->g > 255) {
+    g = (uint32_t) 255;
+  } else {
+    g = (uint32_t) pc->g;
+  }
+  
+  if (pc->b < 0) {
+    b = (uint32_t) 0;
+  } else if (pc->b > 255) {
+    b = (uint32_t) 255;
+  } else {
+    b = (uint32_t) pc->b;
+  }
+  
+  /* Merge into result */
+  return (uint32_t) (
+    (a << 24) |
+    (r << 16) |
+    (g <<  8) |
+     b);
+}
+
+/*
+ * sph_argb_unpack function.
+ */
+void sph_argb_unpack(uint32_t c, SPH_ARGB *pc) {
+  
+  /* Check parameters */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Clear structure */
+  memset(pc, 0, sizeof(SPH_ARGB));
+  
+  /* Get each channel */
+  pc->a = (uint32_t) ((c >> 24) & 0xff);
+  pc->r = (uint32_t) ((c >> 16) & 0xff);
+  pc->g = (uint32_t) ((c >>  8) & 0xff);
+  pc->b = (uint32_t) ( c        & 0xff);
+}
+
+/*
+ * sph_argb_downRGB function.
+ */
+void sph_argb_downRGB(SPH_ARGB *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Clamp each channel */
+  if (pc->a < 0) {
+    pc->a = 0;
+  } else if (pc->a > 255) {
+    pc->a = 255;
+  }
+  
+  if (pc->r < 0) {
+    pc->r = 0;
+  } else if (pc->r > 255) {
+    pc->r = 255;
+  }
+  
+  if (pc->g < 0) {
+    pc->g = 0;
+  } else if (pc->g > 255) {
+    pc->g = 255;
+  }
+  
+  if (pc->b < 0) {
+    pc->b = 0;
+  } else if (pc->b > 255) {
+    pc->b = 255;
+  }
+  
+  /* If the alpha channel is zero, replace color with opaque white */
+  if (pc->a < 1) {
+    pc->a = 255;
+    pc->r = 255;
+    pc->g = 255;
+    pc->b = 255;
+  }
+  
+  /* If the alpha channel is in range [1, 244] then approximate a mix of
+   * the color against a white background */
+  if ((pc->a > 0) && (pc->a < 255)) {
+    
+    /* Compute channels */
+    pc->r = 255 + ((pc->a * (pc->r - 255)) / 255);
+    pc->g = 255 + ((pc->a * (pc->g - 255)) / 255);
+    pc->b = 255 + ((pc->a * (pc->b - 255)) / 255);
+    
+    /* Clamp channels and set alpha to opaque */
+    pc->a = 255;
+    
+    if (pc->r < 0) {
+      pc->r = 0;
+    } else if (pc->r > 255) {
+      pc->r = 255;
+    }
+    
+    if (pc->g < 0) {
+      pc->g = 0;
+    } else if (pc->g > 255) {
+      pc->g = 255;
+    }
+    
+    if (pc->b < 0) {
+      pc->b = 0;
+    } else if (pc->b > 255) {
+      pc->b = 255;
+    }
+  }
+}
+
+/*
+ * sph_argb_downGray function.
+ */
+void sph_argb_downGray(SPH_ARGB *pc) {
+  
+  int32_t gray = 0;
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Down-convert to RGB first */
+  sph_argb_downRGB(pc);
+  
+  /* Adjust results if RGB channels not equal */
+  if ((pc->r != pc->g) || (pc->r != pc->b)) {
+    
+    /* Compute grayscale value */
+    gray = (2126 * ((int32_t) pc->r) +
+            7152 * ((int32_t) pc->g) +
+             722 * ((int32_t) pc->b)) / 10000;
+    
+    /* Clamp grayscale value */
+    if (gray < 0) {
+      gray = 0;
+    } else if (gray > 255) {
+      gray = 255;
+    }
+    
+    /* Replace RGB channels with grayscale value */
+    pc->r = (int) gray;
+    pc->g = (int) gray;
+    pc->b = (int) gray;
+  }
+}
+
+/*
+ * sph_image_grayBits function.
+ */
+int sph_image_grayBits(const uint32_t *pScan, int32_t w) {
+  
+  int result = 1;
+  int g = 0;
+  
+  /* Check parameters */
+  if (pScan == NULL) {
+    abort();
+  }
+  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Raise the depth as needed, stopping early at eight */
+  for( ; (w > 0) && (result < 8); w--) {
+    g = sph_gray_value(*pScan);
+    if ((g % 255) != 0) {
+      if ((g % 85) == 0) {
+        if (result < 2) {
+          result = 2;
+        }
+      } else if ((g % 17) == 0) {
+        if (result < 4) {
+          result = 4;
+        }
+      } else {
+        result = 8;
+      }
+    }
+    pScan++;
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * sph_image_arena_new function.
+ */
+SPH_IMAGE_ARENA *sph_image_arena_new(size_t block) {
+  
+  SPH_IMAGE_ARENA *pa = NULL;
+  
+  /* Use the default block size if none was given */
+  if (block < 1) {
+    block = SPH_ARENA_BLOCK;
+  }
+  
+  /* Keep room for the block header */
+  if (block > SIZE_MAX - SPH_ARENA_HDR - SPH_ARENA_ALIGN) {
+    abort();
+  }
+  
+  /* Allocate and initialize the structure */
+  pa = (SPH_IMAGE_ARENA *) malloc(sizeof(SPH_IMAGE_ARENA));
+  if (pa == NULL) {
+    abort();
+  }
+  memset(pa, 0, sizeof(SPH_IMAGE_ARENA));
+  
+  if (pthread_mutex_init(&(pa->lock), NULL)) {
+    abort();
+  }
+  
+  pa->block = block;
+  pa->pFirst = NULL;
+  pa->pLast = NULL;
+  
+  return pa;
+}
+
+/*
+ * sph_image_arena_allocator function.
+ */
+void sph_image_arena_allocator(
+    SPH_IMAGE_ARENA     * pa,
+    SPH_IMAGE_ALLOCATOR * pAlloc) {
+  
+  /* Check parameters */
+  if ((pa == NULL) || (pAlloc == NULL)) {
+    abort();
+  }
+  
+  /* Fill in the callbacks */
+  memset(pAlloc, 0, sizeof(SPH_IMAGE_ALLOCATOR));
+  pAlloc->allocFn = &sph_arena_allocFn;
+  pAlloc->freeFn = &sph_arena_freeFn;
+  pAlloc->pCustom = (void *) pa;
+}
+
+/*
+ * sph_image_arena_reset function.
+ */
+void sph_image_arena_reset(SPH_IMAGE_ARENA *pa) {
+  
+  SPH_ARENA_CHUNK *pc = NULL;
+  SPH_ARENA_CHUNK *pNext = NULL;
+  
+  /* Check parameter */
+  if (pa == NULL) {
+    abort();
+  }
+  
+  /* Free every block after the first, and empty the first */
+  if (pa->pFirst != NULL) {
+    for(pc = pa->pFirst->pNext; pc != NULL; pc = pNext) {
+      pNext = pc->pNext;
+      free(pc);
+    }
+    pa->pFirst->pNext = NULL;
+    pa->pFirst->used = 0;
+    pa->pLast = pa->pFirst;
+  }
+}
+
+/*
+ * sph_image_arena_free function.
+ */
+void sph_image_arena_free(SPH_IMAGE_ARENA *pa) {
+  
+  SPH_ARENA_CHUNK *pc = NULL;
+  SPH_ARENA_CHUNK *pNext = NULL;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pa != NULL) {
+    
+    /* Free all blocks */
+    for(pc = pa->pFirst; pc != NULL; pc = pNext) {
+      pNext = pc->pNext;
+      free(pc);
+    }
+    
+    /* Free structure */
+    pthread_mutex_destroy(&(pa->lock));
+    free(pa);
+  }
+}
+
+/*
+ * sph_image_writer_new function.
+ */
+SPH_IMAGE_WRITER *sph_image_writer_new(
+    FILE    * pOut,
+    int       ftype,
+    int32_t   w,
+    int32_t   h,
+    int       dconv,
+    int       q) {
+  
+  /* Call through with the standard library allocator */
+  return sph_image_writer_newAlloc(pOut, ftype, w, h, dconv, q, NULL);
+}
+
+/*
+ * sph_image_writer_newAlloc function.
+ */
+SPH_IMAGE_WRITER *sph_image_writer_newAlloc(
+          FILE                * pOut,
+          int                   ftype,
+          int32_t               w,
+          int32_t               h,
+          int                   dconv,
+          int                   q,
+    const SPH_IMAGE_ALLOCATOR * pAlloc) {
+  
+  /* Call through without a memory limit */
+  return sph_image_writer_newLimit(pOut, ftype, w, h, dconv, q, pAlloc, 0);
+}
+
+/*
+ * sph_image_writer_newLimit function.
+ */
+SPH_IMAGE_WRITER *sph_image_writer_newLimit(
+          FILE                * pOut,
+          int                   ftype,
+          int32_t               w,
+          int32_t               h,
+          int                   dconv,
+          int                   q,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit) {
+  
+  SPH_IMAGE_WRITER *pw = NULL;
+  SPH_MEM mem;
+  
+  /* Set up the allocator, with NULL callbacks for the standard library
+   * allocator */
+  sph_mem_init(&mem, pAlloc, limit);
+  
+  /* Allocate image writer structure, and hand the allocator over to
+   * it */
+  pw = (SPH_IMAGE_WRITER *) sph_mem_alloc(&mem, sizeof(SPH_IMAGE_WRITER));
+  if (pw == NULL) {
+    abort();
+  }
+  memset(pw, 0, sizeof(SPH_IMAGE_WRITER));
+  sph_mem_move(&(pw->alloc), &mem);
+  
+  /* Start the image */
+  sph_writer_init(pw, pOut, ftype, w, h, dconv, q);
+  
+  /* Return writer object */
+  return pw;
+}
+
+/*
+ * sph_image_writer_newFromPath function.
+ */
+SPH_IMAGE_WRITER *sph_image_writer_newFromPath(
+    const char    * pPath,
+          int32_t   w,
+          int32_t   h,
+          int       dconv,
+          int       q,
+          int     * pError) {
+  
+  int ftype = 0;
+  int status = 1;
+  FILE *pOut = NULL;
+  SPH_IMAGE_WRITER *pw = NULL;
+  
+  /* Check path parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Determine type from path */
+  ftype = sph_path_getImageType(pPath);
+  
+  /* Fail if type could not be determined */
+  if (ftype == -1) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_FILETYPE;
+    }
+    status = 0;
+  }
+  
+  /* Open the output file */
+  if (status) {
+    pOut = fopen(pPath, "wb");
+    if (pOut == NULL) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_OPEN;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Call through if no error */
+  if (status) {
+    pw = sph_image_writer_new(pOut, ftype, w, h, dconv, q);
+  }
+  
+  /* If successful, clear error if it was passed */
+  if (status) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    }
+  }
+  
+  /* Return writer or NULL */
+  return pw;
+}
+
+/*
+ * sph_image_writer_reset function.
+ */
+void sph_image_writer_reset(
+    SPH_IMAGE_WRITER * pw,
+    FILE             * pOut,
+    int                ftype,
+    int32_t            w,
+    int32_t            h,
+    int                dconv,
+    int                q) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Close the current image and start the new one */
+  sph_writer_release(pw);
+  sph_writer_init(pw, pOut, ftype, w, h, dconv, q);
+}
+
+/*
+ * sph_image_writer_resetFromPath function.
+ */
+int sph_image_writer_resetFromPath(
+          SPH_IMAGE_WRITER * pw,
+    const char             * pPath,
+          int32_t            w,
+          int32_t            h,
+          int                dconv,
+          int                q,
+          int              * pError) {
+  
+  int ftype = 0;
+  int status = 1;
+  FILE *pOut = NULL;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Close the current image */
+  sph_writer_release(pw);
+  
+  /* Determine type from path */
+  ftype = sph_path_getImageType(pPath);
+  
+  /* Fail if type could not be determined */
+  if (ftype == -1) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_FILETYPE;
+    }
+    status = 0;
+  }
+  
+  /* Open the output file */
+  if (status) {
+    pOut = fopen(pPath, "wb");
+    if (pOut == NULL) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_OPEN;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Start the new image if no error */
+  if (status) {
+    sph_writer_init(pw, pOut, ftype, w, h, dconv, q);
+  }
+  
+  /* If successful, clear error if it was passed */
+  if (status) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sph_image_writer_close function.
+ */
+void sph_image_writer_close(SPH_IMAGE_WRITER *pw) {
+  
+  SPH_MEM mem;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pw != NULL) {
+    
+    /* Close the image */
+    sph_writer_release(pw);
+    
+    /* Shut down the native IDAT encoder */
+    if (pw->z_alloc) {
+      deflateEnd(&(pw->z));
+    }
+    
+    /* Free scanline buffer, data buffer, encoder buffers, and curves */
+    sph_mem_freeAligned(&(pw->alloc), pw->pScan);
+    sph_mem_freeAligned(&(pw->alloc), pw->pData);
+    sph_mem_freeAligned(&(pw->alloc), pw->pPrev);
+    sph_mem_freeAligned(&(pw->alloc), pw->pTry);
+    sph_mem_freeAligned(&(pw->alloc), pw->pBest);
+    sph_mem_freeAligned(&(pw->alloc), pw->pZBuf);
+    sph_mem_freeAligned(&(pw->alloc), pw->pCurves);
+    
+    /* Take the allocator back out of the structure and free the
+     * structure through it */
+    sph_mem_move(&mem, &(pw->alloc));
+    sph_mem_free(&mem, pw);
+    sph_mem_destroy(&mem);
+  }
+}
+
+/*
+ * sph_image_writer_ptr function.
+ */
+uint32_t *sph_image_writer_ptr(SPH_IMAGE_WRITER *pw) {
+  
+  uint32_t *pResult = NULL;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Scanlines go through the reorder window if there is one */
+  if (pw->pOrder != NULL) {
+    abort();
+  }
+  
+  /* Start the pipelined encoder before the first scanline if
+   * requested */
+  sph_writer_begin(pw);
+  
+  /* Return pointer to the next pipeline slot, or to the scanline
+   * buffer if not pipelined */
+  if (pw->pPipe != NULL) {
+    pResult = sph_wpipe_slot(pw->pPipe);
+  } else {
+    pResult = pw->pScan;
+  }
+  
+  /* Return pointer */
+  return pResult;
+}
+
+/*
+ * sph_image_writer_write function.
+ */
+void sph_image_writer_write(SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Write the scanline, faulting on error */
+  if (!sph_image_writer_writeEx(pw, NULL)) {
+    abort();
+  }
+}
+
+/*
+ * sph_image_writer_writeEx function.
+ */
+int sph_image_writer_writeEx(SPH_IMAGE_WRITER *pw, int *pError) {
+  
+  int status = 0;
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Scanlines go through the reorder window if there is one */
+  if (pw->pOrder != NULL) {
+    abort();
+  }
+  
+  /* Start the pipelined encoder before the first scanline if
+   * requested */
+  sph_writer_begin(pw);
+  
+  /* Submit the slot returned by sph_image_writer_ptr() if pipelined;
+   * otherwise, write the scanline buffer as a batch of one */
+  if (pw->pPipe != NULL) {
+    if (pw->scan_count >= pw->h) {
+      abort();
+    }
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    }
+    sph_wpipe_slot(pw->pPipe);
+    status = sph_wpipe_submit(pw->pPipe, pError);
+  } else {
+    status = sph_image_writer_writeRows(pw, pw->pScan, pw->w, 1, pError);
+  }
+  
+  return status;
+}
+
+/*
+ * sph_image_writer_writeRows function.
+ */
+int sph_image_writer_writeRows(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Scanlines go through the reorder window if there is one */
+  if (pw->pOrder != NULL) {
+    abort();
+  }
+  
+  return sph_writer_rows(pw, pSrc, stride, n, pError);
+}
+
+/*
+ * sph_image_writer_writeFrom function.
+ */
+int sph_image_writer_writeFrom(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int              * pError) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Write as a batch of one */
+  return sph_image_writer_writeRows(pw, pSrc, pw->w, 1, pError);
+}
+
+/*
+ * sph_image_writer_setRestart function.
+ */
+void sph_image_writer_setRestart(SPH_IMAGE_WRITER *pw, int32_t band) {
+  
+  int32_t count = 0;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((band < 0) || (band > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Check that no scanlines have been written yet */
+  if (pw->scan_count > 0) {
+    abort();
+  }
+  
+  /* Release any previous restart configuration */
+  sph_mem_free(&(pw->alloc), pw->pBandOff);
+  pw->pBandOff = NULL;
+  sph_mem_free(&(pw->alloc), pw->pIndex);
+  pw->pIndex = NULL;
+  pw->band = 0;
+  
+  /* Allocate the band offset table and native encoder buffers */
+  if (band > 0) {
+    if (band > pw->h) {
+      band = pw->h;
+    }
+    count = ((pw->h - 1) / band) + 1;
+    
+    pw->pBandOff = (uint64_t *) sph_mem_alloc(
+                      &(pw->alloc),
+                      ((size_t) count) * sizeof(uint64_t));
+    if (pw->pBandOff == NULL) {
+      abort();
+    }
+    memset(pw->pBandOff, 0, ((size_t) count) * sizeof(uint64_t));
+    
+    pw->pIndex = (uint8_t *) sph_mem_alloc(
+                    &(pw->alloc),
+                    ((size_t) 12) + (((size_t) count) * 8));
+    if (pw->pIndex == NULL) {
+      abort();
+    }
+    
+    sph_idat_alloc(pw);
+    
+    pw->band = band;
+  }
+}
+
+/*
+ * sph_image_writer_setCompression function.
+ */
+void sph_image_writer_setCompression(
+    SPH_IMAGE_WRITER * pw,
+    int                level,
+    int                strategy,
+    int                filters) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((level < -1) || (level > 9)) {
+    abort();
+  }
+  if ((strategy < SPH_IMAGE_STRATEGY_AUTO) ||
+      (strategy > SPH_IMAGE_STRATEGY_FIXED)) {
+    abort();
+  }
+  if ((filters & ~SPH_IMAGE_FILTER_ALL) != 0) {
+    abort();
+  }
+  
+  /* Check that no scanlines have been written yet */
+  if (pw->scan_count > 0) {
+    abort();
+  }
+  
+  /* Store the parameters for the native IDAT encoder */
+  pw->zlevel = level;
+  pw->zstrategy = strategy;
+  pw->filters = filters;
+  
+  /* Pass the parameters through to libpng, which only applies them
+   * when it starts compressing the first scanline */
+  if (pw->ftype == SPH_IMAGE_TYPE_PNG) {
+    if (setjmp(png_jmpbuf(pw->png_ptr))) {
+      /* Careful -- local variables may be in uncertain state? */
+      pw->err_code = SPH_IMAGE_ERR_WRITEDATA;
+    
+    } else {
+      png_set_compression_level(pw->png_ptr,
+        (level < 0) ? Z_DEFAULT_COMPRESSION : level);
+      if (strategy != SPH_IMAGE_STRATEGY_AUTO) {
+        png_set_compression_strategy(pw->png_ptr, sph_zstrategy(pw));
+      }
+      png_set_filter(pw->png_ptr, PNG_FILTER_TYPE_BASE,
+                      sph_png_filters(pw));
+    }
+  
+  } else {
+    /* Unrecognized image file type */
+    abort();
+  }
+}
+
+/*
+ * sph_image_writer_setPipeline function.
+ */
+void sph_image_writer_setPipeline(SPH_IMAGE_WRITER *pw, int32_t rows) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((rows < 0) || (rows > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Check that writing has not started yet */
+  if ((pw->scan_count > 0) || (pw->pPipe != NULL)) {
+    abort();
+  }
+  
+  /* Set the requested value */
+  pw->pipe_rows = rows;
+}
+
+/*
+ * sph_image_writer_setBudget function.
+ */
+void sph_image_writer_setBudget(SPH_IMAGE_WRITER *pw, int32_t msec) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if (msec < 0) {
+    abort();
+  }
+  
+  /* Check that no scanlines have been written yet */
+  if (pw->scan_count > 0) {
+    abort();
+  }
+  
+  /* Set the budget and start the clock */
+  pw->budget = msec;
+  pw->t_start = sph_clock_ms();
+  pw->t_mark = pw->t_start;
+  pw->mark_row = 0;
+  
+  /* The native encoder is needed to change settings mid-stream */
+  if (msec > 0) {
+    sph_idat_alloc(pw);
+  }
+}
+
+/*
+ * sph_image_writer_setCurves function.
+ */
+void sph_image_writer_setCurves(
+          SPH_IMAGE_WRITER * pw,
+    const uint8_t          * pTables) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Check that writing has not started yet */
+  if ((pw->scan_count > 0) || (pw->pPipe != NULL)) {
+    abort();
+  }
+  
+  /* Build the tables, or turn the curves off */
+  if (pTables != NULL) {
+    pw->pCurves = (uint32_t *) sph_buf_fit(
+                    &(pw->alloc),
+                    pw->pCurves,
+                    &(pw->curves_cap),
+                    4 * 256 * sizeof(uint32_t));
+    sph_curves_build(pw->pCurves, pTables);
+    pw->curves = 1;
+  } else {
+    pw->curves = 0;
+  }
+}
+
+/*
+ * sph_image_writer_setReorder function.
+ */
+void sph_image_writer_setReorder(SPH_IMAGE_WRITER *pw, int32_t rows) {
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if ((rows < 1) || (rows > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Check that writing has not started yet and there is no window */
+  if ((pw->scan_count > 0) || (pw->pPipe != NULL) ||
+      (pw->pOrder != NULL)) {
+    abort();
+  }
+  
+  pw->pOrder = sph_worder_new(pw, rows);
+}
+
+/*
+ * sph_image_writer_submitRows function.
+ */
+int sph_image_writer_submitRows(
+          SPH_IMAGE_WRITER * pw,
+          int32_t            y,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError) {
+  
+  int status = 1;
+  int ok = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t i = 0;
+  int32_t row = 0;
+  SPH_WORDER *po = NULL;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pSrc == NULL)) {
+    abort();
+  }
+  if (pw->pOrder == NULL) {
+    abort();
+  }
+  if ((stride < pw->w) || (n < 1) || (y < 0) || (y > pw->h - n)) {
+    abort();
+  }
+  po = pw->pOrder;
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  for(i = 0; i < n; i++) {
+    row = y + i;
+    
+    /* Wait until the scanline is within the window */
+    pthread_mutex_lock(&(po->lock));
+    while ((po->err == SPH_IMAGE_ERR_NONE) &&
+            (row >= po->next + po->nslots)) {
+      pthread_cond_wait(&(po->cond), &(po->lock));
+    }
+    if (po->err != SPH_IMAGE_ERR_NONE) {
+      err = po->err;
+      pthread_mutex_unlock(&(po->lock));
+      status = 0;
+      break;
+    }
+    
+    /* Each scanline may only be submitted once */
+    if ((row < po->next) || (po->pHave)[row % po->nslots]) {
+      abort();
+    }
+    pthread_mutex_unlock(&(po->lock));
+    
+    /* Fill the slot, which no other thread uses */
+    memcpy(
+      sph_worder_slot(po, row),
+      pSrc + ((size_t) i) * ((size_t) stride),
+      ((size_t) pw->w) * sizeof(uint32_t));
+    
+    /* Mark it, and unless another thread is already at it, write the
+     * scanlines at the start of the window for as long as they are
+     * present; the lock is released while each one is written */
+    pthread_mutex_lock(&(po->lock));
+    (po->pHave)[row % po->nslots] = 1;
+    if (!(po->busy)) {
+      po->busy = 1;
+      while ((po->err == SPH_IMAGE_ERR_NONE) && (po->next < pw->h) &&
+              (po->pHave)[po->next % po->nslots]) {
+        pthread_mutex_unlock(&(po->lock));
+        ok = sph_writer_rows(
+                pw, sph_worder_slot(po, po->next), pw->w, 1, &err);
+        pthread_mutex_lock(&(po->lock));
+        if (ok) {
+          (po->pHave)[po->next % po->nslots] = 0;
+          (po->next)++;
+        } else {
+          po->err = err;
+        }
+        pthread_cond_broadcast(&(po->cond));
+      }
+      po->busy = 0;
+    }
+    err = po->err;
+    pthread_mutex_unlock(&(po->lock));
+    
+    if (err != SPH_IMAGE_ERR_NONE) {
+      status = 0;
+      break;
+    }
+  }
+  
+  /* Report error if there was one */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
+  }
+  
+  return status;
+}
+
+/*
+ * sph_image_writer_finish function.
+ */
+int sph_image_writer_finish(SPH_IMAGE_WRITER *pw, int *pError) {
+  
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  SPH_WORDER *po = NULL;
+  
+  /* Check parameters */
+  if (pw == NULL) {
+    abort();
+  }
+  if (pw->pOrder == NULL) {
+    abort();
+  }
+  po = pw->pOrder;
+  
+  /* Wait until all scanlines are written or the window fails */
+  pthread_mutex_lock(&(po->lock));
+  while ((po->err == SPH_IMAGE_ERR_NONE) && (po->next < pw->h)) {
+    pthread_cond_wait(&(po->cond), &(po->lock));
+  }
+  err = po->err;
+  pthread_mutex_unlock(&(po->lock));
+  
+  /* Report error if there was one */
+  if (err != SPH_IMAGE_ERR_NONE) {
+    status = 0;
+  }
+  if (pError != NULL) {
+    *pError = err;
+  }
+  
+  return status;
+}
+
+/*
+ * sph_image_writer_budget function.
+ */
+void sph_image_writer_budget(
+    SPH_IMAGE_WRITER        * pw,
+    SPH_IMAGE_BUDGET_REPORT * pReport) {
+  
+  double elapsed = 0.0;
+  int level = 0;
+  
+  /* Check parameters */
+  if ((pw == NULL) || (pReport == NULL)) {
+    abort();
+  }
+  
+  /* Fill in the report */
+  memset(pReport, 0, sizeof(SPH_IMAGE_BUDGET_REPORT));
+  
+  level = pw->zlevel;
+  if (level < 0) {
+    level = SPH_ZLEVEL_DEFAULT;
+  }
+  pReport->level_start = level;
+  if (pw->z_init) {
+    pReport->level_end = pw->zcur;
+  } else {
+    pReport->level_end = level;
+  }
+  
+  pReport->budget = pw->budget;
+  pReport->fast_filter = pw->fast;
+  pReport->changes = pw->changes;
+  pReport->change_row = pw->change_row;
+  
+  if (pw->budget > 0) {
+    if (pw->t_end >= 0.0) {
+      elapsed = pw->t_end - pw->t_start;
+    } else {
+      elapsed = sph_clock_ms() - pw->t_start;
+    }
+    if (elapsed > (double) INT32_MAX) {
+      elapsed = (double) INT32_MAX;
+    }
+    pReport->elapsed = (int32_t) (elapsed + 0.5);
+    if ((pw->t_end >= 0.0) && (elapsed <= (double) pw->budget)) {
+      pReport->met = 1;
+    }
+  }
+}
+
+/*
+ * sph_image_writer_peakMemory function.
+ */
+size_t sph_image_writer_peakMemory(SPH_IMAGE_WRITER *pw) {
+  
+  /* Check parameter */
+  if (pw == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return sph_mem_peak(&(pw->alloc), 0);
+}
+
+/*
+ * sph_image_reader_new function.
+ */
+SPH_IMAGE_READER *sph_image_reader_new(
+    FILE * pIn,
+    int    ftype,
+    int  * pError) {
+  
+  /* Call through with the standard library allocator */
+  return sph_image_reader_newAlloc(pIn, ftype, NULL, pError);
+}
+
+/*
+ * sph_image_reader_newAlloc function.
+ */
+SPH_IMAGE_READER *sph_image_reader_newAlloc(
+          FILE                * pIn,
+          int                   ftype,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          int                 * pError) {
+  
+  /* Call through without a memory limit */
+  return sph_image_reader_newLimit(pIn, ftype, pAlloc, 0, pError);
+}
+
+/*
+ * sph_image_reader_newLimit function.
+ */
+SPH_IMAGE_READER *sph_image_reader_newLimit(
+          FILE                * pIn,
+          int                   ftype,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit,
+          int                 * pError) {
+  
+  SPH_IMAGE_READER *pr = NULL;
+  SPH_MEM mem;
+  
+  /* Set up the allocator, with NULL callbacks for the standard library
+   * allocator */
+  sph_mem_init(&mem, pAlloc, limit);
+  
+  /* Allocate image reader structure, and hand the allocator over to
+   * it */
+  pr = (SPH_IMAGE_READER *) sph_mem_alloc(&mem, sizeof(SPH_IMAGE_READER));
+  if (pr == NULL) {
+    abort();
+  }
+  memset(pr, 0, sizeof(SPH_IMAGE_READER));
+  sph_mem_move(&(pr->alloc), &mem);
+  
+  /* Open the image, freeing the structure if that fails */
+  if (!sph_reader_init(pr, pIn, ftype, pError)) {
+    sph_mem_freeAligned(&(pr->alloc), pr->pScan);
+    sph_mem_freeAligned(&(pr->alloc), pr->pData);
+    sph_mem_move(&mem, &(pr->alloc));
+    sph_mem_free(&mem, pr);
+    sph_mem_destroy(&mem);
+    pr = NULL;
+  }
+  
+  /* Return reader object or NULL */
+  return pr;
+}
+
+/*
+ * sph_image_reader_newFromPath function.
+ */
+SPH_IMAGE_READER *sph_image_reader_newFromPath(
+    const char * pPath,
+          int  * pError) {
+  
+  int ftype = 0;
+  int status = 1;
+  FILE *pIn = NULL;
+  SPH_IMAGE_READER *pr = NULL;
+  
+  /* Check path parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Determine type from path */
+  ftype = sph_path_getImageType(pPath);
+  
+  /* Fail if type could not be determined */
+  if (ftype == -1) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_FILETYPE;
+    }
+    status = 0;
+  }
+  
+  /* Open the input file */
+  if (status) {
+    pIn = fopen(pPath, "rb");
+    if (pIn == NULL) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_OPEN;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Call through if no error */
+  if (status) {
+    pr = sph_image_reader_new(pIn, ftype, pError);
+  }
+  
+  /* Return reader or NULL */
+  return pr;
+}
+
+/*
+ * sph_image_reader_reset function.
+ */
+int sph_image_reader_reset(
+    SPH_IMAGE_READER * pr,
+    FILE             * pIn,
+    int                ftype,
+    int              * pError) {
+  
+  int status = 0;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Close the current image and open the new one */
+  sph_reader_release(pr);
+  status = sph_reader_init(pr, pIn, ftype, pError);
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sph_image_reader_resetFromPath function.
+ */
+int sph_image_reader_resetFromPath(
+          SPH_IMAGE_READER * pr,
+    const char             * pPath,
+          int              * pError) {
+  
+  int ftype = 0;
+  int status = 1;
+  FILE *pIn = NULL;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Close the current image */
+  sph_reader_release(pr);
+  
+  /* Determine type from path */
+  ftype = sph_path_getImageType(pPath);
+  
+  /* Fail if type could not be determined */
+  if (ftype == -1) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_FILETYPE;
+    }
+    status = 0;
+  }
+  
+  /* Open the input file */
+  if (status) {
+    pIn = fopen(pPath, "rb");
+    if (pIn == NULL) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_OPEN;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Open the new image if no error */
+  if (status) {
+    status = sph_reader_init(pr, pIn, ftype, pError);
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sph_image_reader_close function.
+ */
+void sph_image_reader_close(SPH_IMAGE_READER *pr) {
+  
+  SPH_MEM mem;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pr != NULL) {
+    
+    /* Close the image */
+    sph_reader_release(pr);
+    
+    /* Free scanline buffer, data buffer, reduction sums, and curves */
+    sph_mem_freeAligned(&(pr->alloc), pr->pScan);
+    sph_mem_freeAligned(&(pr->alloc), pr->pData);
+    sph_mem_freeAligned(&(pr->alloc), pr->pSum);
+    sph_mem_freeAligned(&(pr->alloc), pr->pCurves);
+    
+    /* Take the allocator back out of the structure and free the
+     * structure through it */
+    sph_mem_move(&mem, &(pr->alloc));
+    sph_mem_free(&mem, pr);
+    sph_mem_destroy(&mem);
+  }
+}
+
+/*
+ * sph_image_reader_width function.
+ */
+int32_t sph_image_reader_width(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pr->rw;
+}
+
+/*
+ * sph_image_reader_height function.
+ */
+int32_t sph_image_reader_height(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pr->rh;
+}
+
+/*
+ * sph_image_reader_read function.
+ */
+uint32_t *sph_image_reader_read(SPH_IMAGE_READER *pr, int *pError) {
+  
+  uint32_t *pResult = NULL;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Start a background decoder on the first read if there is one that
+   * applies */
+  if ((!(pr->err_flag)) && (pr->ftype == SPH_IMAGE_TYPE_PNG)) {
+    sph_reader_begin(pr);
+  }
+  
+  if ((!(pr->err_flag)) && (pr->pAhead != NULL) && (pr->reduce < 2)) {
+    /* Read-ahead decoder -- hand out the slot directly, which stays
+     * valid until the next read */
+    if (pr->scan_count >= pr->h) {
+      abort();
+    }
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_NONE;
+    }
+    pResult = sph_ahead_row(pr->pAhead, pr->scan_count);
+    if (pResult != NULL) {
+      (pr->scan_count)++;
+    } else {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_READDATA;
+      }
+      pr->err_flag = 1;
+    }
+  
+  } else {
+    /* Read into the scanline buffer as a batch of one */
+    if (sph_image_reader_readRows(pr, pr->pScan, pr->w, 1, pError)) {
+      pResult = pr->pScan;
+    } else {
+      pResult = NULL;
+    }
+  }
+  
+  /* Return scanline buffer pointer if successful, NULL if error */
+  return pResult;
+}
+
+/*
+ * sph_image_reader_readRows function.
+ */
+int sph_image_reader_readRows(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int32_t            n,
+    int              * pError) {
+  
+  /* Volatile, since it is changed by the error handler */
+  volatile int status = 1;
+  int32_t i = 0;
+  uint32_t *pOut = NULL;
+  const uint32_t *pRow = NULL;
+  
+  /* Check parameters */
+  if ((pr == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  if ((stride < pr->rw) || (n < 1)) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Only proceed if not in error mode */
+  if (!(pr->err_flag)) {
+  
+    /* Check that there are enough scanlines left to read */
+    if (pr->reduce > 1) {
+      if (n > pr->rh - pr->out_count) {
+        abort();
+      }
+    } else if (n > pr->h - pr->scan_count) {
+      abort();
+    }
+  
+    /* Handle based on image type */
+    if (pr->ftype == SPH_IMAGE_TYPE_PNG) {
+      
+      /* Start a background decoder on the first read if there is one
+       * that applies */
+      sph_reader_begin(pr);
+      
+      if (pr->reduce > 1) {
+        /* Downscaling -- sum the source scanlines of each reduced
+         * scanline, whichever decoder produces them */
+        status = sph_reader_reduceRows(pr, pDst, stride, n);
+      
+      } else if (pr->pBands != NULL) {
+        /* Parallel band decoder -- copy each decoded scanline out of
+         * its band slot */
+        for(i = 0; i < n; i++) {
+          pRow = sph_bands_row(pr->pBands, pr->scan_count);
+          if (pRow == NULL) {
+            status = 0;
+            break;
+          }
+          pOut = pDst + ((size_t) i) * ((size_t) stride);
+          memcpy(pOut, pRow, ((size_t) pr->w) * sizeof(uint32_t));
+          (pr->scan_count)++;
+        }
+      
+      } else if (pr->pAhead != NULL) {
+        /* Read-ahead decoder -- copy each decoded scanline out of its
+         * slot */
+        for(i = 0; i < n; i++) {
+          pRow = sph_ahead_row(pr->pAhead, pr->scan_count);
+          if (pRow == NULL) {
+            status = 0;
+            break;
+          }
+          pOut = pDst + ((size_t) i) * ((size_t) stride);
+          memcpy(pOut, pRow, ((size_t) pr->w) * sizeof(uint32_t));
+          (pr->scan_count)++;
+        }
+      
+      } else if (pr->pNative != NULL) {
+        /* Native serial decoder after a seek -- decode each scanline
+         * and convert it straight into the destination */
+        for(i = 0; i < n; i++) {
+          if (!sph_native_row(pr->pNative, NULL, NULL)) {
+            status = 0;
+            break;
+          }
+          pOut = pDst + ((size_t) i) * ((size_t) stride);
+          if (pr->bits < 8) {
+            sph_png_decodeRowBits(pr->pNative->pPrev + 1, pOut,
+                                  pr->bits, pr->w,
+                                  sph_reader_curves(pr));
+          } else {
+            sph_png_decodeRow(pr->pNative->pPrev + 1, pOut,
+                              pr->ccount, pr->w,
+                              sph_reader_curves(pr));
+          }
+          (pr->scan_count)++;
+        }
+      
+      } else {
+        /* Serial libpng decoding -- first of all, register error
+         * handler once for the whole batch */
+        if (setjmp(png_jmpbuf(pr->png_ptr))) {
+          /* Careful -- local variables may be in uncertain state? */
+          status = 0;
+        }
+        
+        /* Read and decode each scanline */
+        if (status) {
+          for(i = 0; i < n; i++) {
+            pOut = pDst + ((size_t) i) * ((size_t) stride);
+            png_read_row(
+                pr->png_ptr,
+                (png_bytep) pr->pData,
+                NULL);
+            sph_png_decodeRow(pr->pData, pOut, pr->ccount, pr->w,
+                              sph_reader_curves(pr));
+            (pr->scan_count)++;
+          }
+        }
+        
+        /* If we just read the last scanline, finish reading */
+        if (status) {
+          if (pr->scan_count >= pr->h) {
+            png_read_end(pr->png_ptr, (png_infop)NULL);
+          }
+        }
+      }
+      
+      /* If error, set error code if it was passed and set internal
+       * error mode */
+      if (!status) {
+        if (pError != NULL) {
+          *pError = SPH_IMAGE_ERR_READDATA;
+        }
+        pr->err_flag = 1;
+      }
+    
+    } else {
+      /* Unrecognized image type */
+      abort();
+    }
+  
+  } else {
+    /* In error mode -- set error flag if it was passed and fail */
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_READDATA;
+    }
+    status = 0;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sph_image_reader_readInto function.
+ */
+int sph_image_reader_readInto(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int              * pError) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Read as a batch of one */
+  return sph_image_reader_readRows(pr, pDst, pr->rw, 1, pError);
+}
+
+/*
+ * sph_image_reader_readImage function.
+ */
+uint32_t *sph_image_reader_readImage(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int              * pError) {
+  
+  int status = 1;
+  uint32_t *pBuf = NULL;
+  void *pv = NULL;
+  size_t len = 0;
+  SPH_BANDS *pb = NULL;
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if (stride < 1) {
+    stride = pr->rw;
+  }
+  if (stride < pr->rw) {
+    abort();
+  }
+  
+  /* Check that reading has not started yet */
+  if (pr->scan_count > 0) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Fail if in error mode */
+  if (pr->err_flag) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_READDATA;
+    }
+    status = 0;
+  }
+  
+  /* Use the caller's buffer or allocate one that the caller frees */
+  if (status) {
+    if (pDst != NULL) {
+      pBuf = pDst;
+    } else {
+      if (((size_t) pr->rh) > SIZE_MAX / sizeof(uint32_t) /
+                              ((size_t) stride)) {
+        abort();
+      }
+      len = ((size_t) stride) * ((size_t) pr->rh) * sizeof(uint32_t);
+      if (posix_memalign(&pv, SPH_IMAGE_ALIGN, len)) {
+        abort();
+      }
+      pBuf = (uint32_t *) pv;
+    }
+  }
+  
+  /* Handle based on image type */
+  if (status && (pr->ftype != SPH_IMAGE_TYPE_PNG)) {
+    abort();
+  }
+  
+  /* If the file has a restart index and the image is not downscaled,
+   * decode all bands in parallel straight into the buffer */
+  if (status && (pr->band > 0) && (pr->reduce < 2)) {
+    pb = sph_bands_start(pr, pBuf, (size_t) stride);
+  }
+  
+  if (status && (pb != NULL)) {
+    status = sph_bands_finish(pb);
+    sph_bands_stop(pb);
+    pb = NULL;
+    
+    if (status) {
+      pr->scan_count = pr->h;
+    } else {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_READDATA;
+      }
+      pr->err_flag = 1;
+    }
+  
+  } else if (status) {
+    /* Otherwise, decode serially as one batch, which converts each
+     * scanline straight into the buffer; read-ahead would only add a
+     * copy, so it is turned off */
+    pr->ahead = 0;
+    status = sph_image_reader_readRows(pr, pBuf, stride, pr->rh, pError);
+  }
+  
+  /* Free an allocated buffer on error */
+  if (!status) {
+    if (pDst == NULL) {
+      free(pBuf);
+    }
+    pBuf = NULL;
+  }
+  
+  /* Return the buffer if successful, NULL if error */
+  return pBuf;
+}
+
+/*
+ * sph_image_reader_seek function.
+ */
+int sph_image_reader_seek(
+          SPH_IMAGE_READER * pr,
+    const SPH_IMAGE_INDEX  * px,
+          int32_t            y,
+          int              * pError) {
+  
+  int status = 1;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  int32_t best = 0;
+  const SPH_CHECKPOINT *pc = NULL;
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((y < 0) || (y >= pr->h)) {
+    abort();
+  }
+  if ((pr->ftype != SPH_IMAGE_TYPE_PNG) || (pr->reduce > 1)) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Fail if in error mode */
+  if (pr->err_flag) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_READDATA;
+    }
+    status = 0;
+  }
+  
+  /* Check that the index belongs to the image */
+  if (status && (px != NULL)) {
+    if (!sph_index_match(px, pr)) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_INDEX;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Find the last checkpoint at or before the scanline */
+  if (status && (px != NULL)) {
+    lo = 0;
+    hi = px->count;
+    while (lo < hi) {
+      mid = lo + ((hi - lo) / 2);
+      if (px->pPoints[mid].row <= y) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo > 0) {
+      pc = &(px->pPoints[lo - 1]);
+      best = pc->row;
+    }
+  }
+  
+  if (status && (pr->scan_count >= best) && (pr->scan_count <= y)) {
+    /* The current position is at least as close -- decode forward with
+     * whichever decoder is in use */
+    while (status && (pr->scan_count < y)) {
+      status = sph_image_reader_readRows(pr, pr->pScan, pr->w, 1, pError);
+    }
+  
+  } else if (status && (!(pr->native))) {
+    /* Going back requires the native decoder */
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_INDEX;
+    }
+    status = 0;
+  
+  } else if (status) {
+    /* Stop the background decoders, which are of no use after a seek,
+     * and start the native decoder at the checkpoint */
+    sph_ahead_stop(pr->pAhead);
+    pr->pAhead = NULL;
+    sph_bands_stop(pr->pBands);
+    pr->pBands = NULL;
+    
+    if (pr->pNative == NULL) {
+      pr->pNative = sph_native_new(&(pr->alloc), pr);
+    }
+    status = sph_native_start(pr->pNative, pr->idat_off, pc);
+    
+    /* Decode forward to the scanline */
+    while (status && (pr->pNative->row < y)) {
+      status = sph_native_row(pr->pNative, NULL, NULL);
+    }
+    
+    if (status) {
+      pr->scan_count = y;
+    } else {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_READDATA;
+      }
+      pr->err_flag = 1;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * sph_image_reader_restart function.
+ */
+int32_t sph_image_reader_restart(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pr->band;
+}
+
+/*
+ * sph_image_reader_setThreads function.
+ */
+void sph_image_reader_setThreads(SPH_IMAGE_READER *pr, int threads) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if (threads < 0) {
+    abort();
+  }
+  
+  /* Check that reading has not started yet */
+  if (pr->scan_count > 0) {
+    abort();
+  }
+  
+  /* Set the requested value */
+  pr->threads = threads;
+}
+
+/*
+ * sph_image_reader_setReadAhead function.
+ */
+void sph_image_reader_setReadAhead(SPH_IMAGE_READER *pr, int32_t rows) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((rows < 0) || (rows > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Check that reading has not started yet */
+  if (pr->scan_count > 0) {
+    abort();
+  }
+  
+  /* Set the requested value */
+  pr->ahead = rows;
+}
+
+/*
+ * sph_image_reader_setReduce function.
+ */
+void sph_image_reader_setReduce(SPH_IMAGE_READER *pr, int32_t factor) {
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((factor < 1) || (factor > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  
+  /* Check that reading has not started yet and that the reader was
+   * not moved with sph_image_reader_seek() */
+  if ((pr->scan_count > 0) || (pr->pNative != NULL)) {
+    abort();
+  }
+  
+  /* Set the factor and the reduced dimensions, rounding up so that
+   * partial boxes at the right and bottom edges get their own
+   * pixels */
+  pr->reduce = factor;
+  pr->rw = (int32_t) ((((int64_t) pr->w) + factor - 1) / factor);
+  pr->rh = (int32_t) ((((int64_t) pr->h) + factor - 1) / factor);
+  
+  /* Make room for the running sums of one reduced scanline */
+  if (factor > 1) {
+    pr->pSum = (uint64_t *) sph_buf_fit(
+                  &(pr->alloc),
+                  pr->pSum,
+                  &(pr->sum_cap),
+                  ((size_t) pr->rw) * 4 * sizeof(uint64_t));
+  }
+}
+
+/*
+ * sph_image_reader_setCurves function.
+ */
+void sph_image_reader_setCurves(
+          SPH_IMAGE_READER * pr,
+    const uint8_t          * pTables) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Check that reading has not started yet */
+  if ((pr->scan_count > 0) || (pr->pNative != NULL) ||
+      (pr->pBands != NULL) || (pr->pAhead != NULL)) {
+    abort();
+  }
+  
+  /* Build the tables, or turn the curves off */
+  if (pTables != NULL) {
+    pr->pCurves = (uint32_t *) sph_buf_fit(
+                    &(pr->alloc),
+                    pr->pCurves,
+                    &(pr->curves_cap),
+                    4 * 256 * sizeof(uint32_t));
+    sph_curves_build(pr->pCurves, pTables);
+    pr->curves = 1;
+  } else {
+    pr->curves = 0;
+  }
+}
+
+/*
+ * sph_image_reader_peakMemory function.
+ */
+size_t sph_image_reader_peakMemory(SPH_IMAGE_READER *pr) {
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return sph_mem_peak(&(pr->alloc), 0);
+}
+
+/*
+ * sph_image_index_build function.
+ */
+SPH_IMAGE_INDEX *sph_image_index_build(
+    SPH_IMAGE_READER * pr,
+    int32_t            rows,
+    int              * pError) {
+  
+  int status = 1;
+  long start = 0;
+  int32_t next = 0;
+  SPH_IMAGE_INDEX *px = NULL;
+  SPH_NATIVE *pn = NULL;
+  
+  /* Check parameters */
+  if (pr == NULL) {
+    abort();
+  }
+  if ((rows < 0) || (rows > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if (rows < 1) {
+    rows = SPH_INDEX_ROWS;
+  }
+  if (pr->ftype != SPH_IMAGE_TYPE_PNG) {
+    abort();
+  }
+  
+  /* Check that no background decoder is using the file */
+  if ((pr->pBands != NULL) || (pr->pAhead != NULL)) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Fail if in error mode or if the format can't be indexed */
+  if (pr->err_flag) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_READDATA;
+    }
+    status = 0;
+  } else if (!(pr->native)) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_INDEX;
+    }
+    status = 0;
+  }
+  
+  /* Remember the file position and get the file size */
+  if (status) {
+    start = ftell(pr->pIn);
+    if (start < 0) {
+      status = 0;
+    }
+  }
+  if (status) {
+    px = (SPH_IMAGE_INDEX *) malloc(sizeof(SPH_IMAGE_INDEX));
+    if (px == NULL) {
+      abort();
+    }
+    memset(px, 0, sizeof(SPH_IMAGE_INDEX));
+    sph_mem_init(&(px->alloc), NULL, 0);
+    
+    px->w = pr->w;
+    px->h = pr->h;
+    px->bits = pr->bits;
+    px->ccount = pr->ccount;
+    px->rowbytes = ((((size_t) pr->w) * ((size_t) pr->ccount) *
+                      ((size_t) pr->bits)) + 7) / 8;
+    px->idat_off = pr->idat_off;
+    px->spacing = rows;
+    px->pPoints = NULL;
+    px->count = 0;
+    px->cap = 0;
+    
+    if (fseek(pr->pIn, 0, SEEK_END)) {
+      status = 0;
+    } else {
+      px->fsize = ftell(pr->pIn);
+      if (px->fsize < 0) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Decode the whole image, recording checkpoints along the way */
+  if (status) {
+    pn = sph_native_new(&(pr->alloc), pr);
+    status = sph_native_start(pn, pr->idat_off, NULL);
+    next = rows;
+    while (status && (pn->row < pn->h)) {
+      status = sph_native_row(pn, px, &next);
+    }
+    sph_native_free(pn);
+    pn = NULL;
+  }
+  if ((!status) && (pError != NULL) && (*pError == SPH_IMAGE_ERR_NONE)) {
+    *pError = SPH_IMAGE_ERR_READDATA;
+  }
+  
+  /* Restore the file position for the reader */
+  if (start > 0) {
+    clearerr(pr->pIn);
+    if (fseek(pr->pIn, start, SEEK_SET)) {
+      abort();
+    }
+  }
+  
+  /* Free the index if failure */
+  if (!status) {
+    sph_image_index_free(px);
+    px = NULL;
+  }
+  
+  /* Return the new index or NULL */
+  return px;
+}
+
+/*
+ * sph_image_index_save function.
+ */
+int sph_image_index_save(
+    const SPH_IMAGE_INDEX * px,
+    const char            * pPath,
+          int             * pError) {
+  
+  int status = 1;
+  int32_t i = 0;
+  uint32_t crc = 0;
+  FILE *pOut = NULL;
+  const SPH_CHECKPOINT *pc = NULL;
+  uint8_t hdr[44];
+  uint8_t rec[28];
+  
+  /* Check parameters */
+  if ((px == NULL) || (pPath == NULL)) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Open the index file */
+  pOut = fopen(pPath, "wb");
+  if (pOut == NULL) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_OPEN;
+    }
+    status = 0;
+  }
+  
+  /* Write the header */
+  if (status) {
+    crc = (uint32_t) crc32(0L, Z_NULL, 0);
+    
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, SPH_INDEX_MAGIC, 8);
+    sph_put_be32(hdr + 8, (uint32_t) px->w);
+    sph_put_be32(hdr + 12, (uint32_t) px->h);
+    hdr[16] = (uint8_t) px->bits;
+    hdr[17] = (uint8_t) px->ccount;
+    sph_put_be32(hdr + 20, (uint32_t) px->spacing);
+    sph_put_be64(hdr + 24, (uint64_t) px->fsize);
+    sph_put_be64(hdr + 32, (uint64_t) px->idat_off);
+    sph_put_be32(hdr + 40, (uint32_t) px->count);
+    
+    status = sph_index_put(pOut, hdr, sizeof(hdr), &crc);
+  }
+  
+  /* Write each checkpoint */
+  for(i = 0; status && (i < px->count); i++) {
+    pc = &(px->pPoints[i]);
+    
+    memset(rec, 0, sizeof(rec));
+    sph_put_be32(rec, (uint32_t) pc->row);
+    sph_put_be32(rec + 4, pc->part);
+    sph_put_be64(rec + 8, (uint64_t) pc->off);
+    sph_put_be32(rec + 16, pc->left);
+    rec[20] = (uint8_t) pc->bits;
+    rec[21] = (uint8_t) pc->byte;
+    sph_put_be32(rec + 24, pc->wlen);
+    
+    status = sph_index_put(pOut, rec, sizeof(rec), &crc);
+    if (status) {
+      status = sph_index_put(pOut, pc->pWindow, (size_t) pc->wlen, &crc);
+    }
+    if (status) {
+      status = sph_index_put(pOut, pc->pPart, (size_t) pc->part, &crc);
+    }
+    if (status) {
+      status = sph_index_put(pOut, pc->pPrev, px->rowbytes, &crc);
+    }
+  }
+  
+  /* Write the CRC of everything */
+  if (status) {
+    sph_put_be32(rec, crc);
+    if (fwrite(rec, 1, 4, pOut) != 4) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file */
+  if (pOut != NULL) {
+    if (fclose(pOut)) {
+      status = 0;
+    }
+    pOut = NULL;
+    if ((!status) && (pError != NULL)) {
+      *pError = SPH_IMAGE_ERR_WRITEDATA;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
 
-static void sph_png_decodeRow(
-    const uint8_t  * pData,
-          uint32_t * pScan,
-          int        ccount,
-          int32_t    w);
+/*
+ * sph_image_index_load function.
+ */
+SPH_IMAGE_INDEX *sph_image_index_load(const char *pPath, int *pError) {
+  
+  int status = 1;
+  int32_t i = 0;
+  uint32_t crc = 0;
+  uint32_t count = 0;
+  uint64_t v = 0;
+  FILE *pIn = NULL;
+  SPH_IMAGE_INDEX *px = NULL;
+  SPH_CHECKPOINT *pc = NULL;
+  uint8_t hdr[44];
+  uint8_t rec[28];
+  
+  /* Check parameter */
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Open the index file */
+  pIn = fopen(pPath, "rb");
+  if (pIn == NULL) {
+    if (pError != NULL) {
+      *pError = SPH_IMAGE_ERR_OPEN;
+    }
+    status = 0;
+  }
+  
+  /* Read and check the header */
+  if (status) {
+    crc = (uint32_t) crc32(0L, Z_NULL, 0);
+    status = sph_index_get(pIn, hdr, sizeof(hdr), &crc);
+  }
+  if (status) {
+    if (memcmp(hdr, SPH_INDEX_MAGIC, 8) != 0) {
+      status = 0;
+    }
+  }
+  if (status) {
+    px = (SPH_IMAGE_INDEX *) malloc(sizeof(SPH_IMAGE_INDEX));
+    if (px == NULL) {
+      abort();
+    }
+    memset(px, 0, sizeof(SPH_IMAGE_INDEX));
+    sph_mem_init(&(px->alloc), NULL, 0);
+    
+    px->w = (int32_t) sph_be32(hdr + 8);
+    px->h = (int32_t) sph_be32(hdr + 12);
+    px->bits = hdr[16];
+    px->ccount = hdr[17];
+    px->spacing = (int32_t) sph_be32(hdr + 20);
+    count = sph_be32(hdr + 40);
+    
+    if ((sph_be32(hdr + 8) < 1) || (sph_be32(hdr + 8) > SPH_IMAGE_MAXDIM) ||
+        (sph_be32(hdr + 12) < 1) ||
+        (sph_be32(hdr + 12) > SPH_IMAGE_MAXDIM) ||
+        ((px->bits != 1) && (px->bits != 2) && (px->bits != 4) &&
+          (px->bits != 8)) ||
+        (px->ccount < 1) || (px->ccount > 4) ||
+        ((px->bits < 8) && (px->ccount != 1)) ||
+        (sph_be32(hdr + 20) < 1) ||
+        (sph_be32(hdr + 20) > SPH_IMAGE_MAXDIM) ||
+        (count > (uint32_t) px->h)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    px->rowbytes = ((((size_t) px->w) * ((size_t) px->ccount) *
+                      ((size_t) px->bits)) + 7) / 8;
+    
+    v = sph_be64(hdr + 24);
+    if (v > (uint64_t) LONG_MAX) {
+      status = 0;
+    } else {
+      px->fsize = (long) v;
+    }
+    v = sph_be64(hdr + 32);
+    if (v > (uint64_t) LONG_MAX) {
+      status = 0;
+    } else {
+      px->idat_off = (long) v;
+    }
+  }
+  
+  /* Allocate the checkpoints */
+  if (status && (count > 0)) {
+    px->pPoints = (SPH_CHECKPOINT *) sph_mem_alloc(
+                    &(px->alloc),
+                    ((size_t) count) * sizeof(SPH_CHECKPOINT));
+    if (px->pPoints == NULL) {
+      abort();
+    }
+    px->cap = (int32_t) count;
+  }
+  
+  /* Read and check each checkpoint, which must be in increasing order
+   * of scanlines */
+  for(i = 0; status && (i < (int32_t) count); i++) {
+    status = sph_index_get(pIn, rec, sizeof(rec), &crc);
+    if (status) {
+      pc = &(px->pPoints[i]);
+      pc->row = (int32_t) sph_be32(rec);
+      pc->part = sph_be32(rec + 4);
+      v = sph_be64(rec + 8);
+      pc->left = sph_be32(rec + 16);
+      pc->bits = rec[20];
+      pc->byte = rec[21];
+      pc->wlen = sph_be32(rec + 24);
+      
+      if ((sph_be32(rec) >= (uint32_t) px->h) ||
+          ((i > 0) && (pc->row <= px->pPoints[i - 1].row)) ||
+          (pc->part > px->rowbytes + 1) ||
+          (v > (uint64_t) px->fsize) ||
+          (pc->left > UINT32_C(0x7fffffff)) ||
+          (pc->bits > 7) ||
+          (pc->wlen > SPH_INDEX_WINDOW)) {
+        status = 0;
+      } else {
+        pc->off = (long) v;
+      }
+    }
+    if (status) {
+      pc->pWindow = (uint8_t *) sph_mem_alloc(
+                      &(px->alloc),
+                      ((size_t) pc->wlen) + (2 * px->rowbytes) + 1);
+      if (pc->pWindow == NULL) {
+        abort();
+      }
+      pc->pPart = pc->pWindow + pc->wlen;
+      pc->pPrev = pc->pPart + px->rowbytes + 1;
+      px->count = i + 1;
+      
+      status = sph_index_get(pIn, pc->pWindow, (size_t) pc->wlen, &crc);
+    }
+    if (status) {
+      status = sph_index_get(pIn, pc->pPart, (size_t) pc->part, &crc);
+    }
+    if (status) {
+      status = sph_index_get(pIn, pc->pPrev, px->rowbytes, &crc);
+    }
+  }
+  
+  /* Check the CRC of everything */
+  if (status) {
+    if (fread(rec, 1, 4, pIn) != 4) {
+      status = 0;
+    } else if (sph_be32(rec) != crc) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file */
+  if (pIn != NULL) {
+    fclose(pIn);
+    pIn = NULL;
+    if ((!status) && (pError != NULL)) {
+      *pError = SPH_IMAGE_ERR_INDEX;
+    }
+  }
+  
+  /* Free the index if failure */
+  if (!status) {
+    sph_image_index_free(px);
+    px = NULL;
+  }
+  
+  /* Return the loaded index or NULL */
+  return px;
+}
 
-static int sph_path_getImageType(const char *pPath);
+/*
+ * sph_image_index_free function.
+ */
+void sph_image_index_free(SPH_IMAGE_INDEX *px) {
+  
+  int32_t i = 0;
+  
+  /* Only proceed if non-NULL parameter */
+  if (px != NULL) {
+    for(i = 0; i < px->count; i++) {
+      sph_mem_free(&(px->alloc), px->pPoints[i].pWindow);
+    }
+    sph_mem_free(&(px->alloc), px->pPoints);
+    sph_mem_destroy(&(px->alloc));
+    free(px);
+  }
+}
 
 /*
- * Convert a scanline row to the PNG RGBA format.
- * 
- * pScan points to the scanline to convert.  On input it holds packed
- * ARGB color values.  Its length is w pixels.  w must be in range
- * [1, SPH_IMAGE_MAXDIM].
- * 
- * RGBA binary values that can be passed to the PNG codec will be
- * written to pData.  The length of this buffer must be (w * 4) bytes.
- * 
- * Parameters:
- * 
- *   pScan - pointer to the scanline buffer
- * 
- *   pData - pointer to the data buffer
- * 
- *   w - width of the scanline buffer in pixels
+ * sph_image_index_count function.
  */
-static void sph_png_rowRGBA(
-    const uint32_t * pScan,
-          uint8_t  * pData,
-          int32_t    w) {
+int32_t sph_image_index_count(const SPH_IMAGE_INDEX *px) {
   
-  SPH_ARGB argb;
+  /* Check parameter */
+  if (px == NULL) {
+    abort();
+  }
   
-  /* Clear structure */
-  memset(&argb, 0, sizeof(SPH_ARGB));
+  /* Return requested value */
+  return px->count;
+}
+
+/*
+ * sph_image_cache_newFromPath function.
+ */
+SPH_IMAGE_CACHE *sph_image_cache_newFromPath(
+    const char * pPath,
+          int32_t  strip,
+          size_t   mem,
+          int    * pError) {
+  
+  int status = 1;
+  int i = 0;
+  int32_t j = 0;
+  size_t slen = 0;
+  size_t stripmem = 0;
+  size_t nslots = 0;
+  SPH_IMAGE_CACHE *pc = NULL;
   
   /* Check parameters */
-  if ((pScan == NULL) || (pData == NULL)) {
+  if (pPath == NULL) {
     abort();
   }
-  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+  if ((strip < 0) || (strip > SPH_IMAGE_MAXDIM)) {
     abort();
   }
   
-  /* Convert scanline */
-  for( ; w > 0; w--) {
-    sph_argb_unpack(*pScan, &argb);
-    pData[0] = (unsigned char) argb.r;
-    pData[1] = (unsigned char) argb.g;
-    pData[2] = (unsigned char) argb.b;
-    pData[3] = (unsigned char) argb.a;
-    pData += 4;
-    pScan++;
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Allocate the structure with the standard library allocator */
+  pc = (SPH_IMAGE_CACHE *) malloc(sizeof(SPH_IMAGE_CACHE));
+  if (pc == NULL) {
+    abort();
+  }
+  memset(pc, 0, sizeof(SPH_IMAGE_CACHE));
+  sph_mem_init(&(pc->alloc), NULL, 0);
+  
+  /* Open the image */
+  pc->pr = sph_image_reader_newFromPath(pPath, pError);
+  if (pc->pr == NULL) {
+    status = 0;
+  }
+  
+  /* Copy the path */
+  if (status) {
+    slen = strlen(pPath);
+    pc->pPath = (char *) sph_mem_alloc(&(pc->alloc), slen + 1);
+    if (pc->pPath == NULL) {
+      abort();
+    }
+    memcpy(pc->pPath, pPath, slen + 1);
+    
+    pc->w = pc->pr->w;
+    pc->h = pc->pr->h;
+    pc->pitch = sph_row_pitch(pc->w);
+  }
+  
+  /* With restart points, each strip is a restart band; otherwise, use
+   * the requested strip height */
+  if (status && (pc->pr->band > 0)) {
+    pc->restart = 1;
+    sph_bands_config(&(pc->bands), pc->pr);
+    pc->bands.pAlloc = &(pc->alloc);
+    pc->strip = pc->pr->band;
+    
+    pc->pCur = (uint8_t *) sph_mem_allocAligned(
+                  &(pc->alloc), pc->bands.rowbytes + 1);
+    pc->pPrev = (uint8_t *) sph_mem_allocAligned(
+                  &(pc->alloc), pc->bands.rowbytes + 1);
+    if ((pc->pCur == NULL) || (pc->pPrev == NULL)) {
+      abort();
+    }
+  
+  } else if (status) {
+    pc->restart = 0;
+    pc->strip = strip;
+    if (pc->strip < 1) {
+      pc->strip = SPH_CACHE_STRIP;
+    }
+    if (pc->strip > pc->h) {
+      pc->strip = pc->h;
+    }
+  }
+  
+  /* Determine how many strips fit in the memory limit, keeping at least
+   * one */
+  if (status) {
+    pc->strip_count = ((pc->h - 1) / pc->strip) + 1;
+    
+    if (mem < 1) {
+      mem = SPH_CACHE_MEM;
+    }
+    stripmem = ((size_t) pc->strip) * pc->pitch * sizeof(uint32_t);
+    nslots = mem / stripmem;
+    if (nslots < 1) {
+      nslots = 1;
+    }
+    if (nslots > (size_t) pc->strip_count) {
+      nslots = (size_t) pc->strip_count;
+    }
+    pc->nslots = (int) nslots;
+  }
+  
+  /* Allocate the slot table and the strip table */
+  if (status) {
+    pc->pSlotStrip = (int32_t *) sph_mem_alloc(
+                      &(pc->alloc),
+                      ((size_t) pc->nslots) * sizeof(int32_t));
+    pc->pSlotUse = (uint64_t *) sph_mem_alloc(
+                      &(pc->alloc),
+                      ((size_t) pc->nslots) * sizeof(uint64_t));
+    pc->ppSlotBuf = (uint32_t **) sph_mem_alloc(
+                      &(pc->alloc),
+                      ((size_t) pc->nslots) * sizeof(uint32_t *));
+    pc->pStripSlot = (int *) sph_mem_alloc(
+                      &(pc->alloc),
+                      ((size_t) pc->strip_count) * sizeof(int));
+    if ((pc->pSlotStrip == NULL) || (pc->pSlotUse == NULL) ||
+        (pc->ppSlotBuf == NULL) || (pc->pStripSlot == NULL)) {
+      abort();
+    }
+    
+    for(i = 0; i < pc->nslots; i++) {
+      pc->pSlotStrip[i] = -1;
+      pc->pSlotUse[i] = 0;
+      pc->ppSlotBuf[i] = NULL;
+    }
+    for(j = 0; j < pc->strip_count; j++) {
+      pc->pStripSlot[j] = -1;
+    }
+    pc->use = 0;
+    pc->err_flag = 0;
+  }
+  
+  /* Release the object if failure */
+  if (!status) {
+    sph_image_cache_close(pc);
+    pc = NULL;
+  }
+  
+  /* Return the new object or NULL */
+  return pc;
+}
+
+/*
+ * sph_image_cache_close function.
+ */
+void sph_image_cache_close(SPH_IMAGE_CACHE *pc) {
+  
+  int i = 0;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pc != NULL) {
+    
+    /* Free the strip buffers */
+    if (pc->ppSlotBuf != NULL) {
+      for(i = 0; i < pc->nslots; i++) {
+        sph_mem_freeAligned(&(pc->alloc), pc->ppSlotBuf[i]);
+      }
+    }
+    sph_mem_free(&(pc->alloc), pc->ppSlotBuf);
+    sph_mem_free(&(pc->alloc), pc->pSlotStrip);
+    sph_mem_free(&(pc->alloc), pc->pSlotUse);
+    sph_mem_free(&(pc->alloc), pc->pStripSlot);
+    
+    /* Free the band work buffers */
+    sph_mem_free(&(pc->alloc), pc->pComp);
+    sph_mem_freeAligned(&(pc->alloc), pc->pCur);
+    sph_mem_freeAligned(&(pc->alloc), pc->pPrev);
+    
+    /* Close the reader, which also closes the file */
+    sph_image_reader_close(pc->pr);
+    
+    sph_mem_free(&(pc->alloc), pc->pPath);
+    sph_mem_destroy(&(pc->alloc));
+    free(pc);
+  }
+}
+
+/*
+ * sph_image_cache_width function.
+ */
+int32_t sph_image_cache_width(SPH_IMAGE_CACHE *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pc->w;
+}
+
+/*
+ * sph_image_cache_height function.
+ */
+int32_t sph_image_cache_height(SPH_IMAGE_CACHE *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pc->h;
+}
+
+/*
+ * sph_image_cache_strip function.
+ */
+int32_t sph_image_cache_strip(SPH_IMAGE_CACHE *pc) {
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return pc->strip;
+}
+
+/*
+ * sph_image_cache_setIndex function.
+ */
+int sph_image_cache_setIndex(
+          SPH_IMAGE_CACHE * pc,
+    const SPH_IMAGE_INDEX * px,
+          int             * pError) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pc == NULL) {
+    abort();
+  }
+  
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Check that the index belongs to the image */
+  if (px != NULL) {
+    if (!sph_index_match(px, pc->pr)) {
+      if (pError != NULL) {
+        *pError = SPH_IMAGE_ERR_INDEX;
+      }
+      status = 0;
+    }
+  }
+  
+  /* Use the index, unless restart bands make it unnecessary */
+  if (status && (!(pc->restart))) {
+    pc->pIndex = px;
   }
+  
+  /* Return status */
+  return status;
 }
 
 /*
- * Convert a scanline row to the PNG RGB format.
- * 
- * pScan points to the scanline to convert.  On input it holds packed
- * ARGB color values.  Its length is w pixels.  w must be in range
- * [1, SPH_IMAGE_MAXDIM].
- * 
- * RGB binary values that can be passed to the PNG codec will be written
- * to pData.  The length of this buffer must be (w * 3) bytes.
- * 
- * Parameters:
- * 
- *   pScan - pointer to the scanline buffer
- * 
- *   pData - pointer to the data buffer
- * 
- *   w - width of the scanline buffer in pixels
+ * sph_image_cache_getRow function.
  */
-static void sph_png_rowRGB(
-    const uint32_t * pScan,
-          uint8_t  * pData,
-          int32_t    w) {
-  
-  SPH_ARGB argb;
+const uint32_t *sph_image_cache_getRow(
+    SPH_IMAGE_CACHE * pc,
+    int32_t           y,
+    int             * pError) {
   
-  /* Clear structure */
-  memset(&argb, 0, sizeof(SPH_ARGB));
+  int slot = 0;
+  int32_t st = 0;
+  const uint32_t *pResult = NULL;
   
   /* Check parameters */
-  if ((pScan == NULL) || (pData == NULL)) {
+  if (pc == NULL) {
     abort();
   }
-  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+  if ((y < 0) || (y >= pc->h)) {
     abort();
   }
   
-  /* Convert scanline */
-  for( ; w > 0; w--) {
-    sph_argb_unpack(*pScan, &argb);
-    sph_argb_downRGB(&argb);
-    pData[0] = (unsigned char) argb.r;
-    pData[1] = (unsigned char) argb.g;
-    pData[2] = (unsigned char) argb.b;
-    pData += 3;
-    pScan++;
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Load the strip and find the scanline within it */
+  st = y / pc->strip;
+  slot = sph_cache_load(pc, st, pError);
+  if (slot >= 0) {
+    pResult = pc->ppSlotBuf[slot] +
+                (((size_t) (y - (st * pc->strip))) * pc->pitch);
   }
+  
+  /* Return the scanline if successful, NULL if error */
+  return pResult;
 }
 
 /*
- * Convert a scanline row to the PNG grayscale format.
- * 
- * pScan points to the scanline to convert.  On input it holds packed
- * ARGB color values.  Its length is w pixels.  w must be in range
- * [1, SPH_IMAGE_MAXDIM].
- * 
- * Grayscale binary values that can be passed to the PNG codec will be
- * written to pData.  The length of this buffer must be (w) bytes.
- * 
- * Parameters:
- * 
- *   pScan - pointer to the scanline buffer
- * 
- *   pData - pointer to the data buffer
- * 
- *   w - width of the scanline buffer in pixels
+ * sph_image_cache_getTile function.
  */
-static void sph_png_rowGray(
-    const uint32_t * pScan,
-          uint8_t  * pData,
-          int32_t    w) {
-  
-  SPH_ARGB argb;
+int sph_image_cache_getTile(
+    SPH_IMAGE_CACHE * pc,
+    int32_t           x,
+    int32_t           y,
+    int32_t           w,
+    int32_t           h,
+    uint32_t        * pDst,
+    int32_t           stride,
+    int             * pError) {
   
-  /* Clear structure */
-  memset(&argb, 0, sizeof(SPH_ARGB));
+  int status = 1;
+  int slot = 0;
+  int32_t st = 0;
+  int32_t row = 0;
+  const uint32_t *pRow = NULL;
   
   /* Check parameters */
-  if ((pScan == NULL) || (pData == NULL)) {
+  if ((pc == NULL) || (pDst == NULL)) {
     abort();
   }
-  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+  if ((x < 0) || (y < 0) || (w < 1) || (h < 1) ||
+      (w > pc->w - x) || (h > pc->h - y)) {
+    abort();
+  }
+  if (stride < 1) {
+    stride = w;
+  }
+  if (stride < w) {
     abort();
   }
   
-  /* Convert scanline */
-  for( ; w > 0; w--) {
-    sph_argb_unpack(*pScan, &argb);
-    sph_argb_downGray(&argb);
-    *pData = (unsigned char) argb.b;
-    pData++;
-    pScan++;
+  /* Clear the error code if provided */
+  if (pError != NULL) {
+    *pError = SPH_IMAGE_ERR_NONE;
+  }
+  
+  /* Copy the tile row by row, loading each strip once */
+  for(row = y; row < y + h; row++) {
+    if ((row == y) || (row / pc->strip != st)) {
+      st = row / pc->strip;
+      slot = sph_cache_load(pc, st, pError);
+      if (slot < 0) {
+        status = 0;
+        break;
+      }
+    }
+    pRow = pc->ppSlotBuf[slot] +
+            (((size_t) (row - (st * pc->strip))) * pc->pitch);
+    memcpy(pDst, pRow + x, ((size_t) w) * sizeof(uint32_t));
+    pDst += stride;
   }
+  
+  /* Return status */
+  return status;
 }
 
 /*
- * Given binary scanline data from a PNG file, decode it into a scanline
- * buffer.
- * 
- * ccount is the number of color channels, which must be in range
- * [1, 4].  One channel is grayscale, two is grayscale plus alpha, three
- * is RGB, four is RGB plus alpha.  w is the width in pixels.  w must be
- * in range [1, SPH_IMAGE_MAXDIM].
- * 
- * pData points to the bytes to decode.  Its length is (w * ccount)
- * bytes.
- * 
- * Packed ARGB pixels will be written to pScan.
- * 
- * Parameters:
- * 
- *   pData - pointer to the bytes to decode
- * 
- *   pScan - pointer to the output scanline
- * 
- *   ccount - the number of color channels
- * 
- *   w - the width of the scanline in pixels
+ * sph_image_resampler_new function.
  */
-static void sph_png_decodeRow(
-    const uint8_t  * pData,
-          uint32_t * pScan,
-          int        ccount,
-          int32_t    w) {
+SPH_IMAGE_RESAMPLER *sph_image_resampler_new(
+    int32_t sw,
+    int32_t sh,
+    int32_t dw,
+    int32_t dh,
+    int     kernel,
+    int     flags) {
+  
+  int32_t i = 0;
+  int32_t first = 0;
+  int32_t last = 0;
+  size_t len = 0;
+  double f = 0.0;
+  SPH_IMAGE_RESAMPLER *ps = NULL;
   
-  SPH_ARGB argb;
+  /* Check parameters */
+  if ((sw < 1) || (sw > SPH_IMAGE_MAXDIM) ||
+      (sh < 1) || (sh > SPH_IMAGE_MAXDIM) ||
+      (dw < 1) || (dw > SPH_IMAGE_MAXDIM) ||
+      (dh < 1) || (dh > SPH_IMAGE_MAXDIM)) {
+    abort();
+  }
+  if ((kernel < SPH_IMAGE_KERNEL_BOX) ||
+      (kernel > SPH_IMAGE_KERNEL_LANCZOS)) {
+    abort();
+  }
+  if ((flags & ~SPH_IMAGE_RESAMPLE_LINEAR) != 0) {
+    abort();
+  }
   
-  /* Clear structure */
-  memset(&argb, 0, sizeof(SPH_ARGB));
+  /* Allocate the structure with the standard library allocator */
+  ps = (SPH_IMAGE_RESAMPLER *) malloc(sizeof(SPH_IMAGE_RESAMPLER));
+  if (ps == NULL) {
+    abort();
+  }
+  memset(ps, 0, sizeof(SPH_IMAGE_RESAMPLER));
+  sph_mem_init(&(ps->alloc), NULL, 0);
+  
+  ps->sw = sw;
+  ps->sh = sh;
+  ps->dw = dw;
+  ps->dh = dh;
+  ps->kernel = kernel;
+  if (flags & SPH_IMAGE_RESAMPLE_LINEAR) {
+    ps->linear = 1;
+  } else {
+    ps->linear = 0;
+  }
   
-  /* Check parameters */
-  if ((pScan == NULL) || (pData == NULL)) {
+  /* Find the widest filter windows along each axis */
+  ps->xtaps = 1;
+  for(i = 0; i < dw; i++) {
+    sph_resampler_window(kernel, sw, dw, i, &first, &last);
+    if (last - first + 1 > ps->xtaps) {
+      ps->xtaps = last - first + 1;
+    }
+  }
+  ps->ytaps = 1;
+  for(i = 0; i < dh; i++) {
+    sph_resampler_window(kernel, sh, dh, i, &first, &last);
+    if (last - first + 1 > ps->ytaps) {
+      ps->ytaps = last - first + 1;
+    }
+  }
+  
+  /* Precompute the horizontal filter */
+  if (((size_t) dw) > SIZE_MAX / sizeof(int16_t) / ((size_t) ps->xtaps)) {
     abort();
   }
-  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
+  ps->pXStart = (int32_t *) sph_mem_alloc(
+                  &(ps->alloc), ((size_t) dw) * sizeof(int32_t));
+  ps->pXWeight = (int16_t *) sph_mem_allocAligned(
+                  &(ps->alloc),
+                  ((size_t) dw) * ((size_t) ps->xtaps) * sizeof(int16_t));
+  if ((ps->pXStart == NULL) || (ps->pXWeight == NULL)) {
     abort();
   }
-  if ((ccount < 1) || (ccount > 4)) {
+  for(i = 0; i < dw; i++) {
+    ps->pXStart[i] = sph_resampler_weights(
+                        kernel, sw, dw, ps->xtaps, i,
+                        ps->pXWeight + ((size_t) i) * ps->xtaps);
+  }
+  
+  /* Compute the vertical filter of the first destination scanline */
+  ps->pYWeight = (int16_t *) sph_mem_alloc(
+                  &(ps->alloc), ((size_t) ps->ytaps) * sizeof(int16_t));
+  if (ps->pYWeight == NULL) {
     abort();
   }
+  ps->ystart = sph_resampler_weights(
+                  kernel, sh, dh, ps->ytaps, 0, ps->pYWeight);
   
-  /* Decode scanline */
-  for( ; w > 0; w--) {
-    
-    /* Decode input */
-    if (ccount == 1) {
-      /* Grayscale */
-      argb.a = 255;
-      argb.r = *pData;
-      argb.g = argb.r;
-      argb.b = argb.r;
-      
-    } else if (ccount == 2) {
-      /* Grayscale plus alpha */
-      argb.a = pData[1];
-      argb.r = pData[0];
-      argb.g = argb.r;
-      argb.b = argb.r;
-      
-    } else if (ccount == 3) {
-      /* RGB */
-      argb.a = 255;
-      argb.r = pData[0];
-      argb.g = pData[1];
-      argb.b = pData[2];
-      
-    } else if (ccount == 4) {
-      /* RGBA */
-      argb.a = pData[3];
-      argb.r = pData[0];
-      argb.g = pData[1];
-      argb.b = pData[2];
-      
+  /* Build the conversion tables */
+  ps->pToLin = (uint16_t *) sph_mem_alloc(
+                  &(ps->alloc), 256 * sizeof(uint16_t));
+  if (ps->pToLin == NULL) {
+    abort();
+  }
+  for(i = 0; i < 256; i++) {
+    if (ps->linear) {
+      f = ((double) i) / 255.0;
+      if (f <= 0.04045) {
+        f = f / 12.92;
+      } else {
+        f = pow((f + 0.055) / 1.055, 2.4);
+      }
+      ps->pToLin[i] = (uint16_t) floor(f * SPH_RESAMPLE_MAX + 0.5);
     } else {
-      abort();  /* shouldn't happen */
+      ps->pToLin[i] = (uint16_t) (i * (SPH_RESAMPLE_MAX / 255));
     }
-    
-    /* Write packed result to output */
-    *pScan = sph_argb_pack(&argb);
-    
-    /* Advance pointers */
-    pData += ccount;
-    pScan++;
   }
+  if (ps->linear) {
+    ps->pFromLin = (uint8_t *) sph_mem_alloc(
+                      &(ps->alloc), SPH_RESAMPLE_MAX + 1);
+    if (ps->pFromLin == NULL) {
+      abort();
+    }
+    for(i = 0; i <= SPH_RESAMPLE_MAX; i++) {
+      f = ((double) i) / ((double) SPH_RESAMPLE_MAX);
+      if (f <= 0.0031308) {
+        f = f * 12.92;
+      } else {
+        f = 1.055 * pow(f, 1.0 / 2.4) - 0.055;
+      }
+      ps->pFromLin[i] = (uint8_t) floor(f * 255.0 + 0.5);
+    }
+  }
+  
+  /* Allocate the scanline buffers */
+  ps->pSrc = (uint32_t *) sph_mem_allocAligned(
+                &(ps->alloc), ((size_t) sw) * sizeof(uint32_t));
+  ps->pConv = (int16_t *) sph_mem_allocAligned(
+                &(ps->alloc), ((size_t) sw) * 4 * sizeof(int16_t));
+  ps->pAcc = (int32_t *) sph_mem_allocAligned(
+                &(ps->alloc), ((size_t) dw) * 4 * sizeof(int32_t));
+  if ((ps->pSrc == NULL) || (ps->pConv == NULL) || (ps->pAcc == NULL)) {
+    abort();
+  }
+  
+  /* Allocate the ring, starting each scanline on an aligned boundary */
+  len = SPH_IMAGE_ALIGN / sizeof(int16_t);
+  ps->ring_pitch = ((((size_t) dw) * 4 + len - 1) / len) * len;
+  if (((size_t) ps->ytaps) > SIZE_MAX / sizeof(int16_t) / ps->ring_pitch) {
+    abort();
+  }
+  ps->pRing = (int16_t *) sph_mem_allocAligned(
+                &(ps->alloc),
+                ((size_t) ps->ytaps) * ps->ring_pitch * sizeof(int16_t));
+  if (ps->pRing == NULL) {
+    abort();
+  }
+  
+  /* Return the new object */
+  return ps;
 }
 
 /*
- * Given a file path for an image, determine from the file extension
- * which image type is meant.
- * 
- * If the end of the string is a case-insensitive match for one of the
- * following:
- * 
- *   .PNG
- * 
- * Then this function returns the appropriate SPH_IMAGE_TYPE constant.
- * Otherwise, this function returns -1 to indicate that the file type
- * could not be determined from the path.
- * 
- * Parameters:
- * 
- *   pPath - the path to check
- * 
- * Return:
- * 
- *   the image type, or -1
+ * sph_image_resampler_free function.
  */
-static int sph_path_getImageType(const char *pPath) {
+void sph_image_resampler_free(SPH_IMAGE_RESAMPLER *ps) {
+  
+  /* Only proceed if non-NULL parameter */
+  if (ps != NULL) {
+    sph_mem_free(&(ps->alloc), ps->pXStart);
+    sph_mem_freeAligned(&(ps->alloc), ps->pXWeight);
+    sph_mem_free(&(ps->alloc), ps->pYWeight);
+    sph_mem_free(&(ps->alloc), ps->pToLin);
+    sph_mem_free(&(ps->alloc), ps->pFromLin);
+    sph_mem_freeAligned(&(ps->alloc), ps->pSrc);
+    sph_mem_freeAligned(&(ps->alloc), ps->pConv);
+    sph_mem_freeAligned(&(ps->alloc), ps->pRing);
+    sph_mem_freeAligned(&(ps->alloc), ps->pAcc);
+    sph_mem_destroy(&(ps->alloc));
+    free(ps);
+  }
+}
+
+/*
+ * sph_image_resampler_taps function.
+ */
+int32_t sph_image_resampler_taps(SPH_IMAGE_RESAMPLER *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Return requested value */
+  return ps->ytaps;
+}
+
+/*
+ * sph_image_resampler_needs function.
+ */
+int sph_image_resampler_needs(SPH_IMAGE_RESAMPLER *ps) {
   
-  size_t slen = 0;
-  int extlen = 0;
-  uint32_t extcode = 0;
-  int c = 0;
-  int i = 0;
   int result = 0;
   
   /* Check parameter */
-  if (pPath == NULL) {
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* More input is needed if the window of the next destination
+   * scanline isn't complete */
+  if ((ps->out_count < ps->dh) &&
+      (ps->in_count < ps->ystart + ps->ytaps)) {
+    result = 1;
+  }
+  
+  return result;
+}
+
+/*
+ * sph_image_resampler_ptr function.
+ */
+uint32_t *sph_image_resampler_ptr(SPH_IMAGE_RESAMPLER *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
+    abort();
+  }
+  
+  /* Return the source scanline buffer */
+  return ps->pSrc;
+}
+
+/*
+ * sph_image_resampler_push function.
+ */
+void sph_image_resampler_push(SPH_IMAGE_RESAMPLER *ps) {
+  
+  /* Check parameter */
+  if (ps == NULL) {
     abort();
   }
   
-  /* Get the size of the string, not including the terminating NUL */
-  slen = strlen(pPath);
+  /* Add the scanline in the buffer */
+  sph_resampler_push(ps, ps->pSrc);
+}
+
+/*
+ * sph_image_resampler_pushFrom function.
+ */
+void sph_image_resampler_pushFrom(
+          SPH_IMAGE_RESAMPLER * ps,
+    const uint32_t            * pSrc) {
   
-  /* If the size of the string is at least four, check whether the
-   * fourth from last character is an ASCII dot; if it is, set extlen to
-   * three to indicate a three-character file extension */
-  if (slen >= 4) {
-    if (pPath[slen - 4] == 0x2e) {
-      extlen = 3;
-    }
+  /* Check parameters */
+  if ((ps == NULL) || (pSrc == NULL)) {
+    abort();
   }
   
-  /* If the extension length hasn't been set yet and the size of the
-   * string is at least five, check whether the fifth from last
-   * character is an ASCII dot; if it is, set extlen to four to indicate
-   * a four-character file extension */
-  if ((extlen == 0) && (slen >= 5)) {
-    if (pPath[slen - 5] == 0x2e) {
-      extlen = 4;
-    }
+  /* Add the scanline straight from client memory */
+  sph_resampler_push(ps, pSrc);
+}
+
+/*
+ * sph_image_resampler_row function.
+ */
+void sph_image_resampler_row(SPH_IMAGE_RESAMPLER *ps, uint32_t *pDst) {
+  
+  int32_t x = 0;
+  int32_t t = 0;
+  int32_t w = 0;
+  int32_t a = 0;
+  int32_t v = 0;
+  int c = 0;
+  size_t i = 0;
+  size_t n = 0;
+  uint32_t pix = 0;
+  const int16_t *pr = NULL;
+  int32_t *pa = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  if ((ps->out_count >= ps->dh) ||
+      (ps->in_count < ps->ystart + ps->ytaps)) {
+    abort();
   }
   
-  /* If extlen is non-zero, form the uppercase extension code; else,
-   * leave extension code set to zero */
-  for(i = extlen; i >= 1; i--) {
-    c = pPath[slen - i];
-    if ((c >= 0x61) && (c <= 0x7a)) {
-      /* Lowercase letter -- make uppercase */
-      c = c - 0x20;
+  /* Filter the ring vertically, one source scanline at a time, so that
+   * the inner loop runs over whole contiguous scanlines */
+  n = ((size_t) ps->dw) * 4;
+  pa = ps->pAcc;
+  memset(pa, 0, n * sizeof(int32_t));
+  for(t = 0; t < ps->ytaps; t++) {
+    w = ps->pYWeight[t];
+    if (w != 0) {
+      pr = ps->pRing +
+            ((size_t) ((ps->ystart + t) % ps->ytaps)) * ps->ring_pitch;
+      for(i = 0; i < n; i++) {
+        pa[i] += w * pr[i];
+      }
     }
-    extcode = (extcode << 8) | ((uint32_t) c);
   }
   
-  /* Look up extension code */
-  if (extcode == 0x504e47) {
-    result = SPH_IMAGE_TYPE_PNG;
-  
-  } else {
-    /* Unrecognized */
-    result = -1;
+  /* Round each value, undo the premultiplication, convert back from
+   * the fixed-point scale, and pack */
+  for(x = 0; x < ps->dw; x++) {
+    for(c = 0; c < 4; c++) {
+      if (pa[c] > 0) {
+        pa[c] = (pa[c] + (SPH_RESAMPLE_ONE / 2)) >> SPH_RESAMPLE_BITS;
+        if (pa[c] > SPH_RESAMPLE_MAX) {
+          pa[c] = SPH_RESAMPLE_MAX;
+        }
+      } else {
+        pa[c] = 0;
+      }
+    }
+    
+    a = pa[0];
+    if (a > 0) {
+      pix = ((uint32_t) ((a + (SPH_RESAMPLE_MAX / 510)) /
+                          (SPH_RESAMPLE_MAX / 255))) << 24;
+      for(c = 1; c < 4; c++) {
+        v = pa[c];
+        if (v > a) {
+          v = a;
+        }
+        v = (v * SPH_RESAMPLE_MAX + (a / 2)) / a;
+        if (ps->linear) {
+          v = ps->pFromLin[v];
+        } else {
+          v = (v + (SPH_RESAMPLE_MAX / 510)) / (SPH_RESAMPLE_MAX / 255);
+        }
+        pix |= ((uint32_t) v) << (8 * (3 - c));
+      }
+    } else {
+      pix = 0;
+    }
+    pDst[x] = pix;
+    pa += 4;
   }
   
-  /* Return result */
-  return result;
+  /* Move on to the next destination scanline */
+  (ps->out_count)++;
+  if (ps->out_count < ps->dh) {
+    ps->ystart = sph_resampler_weights(
+                    ps->kernel, ps->sh, ps->dh, ps->ytaps, ps->out_count,
+                    ps->pYWeight);
+  }
 }
 
 /*
- * Public function implementations
- * ===============================
- * 
- * See header for specifications.
- */
-
-/*
- * sph_argb_pack function.
+ * sph_image_pipeline_new function.
  */
-uint32_t sph_argb_pack(const SPH_ARGB *pc) {
+SPH_IMAGE_PIPELINE *sph_image_pipeline_new(SPH_IMAGE_READER *pr) {
   
-  uint32_t a = 0;
-  uint32_t r = 0;
-  uint32_t g = 0;
-  uint32_t b = 0;
+  SPH_IMAGE_PIPELINE *pp = NULL;
   
   /* Check parameter */
-  if (pc == NULL) {
+  if (pr == NULL) {
     abort();
   }
-  
-  /* Get each channel, clamping the ranges */
-  if (pc->a < 0) {
-    a = (uint32_t) 0;
-  } else if (pc->a > 255) {
-    a = (uint32_t) 255;
-  } else {
-    a = (uint32_t) pc->a;
+  if ((pr->scan_count > 0) || (pr->out_count > 0)) {
+    abort();
   }
   
-  if (pc->r < 0) {
-    r = (uint32_t) 0;
-  } else if (pc->r > 255) {
-    r = (uint32_t) 255;
-  } else {
-    r = (uint32_t) pc->r;
+  /* Allocate the structure with the standard library allocator */
+  pp = (SPH_IMAGE_PIPELINE *) malloc(sizeof(SPH_IMAGE_PIPELINE));
+  if (pp == NULL) {
+    abort();
   }
+  memset(pp, 0, sizeof(SPH_IMAGE_PIPELINE));
+  sph_mem_init(&(pp->alloc), NULL, 0);
   
-  if (pc->g < 0) {
-    g = (uint32_t) 0;
-  } else if (pc->g > 255) {
-    g = (uint32_t) 255;
-  } else {
-    g = (uint32_t) pc->g;
+  if (pthread_mutex_init(&(pp->lock), NULL)) {
+    abort();
   }
-  
-  if (pc->b < 0) {
-    b = (uint32_t) 0;
-  } else if (pc->b > 255) {
-    b = (uint32_t) 255;
-  } else {
-    b = (uint32_t) pc->b;
+  if (pthread_cond_init(&(pp->cond), NULL)) {
+    abort();
   }
   
-  /* Merge into result */
-  return (uint32_t) (
-    (a << 24) |
-    (r << 16) |
-    (g <<  8) |
-     b);
+  pp->pr = pr;
+  pp->w = sph_image_reader_width(pr);
+  pp->h = sph_image_reader_height(pr);
+  pp->pStages = NULL;
+  pp->count = 0;
+  pp->cap = 0;
+  pp->pLinks = NULL;
+  pp->threaded = 0;
+  pp->ran = 0;
+  pp->stop = 0;
+  pp->err_code = SPH_IMAGE_ERR_NONE;
+  pp->has_source = 0;
+  
+  return pp;
 }
 
 /*
- * sph_argb_unpack function.
+ * sph_image_pipeline_free function.
  */
-void sph_argb_unpack(uint32_t c, SPH_ARGB *pc) {
+void sph_image_pipeline_free(SPH_IMAGE_PIPELINE *pp) {
+  
+  int32_t i = 0;
+  SPH_CONVOLVE *pc = NULL;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pp != NULL) {
+    for(i = 0; i < pp->count; i++) {
+      sph_image_resampler_free((pp->pStages)[i].ps);
+      pc = (pp->pStages)[i].pc;
+      if (pc != NULL) {
+        sph_mem_free(&(pp->alloc), pc->pKernel);
+        sph_mem_freeAligned(&(pp->alloc), pc->pPad);
+        sph_mem_freeAligned(&(pp->alloc), pc->pRing);
+        sph_mem_freeAligned(&(pp->alloc), pc->pAcc);
+        sph_mem_free(&(pp->alloc), pc);
+      }
+      sph_mem_free(&(pp->alloc), (void *) (pp->pStages)[i].ppIn);
+    }
+    if (pp->pLinks != NULL) {
+      for(i = 0; i < pp->count; i++) {
+        sph_mem_freeAligned(&(pp->alloc), (pp->pLinks)[i].pBuf);
+      }
+    }
+    sph_mem_free(&(pp->alloc), pp->pLinks);
+    sph_mem_free(&(pp->alloc), pp->pStages);
+    pthread_cond_destroy(&(pp->cond));
+    pthread_mutex_destroy(&(pp->lock));
+    sph_mem_destroy(&(pp->alloc));
+    free(pp);
+  }
+}
+
+/*
+ * sph_image_pipeline_addStage function.
+ */
+void sph_image_pipeline_addStage(
+          SPH_IMAGE_PIPELINE * pp,
+    const SPH_IMAGE_STAGE    * pStage) {
+  sph_pipeline_add(pp, pStage, NULL, NULL);
+}
+
+/*
+ * sph_image_pipeline_addResampler function.
+ */
+void sph_image_pipeline_addResampler(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              dw,
+    int32_t              dh,
+    int                  kernel,
+    int                  flags) {
+  
+  SPH_IMAGE_STAGE st;
+  SPH_IMAGE_RESAMPLER *ps = NULL;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(SPH_IMAGE_STAGE));
   
   /* Check parameters */
-  if (pc == NULL) {
+  if (pp == NULL) {
+    abort();
+  }
+  if (pp->ran) {
     abort();
   }
   
-  /* Clear structure */
-  memset(pc, 0, sizeof(SPH_ARGB));
+  /* Allocate the resampler and wrap it in a stage whose window is the
+   * vertical filter */
+  ps = sph_image_resampler_new(pp->w, pp->h, dw, dh, kernel, flags);
   
-  /* Get each channel */
-  pc->a = (uint32_t) ((c >> 24) & 0xff);
-  pc->r = (uint32_t) ((c >> 16) & 0xff);
-  pc->g = (uint32_t) ((c >>  8) & 0xff);
-  pc->b = (uint32_t) ( c        & 0xff);
+  st.w = dw;
+  st.h = dh;
+  st.window = sph_image_resampler_taps(ps);
+  st.lastFn = &sph_pipeline_resampleLast;
+  st.rowFn = &sph_pipeline_resampleRow;
+  st.pParam = ps;
+  
+  sph_pipeline_add(pp, &st, ps, NULL);
 }
 
 /*
- * sph_argb_downRGB function.
+ * sph_image_pipeline_addConvolution function.
  */
-void sph_argb_downRGB(SPH_ARGB *pc) {
+void sph_image_pipeline_addConvolution(
+          SPH_IMAGE_PIPELINE * pp,
+          int32_t              kw,
+          int32_t              kh,
+    const double             * pKernel,
+          int32_t              bias,
+          int                  flags) {
   
-  /* Check parameter */
-  if (pc == NULL) {
+  SPH_CONVOLVE *pc = NULL;
+  
+  /* Check parameters */
+  if ((pp == NULL) || (pKernel == NULL)) {
     abort();
   }
   
-  /* Clamp each channel */
-  if (pc->a < 0) {
-    pc->a = 0;
-  } else if (pc->a > 255) {
-    pc->a = 255;
+  /* Add the stage and fill in the weights */
+  pc = sph_pipeline_convolve(pp, kw, kh, 0, bias, flags);
+  if (sph_convolve_weights(pKernel, kw * kh, pc->pKernel) >
+        SPH_IMAGE_CONVOLVE_MAXGAIN * SPH_CONVOLVE_ONE) {
+    abort();
   }
+}
+
+/*
+ * sph_image_pipeline_addSeparable function.
+ */
+void sph_image_pipeline_addSeparable(
+          SPH_IMAGE_PIPELINE * pp,
+          int32_t              kw,
+    const double             * pRowKernel,
+          int32_t              kh,
+    const double             * pColKernel,
+          int32_t              bias,
+          int                  flags) {
+  
+  int32_t rgain = 0;
+  int32_t cgain = 0;
+  SPH_CONVOLVE *pc = NULL;
   
-  if (pc->r < 0) {
-    pc->r = 0;
-  } else if (pc->r > 255) {
-    pc->r = 255;
+  /* Check parameters */
+  if ((pp == NULL) || (pRowKernel == NULL) || (pColKernel == NULL)) {
+    abort();
   }
   
-  if (pc->g < 0) {
-    pc->g = 0;
-  } else if (pc->g > 255) {
-    pc->g = 255;
+  /* Add the stage and fill in the weights; each pass sums into its own
+   * accumulators, so each part must stay within the gain limit on its
+   * own, and the gain of the whole kernel is the product of the two */
+  pc = sph_pipeline_convolve(pp, kw, kh, 1, bias, flags);
+  rgain = sph_convolve_weights(pRowKernel, kw, pc->pKernel);
+  cgain = sph_convolve_weights(pColKernel, kh, pc->pKernel + kw);
+  if ((rgain > SPH_IMAGE_CONVOLVE_MAXGAIN * SPH_CONVOLVE_ONE) ||
+      (cgain > SPH_IMAGE_CONVOLVE_MAXGAIN * SPH_CONVOLVE_ONE)) {
+    abort();
   }
-  
-  if (pc->b < 0) {
-    pc->b = 0;
-  } else if (pc->b > 255) {
-    pc->b = 255;
+  if (((double) rgain) * ((double) cgain) >
+        ((double) SPH_IMAGE_CONVOLVE_MAXGAIN) *
+          ((double) SPH_CONVOLVE_ONE) * ((double) SPH_CONVOLVE_ONE)) {
+    abort();
   }
+}
+
+/*
+ * sph_image_pipeline_setThreaded function.
+ */
+void sph_image_pipeline_setThreaded(SPH_IMAGE_PIPELINE *pp, int threaded) {
   
-  /* If the alpha channel is zero, replace color with opaque white */
-  if (pc->a < 1) {
-    pc->a = 255;
-    pc->r = 255;
-    pc->g = 255;
-    pc->b = 255;
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
+  }
+  if (pp->ran) {
+    abort();
   }
   
-  /* If the alpha channel is in range [1, 244] then approximate a mix of
-   * the color against a white background */
-  if ((pc->a > 0) && (pc->a < 255)) {
-    
-    /* Compute channels */
-    pc->r = 255 + ((pc->a * (pc->r - 255)) / 255);
-    pc->g = 255 + ((pc->a * (pc->g - 255)) / 255);
-    pc->b = 255 + ((pc->a * (pc->b - 255)) / 255);
-    
-    /* Clamp channels and set alpha to opaque */
-    pc->a = 255;
-    
-    if (pc->r < 0) {
-      pc->r = 0;
-    } else if (pc->r > 255) {
-      pc->r = 255;
-    }
-    
-    if (pc->g < 0) {
-      pc->g = 0;
-    } else if (pc->g > 255) {
-      pc->g = 255;
-    }
-    
-    if (pc->b < 0) {
-      pc->b = 0;
-    } else if (pc->b > 255) {
-      pc->b = 255;
-    }
+  if (threaded) {
+    pp->threaded = 1;
+  } else {
+    pp->threaded = 0;
   }
 }
 
 /*
- * sph_argb_downGray function.
+ * sph_image_pipeline_width function.
  */
-void sph_argb_downGray(SPH_ARGB *pc) {
-  
-  int32_t gray = 0;
+int32_t sph_image_pipeline_width(SPH_IMAGE_PIPELINE *pp) {
   
   /* Check parameter */
-  if (pc == NULL) {
+  if (pp == NULL) {
     abort();
   }
   
-  /* Down-convert to RGB first */
-  sph_argb_downRGB(pc);
-  
-  /* Adjust results if RGB channels not equal */
-  if ((pc->r != pc->g) || (pc->r != pc->b)) {
-    
-    /* Compute grayscale value */
-    gray = (2126 * ((int32_t) pc->r) +
-            7152 * ((int32_t) pc->g) +
-             722 * ((int32_t) pc->b)) / 10000;
-    
-    /* Clamp grayscale value */
-    if (gray < 0) {
-      gray = 0;
-    } else if (gray > 255) {
-      gray = 255;
-    }
-    
-    /* Replace RGB channels with grayscale value */
-    pc->r = (int) gray;
-    pc->g = (int) gray;
-    pc->b = (int) gray;
+  return pp->w;
+}
+
+/*
+ * sph_image_pipeline_height function.
+ */
+int32_t sph_image_pipeline_height(SPH_IMAGE_PIPELINE *pp) {
+  
+  /* Check parameter */
+  if (pp == NULL) {
+    abort();
   }
+  
+  return pp->h;
 }
 
 /*
- * sph_image_writer_new function.
+ * sph_image_pipeline_run function.
  */
-SPH_IMAGE_WRITER *sph_image_writer_new(
-    FILE    * pOut,
-    int       ftype,
-    int32_t   w,
-    int32_t   h,
-    int       dconv,
-    int       q) {
-  
-  SPH_IMAGE_WRITER *pw = NULL;
+int sph_image_pipeline_run(
+    SPH_IMAGE_PIPELINE * pp,
+    SPH_IMAGE_WRITER   * pw,
+    int                * pError) {
   
-  /* Ignore the q parameter */
-  (void) q;
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t i = 0;
+  int32_t y = 0;
+  SPH_PIPE_LINK *pl = NULL;
   
   /* Check parameters */
-  if (pOut == NULL) {
-    abort();
-  }
-  if (ftype != SPH_IMAGE_TYPE_PNG) {
-    abort();
-  }
-  if ((w < 1) || (w > SPH_IMAGE_MAXDIM)) {
-    abort();
-  }
-  if ((h < 1) || (h > SPH_IMAGE_MAXDIM)) {
+  if ((pp == NULL) || (pw == NULL)) {
     abort();
   }
-  if ((dconv != SPH_IMAGE_DOWN_NONE) &&
-      (dconv != SPH_IMAGE_DOWN_RGB) &&
-      (dconv != SPH_IMAGE_DOWN_GRAY)) {
+  if (pp->ran) {
     abort();
   }
-  
-  /* Allocate image writer structure */
-  pw = (SPH_IMAGE_WRITER *) malloc(sizeof(SPH_IMAGE_WRITER));
-  if (pw == NULL) {
+  if ((pw->w != pp->w) || (pw->h != pp->h) || (pw->scan_count > 0)) {
     abort();
   }
-  memset(pw, 0, sizeof(SPH_IMAGE_WRITER));
-  
-  /* Allocate scanline buffer */
-  pw->pScan = (uint32_t *) malloc(((size_t) w) * sizeof(uint32_t));
-  if (pw->pScan == NULL) {
+  if ((pp->pr->scan_count > 0) || (pp->pr->out_count > 0)) {
     abort();
   }
-  memset(pw->pScan, 0, ((size_t) w) * sizeof(uint32_t));
-  
-  /* Allocate data buffer */
-  if (dconv == SPH_IMAGE_DOWN_NONE) {
-    /* RGBA */
-    pw->pData = (uint8_t *) malloc(((size_t) w) * ((size_t) 4));
-    if (pw->pData == NULL) {
+  pp->ran = 1;
+  
+  /* Allocate the rings in front of each stage */
+  if (pp->count > 0) {
+    pp->pLinks = (SPH_PIPE_LINK *) sph_mem_alloc(
+                    &(pp->alloc),
+                    ((size_t) pp->count) * sizeof(SPH_PIPE_LINK));
+    if (pp->pLinks == NULL) {
       abort();
     }
-    memset(pw->pData, 0, ((size_t) w) * ((size_t) 4));
-  
-  } else if (dconv == SPH_IMAGE_DOWN_RGB) {
-    /* RGB */
-    pw->pData = (uint8_t *) malloc(((size_t) w) * ((size_t) 3));
-    if (pw->pData == NULL) {
-      abort();
+    memset(pp->pLinks, 0, ((size_t) pp->count) * sizeof(SPH_PIPE_LINK));
+  }
+  for(i = 0; i < pp->count; i++) {
+    pl = &((pp->pLinks)[i]);
+    pl->w = (pp->pStages)[i].in_w;
+    pl->h = (pp->pStages)[i].in_h;
+    pl->cap = (pp->pStages)[i].def.window;
+    if (pp->threaded) {
+      pl->cap += SPH_PIPELINE_SLACK;
     }
-    memset(pw->pData, 0, ((size_t) w) * ((size_t) 3));
-  
-  } else if (dconv == SPH_IMAGE_DOWN_GRAY) {
-    /* Grayscale */
-    pw->pData = (uint8_t *) malloc((size_t) w);
-    if (pw->pData == NULL) {
+    if (pl->cap > pl->h) {
+      pl->cap = pl->h;
+    }
+    pl->pitch = sph_row_pitch(pl->w);
+    pl->pBuf = (uint32_t *) sph_mem_allocAligned(
+                  &(pp->alloc),
+                  ((size_t) pl->cap) * pl->pitch * sizeof(uint32_t));
+    if (pl->pBuf == NULL) {
       abort();
     }
-    memset(pw->pData, 0, (size_t) w);
-  
-  } else {
-    /* Unrecognized down-conversion */
-    abort();
+    pl->produced = 0;
+    pl->released = 0;
+    pl->done = 0;
   }
   
-  /* Initialize all general fields */
-  pw->pOut = pOut;
-  pw->ftype = ftype;
-  pw->w = w;
-  pw->h = h;
-  pw->scan_count = 0;
-  pw->dconv = dconv;
+  /* Run the pipeline */
+  if (pp->count < 1) {
+    /* No stages, so read straight into the writer */
+    for(y = 0; y < pp->h; y++) {
+      if (!sph_image_reader_readInto(
+              pp->pr, sph_image_writer_ptr(pw), &err)) {
+        status = 0;
+        break;
+      }
+      if (!sph_image_writer_writeEx(pw, &err)) {
+        status = 0;
+        break;
+      }
+    }
   
-  /* Initialize specific codec */
-  if (ftype == SPH_IMAGE_TYPE_PNG) {
-    /* Initialize PNG codec */
-    pw->png_ptr = png_create_write_struct(
-                PNG_LIBPNG_VER_STRING,
-                NULL, NULL, NULL);  /* Default error handling */
-    if (pw->png_ptr == NULL) {
-      /* Error initializing PNG codec */
-      abort();
+  } else if (!(pp->threaded)) {
+    /* Pull each output scanline through all stages */
+    for(y = 0; y < pp->h; y++) {
+      if (!sph_pipeline_pull(
+              pp, pp->count - 1, y, sph_image_writer_ptr(pw))) {
+        status = 0;
+        break;
+      }
+      if (!sph_image_writer_writeEx(pw, &err)) {
+        sph_pipeline_fail(pp, err);
+        status = 0;
+        break;
+      }
     }
-    
-    pw->info_ptr = png_create_info_struct(pw->png_ptr);
-    if (pw->info_ptr == NULL) {
-      /* Error creating information structure */
-      abort();
+    if (!status) {
+      err = pp->err_code;
     }
   
-    /* Establish error handler for PNG */
-    if (setjmp(png_jmpbuf(pw->png_ptr))) {
-      /* Careful -- local variables may be in uncertain state? */
-      abort();
+  } else {
+    /* Start the source thread and a thread for every stage but the
+     * last; if a thread can't be started, the pipeline just stops */
+    if (pthread_create(&(pp->source), NULL, &sph_pipeline_source, pp)) {
+      sph_pipeline_fail(pp, SPH_IMAGE_ERR_UNKNOWN);
+    } else {
+      pp->has_source = 1;
+    }
+    for(i = 0; i < pp->count - 1; i++) {
+      if (pthread_create(&((pp->pStages)[i].thread), NULL,
+                          &sph_pipeline_worker, &((pp->pStages)[i]))) {
+        sph_pipeline_fail(pp, SPH_IMAGE_ERR_UNKNOWN);
+        break;
+      }
+      (pp->pStages)[i].has_thread = 1;
     }
-  
-    /* Initialize PNG I/O */
-    png_init_io(pw->png_ptr, pw->pOut);
-    
-    /* Initialize writing information */
-    if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
-      /* No down-conversion, so full ARGB */
-      png_set_IHDR(pw->png_ptr, pw->info_ptr,
-          pw->w, pw->h,   /* Width and height */
-          8,              /* Bits per channel */
-          PNG_COLOR_TYPE_RGB_ALPHA,
-          PNG_INTERLACE_NONE,
-          PNG_COMPRESSION_TYPE_DEFAULT,
-          PNG_FILTER_TYPE_DEFAULT);
-    
-    } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
-      /* RGB down-conversion */
-      png_set_IHDR(pw->png_ptr, pw->info_ptr,
-          pw->w, pw->h,   /* Width and height */
-          8,              /* Bits per channel */
-          PNG_COLOR_TYPE_RGB,
-          PNG_INTERLACE_NONE,
-          PNG_COMPRESSION_TYPE_DEFAULT,
-          PNG_FILTER_TYPE_DEFAULT);
     
-    } else if (pw->dconv == SPH_IMAGE_DOWN_GRAY) {
-      /* Grayscale down-conversion */
-      png_set_IHDR(pw->png_ptr, pw->info_ptr,
-          pw->w, pw->h,   /* Width and height */
-          8,              /* Bits per channel */
-          PNG_COLOR_TYPE_GRAY,
-          PNG_INTERLACE_NONE,
-          PNG_COMPRESSION_TYPE_DEFAULT,
-          PNG_FILTER_TYPE_DEFAULT);
+    /* Run the last stage here, and wait for all threads */
+    sph_pipeline_stage(&((pp->pStages)[pp->count - 1]), pw);
     
-    } else {
-      /* Unrecognized down-conversion */
-      abort();
+    if (pp->has_source) {
+      pthread_join(pp->source, NULL);
+      pp->has_source = 0;
+    }
+    for(i = 0; i < pp->count - 1; i++) {
+      if ((pp->pStages)[i].has_thread) {
+        pthread_join((pp->pStages)[i].thread, NULL);
+        (pp->pStages)[i].has_thread = 0;
+      }
     }
     
-    /* Write PNG headers to output */
-    png_write_info(pw->png_ptr, pw->info_ptr);
+    if (pp->stop) {
+      status = 0;
+      err = pp->err_code;
+    }
+  }
   
-  } else {
-    /* Unrecognized image file type */
-    abort();
+  /* Set error code if necessary */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
   }
   
-  /* Return writer object */
-  return pw;
+  return status;
 }
 
 /*
- * sph_image_writer_newFromPath function.
+ * sph_image_mosaic_new function.
  */
-SPH_IMAGE_WRITER *sph_image_writer_newFromPath(
-    const char    * pPath,
-          int32_t   w,
-          int32_t   h,
-          int       dconv,
-          int       q,
-          int     * pError) {
+SPH_IMAGE_MOSAIC *sph_image_mosaic_new(int32_t cols, int32_t rows) {
   
-  int ftype = 0;
-  int status = 1;
-  FILE *pOut = NULL;
-  SPH_IMAGE_WRITER *pw = NULL;
+  SPH_IMAGE_MOSAIC *pm = NULL;
   
-  /* Check path parameter */
-  if (pPath == NULL) {
+  /* Check parameters */
+  if ((cols < 1) || (cols > SPH_IMAGE_MAXDIM) ||
+      (rows < 1) || (rows > SPH_IMAGE_MAXDIM)) {
     abort();
   }
   
-  /* Determine type from path */
-  ftype = sph_path_getImageType(pPath);
+  /* Allocate the structure with the standard library allocator */
+  pm = (SPH_IMAGE_MOSAIC *) malloc(sizeof(SPH_IMAGE_MOSAIC));
+  if (pm == NULL) {
+    abort();
+  }
+  memset(pm, 0, sizeof(SPH_IMAGE_MOSAIC));
+  sph_mem_init(&(pm->alloc), NULL, 0);
   
-  /* Fail if type could not be determined */
-  if (ftype == -1) {
-    if (pError != NULL) {
-      *pError = SPH_IMAGE_ERR_FILETYPE;
-    }
-    status = 0;
+  if (pthread_mutex_init(&(pm->lock), NULL)) {
+    abort();
+  }
+  if (pthread_cond_init(&(pm->cond), NULL)) {
+    abort();
   }
   
-  /* Open the output file */
-  if (status) {
-    pOut = fopen(pPath, "wb");
-    if (pOut == NULL) {
-      if (pError != NULL) {
-        *pError = SPH_IMAGE_ERR_OPEN;
-      }
-      status = 0;
+  pm->cols = cols;
+  pm->rows = rows;
+  pm->measured = 0;
+  pm->ran = 0;
+  pm->threads = 0;
+  pm->stop = 0;
+  pm->err_code = SPH_IMAGE_ERR_NONE;
+  
+  /* Allocate the tile paths, all blank, and the per-column and per-row
+   * arrays */
+  pm->ppPaths = (char **) sph_mem_alloc(
+                  &(pm->alloc),
+                  ((size_t) cols) * ((size_t) rows) * sizeof(char *));
+  pm->pColX = (int32_t *) sph_mem_alloc(
+                  &(pm->alloc), ((size_t) cols + 1) * sizeof(int32_t));
+  pm->pRowH = (int32_t *) sph_mem_alloc(
+                  &(pm->alloc), ((size_t) rows) * sizeof(int32_t));
+  pm->ppReaders = (SPH_IMAGE_READER **) sph_mem_alloc(
+                  &(pm->alloc),
+                  ((size_t) cols) * sizeof(SPH_IMAGE_READER *));
+  if ((pm->ppPaths == NULL) || (pm->pColX == NULL) ||
+      (pm->pRowH == NULL) || (pm->ppReaders == NULL)) {
+    abort();
+  }
+  memset(pm->ppPaths, 0,
+          ((size_t) cols) * ((size_t) rows) * sizeof(char *));
+  memset(pm->pColX, 0, ((size_t) cols + 1) * sizeof(int32_t));
+  memset(pm->pRowH, 0, ((size_t) rows) * sizeof(int32_t));
+  memset(pm->ppReaders, 0, ((size_t) cols) * sizeof(SPH_IMAGE_READER *));
+  
+  return pm;
+}
+
+/*
+ * sph_image_mosaic_free function.
+ */
+void sph_image_mosaic_free(SPH_IMAGE_MOSAIC *pm) {
+  
+  size_t i = 0;
+  
+  /* Only proceed if non-NULL parameter */
+  if (pm != NULL) {
+    sph_mosaic_closeAll(pm);
+    for(i = 0; i < ((size_t) pm->cols) * ((size_t) pm->rows); i++) {
+      sph_mem_free(&(pm->alloc), (pm->ppPaths)[i]);
     }
+    sph_mem_free(&(pm->alloc), pm->ppPaths);
+    sph_mem_free(&(pm->alloc), pm->pColX);
+    sph_mem_free(&(pm->alloc), pm->pRowH);
+    sph_mem_free(&(pm->alloc), pm->ppReaders);
+    sph_mem_freeAligned(&(pm->alloc), pm->pBuf);
+    sph_mem_free(&(pm->alloc), pm->pWorkers);
+    pthread_cond_destroy(&(pm->cond));
+    pthread_mutex_destroy(&(pm->lock));
+    sph_mem_destroy(&(pm->alloc));
+    free(pm);
   }
+}
+
+/*
+ * sph_image_mosaic_setTile function.
+ */
+void sph_image_mosaic_setTile(
+          SPH_IMAGE_MOSAIC * pm,
+          int32_t            col,
+          int32_t            row,
+    const char             * pPath) {
   
-  /* Call through if no error */
-  if (status) {
-    pw = sph_image_writer_new(pOut, ftype, w, h, dconv, q);
+  size_t i = 0;
+  size_t len = 0;
+  
+  /* Check parameters */
+  if (pm == NULL) {
+    abort();
+  }
+  if ((col < 0) || (col >= pm->cols) || (row < 0) || (row >= pm->rows)) {
+    abort();
+  }
+  if (pm->measured) {
+    abort();
   }
   
-  /* If successful, clear error if it was passed */
-  if (status) {
-    if (pError != NULL) {
-      *pError = SPH_IMAGE_ERR_NONE;
+  /* Replace the path */
+  i = ((size_t) row) * pm->cols + col;
+  sph_mem_free(&(pm->alloc), (pm->ppPaths)[i]);
+  (pm->ppPaths)[i] = NULL;
+  if (pPath != NULL) {
+    len = strlen(pPath) + 1;
+    (pm->ppPaths)[i] = (char *) sph_mem_alloc(&(pm->alloc), len);
+    if ((pm->ppPaths)[i] == NULL) {
+      abort();
     }
+    memcpy((pm->ppPaths)[i], pPath, len);
   }
+}
+
+/*
+ * sph_image_mosaic_setThreads function.
+ */
+void sph_image_mosaic_setThreads(SPH_IMAGE_MOSAIC *pm, int threads) {
   
-  /* Return writer or NULL */
-  return pw;
+  /* Check parameters */
+  if ((pm == NULL) || (threads < 0)) {
+    abort();
+  }
+  if (pm->ran) {
+    abort();
+  }
+  
+  pm->threads = threads;
 }
 
 /*
- * sph_image_writer_close function.
+ * sph_image_mosaic_measure function.
  */
-void sph_image_writer_close(SPH_IMAGE_WRITER *pw) {
+int sph_image_mosaic_measure(SPH_IMAGE_MOSAIC *pm, int *pError) {
   
-  /* Only proceed if non-NULL parameter */
-  if (pw != NULL) {
+  int status = 1;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t c = 0;
+  int32_t r = 0;
+  int32_t tw = 0;
+  int32_t th = 0;
+  int64_t total = 0;
+  const char *pPath = NULL;
+  SPH_IMAGE_READER *pr = NULL;
   
-    /* Shut down codecs */
-    if (pw->ftype == SPH_IMAGE_TYPE_PNG) {
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  if (pm->measured) {
+    abort();
+  }
   
-      /* Establish error handler for PNG */
-      if (setjmp(png_jmpbuf(pw->png_ptr))) {
-        /* Careful -- local variables may be in uncertain state? */
-        abort();
+  /* Get the size of each tile that isn't blank from its header, and
+   * check it against its row and column; the column widths are kept in
+   * pColX until they are turned into offsets */
+  memset(pm->pColX, 0, ((size_t) pm->cols + 1) * sizeof(int32_t));
+  memset(pm->pRowH, 0, ((size_t) pm->rows) * sizeof(int32_t));
+  for(r = 0; status && (r < pm->rows); r++) {
+    for(c = 0; c < pm->cols; c++) {
+      pPath = (pm->ppPaths)[((size_t) r) * pm->cols + c];
+      if (pPath == NULL) {
+        continue;
       }
+      
+      pr = sph_image_reader_newFromPath(pPath, &err);
+      if (pr == NULL) {
+        status = 0;
+        break;
+      }
+      tw = sph_image_reader_width(pr);
+      th = sph_image_reader_height(pr);
+      sph_image_reader_close(pr);
+      pr = NULL;
+      
+      if ((((pm->pColX)[c] != 0) && ((pm->pColX)[c] != tw)) ||
+          (((pm->pRowH)[r] != 0) && ((pm->pRowH)[r] != th))) {
+        err = SPH_IMAGE_ERR_MOSAIC;
+        status = 0;
+        break;
+      }
+      (pm->pColX)[c] = tw;
+      (pm->pRowH)[r] = th;
+    }
+  }
   
-      /* Free PNG structures */
-      png_destroy_write_struct(&(pw->png_ptr), &(pw->info_ptr));
-    
-    } else {
-      /* Unrecognized image type */
-      abort();
+  /* Turn the column widths into offsets, checking that no column is
+   * blank and that the output isn't too wide */
+  if (status) {
+    total = 0;
+    for(c = 0; c < pm->cols; c++) {
+      tw = (pm->pColX)[c];
+      if (tw < 1) {
+        err = SPH_IMAGE_ERR_MOSAIC;
+        status = 0;
+        break;
+      }
+      (pm->pColX)[c] = (int32_t) total;
+      total += tw;
+      if (total > SPH_IMAGE_MAXDIM) {
+        err = SPH_IMAGE_ERR_IMAGEDIM;
+        status = 0;
+        break;
+      }
+    }
+    if (status) {
+      (pm->pColX)[pm->cols] = (int32_t) total;
+      pm->w = (int32_t) total;
+    }
+  }
+  
+  /* Add up the row heights and count the bands, checking that no row
+   * is blank and that the output isn't too tall */
+  if (status) {
+    total = 0;
+    pm->band_count = 0;
+    for(r = 0; r < pm->rows; r++) {
+      th = (pm->pRowH)[r];
+      if (th < 1) {
+        err = SPH_IMAGE_ERR_MOSAIC;
+        status = 0;
+        break;
+      }
+      total += th;
+      if (total > SPH_IMAGE_MAXDIM) {
+        err = SPH_IMAGE_ERR_IMAGEDIM;
+        status = 0;
+        break;
+      }
+      pm->band_count += (th + SPH_MOSAIC_BAND - 1) / SPH_MOSAIC_BAND;
+    }
+    if (status) {
+      pm->h = (int32_t) total;
     }
+  }
+  
+  if (status) {
+    pm->measured = 1;
+  }
   
-    /* Close file */
-    fclose(pw->pOut);
-    
-    /* Free scanline buffer and data buffer */
-    free(pw->pScan);
-    free(pw->pData);
-    
-    /* Free structure */
-    free(pw);
+  /* Set error code if necessary */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
   }
+  
+  return status;
 }
 
 /*
- * sph_image_writer_ptr function.
+ * sph_image_mosaic_width function.
  */
-uint32_t *sph_image_writer_ptr(SPH_IMAGE_WRITER *pw) {
+int32_t sph_image_mosaic_width(SPH_IMAGE_MOSAIC *pm) {
   
   /* Check parameter */
-  if (pw == NULL) {
+  if (pm == NULL) {
+    abort();
+  }
+  if (!(pm->measured)) {
     abort();
   }
   
-  /* Return pointer */
-  return pw->pScan;
+  return pm->w;
 }
 
 /*
- * sph_image_writer_write function.
+ * sph_image_mosaic_height function.
  */
-void sph_image_writer_write(SPH_IMAGE_WRITER *pw) {
+int32_t sph_image_mosaic_height(SPH_IMAGE_MOSAIC *pm) {
   
   /* Check parameter */
-  if (pw == NULL) {
+  if (pm == NULL) {
     abort();
   }
-  
-  /* Check that not all scanlines have been written */
-  if (pw->scan_count >= pw->h) {
+  if (!(pm->measured)) {
     abort();
   }
   
-  /* Handle based on image type */
-  if (pw->ftype == SPH_IMAGE_TYPE_PNG) {
-  
-    /* PNG -- first of all, register error handler */
-    if (setjmp(png_jmpbuf(pw->png_ptr))) {
-      /* Careful -- local variables may be in uncertain state? */
-      abort();
-    }
-  
-    /* Serialize into bytes */
-    if (pw->dconv == SPH_IMAGE_DOWN_NONE) {
-      /* No down-conversion, so full RGBA */
-      sph_png_rowRGBA(pw->pScan, pw->pData, pw->w);
-      
-    } else if (pw->dconv == SPH_IMAGE_DOWN_RGB) {
-      /* RGB down-conversion */
-      sph_png_rowRGB(pw->pScan, pw->pData, pw->w);
-      
-    } else if (pw->dconv == SPH_IMAGE_DOWN_GRAY) {
-      /* Grayscale down-conversion */
-      sph_png_rowGray(pw->pScan, pw->pData, pw->w);
-      
-    } else {
-      /* Unrecognized down-conversion setting */
-      abort();
-    }
-  
-    /* Write the serialized scanline */
-    png_write_row(
-        pw->png_ptr,
-        (png_bytep) pw->pData);
-        
-    /* Increase the scanline count */
-    (pw->scan_count)++;
-    
-    /* If we just wrote the last scanline, finish writing */
-    if (pw->scan_count >= pw->h) {
-      png_write_end(pw->png_ptr, pw->info_ptr);
-    }
-    
-  } else {
-    /* Unrecognized image type */
-    abort();
-  }
+  return pm->h;
 }
 
 /*
- * sph_image_reader_new function.
+ * sph_image_mosaic_run function.
  */
-SPH_IMAGE_READER *sph_image_reader_new(
-    FILE * pIn,
-    int    ftype,
-    int  * pError) {
-
-  SPH_IMAGE_READER *pr = NULL;
-  int status = 1;
-  
-  uint32_t w = 0;
-  uint32_t h = 0;
-  int bdepth = 0;
-  int ctype = 0;
-  int imethod = 0;
-  int ccount = 0;
-  int alpha_flag = 0;
+int sph_image_mosaic_run(
+    SPH_IMAGE_MOSAIC * pm,
+    SPH_IMAGE_WRITER * pw,
+    int              * pError) {
   
-  png_uint_32 w_png = 0;
-  png_uint_32 h_png = 0;
+  int status = 1;
+  int quit = 0;
+  int err = SPH_IMAGE_ERR_NONE;
+  int i = 0;
+  int32_t k = 0;
+  int32_t r = 0;
+  int32_t y = 0;
+  int32_t n = 0;
+  SPH_MOSAIC_WORKER *pk = NULL;
   
-  png_structp png_ptr = NULL;
-  png_infop info_ptr = NULL;
-
   /* Check parameters */
-  if (pIn == NULL) {
+  if ((pm == NULL) || (pw == NULL)) {
     abort();
   }
-  if (ftype != SPH_IMAGE_TYPE_PNG) {
+  if ((!(pm->measured)) || pm->ran) {
     abort();
   }
-  
-  /* Set error to unknown in case we need to leave from a longjmp */
-  if (pError != NULL) {
-    *pError = SPH_IMAGE_ERR_UNKNOWN;
+  if ((pw->w != pm->w) || (pw->h != pm->h) || (pw->scan_count > 0)) {
+    abort();
+  }
+  pm->ran = 1;
+  
+  /* Allocate the two band buffers */
+  pm->pitch = sph_row_pitch(pm->w);
+  pm->pBuf = (uint32_t *) sph_mem_allocAligned(
+                &(pm->alloc),
+                2 * SPH_MOSAIC_BAND * pm->pitch * sizeof(uint32_t));
+  if (pm->pBuf == NULL) {
+    abort();
   }
   
-  /* Read header information and initialize codecs */
-  if (ftype == SPH_IMAGE_TYPE_PNG) {
-    
-    /* Initialize PNG codec */
-    png_ptr = png_create_read_struct(
-                PNG_LIBPNG_VER_STRING,
-                NULL, NULL, NULL);  /* Default error handling */
-    if (png_ptr == NULL) {
-      /* Error initializing PNG codec */
-      abort();
-    }
-    
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL) {
-      /* Error creating information structure */
-      abort();
-    }
-  
-    /* Establish error handler for PNG */
-    if (setjmp(png_jmpbuf(png_ptr))) {
-      /* Careful -- local variables may be in uncertain state? */
-      status = 0;
-    }
+  /* Decide the number of workers */
+  pm->nworkers = pm->threads;
+  if (pm->nworkers < 1) {
+    pm->nworkers = sph_auto_threads();
+  }
+  if (pm->nworkers > pm->cols) {
+    pm->nworkers = (int) pm->cols;
+  }
   
-    /* Initialize PNG I/O */
-    if (status) {
-      png_init_io(png_ptr, pIn);
-    }
-    
-    /* Read the headers of the input file */
-    if (status) {
-      png_read_info(png_ptr, info_ptr);
-    }
-    
-    /* Get information about the input file format */
-    if (status) {
-      png_get_IHDR(png_ptr, info_ptr,
-        &w_png, &h_png,
-        &bdepth,
-        &ctype,
-        &imethod,
-        NULL, NULL);
-      
-      /* Older versions of libpng define png_uint_32 as a long, which
-       * might be 64-bit on some platforms, so we first have to save
-       * the variables to a png_uint_32, then transfer them to w and h
-       * here */
-      w = (uint32_t) w_png;
-      h = (uint32_t) h_png;
-    }
-    
-    /* Make sure dimensions are not too large */
-    if (status) {
-      if ((w > SPH_IMAGE_MAXDIM) || (h > SPH_IMAGE_MAXDIM)) {
-        if (pError != NULL) {
-          *pError = SPH_IMAGE_ERR_IMAGEDIM;
-        }
+  if (pm->nworkers < 2) {
+    /* Decode and write each band on the calling thread */
+    pm->nworkers = 1;
+    for(k = 0; k < pm->band_count; k++) {
+      n = sph_mosaic_band(pm, r, y);
+      if (!sph_mosaic_decode(pm, 0, 1, r, y, n, pm->pBuf, &err)) {
         status = 0;
+        break;
       }
-    }
-    
-    /* Make sure input file is not interlaced */
-    if (status) {
-      if (imethod != PNG_INTERLACE_NONE) {
-        if (pError != NULL) {
-          *pError = SPH_IMAGE_ERR_INTERLACED;
-        }
+      if (!sph_image_writer_writeRows(
+              pw, pm->pBuf, (int32_t) pm->pitch, n, &err)) {
         status = 0;
+        break;
       }
+      sph_mosaic_next(pm, &r, &y, n);
     }
-    
-    /* Make sure input file is not 16-bit */
-    if (status) {
-      if (bdepth > 8) {
-        if (pError != NULL) {
-          *pError = SPH_IMAGE_ERR_BITDEPTH;
-        }
-        status = 0;
+  
+  } else {
+    /* Start the workers; if one can't be started, the mosaic just
+     * stops */
+    pm->pWorkers = (SPH_MOSAIC_WORKER *) sph_mem_alloc(
+                      &(pm->alloc),
+                      ((size_t) pm->nworkers) * sizeof(SPH_MOSAIC_WORKER));
+    if (pm->pWorkers == NULL) {
+      abort();
+    }
+    memset(pm->pWorkers, 0,
+            ((size_t) pm->nworkers) * sizeof(SPH_MOSAIC_WORKER));
+    for(i = 0; i < pm->nworkers; i++) {
+      pk = &((pm->pWorkers)[i]);
+      pk->pm = pm;
+      pk->index = i;
+      if (pthread_create(&(pk->thread), NULL, &sph_mosaic_worker, pk)) {
+        sph_mosaic_fail(pm, SPH_IMAGE_ERR_UNKNOWN);
+        break;
       }
+      pk->has_thread = 1;
     }
     
-    /* Request expansions specific to color spaces */
-    if (status && (ctype == PNG_COLOR_TYPE_PALETTE)) {
-      /* Palette image -- expand to RGB */
-      png_set_palette_to_rgb(png_ptr);
+    /* Write each band once all workers are done with it */
+    for(k = 0; k < pm->band_count; k++) {
+      n = sph_mosaic_band(pm, r, y);
       
-    } else if (status && ((ctype == PNG_COLOR_TYPE_GRAY) ||
-                          (ctype == PNG_COLOR_TYPE_GRAY_ALPHA))) {
-      /* Grayscale -- expand if less than 8-bit */
-      if (bdepth < 8) {
-        png_set_expand_gray_1_2_4_to_8(png_ptr);
+      pthread_mutex_lock(&(pm->lock));
+      while ((!(pm->stop)) && ((pm->ready)[k % 2] < pm->nworkers)) {
+        pthread_cond_wait(&(pm->cond), &(pm->lock));
       }
-    
-    } else if (status && ((ctype == PNG_COLOR_TYPE_RGB) ||
-                          (ctype == PNG_COLOR_TYPE_RGB_ALPHA))) {
-      /* RGB -- expand if less than 8-bit */
-      if (bdepth < 8) {
-        png_set_expand(png_ptr);
+      quit = pm->stop;
+      pthread_mutex_unlock(&(pm->lock));
+      if (quit) {
+        break;
       }
       
-    } else if (status) {
-      /* Unrecognized color space -- shouldn't happen */
-      abort();
-    }
-    
-    /* If there is a transparency chunk and color type doesn't already
-     * have alpha channel, add alpha channel and set alpha flag */
-    if (status) {
-      if ((ctype != PNG_COLOR_TYPE_GRAY_ALPHA) &&
-          (ctype != PNG_COLOR_TYPE_RGB_ALPHA)) {
-        if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
-          alpha_flag = 1;
-          png_set_tRNS_to_alpha(png_ptr);
-        }
+      if (!sph_image_writer_writeRows(
+              pw, sph_mosaic_slot(pm, k), (int32_t) pm->pitch, n,
+              &err)) {
+        sph_mosaic_fail(pm, err);
+        break;
       }
+      
+      pthread_mutex_lock(&(pm->lock));
+      (pm->ready)[k % 2] = 0;
+      pm->written = k + 1;
+      pthread_cond_broadcast(&(pm->cond));
+      pthread_mutex_unlock(&(pm->lock));
+      
+      sph_mosaic_next(pm, &r, &y, n);
     }
     
-    /* Determine the number of color channels */
-    if (ctype == PNG_COLOR_TYPE_PALETTE) {
-      /* Palette image has 3 or 4 channels, depending on alpha flag */
-      if (alpha_flag) {
-        ccount = 4;
-      } else {
-        ccount = 3;
-      }
-    
-    } else if (ctype == PNG_COLOR_TYPE_GRAY) {
-      /* Grayscale image has 1 or 2 channels, depending on alpha flag */
-      if (alpha_flag) {
-        ccount = 2;
-      } else {
-        ccount = 1;
-      }
-    
-    } else if (ctype == PNG_COLOR_TYPE_RGB) {
-      /* RGB image has 3 or 4 channels, depending on alpha flag */
-      if (alpha_flag) {
-        ccount = 4;
-      } else {
-        ccount = 3;
+    /* Wait for all workers */
+    for(i = 0; i < pm->nworkers; i++) {
+      pk = &((pm->pWorkers)[i]);
+      if (pk->has_thread) {
+        pthread_join(pk->thread, NULL);
+        pk->has_thread = 0;
       }
-    
-    } else if (ctype == PNG_COLOR_TYPE_GRAY_ALPHA) {
-      /* Grayscale with alpha has 2 channels */
-      ccount = 2;
-    
-    } else if (ctype == PNG_COLOR_TYPE_RGB_ALPHA) {
-      /* RGB with alpha has 4 channels */
-      ccount = 4;
-    
-    } else {
-      /* Unrecognized color type -- shouldn't happen */
-      abort();
-    }
-    
-    /* Update reading info */
-    if (status) {
-      png_read_update_info(png_ptr, info_ptr);
-    }
-    
-    /* If there was any problem, free the PNG codec */
-    if (!status) {
-      png_destroy_read_struct(
-        &png_ptr, &info_ptr, (png_infopp)NULL);
-      png_ptr = NULL;
-      info_ptr = NULL;
-    }
-  
-  } else {
-    /* Unrecognized image file type */
-    abort();
-  }
-  
-  /* Allocate image reader structure */
-  if (status) {
-    pr = (SPH_IMAGE_READER *) malloc(sizeof(SPH_IMAGE_READER));
-    if (pr == NULL) {
-      abort();
     }
-    memset(pr, 0, sizeof(SPH_IMAGE_READER));
-  }
-
-  /* Initialize all general fields, including transferring the input
-   * file into the structure */
-  if (status) {
-    pr->err_flag = 0;
-    pr->pIn = pIn;
-    pr->ftype = ftype;
-    pr->w = w;
-    pr->h = h;
-    pr->scan_count = 0;
-    pr->ccount = ccount;
     
-    pIn = NULL;
+    if (pm->stop) {
+      status = 0;
+      err = pm->err_code;
+    }
   }
   
-  /* Transfer codec into object */
-  if (status && (ftype == SPH_IMAGE_TYPE_PNG)) {
-    /* PNG codec */
-    pr->png_ptr = png_ptr;
-    pr->info_ptr = info_ptr;
-    
-    png_ptr = NULL;
-    info_ptr = NULL;
-    
-  } else if (status) {
-    /* Unrecognized image type */
+  /* Close any tiles left open by an error */
+  sph_mosaic_closeAll(pm);
+  
+  /* Set error code if necessary */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
+  }
+  
+  return status;
+}
+
+/*
+ * sph_image_trim_new function.
+ */
+SPH_IMAGE_TRIM *sph_image_trim_new(const char *pPath) {
+  
+  size_t len = 0;
+  SPH_IMAGE_TRIM *pt = NULL;
+  
+  /* Check parameter */
+  if (pPath == NULL) {
     abort();
   }
   
-  /* Allocate scanline buffer */
-  if (status) {
-    pr->pScan = (uint32_t *) malloc(((size_t) w) * sizeof(uint32_t));
-    if (pr->pScan == NULL) {
-      abort();
-    }
-    memset(pr->pScan, 0, ((size_t) w) * sizeof(uint32_t));
+  /* Allocate the structure with the standard library allocator */
+  pt = (SPH_IMAGE_TRIM *) malloc(sizeof(SPH_IMAGE_TRIM));
+  if (pt == NULL) {
+    abort();
+  }
+  memset(pt, 0, sizeof(SPH_IMAGE_TRIM));
+  sph_mem_init(&(pt->alloc), NULL, 0);
+  
+  pt->mode = SPH_IMAGE_TRIM_ALPHA;
+  pt->color = 0;
+  pt->limit = SPH_TRIM_MEM;
+  pt->found = 0;
+  pt->measured = 0;
+  pt->ran = 0;
+  pt->pBuf = NULL;
+  
+  /* Copy the path */
+  len = strlen(pPath) + 1;
+  pt->pPath = (char *) sph_mem_alloc(&(pt->alloc), len);
+  if (pt->pPath == NULL) {
+    abort();
   }
+  memcpy(pt->pPath, pPath, len);
   
-  /* Allocate data buffer */
-  if (status) {
-    pr->pData = (uint8_t *) malloc(((size_t) w) * ((size_t) ccount));
-    if (pr->pData == NULL) {
-      abort();
-    }
-    memset(pr->pData, 0, ((size_t) w) * ((size_t) ccount));
+  return pt;
+}
+
+/*
+ * sph_image_trim_free function.
+ */
+void sph_image_trim_free(SPH_IMAGE_TRIM *pt) {
+  
+  /* Only proceed if non-NULL parameter */
+  if (pt != NULL) {
+    sph_mem_free(&(pt->alloc), pt->pPath);
+    sph_mem_freeAligned(&(pt->alloc), pt->pBuf);
+    sph_mem_destroy(&(pt->alloc));
+    free(pt);
   }
+}
+
+/*
+ * sph_image_trim_setBackground function.
+ */
+void sph_image_trim_setBackground(
+    SPH_IMAGE_TRIM * pt,
+    int              mode,
+    uint32_t         color) {
   
-  /* If failure, close the file */
-  if (!status) {
-    fclose(pIn);
+  /* Check parameters */
+  if (pt == NULL) {
+    abort();
+  }
+  if ((mode != SPH_IMAGE_TRIM_ALPHA) && (mode != SPH_IMAGE_TRIM_COLOR) &&
+      (mode != SPH_IMAGE_TRIM_CORNER)) {
+    abort();
+  }
+  if (pt->measured) {
+    abort();
   }
   
-  /* If successful, set error to NONE */
-  if (status) {
-    if (pError != NULL) {
-      *pError = SPH_IMAGE_ERR_NONE;
-    }
+  pt->mode = mode;
+  pt->color = color;
+}
+
+/*
+ * sph_image_trim_setMemory function.
+ */
+void sph_image_trim_setMemory(SPH_IMAGE_TRIM *pt, size_t limit) {
+  
+  /* Check parameter */
+  if (pt == NULL) {
+    abort();
+  }
+  if (pt->measured) {
+    abort();
   }
   
-  /* Return reader object or NULL */
-  return pr;
+  pt->limit = limit;
 }
 
 /*
- * sph_image_reader_newFromPath function.
+ * sph_image_trim_measure function.
  */
-SPH_IMAGE_READER *sph_image_reader_newFromPath(
-    const char * pPath,
-          int  * pError) {
+int sph_image_trim_measure(SPH_IMAGE_TRIM *pt, int *pError) {
   
-  int ftype = 0;
   int status = 1;
-  FILE *pIn = NULL;
+  int err = SPH_IMAGE_ERR_NONE;
+  int found = 0;
+  int32_t y = 0;
+  uint32_t *pRow = NULL;
   SPH_IMAGE_READER *pr = NULL;
   
-  /* Check path parameter */
-  if (pPath == NULL) {
+  /* Check parameter */
+  if (pt == NULL) {
+    abort();
+  }
+  if (pt->measured) {
     abort();
   }
   
-  /* Determine type from path */
-  ftype = sph_path_getImageType(pPath);
-  
-  /* Fail if type could not be determined */
-  if (ftype == -1) {
-    if (pError != NULL) {
-      *pError = SPH_IMAGE_ERR_FILETYPE;
-    }
+  /* Open the image */
+  pr = sph_image_reader_newFromPath(pt->pPath, &err);
+  if (pr == NULL) {
     status = 0;
   }
   
-  /* Open the input file */
   if (status) {
-    pIn = fopen(pPath, "rb");
-    if (pIn == NULL) {
-      if (pError != NULL) {
-        *pError = SPH_IMAGE_ERR_OPEN;
+    pt->iw = sph_image_reader_width(pr);
+    pt->ih = sph_image_reader_height(pr);
+    pt->pitch = sph_row_pitch(pt->iw);
+    pt->found = 0;
+    
+    if (pt->mode == SPH_IMAGE_TRIM_COLOR) {
+      pt->mask = UINT32_C(0xffffffff);
+      pt->value = pt->color;
+    } else {
+      pt->mask = UINT32_C(0xff000000);
+      pt->value = 0;
+    }
+  }
+  
+  /* Decode each scanline, into the kept scanlines once there are
+   * any */
+  for(y = 0; status && (y < pt->ih); y++) {
+    if (pt->pBuf != NULL) {
+      pRow = pt->pBuf + ((size_t) (y - pt->y)) * pt->pitch;
+      if (!sph_image_reader_readRows(
+              pr, pRow, (int32_t) pt->pitch, 1, &err)) {
+        status = 0;
+        break;
       }
-      status = 0;
+    } else {
+      pRow = sph_image_reader_read(pr, &err);
+      if (pRow == NULL) {
+        status = 0;
+        break;
+      }
+    }
+    
+    /* The top-left pixel sets the background color in corner mode,
+     * unless it is fully transparent */
+    if ((y == 0) && (pt->mode == SPH_IMAGE_TRIM_CORNER) &&
+        ((pRow[0] >> 24) != 0)) {
+      pt->mask = UINT32_C(0xffffffff);
+      pt->value = pRow[0];
+    }
+    
+    found = pt->found;
+    sph_trim_row(pt, pRow, y);
+    
+    /* At the first scanline with content, start keeping the scanlines
+     * if all the rest of them fit within the memory limit */
+    if ((!found) && pt->found &&
+        ((pt->limit / (pt->pitch * sizeof(uint32_t))) >=
+          ((size_t) (pt->ih - y)))) {
+      pt->pBuf = (uint32_t *) sph_mem_allocAligned(
+                    &(pt->alloc),
+                    ((size_t) (pt->ih - y)) * pt->pitch * sizeof(uint32_t));
+      if (pt->pBuf == NULL) {
+        abort();
+      }
+      memcpy(pt->pBuf, pRow, ((size_t) pt->iw) * sizeof(uint32_t));
     }
   }
   
-  /* Call through if no error */
+  sph_image_reader_close(pr);
+  pr = NULL;
+  
+  /* Turn the edges into a size, using the top-left pixel if the whole
+   * image is background */
   if (status) {
-    pr = sph_image_reader_new(pIn, ftype, pError);
+    if (pt->found) {
+      pt->w = pt->w - pt->x;
+      pt->h = pt->h - pt->y;
+    } else {
+      pt->x = 0;
+      pt->y = 0;
+      pt->w = 1;
+      pt->h = 1;
+    }
+    pt->measured = 1;
+  
+  } else {
+    sph_mem_freeAligned(&(pt->alloc), pt->pBuf);
+    pt->pBuf = NULL;
   }
   
-  /* Return reader or NULL */
-  return pr;
+  /* Set error code if necessary */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
+  }
+  
+  return status;
 }
 
 /*
- * sph_image_reader_close function.
+ * sph_image_trim_x function.
  */
-void sph_image_reader_close(SPH_IMAGE_READER *pr) {
-  
-  /* Only proceed if non-NULL parameter */
-  if (pr != NULL) {
-  
-    /* Shut down codecs */
-    if (pr->ftype == SPH_IMAGE_TYPE_PNG) {
+int32_t sph_image_trim_x(SPH_IMAGE_TRIM *pt) {
   
-      /* Establish error handler for PNG */
-      if (setjmp(png_jmpbuf(pr->png_ptr))) {
-        /* Careful -- local variables may be in uncertain state? */
-        abort();
-      }
+  /* Check parameter */
+  if (pt == NULL) {
+    abort();
+  }
+  if (!(pt->measured)) {
+    abort();
+  }
   
-      /* Free PNG structures */
-      png_destroy_read_struct(
-          &(pr->png_ptr),
-          &(pr->info_ptr),
-          (png_infopp)NULL);
-    
-    } else {
-      /* Unrecognized image type */
-      abort();
-    }
+  return pt->x;
+}
+
+/*
+ * sph_image_trim_y function.
+ */
+int32_t sph_image_trim_y(SPH_IMAGE_TRIM *pt) {
   
-    /* Close file */
-    fclose(pr->pIn);
-    
-    /* Free scanline buffer and data buffer */
-    free(pr->pScan);
-    free(pr->pData);
-    
-    /* Free structure */
-    free(pr);
+  /* Check parameter */
+  if (pt == NULL) {
+    abort();
+  }
+  if (!(pt->measured)) {
+    abort();
   }
+  
+  return pt->y;
 }
 
 /*
- * sph_image_reader_width function.
+ * sph_image_trim_width function.
  */
-int32_t sph_image_reader_width(SPH_IMAGE_READER *pr) {
+int32_t sph_image_trim_width(SPH_IMAGE_TRIM *pt) {
   
   /* Check parameter */
-  if (pr == NULL) {
+  if (pt == NULL) {
+    abort();
+  }
+  if (!(pt->measured)) {
     abort();
   }
   
-  /* Return requested value */
-  return pr->w;
+  return pt->w;
 }
 
 /*
- * sph_image_reader_height function.
+ * sph_image_trim_height function.
  */
-int32_t sph_image_reader_height(SPH_IMAGE_READER *pr) {
+int32_t sph_image_trim_height(SPH_IMAGE_TRIM *pt) {
   
   /* Check parameter */
-  if (pr == NULL) {
+  if (pt == NULL) {
+    abort();
+  }
+  if (!(pt->measured)) {
     abort();
   }
   
-  /* Return requested value */
-  return pr->h;
+  return pt->h;
 }
 
 /*
- * sph_image_reader_read function.
+ * sph_image_trim_run function.
  */
-uint32_t *sph_image_reader_read(SPH_IMAGE_READER *pr, int *pError) {
+int sph_image_trim_run(
+    SPH_IMAGE_TRIM   * pt,
+    SPH_IMAGE_WRITER * pw,
+    int              * pError) {
   
   int status = 1;
-  uint32_t *pResult = NULL;
+  int err = SPH_IMAGE_ERR_NONE;
+  int32_t y = 0;
+  uint32_t *pRow = NULL;
+  SPH_IMAGE_READER *pr = NULL;
   
-  /* Check parameter */
-  if (pr == NULL) {
+  /* Check parameters */
+  if ((pt == NULL) || (pw == NULL)) {
     abort();
   }
-  
-  /* Clear the error code if provided */
-  if (pError != NULL) {
-    *pError = SPH_IMAGE_ERR_NONE;
+  if ((!(pt->measured)) || pt->ran) {
+    abort();
   }
+  if ((pw->w != pt->w) || (pw->h != pt->h) || (pw->scan_count > 0)) {
+    abort();
+  }
+  pt->ran = 1;
   
-  /* Only proceed if not in error mode */
-  if (!(pr->err_flag)) {
-  
-    /* Check that not all scanlines have been read */
-    if (pr->scan_count >= pr->h) {
-      abort();
+  if (pt->pBuf != NULL) {
+    /* The box is in the kept scanlines, which start at its top */
+    if (!sph_image_writer_writeRows(
+            pw, pt->pBuf + pt->x, (int32_t) pt->pitch, pt->h, &err)) {
+      status = 0;
     }
   
-    /* Handle based on image type */
-    if (pr->ftype == SPH_IMAGE_TYPE_PNG) {
-  
-      /* PNG -- first of all, register error handler */
-      if (setjmp(png_jmpbuf(pr->png_ptr))) {
-        /* Careful -- local variables may be in uncertain state? */
+  } else {
+    /* Open the image again and check that it hasn't changed size */
+    pr = sph_image_reader_newFromPath(pt->pPath, &err);
+    if (pr == NULL) {
+      status = 0;
+    }
+    if (status && ((sph_image_reader_width(pr) != pt->iw) ||
+                    (sph_image_reader_height(pr) != pt->ih))) {
+      err = SPH_IMAGE_ERR_READDATA;
+      status = 0;
+    }
+    
+    /* Skip the scanlines above the box */
+    if (status && (pt->y > 0)) {
+      if (!sph_image_reader_seek(pr, NULL, pt->y, &err)) {
         status = 0;
       }
-  
-      /* Read the scanline bytes */
-      if (status) {
-        png_read_row(
-            pr->png_ptr,
-            (png_bytep) pr->pData,
-            NULL);
-      }
-  
-      /* Decode the bytes */
-      if (status) {
-        sph_png_decodeRow(pr->pData, pr->pScan, pr->ccount, pr->w);
-      }
-        
-      /* Increase the scanline count */
-      if (status) {
-        (pr->scan_count)++;
-      }
+    }
     
-      /* If we just read the last scanline, finish reading */
-      if (status) {
-        if (pr->scan_count >= pr->h) {
-          png_read_end(pr->png_ptr, (png_infop)NULL);
-        }
+    /* Write the box from each of its scanlines, leaving the scanlines
+     * below it undecoded */
+    for(y = 0; status && (y < pt->h); y++) {
+      pRow = sph_image_reader_read(pr, &err);
+      if (pRow == NULL) {
+        status = 0;
+        break;
       }
-      
-      /* If error, set error code if it was passed and set internal
-       * error mode */
-      if (!status) {
-        if (pError != NULL) {
-          *pError = SPH_IMAGE_ERR_READDATA;
-        }
-        pr->err_flag = 1;
+      if (!sph_image_writer_writeRows(pw, pRow + pt->x, pt->w, 1, &err)) {
+        status = 0;
+        break;
       }
-    
-    } else {
-      /* Unrecognized image type */
-      abort();
-    }
-  
-  } else {
-    /* In error mode -- set error flag if it was passed and fail */
-    if (pError != NULL) {
-      *pError = SPH_IMAGE_ERR_READDATA;
     }
-    status = 0;
+    
+    sph_image_reader_close(pr);
+    pr = NULL;
   }
   
-  /* Return scanline buffer pointer if successful, NULL if error */
-  if (status) {
-    pResult = pr->pScan;
-  } else {
-    pResult = NULL;
+  /* Release the kept scanlines */
+  sph_mem_freeAligned(&(pt->alloc), pt->pBuf);
+  pt->pBuf = NULL;
+  
+  /* Set error code if necessary */
+  if ((!status) && (pError != NULL)) {
+    *pError = err;
   }
   
-  /* Always return pointer to scanline buffer */
-  return pResult;
+  return status;
 }
 
 /*
@@ -1580,6 +15051,30 @@ const char *sph_image_errorString(int code) {
       result = "Error while reading image data";
       break;
     
+    case SPH_IMAGE_ERR_GRAYDEPTH:
+      result = "Gray value can't be stored exactly at output bit depth";
+      break;
+    
+    case SPH_IMAGE_ERR_WRITEDATA:
+      result = "Error while writing image data";
+      break;
+    
+    case SPH_IMAGE_ERR_INDEX:
+      result = "Index file is invalid or doesn't match the image";
+      break;
+    
+    case SPH_IMAGE_ERR_MEMORY:
+      result = "Image doesn't fit in the memory limit";
+      break;
+    
+    case SPH_IMAGE_ERR_STAGE:
+      result = "Image pipeline stage failed";
+      break;
+    
+    case SPH_IMAGE_ERR_MOSAIC:
+      result = "Mosaic tiles don't line up";
+      break;
+    
     default:
       result = "Unknown image file I/O error";
   }
@@ -18,9 +18,41 @@ typedef struct SPH_IMAGE_WRITER_TAG SPH_IMAGE_WRITER;
 struct SPH_IMAGE_READER_TAG;
 typedef struct SPH_IMAGE_READER_TAG SPH_IMAGE_READER;
 
+struct SPH_IMAGE_ARENA_TAG;
+typedef struct SPH_IMAGE_ARENA_TAG SPH_IMAGE_ARENA;
+
+struct SPH_IMAGE_CACHE_TAG;
+typedef struct SPH_IMAGE_CACHE_TAG SPH_IMAGE_CACHE;
+
+struct SPH_IMAGE_INDEX_TAG;
+typedef struct SPH_IMAGE_INDEX_TAG SPH_IMAGE_INDEX;
+
+struct SPH_IMAGE_RESAMPLER_TAG;
+typedef struct SPH_IMAGE_RESAMPLER_TAG SPH_IMAGE_RESAMPLER;
+
+struct SPH_IMAGE_PIPELINE_TAG;
+typedef struct SPH_IMAGE_PIPELINE_TAG SPH_IMAGE_PIPELINE;
+
+struct SPH_IMAGE_MOSAIC_TAG;
+typedef struct SPH_IMAGE_MOSAIC_TAG SPH_IMAGE_MOSAIC;
+
+struct SPH_IMAGE_TRIM_TAG;
+typedef struct SPH_IMAGE_TRIM_TAG SPH_IMAGE_TRIM;
+
 /* Maximum value for width and height dimensions of an image */
 #define SPH_IMAGE_MAXDIM (1000000)
 
+/*
+ * The alignment in bytes of the scanline buffers that readers and
+ * writers hand out.
+ * 
+ * Those buffers start at a multiple of this value, and their size is
+ * padded to a multiple of it, so vector code can process whole blocks
+ * without a separate loop for the remainder.  The contents of the
+ * padding are unspecified, and the padding may be overwritten freely.
+ */
+#define SPH_IMAGE_ALIGN (64)
+
 /* Image file type definitions */
 #define SPH_IMAGE_TYPE_PNG  (1)   /* PNG file */
 
@@ -28,6 +60,59 @@ typedef struct SPH_IMAGE_READER_TAG SPH_IMAGE_READER;
 #define SPH_IMAGE_DOWN_NONE (0)   /* No down-conversion */
 #define SPH_IMAGE_DOWN_RGB  (1)   /* RGB down-conversion */
 #define SPH_IMAGE_DOWN_GRAY (2)   /* Grayscale down-conversion */
+#define SPH_IMAGE_DOWN_GRAY1 (3)  /* 1-bit grayscale down-conversion */
+#define SPH_IMAGE_DOWN_GRAY2 (4)  /* 2-bit grayscale down-conversion */
+#define SPH_IMAGE_DOWN_GRAY4 (5)  /* 4-bit grayscale down-conversion */
+
+/*
+ * Flag that may be combined with SPH_IMAGE_DOWN_GRAY1, GRAY2, or GRAY4
+ * to quantize grayscale values to the nearest available level instead
+ * of requiring each value to be exactly representable.
+ */
+#define SPH_IMAGE_DOWN_QUANTIZE (0x100)
+
+/*
+ * PNG filter flags for sph_image_writer_setCompression().
+ * 
+ * These may be combined with bitwise OR to allow more than one filter.
+ */
+#define SPH_IMAGE_FILTER_NONE  (0x01) /* No filter */
+#define SPH_IMAGE_FILTER_SUB   (0x02) /* Sub filter */
+#define SPH_IMAGE_FILTER_UP    (0x04) /* Up filter */
+#define SPH_IMAGE_FILTER_AVG   (0x08) /* Average filter */
+#define SPH_IMAGE_FILTER_PAETH (0x10) /* Paeth filter */
+#define SPH_IMAGE_FILTER_ALL   (0x1f) /* All filters */
+
+/* Compression strategies for sph_image_writer_setCompression() */
+#define SPH_IMAGE_STRATEGY_AUTO     (0) /* Choose automatically */
+#define SPH_IMAGE_STRATEGY_DEFAULT  (1) /* Normal deflate */
+#define SPH_IMAGE_STRATEGY_FILTERED (2) /* Tuned for filtered data */
+#define SPH_IMAGE_STRATEGY_HUFFMAN  (3) /* Huffman coding only */
+#define SPH_IMAGE_STRATEGY_RLE      (4) /* Run-length matches only */
+#define SPH_IMAGE_STRATEGY_FIXED    (5) /* Fixed Huffman codes */
+
+/* Resampling kernel definitions */
+#define SPH_IMAGE_KERNEL_BOX      (1) /* Box, or nearest when enlarging */
+#define SPH_IMAGE_KERNEL_TRIANGLE (2) /* Triangle (bilinear) */
+#define SPH_IMAGE_KERNEL_CUBIC    (3) /* Catmull-Rom (bicubic) */
+#define SPH_IMAGE_KERNEL_LANCZOS  (4) /* Lanczos with three lobes */
+
+/* Resampler flag to filter in linear light instead of sRGB */
+#define SPH_IMAGE_RESAMPLE_LINEAR (0x01)
+
+/* Convolution flag to filter color without alpha, keeping the alpha */
+#define SPH_IMAGE_CONVOLVE_STRAIGHT (0x01)
+
+/* Maximum width or height of a convolution kernel */
+#define SPH_IMAGE_CONVOLVE_MAXTAPS (63)
+
+/* Maximum sum of the magnitudes of the weights of a convolution kernel */
+#define SPH_IMAGE_CONVOLVE_MAXGAIN (32)
+
+/* Trim background modes */
+#define SPH_IMAGE_TRIM_ALPHA  (0) /* Fully transparent pixels */
+#define SPH_IMAGE_TRIM_COLOR  (1) /* Pixels of one given color */
+#define SPH_IMAGE_TRIM_CORNER (2) /* Pixels like the top-left corner */
 
 /* Image errors */
 #define SPH_IMAGE_ERR_UNKNOWN   (-1) /* Unknown error */
@@ -38,6 +123,12 @@ typedef struct SPH_IMAGE_READER_TAG SPH_IMAGE_READER;
 #define SPH_IMAGE_ERR_FILETYPE   (4) /* Can't determine file type */
 #define SPH_IMAGE_ERR_OPEN       (5) /* Can't open file */
 #define SPH_IMAGE_ERR_READDATA   (6) /* Error reading data */
+#define SPH_IMAGE_ERR_GRAYDEPTH  (7) /* Gray value doesn't fit depth */
+#define SPH_IMAGE_ERR_WRITEDATA  (8) /* Error writing data */
+#define SPH_IMAGE_ERR_INDEX      (9) /* Index invalid or mismatched */
+#define SPH_IMAGE_ERR_MEMORY    (10) /* Memory limit too small */
+#define SPH_IMAGE_ERR_STAGE     (11) /* Pipeline stage failed */
+#define SPH_IMAGE_ERR_MOSAIC    (12) /* Mosaic tiles don't line up */
 
 /*
  * A structure holding a parsed ARGB color.
@@ -77,6 +168,153 @@ typedef struct {
   
 } SPH_ARGB;
 
+/*
+ * A structure reporting how an image writer kept to its time budget.
+ * 
+ * See sph_image_writer_setBudget() and sph_image_writer_budget().
+ */
+typedef struct {
+  
+  /*
+   * The time budget in milliseconds, or zero if there is none.
+   */
+  int32_t budget;
+  
+  /*
+   * The time in milliseconds from when the budget was set until the
+   * last scanline was written, or until now if the image isn't
+   * finished yet.
+   */
+  int32_t elapsed;
+  
+  /*
+   * The deflate compression level at the start of the image and the
+   * level in use at the end (or currently).
+   */
+  int level_start;
+  int level_end;
+  
+  /*
+   * Non-zero if the writer stopped searching for the best PNG filter
+   * and used a single filter for each scanline instead.
+   */
+  int fast_filter;
+  
+  /*
+   * The number of times the writer moved to faster settings.
+   */
+  int32_t changes;
+  
+  /*
+   * The index of the first scanline written with faster settings, or
+   * -1 if the settings were never changed.
+   */
+  int32_t change_row;
+  
+  /*
+   * Non-zero if the image was finished within the budget.  Always zero
+   * if there is no budget or the image isn't finished yet.
+   */
+  int met;
+
+} SPH_IMAGE_BUDGET_REPORT;
+
+/*
+ * A set of memory allocation callbacks for image readers and writers.
+ * 
+ * See sph_image_reader_newAlloc() and sph_image_writer_newAlloc().
+ */
+typedef struct {
+  
+  /*
+   * Allocate a block of len bytes, which is always at least one.
+   * 
+   * pCustom is the pCustom field of this structure.  The block must be
+   * suitably aligned for any type.  Return NULL if the memory can't be
+   * allocated.
+   */
+  void *(*allocFn)(void *pCustom, size_t len);
+  
+  /*
+   * Free a block returned by allocFn.
+   * 
+   * pCustom is the pCustom field of this structure.  p is never NULL.
+   */
+  void (*freeFn)(void *pCustom, void *p);
+  
+  /*
+   * Custom data passed through to the callbacks.
+   */
+  void *pCustom;
+
+} SPH_IMAGE_ALLOCATOR;
+
+/*
+ * A row-transform stage of an image pipeline.
+ * 
+ * See sph_image_pipeline_addStage().
+ */
+typedef struct {
+  
+  /*
+   * The width and height in pixels of the scanlines that the stage
+   * produces.
+   * 
+   * Valid range is [1, SPH_IMAGE_MAXDIM].
+   */
+  int32_t w;
+  int32_t h;
+  
+  /*
+   * The number of consecutive input scanlines that the stage looks at
+   * to produce one output scanline.
+   * 
+   * Valid range is [1, SPH_IMAGE_MAXDIM].
+   */
+  int32_t window;
+  
+  /*
+   * Return the last input scanline of the window of output scanline y.
+   * 
+   * pParam is the pParam field of this structure.  The window is the
+   * window input scanlines that end with this one.  It must overlap
+   * the input, so the result must be at least zero and less than the
+   * input height plus (window - 1), and it must not decrease as y
+   * increases.  The function is called once for each output scanline,
+   * in order, after the row function of the previous output scanline.
+   * 
+   * If NULL, the window is centered on input scanline y, and the stage
+   * must have the same height as its input.
+   */
+  int32_t (*lastFn)(void *pParam, int32_t y);
+  
+  /*
+   * Produce output scanline y.
+   * 
+   * pParam is the pParam field of this structure.  ppIn has window
+   * pointers to the input scanlines of the window, which start with
+   * input scanline first.  Pointers to scanlines outside the input,
+   * above its top or below its bottom, are NULL.  The output scanline
+   * goes into pOut.
+   * 
+   * The input scanlines belong to the pipeline and may only be read.
+   * pOut doesn't overlap them.  Return non-zero if successful, or zero
+   * to stop the pipeline with the error SPH_IMAGE_ERR_STAGE.
+   */
+  int (*rowFn)(
+            void            * pParam,
+            int32_t           y,
+            int32_t           first,
+      const uint32_t *const * ppIn,
+            uint32_t        * pOut);
+  
+  /*
+   * Custom data passed through to the callbacks.
+   */
+  void *pParam;
+
+} SPH_IMAGE_STAGE;
+
 /*
  * Given a parsed ARGB color, pack it into an unsigned 32-bit integer.
  * 
@@ -171,6 +409,105 @@ void sph_argb_downRGB(SPH_ARGB *pc);
  */
 void sph_argb_downGray(SPH_ARGB *pc);
 
+/*
+ * Determine the smallest grayscale bit depth that can exactly hold a
+ * scanline after grayscale down-conversion.
+ * 
+ * pScan points to w packed ARGB pixels.  w must be in range
+ * [1, SPH_IMAGE_MAXDIM].  Each pixel is down-converted with
+ * sph_argb_downGray() and the resulting gray values are checked.
+ * 
+ * The return value is 1 if every gray value is 0 or 255, 2 if every
+ * gray value is a multiple of 85, 4 if every gray value is a multiple
+ * of 17, and otherwise 8.  Clients can take the maximum of this value
+ * across all scanlines to select an exact SPH_IMAGE_DOWN_GRAY1,
+ * SPH_IMAGE_DOWN_GRAY2, or SPH_IMAGE_DOWN_GRAY4 mode, falling back to
+ * SPH_IMAGE_DOWN_GRAY if the result is 8.
+ * 
+ * Parameters:
+ * 
+ *   pScan - pointer to the scanline
+ * 
+ *   w - the width of the scanline in pixels
+ * 
+ * Return:
+ * 
+ *   the smallest exact grayscale bit depth (1, 2, 4, or 8)
+ */
+int sph_image_grayBits(const uint32_t *pScan, int32_t w);
+
+/*
+ * Allocate a new memory arena.
+ * 
+ * An arena hands out memory from large blocks that it gets from the
+ * system, and frees all of it at once when the arena is reset or freed.
+ * Freeing an individual allocation does nothing.  Use
+ * sph_image_arena_allocator() to get callbacks that allocate from the
+ * arena, and pass them to sph_image_reader_newAlloc() or
+ * sph_image_writer_newAlloc().  This keeps all the memory of a job
+ * together, so long-running programs don't fragment their heap.
+ * 
+ * Since freed memory is only reclaimed when the arena is reset, an
+ * arena should serve one job at a time, such as copying one image, and
+ * be reset once all the reader and writer objects that use it have been
+ * closed.  The arena is safe to use from several threads at once, so it
+ * also works with parallel decoding, read-ahead, and pipelining.
+ * 
+ * block is the size in bytes of the blocks requested from the system,
+ * or zero for a default of one megabyte.  Larger allocations get a block
+ * of their own.
+ * 
+ * Parameters:
+ * 
+ *   block - the block size in bytes, or zero
+ * 
+ * Return:
+ * 
+ *   the new arena
+ */
+SPH_IMAGE_ARENA *sph_image_arena_new(size_t block);
+
+/*
+ * Get allocation callbacks that allocate from a memory arena.
+ * 
+ * The arena must not be freed while any object that uses the callbacks
+ * is still open.
+ * 
+ * Parameters:
+ * 
+ *   pa - the arena
+ * 
+ *   pAlloc - the structure to receive the callbacks
+ */
+void sph_image_arena_allocator(
+    SPH_IMAGE_ARENA     * pa,
+    SPH_IMAGE_ALLOCATOR * pAlloc);
+
+/*
+ * Free everything that was allocated from a memory arena.
+ * 
+ * The first block is kept for the next job and all other blocks are
+ * returned to the system.  All objects that use the arena must have
+ * been closed first.
+ * 
+ * Parameters:
+ * 
+ *   pa - the arena
+ */
+void sph_image_arena_reset(SPH_IMAGE_ARENA *pa);
+
+/*
+ * Free a memory arena along with everything allocated from it.
+ * 
+ * All objects that use the arena must have been closed first.  If NULL
+ * is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pa - the arena, or NULL
+ */
+void sph_image_arena_free(SPH_IMAGE_ARENA *pa);
+
 /*
  * Allocate a new image writer object, given a handle.
  * 
@@ -192,6 +529,18 @@ void sph_argb_downGray(SPH_ARGB *pc);
  * down-conversion is requested.  JPEG files must use either RGB or
  * grayscale down-conversion.
  * 
+ * SPH_IMAGE_DOWN_GRAY1, SPH_IMAGE_DOWN_GRAY2, and SPH_IMAGE_DOWN_GRAY4
+ * apply grayscale down-conversion and then store each gray value with
+ * only 1, 2, or 4 bits.  By default, these modes are exact, meaning
+ * that each 8-bit gray value must be a multiple of 255, 85, or 17,
+ * respectively, so that it can be stored without loss.  Writing a
+ * scanline that contains any other gray value fails with the error
+ * SPH_IMAGE_ERR_GRAYDEPTH.  If SPH_IMAGE_DOWN_QUANTIZE is combined with
+ * one of these modes, each gray value is instead rounded to the nearest
+ * available level, which amounts to a threshold at 128 for the 1-bit
+ * mode.  Use sph_image_grayBits() to check in advance which exact mode
+ * a scanline fits in.
+ * 
  * q is reserved for a compression quality value.  It is not currently
  * used and should be set to zero.
  * 
@@ -199,6 +548,10 @@ void sph_argb_downGray(SPH_ARGB *pc);
  * write each scanline.  Then, close the image writer.  All image writer
  * objects should eventually be closed with sph_image_writer_close().
  * 
+ * The image headers are written right away.  If that fails, the writer
+ * is still returned, but every write fails with the error
+ * SPH_IMAGE_ERR_WRITEDATA, as reported by sph_image_writer_writeEx().
+ * 
  * Parameters:
  * 
  *   pOut - the handle to the output file
@@ -277,6 +630,196 @@ SPH_IMAGE_WRITER *sph_image_writer_newFromPath(
           int       q,
           int     * pError);
 
+/*
+ * Allocate a new image writer object that uses custom memory
+ * allocation.
+ * 
+ * This is the same as sph_image_writer_new(), except that all memory
+ * for the writer comes from the given callbacks.  That covers the
+ * writer structure, its buffers, its background thread, and the
+ * structures and compression state of libpng and zlib.  The callbacks
+ * stay in use after sph_image_writer_reset().  If pipelining is enabled,
+ * the callbacks are also called from the encoder thread, so they must
+ * be safe to call from several threads at once.
+ * 
+ * pAlloc is copied into the writer, so the structure itself need not
+ * stay valid.  If it is NULL, the standard library allocator is used.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the handle to the output file
+ * 
+ *   ftype - the type of image to write
+ * 
+ *   w - the width of the image in pixels
+ * 
+ *   h - the height of the image in pixels
+ * 
+ *   dconv - the down-conversion requested
+ * 
+ *   q - reserved, set to zero
+ * 
+ *   pAlloc - the allocation callbacks, or NULL
+ * 
+ * Return:
+ * 
+ *   the new image writer object
+ */
+SPH_IMAGE_WRITER *sph_image_writer_newAlloc(
+          FILE                * pOut,
+          int                   ftype,
+          int32_t               w,
+          int32_t               h,
+          int                   dconv,
+          int                   q,
+    const SPH_IMAGE_ALLOCATOR * pAlloc);
+
+/*
+ * Allocate a new image writer object with a memory limit.
+ * 
+ * This is the same as sph_image_writer_newAlloc(), except that the
+ * writer tries to keep the memory it allocates under limit bytes.  The
+ * limit counts every block allocated for the writer, including the
+ * writer structure and the memory of libpng and zlib.  It stays in
+ * effect after sph_image_writer_reset().  A limit of zero means no
+ * limit.
+ * 
+ * Before the first scanline of each image, the writer lowers the
+ * deflate window size and memory level as far as necessary to fit the
+ * limit, which costs some compression.  If the image can't fit even
+ * with the smallest settings, the writer enters error mode instead, and
+ * every write fails with SPH_IMAGE_ERR_MEMORY.  The scanline buffers
+ * that the width requires are allocated in any case.  A pipeline set with
+ * sph_image_writer_setPipeline() gets only as many slots as fit, and
+ * none if no slot fits, and so does a reorder window set with
+ * sph_image_writer_setReorder().
+ * 
+ * The needs of libpng and zlib are estimated, so the limit is not
+ * exact.  Use sph_image_writer_peakMemory() to see how much memory a
+ * writer actually used.
+ * 
+ * Parameters:
+ * 
+ *   pOut - the handle to the output file
+ * 
+ *   ftype - the type of image to write
+ * 
+ *   w - the width of the image in pixels
+ * 
+ *   h - the height of the image in pixels
+ * 
+ *   dconv - the down-conversion requested
+ * 
+ *   q - reserved, set to zero
+ * 
+ *   pAlloc - the allocation callbacks, or NULL
+ * 
+ *   limit - the memory limit in bytes, or zero
+ * 
+ * Return:
+ * 
+ *   the new image writer object
+ */
+SPH_IMAGE_WRITER *sph_image_writer_newLimit(
+          FILE                * pOut,
+          int                   ftype,
+          int32_t               w,
+          int32_t               h,
+          int                   dconv,
+          int                   q,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit);
+
+/*
+ * Reuse an image writer object to write another image.
+ * 
+ * This has the same effect as closing the writer with
+ * sph_image_writer_close() and allocating a new one with
+ * sph_image_writer_new() using the given parameters, except that the
+ * writer object itself is kept.  The scanline buffer and the internal
+ * buffers are kept whenever they are large enough for the new image,
+ * and the deflate stream used for restart points and time budgets is
+ * reset rather than allocated again.  This saves allocation work when
+ * many images are written in a row.
+ * 
+ * The current image is closed exactly as sph_image_writer_close()
+ * would close it, including closing its file handle, so it is only
+ * valid if all of its scanlines have been written.  All settings, such
+ * as compression parameters, restart points, time budgets, and
+ * pipelining, return to their defaults and must be set again for the
+ * new image.  Pointers previously returned by sph_image_writer_ptr()
+ * are no longer valid.
+ * 
+ * The parameters pOut ftype w h dconv and q have the same meaning as
+ * for sph_image_writer_new().
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pOut - the handle to the output file
+ * 
+ *   ftype - the type of image to write
+ * 
+ *   w - the width of the image in pixels
+ * 
+ *   h - the height of the image in pixels
+ * 
+ *   dconv - the down-conversion requested
+ * 
+ *   q - reserved, set to zero
+ */
+void sph_image_writer_reset(
+    SPH_IMAGE_WRITER * pw,
+    FILE             * pOut,
+    int                ftype,
+    int32_t            w,
+    int32_t            h,
+    int                dconv,
+    int                q);
+
+/*
+ * A wrapper around sph_image_writer_reset() that takes a file path.
+ * 
+ * The path is handled the same way as for
+ * sph_image_writer_newFromPath().  The current image is always closed.
+ * If the new path can't be used, the function fails, and the writer is
+ * left without an image.  In that case, the only valid operations on
+ * the writer are another reset and sph_image_writer_close().
+ * 
+ * If pError is provided, then it will always be filled in upon return
+ * either with an error code (if the function fails) or with zero
+ * (SPH_IMAGE_ERR_NONE) if the function is successful.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pPath - the path to the image file to write
+ * 
+ *   w - the width of the image in pixels
+ * 
+ *   h - the height of the image in pixels
+ * 
+ *   dconv - the down-conversion requested
+ * 
+ *   q - reserved, set to zero
+ * 
+ *   pError - pointer to error return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+int sph_image_writer_resetFromPath(
+          SPH_IMAGE_WRITER * pw,
+    const char             * pPath,
+          int32_t            w,
+          int32_t            h,
+          int                dconv,
+          int                q,
+          int              * pError);
+
 /*
  * Close a given image writer object.
  * 
@@ -312,7 +855,13 @@ void sph_image_writer_close(SPH_IMAGE_WRITER *pw);
  * channels.  The RGB channels are non-linear and the sRGB color space
  * should be assumed.
  * 
+ * The buffer is aligned and padded as described for SPH_IMAGE_ALIGN.
+ * 
  * The pointer remains valid until the image writer object is closed.
+ * With pipelining, the pointer is instead to the next free buffer of
+ * the pipeline, which is only valid until the next write, and this
+ * function may block until a buffer is free (see
+ * sph_image_writer_setPipeline()).
  * 
  * Parameters:
  * 
@@ -342,6 +891,9 @@ uint32_t *sph_image_writer_ptr(SPH_IMAGE_WRITER *pw);
  * image writer object is closed before all scanlines have been written,
  * the output file will be invalid.
  * 
+ * A fault occurs if there is a write error.  Use
+ * sph_image_writer_writeEx() instead to handle write errors.
+ * 
  * Parameters:
  * 
  *   pw - the image writer object
@@ -349,25 +901,481 @@ uint32_t *sph_image_writer_ptr(SPH_IMAGE_WRITER *pw);
 void sph_image_writer_write(SPH_IMAGE_WRITER *pw);
 
 /*
- * Allocate a new image reader object, given a handle.
+ * Transfer a scanline to the given image writer object, reporting
+ * write errors.
  * 
- * pIn is the handle to the image file to read.  The handle must be open
- * for reading, and it should refer to a normal disk file, or undefined
- * behavior occurs.  The image reader takes ownership of the file 
- * handle, and it will automatically close the file handle when the 
- * reader object is closed.
+ * This is the same as sph_image_writer_write(), except for error
+ * handling.
  * 
- * ftype is the type of image file to read.  It must be one of the
- * SPH_IMAGE_TYPE constants.  (Currently only PNG is supported.)
+ * pw is the image writer object.  A fault occurs if all scanlines have
+ * already been written.  Scanlines should be written from top to
+ * bottom.
  * 
- * After an image reader is allocated, sph_image_reader_width() and
- * sph_image_reader_height() can retrieve the dimensions of the file,
- * while sph_image_reader_read() can read the scanlines of the image.
- * Close the image reader with sph_image_reader_close() when done.
+ * The data to write is held in the image writer object's scanline
+ * buffer.  Use sph_image_writer_ptr() to get a pointer to the buffer.
  * 
- * If there is an error, NULL is returned.  If pError is not NULL, then
- * an error code will be written there on failure, or a zero error
- * (SPH_IMAGE_ERR_NONE) on success.  If an error occurs, the file
+ * The contents of the scanline buffer are unmodified by this function.
+ * 
+ * Once all scanlines have been written (the total number of scanlines
+ * must equal the height specified to sph_image_writer_new()), the image
+ * writer object may be closed with sph_image_writer_close().  If the
+ * image writer object is closed before all scanlines have been written,
+ * the output file will be invalid.
+ * 
+ * If there is a write error, zero is returned and the scanline is not
+ * counted as written.  All subsequent writes after a write error will
+ * also fail with the same error, and the output file will be invalid.
+ * SPH_IMAGE_ERR_GRAYDEPTH occurs with the exact low bit-depth grayscale
+ * modes.  SPH_IMAGE_ERR_WRITEDATA occurs if the output file can't be
+ * written, for example because the disk is full, or if the writer
+ * couldn't even write the image headers when it was created.  Writing
+ * the last scanline flushes the output file, so that errors held back
+ * by file buffering are reported then.
+ * 
+ * pError, if provided, will be set to an error code if there is an
+ * error, or zero (SPH_IMAGE_ERR_NONE) if there was no error.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if write error
+ */
+int sph_image_writer_writeEx(SPH_IMAGE_WRITER *pw, int *pError);
+
+/*
+ * Transfer a batch of scanlines from caller memory to the given image
+ * writer object.
+ * 
+ * This has the same effect as copying each of n scanlines into the
+ * scanline buffer and calling sph_image_writer_write(), but the
+ * scanlines are converted directly from pSrc and error handling is only
+ * set up once for the whole batch.  For narrow images with many rows,
+ * this removes most of the per-row call overhead.
+ * 
+ * pSrc points to the first pixel of the first scanline.  Each scanline
+ * has the same packed ARGB format as the scanline buffer (see
+ * sph_image_writer_ptr()).  stride is the distance in pixels from the
+ * start of one scanline to the start of the next, which must be at
+ * least the image width.  The memory at pSrc is not modified.
+ * 
+ * n is the number of scanlines to write, which must be at least one.  A
+ * fault occurs if n is greater than the number of scanlines that remain
+ * to be written.
+ * 
+ * Errors work the same way as for sph_image_writer_writeEx().  If there
+ * is an error partway through the batch, the scanlines before the
+ * failing scanline have been written, and the writer is in error mode.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pSrc - pointer to the first scanline to write
+ * 
+ *   stride - the distance in pixels between scanlines
+ * 
+ *   n - the number of scanlines to write
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if write error
+ */
+int sph_image_writer_writeRows(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError);
+
+/*
+ * Write one scanline from caller memory to the given image writer
+ * object.
+ * 
+ * This is the same as sph_image_writer_writeRows() with a batch of one
+ * scanline.  The scanline is converted directly from pSrc, so there is
+ * no need to copy it into the scanline buffer first.  pSrc has the same
+ * packed ARGB format as the scanline buffer (see sph_image_writer_ptr())
+ * and is not modified.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pSrc - pointer to the scanline to write
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if write error
+ */
+int sph_image_writer_writeFrom(
+          SPH_IMAGE_WRITER * pw,
+    const uint32_t         * pSrc,
+          int              * pError);
+
+/*
+ * Enable restart points in the output of an image writer.
+ * 
+ * Restart points allow a PNG file to be decoded in parallel.  The image
+ * is divided into bands of band scanlines each (the last band may be
+ * shorter).  The compressed data is fully flushed at the start of each
+ * band, each band starts in a new IDAT chunk, and the first scanline of
+ * each band only uses PNG filters that don't refer to the previous
+ * scanline.  An ancillary chunk recording the file offset of each band
+ * is written right before the IEND chunk that ends the file, where
+ * readers look for it.  The result is still a valid PNG file that any
+ * decoder can read, and Sophistry's image reader uses the recorded
+ * offsets to decode the bands in parallel on worker threads.
+ * 
+ * Restart points make the file slightly larger, since compression can
+ * not use matches that cross band boundaries.  Bands of a few dozen
+ * scanlines or more keep the overhead small for all but very narrow
+ * images.
+ * 
+ * band is the number of scanlines in each band.  It must be in range
+ * zero up to and including SPH_IMAGE_MAXDIM.  Values greater than the
+ * image height are treated as the image height.  Zero disables restart
+ * points, which is the default.
+ * 
+ * Restart points require a writer whose file offsets can be tracked,
+ * which is always the case since the writer owns its file handle.  A
+ * fault occurs if any scanlines have already been written.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   band - the number of scanlines per band, or zero
+ */
+void sph_image_writer_setRestart(SPH_IMAGE_WRITER *pw, int32_t band);
+
+/*
+ * Set the compression parameters of an image writer.
+ * 
+ * level is the deflate compression level, from zero (no compression)
+ * up to and including nine (smallest output, slowest).  It may also be
+ * -1 to use the default level, which is a reasonable tradeoff between
+ * speed and size.
+ * 
+ * strategy is one of the SPH_IMAGE_STRATEGY constants.  The automatic
+ * strategy is tuned for filtered data unless the image is written with
+ * a low bit-depth grayscale down-conversion.
+ * 
+ * filters is a combination of SPH_IMAGE_FILTER flags giving the PNG
+ * filters that may be used.  When more than one filter is allowed, the
+ * one that appears to compress best is chosen for each scanline.  Zero
+ * chooses automatically, which allows all filters except for low
+ * bit-depth grayscale, where only the None filter is used.  When
+ * restart points are enabled, the first scanline of each band only
+ * uses the allowed filters that don't refer to the previous scanline,
+ * or the None filter if there are none.
+ * 
+ * Which parameters give the smallest file depends on the image, so
+ * tools that want the smallest possible output can write the same
+ * image several times with different parameters and keep the smallest
+ * result.  pngcopy does this with its -trials option.
+ * 
+ * The defaults are -1, SPH_IMAGE_STRATEGY_AUTO and zero.  A fault
+ * occurs if any scanlines have already been written.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   level - the compression level, or -1
+ * 
+ *   strategy - the compression strategy
+ * 
+ *   filters - the allowed filters, or zero
+ */
+void sph_image_writer_setCompression(
+    SPH_IMAGE_WRITER * pw,
+    int                level,
+    int                strategy,
+    int                filters);
+
+/*
+ * Enable pipelined encoding on a background thread.
+ * 
+ * Normally, each scanline is converted and compressed on the calling
+ * thread when it is written, so the client can't start producing the
+ * next scanline until encoding is done.  With pipelining, the writer
+ * has a ring of rows scanline buffers.  sph_image_writer_ptr() returns
+ * the next free buffer in the ring, waiting if the ring is full, and
+ * sph_image_writer_write() hands the buffer to a background thread
+ * that converts and compresses scanlines in order.  Batch writes copy
+ * each scanline into the ring.  Producing scanlines then overlaps with
+ * encoding on a second processor.
+ * 
+ * Errors are reported by a later write than the one that submitted the
+ * failing scanline, but always by the time the last scanline has been
+ * written, since writing the last scanline waits until the whole image
+ * is encoded.  Once an error is reported, all further writes fail with
+ * the same error, as usual.
+ * 
+ * Each call to sph_image_writer_ptr() may return a different pointer,
+ * so clients must call it again for each scanline.
+ * 
+ * rows is the number of scanline buffers, which must be in range zero
+ * up to and including SPH_IMAGE_MAXDIM.  Values greater than the image
+ * height are treated as the image height.  Zero disables pipelining,
+ * which is the default.  The thread is started on the first call to
+ * sph_image_writer_ptr() or the first write.  A fault occurs if that
+ * has already happened.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   rows - the number of pipeline scanlines, or zero
+ */
+void sph_image_writer_setPipeline(SPH_IMAGE_WRITER *pw, int32_t rows);
+
+/*
+ * Give an image writer a time budget for encoding the image.
+ * 
+ * The clock starts when this function is called and runs until the
+ * last scanline has been written, so it includes the time the client
+ * spends producing scanlines.  As scanlines are written, the writer
+ * measures how long each one takes and projects when the image will be
+ * finished.  Whenever the projection is over budget, the writer moves
+ * to faster settings for the rest of the image: first lower deflate
+ * levels, then a single PNG filter per scanline instead of searching
+ * for the best one, and finally storing the data uncompressed.  The
+ * writer never moves back to slower settings.
+ * 
+ * The settings can only change between deflate blocks, which is done
+ * with the native IDAT encoder, so a budget also means the output is
+ * written that way (see sph_image_writer_setRestart()).  The output is
+ * an ordinary PNG file either way.  The starting settings are the ones
+ * given to sph_image_writer_setCompression(), if any.
+ * 
+ * A budget is a target rather than a guarantee: if even the fastest
+ * settings are too slow, or the client produces scanlines too slowly,
+ * the budget will be exceeded.  sph_image_writer_budget() reports what
+ * the writer did.
+ * 
+ * msec is the budget in milliseconds.  It must be zero or greater.
+ * Zero disables the budget, which is the default.  A fault occurs if
+ * any scanlines have already been written.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   msec - the time budget in milliseconds, or zero
+ */
+void sph_image_writer_setBudget(SPH_IMAGE_WRITER *pw, int32_t msec);
+
+/*
+ * Apply per-channel tone curves to the scanlines of an image writer.
+ * 
+ * pTables holds four tables of 256 bytes each, for the alpha, red,
+ * green, and blue channels in that order, for a total of 1024 bytes.
+ * Every channel value of every pixel written is replaced with the
+ * entry of its table at that value before any down-conversion.  The
+ * tables are copied.  The client's scanlines are not modified; the
+ * curves are applied inside the conversion to PNG samples that the
+ * writer does anyway, so they cost only a few table lookups per pixel.
+ * 
+ * NULL turns the curves off, which is the default.  Resetting the
+ * writer to a new image also turns them off.  A fault occurs if any
+ * scanlines have already been written, or if the pipelined encoder has
+ * started (see sph_image_writer_setPipeline()).
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pTables - the four channel tables, or NULL
+ */
+void sph_image_writer_setCurves(
+          SPH_IMAGE_WRITER * pw,
+    const uint8_t          * pTables);
+
+/*
+ * Enable out-of-order scanline submission from any number of threads.
+ * 
+ * Normally, scanlines must be written from top to bottom by one thread
+ * at a time.  With a reorder window, sph_image_writer_submitRows()
+ * accepts scanlines in any order from any thread, so that producers
+ * rendering different bands of the image don't have to be serialized
+ * through one buffer.  The window is a ring of rows scanline slots that
+ * starts at the first scanline that hasn't been written yet.  Each
+ * submitted scanline is copied into its slot, and as soon as the first
+ * scanline of the window is present, it is written, followed by every
+ * present scanline after it up to the first gap.  That writing is done
+ * by the submitting thread that filled the start of the window, while
+ * other threads keep submitting.  If pipelining is enabled as well (see
+ * sph_image_writer_setPipeline()), the scanlines are handed on to the
+ * pipelined encoder instead of being encoded by that thread.
+ * 
+ * A thread that submits a scanline beyond the end of the window waits
+ * until the window has moved far enough, so memory stays bounded by the
+ * window however far ahead the producers get.  The first scanline of
+ * the window can always be submitted, so producers never deadlock as
+ * long as each thread submits its own scanlines from top to bottom.
+ * 
+ * rows is the number of slots in the window, which must be in range one
+ * up to and including SPH_IMAGE_MAXDIM.  Values greater than the image
+ * height are treated as the image height.  Under a memory limit, the
+ * window gets only as many slots as fit, and if none fit, every
+ * submission fails with SPH_IMAGE_ERR_MEMORY.
+ * 
+ * Once the window is enabled, scanlines can only be written with
+ * sph_image_writer_submitRows(), and a fault occurs if any other
+ * function that writes scanlines or sph_image_writer_ptr() is called.
+ * Resetting the writer to a new image removes the window.  A fault
+ * occurs if a window is already enabled, if any scanlines have already
+ * been written, or if the pipelined encoder has started.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   rows - the number of scanlines in the reorder window
+ */
+void sph_image_writer_setReorder(SPH_IMAGE_WRITER *pw, int32_t rows);
+
+/*
+ * Submit a batch of scanlines to the reorder window of an image writer.
+ * 
+ * This may be called from any thread at the same time as other calls
+ * to this function for the same writer, but not at the same time as
+ * any other function of the writer except sph_image_writer_finish().
+ * 
+ * The n scanlines starting at scanline y are copied from pSrc, where
+ * stride is the distance in pixels between scanlines, which must be at
+ * least the image width.  The scanlines are submitted one at a time,
+ * each one waiting until it is within the reorder window, and any
+ * scanlines that can be written in order are written before this
+ * returns.  The client's buffer may be reused as soon as this returns.
+ * 
+ * A reorder window must have been enabled with
+ * sph_image_writer_setReorder().  A fault occurs if y is negative, if
+ * (y + n) is greater than the image height, or if any of the scanlines
+ * has already been submitted.
+ * 
+ * If writing fails, every later submission and every submission that
+ * is waiting fails with the same error.  Errors are only reported by
+ * the calls that run after the failure, so sph_image_writer_finish()
+ * should be used to learn whether the whole image was written.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   y - the first scanline
+ * 
+ *   pSrc - pointer to the first scanline
+ * 
+ *   stride - the distance in pixels between scanlines
+ * 
+ *   n - the number of scanlines
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_writer_submitRows(
+          SPH_IMAGE_WRITER * pw,
+          int32_t            y,
+    const uint32_t         * pSrc,
+          int32_t            stride,
+          int32_t            n,
+          int              * pError);
+
+/*
+ * Wait until all scanlines submitted to the reorder window of an image
+ * writer have been written.
+ * 
+ * This blocks until every scanline of the image has been written, or
+ * until writing fails, so it must only be called once all scanlines
+ * have been or are being submitted.  It may be called from any thread,
+ * including while other threads are still submitting.  Afterwards, the
+ * writer can be closed.
+ * 
+ * A fault occurs if no reorder window has been enabled with
+ * sph_image_writer_setReorder().
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if the whole image was written, zero if error
+ */
+int sph_image_writer_finish(SPH_IMAGE_WRITER *pw, int *pError);
+
+/*
+ * Report how an image writer kept to its time budget.
+ * 
+ * This may be called at any time before the writer is closed.  It is
+ * most useful after the last scanline has been written.  If no budget
+ * was set, the report has a zero budget and no changes.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ *   pReport - the structure to receive the report
+ */
+void sph_image_writer_budget(
+    SPH_IMAGE_WRITER        * pw,
+    SPH_IMAGE_BUDGET_REPORT * pReport);
+
+/*
+ * Get the peak memory use of an image writer.
+ * 
+ * This is the largest number of bytes that were allocated for the
+ * writer at any one time since it was allocated or last reset,
+ * including the memory of libpng, zlib, and the pipeline thread.  It
+ * includes a small header that the writer adds to each block for the
+ * count.
+ * 
+ * Parameters:
+ * 
+ *   pw - the image writer object
+ * 
+ * Return:
+ * 
+ *   the peak memory use in bytes
+ */
+size_t sph_image_writer_peakMemory(SPH_IMAGE_WRITER *pw);
+
+/*
+ * Allocate a new image reader object, given a handle.
+ * 
+ * pIn is the handle to the image file to read.  The handle must be open
+ * for reading, and it should refer to a normal disk file, or undefined
+ * behavior occurs.  The image reader takes ownership of the file 
+ * handle, and it will automatically close the file handle when the 
+ * reader object is closed.
+ * 
+ * ftype is the type of image file to read.  It must be one of the
+ * SPH_IMAGE_TYPE constants.  (Currently only PNG is supported.)
+ * 
+ * After an image reader is allocated, sph_image_reader_width() and
+ * sph_image_reader_height() can retrieve the dimensions of the file,
+ * while sph_image_reader_read() can read the scanlines of the image.
+ * Close the image reader with sph_image_reader_close() when done.
+ * 
+ * If there is an error, NULL is returned.  If pError is not NULL, then
+ * an error code will be written there on failure, or a zero error
+ * (SPH_IMAGE_ERR_NONE) on success.  If an error occurs, the file
  * handle will be closed by this function.
  * 
  * Parameters:
@@ -423,6 +1431,158 @@ SPH_IMAGE_READER *sph_image_reader_newFromPath(
     const char * pPath,
           int  * pError);
 
+/*
+ * Allocate a new image reader object that uses custom memory
+ * allocation.
+ * 
+ * This is the same as sph_image_reader_new(), except that all memory
+ * for the reader comes from the given callbacks.  That covers the
+ * reader structure, its buffers, its background threads, and the
+ * structures and decompression state of libpng and zlib.  The callbacks
+ * stay in use after sph_image_reader_reset().  If parallel band
+ * decoding or read-ahead is used, the callbacks are also called from
+ * worker threads, so they must be safe to call from several threads at
+ * once.
+ * 
+ * pAlloc is copied into the reader, so the structure itself need not
+ * stay valid.  If it is NULL, the standard library allocator is used.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the handle to the input file
+ * 
+ *   ftype - the type of image to read
+ * 
+ *   pAlloc - the allocation callbacks, or NULL
+ * 
+ *   pError - pointer to the error return, or NULL
+ * 
+ * Return:
+ * 
+ *   the new image reader object, or NULL
+ */
+SPH_IMAGE_READER *sph_image_reader_newAlloc(
+          FILE                * pIn,
+          int                   ftype,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          int                 * pError);
+
+/*
+ * Allocate a new image reader object with a memory limit.
+ * 
+ * This is the same as sph_image_reader_newAlloc(), except that the
+ * reader tries to keep the memory it allocates under limit bytes.  The
+ * limit counts every block allocated for the reader, including the
+ * reader structure and the memory of libpng and zlib.  It stays in
+ * effect after sph_image_reader_reset().  A limit of zero means no
+ * limit.
+ * 
+ * After the image headers are read, and before any buffers are
+ * allocated for the image, the reader estimates the least memory it
+ * needs to decode the image one scanline at a time.  If that doesn't
+ * fit, opening the image fails with SPH_IMAGE_ERR_MEMORY.  Parallel
+ * band decoding uses only as many threads as fit, and read-ahead uses
+ * only as many slots as fit; either is skipped if it doesn't fit at
+ * all.
+ * 
+ * The needs of libpng and zlib are estimated, so the limit is not
+ * exact.  Use sph_image_reader_peakMemory() to see how much memory a
+ * reader actually used.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the handle to the input file
+ * 
+ *   ftype - the type of image to read
+ * 
+ *   pAlloc - the allocation callbacks, or NULL
+ * 
+ *   limit - the memory limit in bytes, or zero
+ * 
+ *   pError - pointer to the error return, or NULL
+ * 
+ * Return:
+ * 
+ *   the new image reader object, or NULL
+ */
+SPH_IMAGE_READER *sph_image_reader_newLimit(
+          FILE                * pIn,
+          int                   ftype,
+    const SPH_IMAGE_ALLOCATOR * pAlloc,
+          size_t                limit,
+          int                 * pError);
+
+/*
+ * Reuse an image reader object to read another image.
+ * 
+ * This has the same effect as closing the reader with
+ * sph_image_reader_close() and allocating a new one with
+ * sph_image_reader_new(), except that the reader object itself is
+ * kept, along with its scanline buffer and internal buffers whenever
+ * they are large enough for the new image.  This saves allocation work
+ * when many images are read in a row.
+ * 
+ * The current image is closed exactly as sph_image_reader_close() would
+ * close it, including closing its file handle.  The thread count and
+ * read-ahead settings return to their defaults and must be set again
+ * for the new image.  Pointers previously returned by
+ * sph_image_reader_read() are no longer valid.
+ * 
+ * pIn and ftype have the same meaning as for sph_image_reader_new(),
+ * and the new file handle is closed by this function if there is an
+ * error.  If the function fails, the reader is left without an image.
+ * In that case, the only valid operations on the reader are another
+ * reset and sph_image_reader_close().
+ * 
+ * If pError is not NULL, then an error code will be written there on
+ * failure, or a zero error (SPH_IMAGE_ERR_NONE) on success.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pIn - the handle to the input file
+ * 
+ *   ftype - the type of image to read
+ * 
+ *   pError - pointer to the error return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+int sph_image_reader_reset(
+    SPH_IMAGE_READER * pr,
+    FILE             * pIn,
+    int                ftype,
+    int              * pError);
+
+/*
+ * A wrapper around sph_image_reader_reset() that takes a file path.
+ * 
+ * The path is handled the same way as for
+ * sph_image_reader_newFromPath().  The current image is always closed,
+ * even if the new path can't be opened.
+ * 
+ * See sph_image_reader_reset() for further information.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pPath - the path to the image file to read
+ * 
+ *   pError - pointer to the error return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+int sph_image_reader_resetFromPath(
+          SPH_IMAGE_READER * pr,
+    const char             * pPath,
+          int              * pError);
+
 /*
  * Close a given image reader object.
  * 
@@ -440,7 +1600,8 @@ void sph_image_reader_close(SPH_IMAGE_READER *pr);
 /*
  * Get the width of the image in pixels.
  * 
- * The range is [1, SPH_IMAGE_MAXDIM].
+ * The range is [1, SPH_IMAGE_MAXDIM].  If a reduction factor was set
+ * with sph_image_reader_setReduce(), this is the reduced width.
  * 
  * Parameters:
  * 
@@ -455,7 +1616,8 @@ int32_t sph_image_reader_width(SPH_IMAGE_READER *pr);
 /*
  * Get the height of the image in pixels.
  * 
- * The range is [1, SPH_IMAGE_MAXDIM].
+ * The range is [1, SPH_IMAGE_MAXDIM].  If a reduction factor was set
+ * with sph_image_reader_setReduce(), this is the reduced height.
  * 
  * Parameters:
  * 
@@ -479,9 +1641,11 @@ int32_t sph_image_reader_height(SPH_IMAGE_READER *pr);
  * is non-premultiplied with respect to the RGB channels.  The RGB
  * channels are non-linear and the sRGB color space should be assumed.
  * 
+ * The buffer is aligned and padded as described for SPH_IMAGE_ALIGN.
  * The client may modify the buffer.  The pointer remains valid until
  * the next call to sph_image_reader_read() or until the reader object
- * is closed (whichever occurs first).
+ * is closed (whichever occurs first).  With read-ahead, any other read
+ * also invalidates it (see sph_image_reader_setReadAhead()).
  * 
  * Each time this function is called, it reads another scanline from the
  * image.  A fault occurs if it tries to read more than the total number
@@ -508,6 +1672,1528 @@ int32_t sph_image_reader_height(SPH_IMAGE_READER *pr);
  */
 uint32_t *sph_image_reader_read(SPH_IMAGE_READER *pr, int *pError);
 
+/*
+ * Read a batch of scanlines into caller memory.
+ * 
+ * This has the same effect as calling sph_image_reader_read() n times
+ * and copying each scanline out, but the scanlines are decoded directly
+ * into pDst and error handling is only set up once for the whole batch.
+ * For narrow images with many rows, this removes most of the per-row
+ * call overhead.
+ * 
+ * pDst points to where the first pixel of the first scanline should be
+ * written.  Each scanline has the same packed ARGB format as returned
+ * by sph_image_reader_read().  stride is the distance in pixels from
+ * the start of one scanline to the start of the next, which must be at
+ * least the image width.  Pixels between the end of one scanline and
+ * the start of the next are not modified.
+ * 
+ * n is the number of scanlines to read, which must be at least one.  A
+ * fault occurs if n is greater than the number of scanlines that remain
+ * to be read.
+ * 
+ * Errors work the same way as for sph_image_reader_read().  If there is
+ * a read error, the contents of the scanlines in pDst are undefined.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pDst - pointer to the first scanline to read into
+ * 
+ *   stride - the distance in pixels between scanlines
+ * 
+ *   n - the number of scanlines to read
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+int sph_image_reader_readRows(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int32_t            n,
+    int              * pError);
+
+/*
+ * Read the next scanline into caller memory.
+ * 
+ * This is the same as sph_image_reader_readRows() with a batch of one
+ * scanline.  Without parallel band decoding or read-ahead, the scanline
+ * is decoded directly into pDst, which receives exactly as many pixels
+ * as the width of the image.  For example, pDst may be the scanline
+ * buffer of an image writer, so that copying an image needs no copy of
+ * each scanline.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pDst - pointer to the memory that receives the scanline
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+int sph_image_reader_readInto(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int              * pError);
+
+/*
+ * Read the whole image into a contiguous buffer in one call.
+ * 
+ * This reads every scanline of the image, from top to bottom, with the
+ * same packed ARGB format as sph_image_reader_read().  Each scanline is
+ * converted straight into its place in the buffer as it is decoded,
+ * with no intermediate copies.  If the image has restart points (see
+ * sph_image_reader_restart()) and more than one thread is in use (see
+ * sph_image_reader_setThreads()), all bands are decoded in parallel,
+ * each one directly into the buffer.  Otherwise, the image is decoded
+ * serially on the calling thread, and any read-ahead setting is
+ * ignored.
+ * 
+ * pDst points to where the first pixel of the first scanline should be
+ * written, and must have room for (stride * height) pixels.  If pDst is
+ * NULL, a buffer of that size is allocated, aligned as described for
+ * SPH_IMAGE_ALIGN.  An allocated buffer comes from the standard library
+ * regardless of the allocator of the reader, so that it can outlive
+ * the reader, and the client must release it with free().
+ * 
+ * stride is the distance in pixels from the start of one scanline to
+ * the start of the next.  If it is less than one, the image width is
+ * used, so that the scanlines are packed.  Otherwise, it must be at
+ * least the image width.  Pixels between the end of one scanline and
+ * the start of the next are not modified.
+ * 
+ * A fault occurs if any scanlines have already been read.  Afterwards,
+ * all scanlines have been read, so the only thing left to do with the
+ * reader is to close or reset it.
+ * 
+ * If there is a read error, NULL is returned and the contents of pDst
+ * are undefined.  An allocated buffer is freed in that case.  pError
+ * works the same way as for sph_image_reader_read().
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pDst - pointer to the buffer that receives the image, or NULL to
+ *   allocate one
+ * 
+ *   stride - the distance in pixels between scanlines, or zero for the
+ *   image width
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   pointer to the image buffer, or NULL if read error
+ */
+uint32_t *sph_image_reader_readImage(
+    SPH_IMAGE_READER * pr,
+    uint32_t         * pDst,
+    int32_t            stride,
+    int              * pError);
+
+/*
+ * Move the read position of a reader to any scanline.
+ * 
+ * After a successful seek, the next scanline read is scanline y, which
+ * must be in range [0, height - 1].  Seeking both forward and backward
+ * is allowed, as often as needed.
+ * 
+ * If px is not NULL, it is a checkpoint index of the image (see
+ * sph_image_index_build()).  Decoding then resumes at the last
+ * checkpoint at or before scanline y, so the cost of a seek is bounded
+ * by the spacing of the checkpoints rather than by y.  If px is NULL,
+ * or if the current read position is closer, the reader decodes
+ * forward from the current position, or from the top of the image when
+ * seeking backward.
+ * 
+ * Seeking backward or from a checkpoint needs the native decoder, so
+ * it is only possible for the same image formats that support restart
+ * points (see sph_image_reader_restart()).  From then on, the native
+ * decoder on the calling thread decodes all scanlines, and parallel
+ * band decoding and read-ahead stop.  The results are exactly the same
+ * as with libpng.
+ * 
+ * If the index doesn't match the image, or if the seek is backward and
+ * the image format isn't supported, the seek fails with the error code
+ * SPH_IMAGE_ERR_INDEX, and the reader is unchanged.  If there is a read
+ * error, the reader enters error mode as for sph_image_reader_read().
+ * A fault occurs if the reader is downscaled (see
+ * sph_image_reader_setReduce()).
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   px - the checkpoint index of the image, or NULL
+ * 
+ *   y - the scanline to seek to
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_reader_seek(
+          SPH_IMAGE_READER * pr,
+    const SPH_IMAGE_INDEX  * px,
+          int32_t            y,
+          int              * pError);
+
+/*
+ * Get the number of scanlines in each restart band of the image.
+ * 
+ * When an image reader is created, it looks for a restart index that
+ * was written by an image writer with sph_image_writer_setRestart().
+ * If one is found and the image is in a format that the parallel
+ * decoder supports (8-bit grayscale, grayscale plus alpha, RGB, or RGBA,
+ * or 1-bit, 2-bit, or 4-bit grayscale, in each case without a
+ * transparency chunk), the bands are decoded in parallel on worker
+ * threads.  The results are exactly the same as with serial decoding.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   the number of scanlines per band, or zero if the image can't be
+ *   decoded in parallel
+ */
+int32_t sph_image_reader_restart(SPH_IMAGE_READER *pr);
+
+/*
+ * Set the number of worker threads used for parallel band decoding.
+ * 
+ * This only matters for images that have restart points (see
+ * sph_image_reader_restart()).  threads must be zero or greater.  Zero
+ * means the number of online processors, up to a fixed limit, which is
+ * the default.  One means no worker threads, so the image is decoded
+ * serially on the calling thread.
+ * 
+ * The worker threads are started on the first read, and each one may
+ * hold up to two decoded bands in memory at a time.  A fault occurs if
+ * any scanlines have already been read.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   threads - the number of worker threads, or zero for automatic
+ */
+void sph_image_reader_setThreads(SPH_IMAGE_READER *pr, int threads);
+
+/*
+ * Enable read-ahead decoding on a background thread.
+ * 
+ * Normally, each scanline is decoded on the calling thread when it is
+ * read, so the client's processing of one scanline and the decoding of
+ * the next never overlap.  With read-ahead, a background thread decodes
+ * scanlines in order into a ring of rows scanline buffers, running
+ * ahead of the client by up to that many scanlines, and each read just
+ * hands out the next decoded scanline.  When the client does about as
+ * much work per scanline as decoding takes, this can nearly halve the
+ * total time on a machine with a spare processor.
+ * 
+ * With read-ahead, sph_image_reader_read() returns a pointer into the
+ * ring instead of copying the scanline.  The pointer remains valid
+ * until the next read of any kind or until the reader is closed.  If a
+ * scanline fails to decode, all scanlines before it are still returned
+ * normally, and the error is reported when the failed scanline is read.
+ * 
+ * Images with restart points that are decoded by the parallel band
+ * decoder already decode ahead of the client, so read-ahead is not
+ * used for them (see sph_image_reader_setThreads()).
+ * 
+ * rows is the number of scanline buffers, which must be in range zero
+ * up to and including SPH_IMAGE_MAXDIM.  Values greater than the image
+ * height are treated as the image height.  Zero disables read-ahead,
+ * which is the default.  The thread is started on the first read.  A
+ * fault occurs if any scanlines have already been read.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   rows - the number of read-ahead scanlines, or zero
+ */
+void sph_image_reader_setReadAhead(SPH_IMAGE_READER *pr, int32_t rows);
+
+/*
+ * Downscale the image by an integer factor while decoding.
+ * 
+ * Each factor by factor box of source pixels becomes one pixel that is
+ * their rounded average, so a thumbnail can be read straight from a
+ * large image without ever holding a full-resolution scanline in
+ * client memory.  The boxes are summed as the source scanlines are
+ * decoded, and only one reduced scanline of running sums is kept.
+ * Colors are weighted by alpha, so fully transparent pixels do not
+ * darken their neighbors, and a box that is entirely transparent
+ * becomes transparent black.
+ * 
+ * The reduced dimensions are rounded up, and the boxes at the right and
+ * bottom edges average only the source pixels that exist.  After this
+ * call, sph_image_reader_width() and sph_image_reader_height() return
+ * the reduced dimensions, and all reads deliver reduced scanlines.
+ * The parallel band decoder and the read-ahead decoder still work and
+ * feed the reduction.  Downscaled readers can't be moved with
+ * sph_image_reader_seek().
+ * 
+ * factor must be in range one up to and including SPH_IMAGE_MAXDIM.
+ * One disables the reduction, which is the default.  Resetting the
+ * reader to a new image also sets the factor back to one.  A fault
+ * occurs if any scanlines have already been read or if the reader was
+ * moved with sph_image_reader_seek().
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   factor - the reduction factor
+ */
+void sph_image_reader_setReduce(SPH_IMAGE_READER *pr, int32_t factor);
+
+/*
+ * Apply per-channel tone curves to the scanlines of an image reader.
+ * 
+ * pTables holds four tables of 256 bytes each, for the alpha, red,
+ * green, and blue channels in that order, for a total of 1024 bytes.
+ * Every channel value of every pixel that the reader returns is
+ * replaced with the entry of its table at that value.  This covers
+ * levels adjustments, inversions, thresholds, and gamma changes.  The
+ * tables are copied.
+ * 
+ * The curves are applied inside the conversion to ARGB that the reader
+ * does anyway, so they cost only a few table lookups per pixel, and
+ * no separate pass over the scanlines.  This also holds for the
+ * parallel band decoder and the read-ahead decoder.  For a downscaled
+ * reader (see sph_image_reader_setReduce()), the curves apply to the
+ * reduced pixels.
+ * 
+ * NULL turns the curves off, which is the default.  Resetting the
+ * reader to a new image also turns them off.  A fault occurs if any
+ * scanlines have already been read or if the reader was moved with
+ * sph_image_reader_seek().
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   pTables - the four channel tables, or NULL
+ */
+void sph_image_reader_setCurves(
+          SPH_IMAGE_READER * pr,
+    const uint8_t          * pTables);
+
+/*
+ * Get the peak memory use of an image reader.
+ * 
+ * This is the largest number of bytes that were allocated for the
+ * reader at any one time since it was allocated or last reset,
+ * including the memory of libpng, zlib, and the worker threads.  It
+ * includes a small header that the reader adds to each block for the
+ * count.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ * Return:
+ * 
+ *   the peak memory use in bytes
+ */
+size_t sph_image_reader_peakMemory(SPH_IMAGE_READER *pr);
+
+/*
+ * Build a checkpoint index for the image of a reader.
+ * 
+ * The whole image is decoded once, and at about every rows scanlines,
+ * the complete state needed to resume decoding is recorded as a
+ * checkpoint: the file position, the last 32 KiB of decompressed data,
+ * and the previous scanline.  With the index, sph_image_reader_seek()
+ * can then reach any scanline by decoding at most about rows scanlines.
+ * Checkpoints can only be placed where the compressed data allows it,
+ * so their actual spacing varies.
+ * 
+ * Each checkpoint takes up to 32 KiB plus about twice the size of an
+ * uncompressed scanline in memory and in the index file, so a spacing
+ * of hundreds of scanlines is reasonable for large images.
+ * 
+ * rows is the desired number of scanlines between checkpoints, or zero
+ * for a default of 256.  The image must be in a format that supports
+ * restart points (see sph_image_reader_restart()), or else the build
+ * fails with SPH_IMAGE_ERR_INDEX.  A read error in the image data fails
+ * with SPH_IMAGE_ERR_READDATA.  In either case, the reader itself is
+ * not affected.
+ * 
+ * The reader is left at the same read position, so the index can be
+ * built right after opening an image and before reading it.  A fault
+ * occurs if parallel band decoding or read-ahead is running.
+ * 
+ * The index is independent of the reader, and it must be released with
+ * sph_image_index_free().
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader object
+ * 
+ *   rows - the desired number of scanlines between checkpoints, or zero
+ *   for default
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   the new index, or NULL if error
+ */
+SPH_IMAGE_INDEX *sph_image_index_build(
+    SPH_IMAGE_READER * pr,
+    int32_t            rows,
+    int              * pError);
+
+/*
+ * Save a checkpoint index to a file.
+ * 
+ * The index is usually kept as a sidecar file next to the image, so
+ * that it only needs to be built once.  The file records the size of
+ * the image file and its geometry, so that an index that doesn't match
+ * is rejected when it is used.  If the file can't be created, the
+ * error is SPH_IMAGE_ERR_OPEN, and if it can't be written, the error is
+ * SPH_IMAGE_ERR_WRITEDATA.
+ * 
+ * Parameters:
+ * 
+ *   px - the index
+ * 
+ *   pPath - path to the index file to create
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_index_save(
+    const SPH_IMAGE_INDEX * px,
+    const char            * pPath,
+          int             * pError);
+
+/*
+ * Load a checkpoint index from a file saved by sph_image_index_save().
+ * 
+ * If the file can't be opened, the error is SPH_IMAGE_ERR_OPEN.  If it
+ * isn't a valid index file, the error is SPH_IMAGE_ERR_INDEX.  Whether
+ * the index matches an image is only checked when it is used.
+ * 
+ * Parameters:
+ * 
+ *   pPath - path to the index file
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   the loaded index, or NULL if error
+ */
+SPH_IMAGE_INDEX *sph_image_index_load(const char *pPath, int *pError);
+
+/*
+ * Free a checkpoint index.
+ * 
+ * If NULL is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   px - the index, or NULL
+ */
+void sph_image_index_free(SPH_IMAGE_INDEX *px);
+
+/*
+ * Get the number of checkpoints in an index.
+ * 
+ * This may be zero for small images or images whose compressed data
+ * has no usable checkpoint positions.
+ * 
+ * Parameters:
+ * 
+ *   px - the index
+ * 
+ * Return:
+ * 
+ *   the number of checkpoints
+ */
+int32_t sph_image_index_count(const SPH_IMAGE_INDEX *px);
+
+/*
+ * Open an image file for random access through a strip cache.
+ * 
+ * An image cache serves scanlines and rectangular tiles of an image in
+ * any order, without holding the whole image in memory.  The image is
+ * divided into strips of whole scanlines, and decoded strips are kept
+ * in memory up to a limit.  When the limit is reached, the least
+ * recently used strip is evicted.  An access to a strip that isn't
+ * cached decodes it again.
+ * 
+ * If the image has restart points (see sph_image_writer_setRestart()),
+ * each strip is one restart band, which is decoded on its own, so any
+ * strip can be reached without decoding the rest of the image.  The
+ * strip parameter is ignored in that case.  Otherwise, the image can
+ * only be decoded serially.  Strips below the last decoded one are
+ * reached by decoding forward, and strips above it by decoding again
+ * from the top of the image, so clients should favor accesses from top
+ * to bottom.
+ * 
+ * strip is the number of scanlines in each strip for images without
+ * restart points, or zero for a default of 64.  It is reduced to the
+ * image height if it is greater.
+ * 
+ * mem is the limit in bytes for the memory that holds decoded strips,
+ * or zero for a default of 64 MiB.  Each strip takes up about (strip *
+ * width * 4) bytes.  At least one strip is always held, even if it
+ * exceeds the limit.  Memory for strips is only allocated when strips
+ * are first decoded.  The decoder itself needs a further amount of
+ * memory that is proportional to the image width.
+ * 
+ * The file type is determined from the file extension in the same way
+ * as for sph_image_reader_newFromPath().  The file stays open until the
+ * cache is closed, and for images without restart points it is opened
+ * again each time decoding starts over from the top.
+ * 
+ * Parameters:
+ * 
+ *   pPath - path to the image file
+ * 
+ *   strip - the number of scanlines per strip, or zero for default
+ * 
+ *   mem - the memory limit for strips in bytes, or zero for default
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   the new image cache object, or NULL if error
+ */
+SPH_IMAGE_CACHE *sph_image_cache_newFromPath(
+    const char * pPath,
+          int32_t  strip,
+          size_t   mem,
+          int    * pError);
+
+/*
+ * Close an image cache object.
+ * 
+ * The reader and file that the cache uses are also closed.  If NULL is
+ * passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object, or NULL
+ */
+void sph_image_cache_close(SPH_IMAGE_CACHE *pc);
+
+/*
+ * Get the width of the image of a cache in pixels.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ * Return:
+ * 
+ *   the width in pixels
+ */
+int32_t sph_image_cache_width(SPH_IMAGE_CACHE *pc);
+
+/*
+ * Get the height of the image of a cache in pixels.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ * Return:
+ * 
+ *   the height in pixels
+ */
+int32_t sph_image_cache_height(SPH_IMAGE_CACHE *pc);
+
+/*
+ * Get the number of scanlines in each strip of a cache.
+ * 
+ * This is the restart band height for images with restart points.
+ * Accesses that stay within one strip at a time are cheapest.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ * Return:
+ * 
+ *   the number of scanlines per strip
+ */
+int32_t sph_image_cache_strip(SPH_IMAGE_CACHE *pc);
+
+/*
+ * Give an image cache a checkpoint index for its image.
+ * 
+ * For images without restart points, the cache then reaches a strip
+ * that isn't cached by seeking from the nearest checkpoint (see
+ * sph_image_reader_seek()), instead of decoding from the top of the
+ * image, so strips may be accessed in any order at a bounded cost.
+ * Images with restart points don't need an index, and it is ignored.
+ * 
+ * The index must remain valid until the cache is closed or given
+ * another index.  If px is NULL, the cache stops using an index.  If
+ * the index doesn't match the image, the error is SPH_IMAGE_ERR_INDEX
+ * and the cache is unchanged.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ *   px - the checkpoint index, or NULL
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_cache_setIndex(
+          SPH_IMAGE_CACHE * pc,
+    const SPH_IMAGE_INDEX * px,
+          int             * pError);
+
+/*
+ * Get any scanline of the image of a cache.
+ * 
+ * y is the scanline to get, which must be in range [0, height - 1].
+ * The scanline has the same packed ARGB format as returned by
+ * sph_image_reader_read(), and it is aligned as described for
+ * SPH_IMAGE_ALIGN.  The client must not modify it.  The pointer remains
+ * valid until the next call to sph_image_cache_getRow() or
+ * sph_image_cache_getTile(), or until the cache is closed (whichever
+ * occurs first).
+ * 
+ * If there is a read error, NULL is returned.  After a read error, the
+ * cache is in error mode and all further accesses fail.
+ * 
+ * pError, if provided, will be set to an error code if there is an
+ * error, or zero (SPH_IMAGE_ERR_NONE) if there was no error.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ *   y - the scanline to get
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   pointer to the scanline, or NULL if read error
+ */
+const uint32_t *sph_image_cache_getRow(
+    SPH_IMAGE_CACHE * pc,
+    int32_t           y,
+    int             * pError);
+
+/*
+ * Copy a rectangular tile of the image of a cache into caller memory.
+ * 
+ * The tile has its top-left corner at pixel (x, y) and is w pixels wide
+ * and h pixels high.  It must lie entirely within the image.  The tile
+ * is written to pDst with the same packed ARGB format as returned by
+ * sph_image_reader_read().  stride is the distance in pixels from the
+ * start of one tile row to the start of the next.  If it is less than
+ * one, the tile width is used.  Otherwise, it must be at least the tile
+ * width.
+ * 
+ * Each strip that the tile overlaps is loaded once.  If the cache holds
+ * fewer strips than the tile overlaps, earlier strips of the tile may be
+ * evicted by later ones.
+ * 
+ * Errors work the same way as for sph_image_cache_getRow().  If there
+ * is a read error, the contents of pDst are undefined.
+ * 
+ * Parameters:
+ * 
+ *   pc - the image cache object
+ * 
+ *   x - the left column of the tile
+ * 
+ *   y - the top scanline of the tile
+ * 
+ *   w - the width of the tile
+ * 
+ *   h - the height of the tile
+ * 
+ *   pDst - pointer to the memory that receives the tile
+ * 
+ *   stride - the distance in pixels between tile rows, or zero for the
+ *   tile width
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if read error
+ */
+int sph_image_cache_getTile(
+    SPH_IMAGE_CACHE * pc,
+    int32_t           x,
+    int32_t           y,
+    int32_t           w,
+    int32_t           h,
+    uint32_t        * pDst,
+    int32_t           stride,
+    int             * pError);
+
+/*
+ * Allocate a new resampler object.
+ * 
+ * A resampler scales a stream of scanlines from one size to another,
+ * typically between an image reader and an image writer.  Any source
+ * and destination sizes are allowed, and each axis may be reduced or
+ * enlarged independently.  The resampler is separable: each source
+ * scanline is filtered horizontally as soon as it arrives, and each
+ * destination scanline is then filtered vertically from the source
+ * scanlines that its window covers.  Only that window of horizontally
+ * filtered scanlines is kept, so memory is proportional to the
+ * destination width times the number of vertical filter taps (see
+ * sph_image_resampler_taps()), and not to the height of either image.
+ * 
+ * The client alternates between pushing source scanlines and pulling
+ * destination scanlines.  Before each destination scanline, push
+ * source scanlines in order as long as sph_image_resampler_needs()
+ * says so, then get the destination scanline with
+ * sph_image_resampler_row().  For example, with a reader and a writer:
+ * 
+ *   for(y = 0; y < dh; y++) {
+ *     while (sph_image_resampler_needs(ps)) {
+ *       sph_image_reader_readInto(pr, sph_image_resampler_ptr(ps), NULL);
+ *       sph_image_resampler_push(ps);
+ *     }
+ *     sph_image_resampler_row(ps, sph_image_writer_ptr(pw));
+ *     sph_image_writer_write(pw);
+ *   }
+ * 
+ * (Error checks are left out.)  When reducing, the filter kernel is
+ * stretched to cover the reduction ratio, so every source pixel
+ * contributes.  At the edges, the part of the kernel that falls outside
+ * the source is dropped and the rest is normalized.  A few source
+ * scanlines at the bottom may not be needed at all, in which case they
+ * are never requested.
+ * 
+ * Filtering uses 14-bit fixed-point weights and channel values on
+ * premultiplied alpha, so transparent pixels don't bleed their color
+ * into the result.  If flags includes SPH_IMAGE_RESAMPLE_LINEAR, color
+ * channels are converted from sRGB to linear light before filtering
+ * and back afterwards, which keeps reductions of fine, high-contrast
+ * detail from coming out too dark, at some extra cost.  Kernels with
+ * negative lobes (cubic and Lanczos) sharpen edges and may ring
+ * slightly; results are clamped to the valid range.
+ * 
+ * For very large reductions, the number of taps and the cost per
+ * pixel grow with the ratio, and the precision of each weight drops.
+ * Reducing the image first with sph_image_reader_setReduce() to within
+ * a few times the final size avoids both.
+ * 
+ * All dimensions must be in range [1, SPH_IMAGE_MAXDIM].  kernel is one
+ * of the SPH_IMAGE_KERNEL constants, and flags is zero or
+ * SPH_IMAGE_RESAMPLE_LINEAR.  Resamplers can't fail apart from running
+ * out of memory, which is a fault.
+ * 
+ * Parameters:
+ * 
+ *   sw - the source width in pixels
+ * 
+ *   sh - the source height in pixels
+ * 
+ *   dw - the destination width in pixels
+ * 
+ *   dh - the destination height in pixels
+ * 
+ *   kernel - the filter kernel
+ * 
+ *   flags - the resampling flags
+ * 
+ * Return:
+ * 
+ *   the new resampler object
+ */
+SPH_IMAGE_RESAMPLER *sph_image_resampler_new(
+    int32_t sw,
+    int32_t sh,
+    int32_t dw,
+    int32_t dh,
+    int     kernel,
+    int     flags);
+
+/*
+ * Free a resampler object.
+ * 
+ * If NULL is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object, or NULL
+ */
+void sph_image_resampler_free(SPH_IMAGE_RESAMPLER *ps);
+
+/*
+ * Get the number of vertical filter taps of a resampler.
+ * 
+ * This is the number of horizontally filtered source scanlines that the
+ * resampler holds, which is the most that any destination scanline is
+ * computed from.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ * Return:
+ * 
+ *   the number of vertical taps
+ */
+int32_t sph_image_resampler_taps(SPH_IMAGE_RESAMPLER *ps);
+
+/*
+ * Check whether a resampler needs another source scanline before it can
+ * produce the next destination scanline.
+ * 
+ * Zero is returned once all destination scanlines have been produced.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ * Return:
+ * 
+ *   non-zero if the next source scanline must be pushed, zero if the
+ *   next destination scanline can be produced
+ */
+int sph_image_resampler_needs(SPH_IMAGE_RESAMPLER *ps);
+
+/*
+ * Get the source scanline buffer of a resampler.
+ * 
+ * The buffer has room for one source scanline, and it is aligned and
+ * padded like the scanline buffers of readers (see SPH_IMAGE_ALIGN).
+ * Fill it with the next source scanline and then call
+ * sph_image_resampler_push().  The pointer stays the same for the
+ * lifetime of the object.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ * Return:
+ * 
+ *   the source scanline buffer
+ */
+uint32_t *sph_image_resampler_ptr(SPH_IMAGE_RESAMPLER *ps);
+
+/*
+ * Push the source scanline in the buffer of a resampler.
+ * 
+ * The scanline is filtered horizontally right away, so the buffer may
+ * be filled again as soon as this returns.  A fault occurs if
+ * sph_image_resampler_needs() would return zero.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ */
+void sph_image_resampler_push(SPH_IMAGE_RESAMPLER *ps);
+
+/*
+ * Push a source scanline from client memory to a resampler.
+ * 
+ * This is the same as sph_image_resampler_push(), except that the
+ * scanline is read from pSrc, which holds the source width in pixels,
+ * instead of the buffer of the resampler.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ *   pSrc - the source scanline
+ */
+void sph_image_resampler_pushFrom(
+          SPH_IMAGE_RESAMPLER * ps,
+    const uint32_t            * pSrc);
+
+/*
+ * Produce the next destination scanline of a resampler.
+ * 
+ * pDst receives the destination width in pixels.  A fault occurs if
+ * sph_image_resampler_needs() would return non-zero or if all
+ * destination scanlines have already been produced.
+ * 
+ * Parameters:
+ * 
+ *   ps - the resampler object
+ * 
+ *   pDst - the destination scanline
+ */
+void sph_image_resampler_row(SPH_IMAGE_RESAMPLER *ps, uint32_t *pDst);
+
+/*
+ * Allocate a new image pipeline object.
+ * 
+ * A pipeline connects an image reader, a chain of row-transform stages,
+ * and an image writer, and moves the scanlines through them, so that
+ * clients don't need to write their own loops around each transform.
+ * Each stage declares how many input scanlines it looks at for each
+ * output scanline, and the pipeline keeps only that many scanlines
+ * between stages, in rings.  Every scanline is produced directly into
+ * the place where the next stage reads it: the reader converts into
+ * the ring of the first stage, each stage writes into the ring of the
+ * next, and the last stage writes into the scanline buffer of the
+ * writer.  No full image is ever held, and no scanline is copied
+ * between stages.
+ * 
+ * The reader is the source of the pipeline.  Any options of the reader,
+ * such as sph_image_reader_setReduce(), must be set before the pipeline
+ * is allocated, and no scanlines may have been read.  The pipeline
+ * doesn't take ownership of the reader.
+ * 
+ * Parameters:
+ * 
+ *   pr - the image reader to read from
+ * 
+ * Return:
+ * 
+ *   the new pipeline object
+ */
+SPH_IMAGE_PIPELINE *sph_image_pipeline_new(SPH_IMAGE_READER *pr);
+
+/*
+ * Free an image pipeline object.
+ * 
+ * The reader and writer that the pipeline used are not closed.  If NULL
+ * is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object, or NULL
+ */
+void sph_image_pipeline_free(SPH_IMAGE_PIPELINE *pp);
+
+/*
+ * Add a row-transform stage to the end of an image pipeline.
+ * 
+ * The input of the stage is the output of the previous stage, or of
+ * the reader for the first stage.  Its width and height are what
+ * sph_image_pipeline_width() and sph_image_pipeline_height() return
+ * before the stage is added.  The structure is copied.
+ * 
+ * A fault occurs if the pipeline has already run, or if the stage has
+ * a NULL lastFn but a different height than its input.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   pStage - the stage to add
+ */
+void sph_image_pipeline_addStage(
+          SPH_IMAGE_PIPELINE * pp,
+    const SPH_IMAGE_STAGE    * pStage);
+
+/*
+ * Add a resampling stage to the end of an image pipeline.
+ * 
+ * The stage resizes its input to dw by dh pixels with a resampler
+ * object that the pipeline owns.  The parameters are the same as for
+ * sph_image_resampler_new().  A fault occurs if the pipeline has
+ * already run.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   dw - the output width in pixels
+ * 
+ *   dh - the output height in pixels
+ * 
+ *   kernel - the filter kernel
+ * 
+ *   flags - the resampling flags
+ */
+void sph_image_pipeline_addResampler(
+    SPH_IMAGE_PIPELINE * pp,
+    int32_t              dw,
+    int32_t              dh,
+    int                  kernel,
+    int                  flags);
+
+/*
+ * Add a convolution stage to the end of an image pipeline.
+ * 
+ * The stage filters its input with a kernel of kw by kh weights, given
+ * row by row in pKernel, and keeps only kh converted scanlines, so that
+ * blurring, sharpening, and edge detection run in constant memory.
+ * Each output pixel is the sum of the input pixels around it, each
+ * multiplied by the weight at the same place in the kernel, whose
+ * center weight lines up with the output pixel.  Pixels beyond the
+ * edges of the input repeat the nearest edge pixel.
+ * 
+ * The kernel width and height must both be odd and in range [1,
+ * SPH_IMAGE_CONVOLVE_MAXTAPS].  Weights are converted to fixed point
+ * with 12 fractional bits, and the magnitudes of all the weights must
+ * add up to at most SPH_IMAGE_CONVOLVE_MAXGAIN.  For kernels adding up
+ * to one, the fixed-point weights add up to exactly one as well.
+ * 
+ * By default, all four channels are filtered with color weighted by
+ * alpha, which is right for blurring.  If flags includes
+ * SPH_IMAGE_CONVOLVE_STRAIGHT, color is filtered without alpha
+ * weighting and the alpha channel is copied from the input, which is
+ * needed for kernels that add up to zero, such as edge detectors.  The
+ * bias, in range [-255, 255], is added to each color channel of the
+ * result, such as 128 to show the output of an edge detector.  Results
+ * are clamped.
+ * 
+ * A fault occurs if the pipeline has already run, or if the kernel is
+ * invalid.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   kw - the kernel width
+ * 
+ *   kh - the kernel height
+ * 
+ *   pKernel - the (kw * kh) weights, row by row
+ * 
+ *   bias - the value added to each color channel
+ * 
+ *   flags - the convolution flags
+ */
+void sph_image_pipeline_addConvolution(
+          SPH_IMAGE_PIPELINE * pp,
+          int32_t              kw,
+          int32_t              kh,
+    const double             * pKernel,
+          int32_t              bias,
+          int                  flags);
+
+/*
+ * Add a separable convolution stage to the end of an image pipeline.
+ * 
+ * This is the same as sph_image_pipeline_addConvolution() with a kernel
+ * whose weight at column i of row j is pRowKernel[i] times
+ * pColKernel[j], such as a Gaussian blur or a box blur.  Each input
+ * scanline is filtered horizontally once, and output scanlines then
+ * only need kh weights per pixel, instead of kw * kh.
+ * 
+ * The magnitudes of the weights of pRowKernel, added up, times those of
+ * pColKernel, added up, must be at most SPH_IMAGE_CONVOLVE_MAXGAIN.
+ * Since the two passes are summed separately, the magnitudes of each
+ * kernel on its own must also add up to at most
+ * SPH_IMAGE_CONVOLVE_MAXGAIN.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   kw - the kernel width
+ * 
+ *   pRowKernel - the kw horizontal weights
+ * 
+ *   kh - the kernel height
+ * 
+ *   pColKernel - the kh vertical weights
+ * 
+ *   bias - the value added to each color channel
+ * 
+ *   flags - the convolution flags
+ */
+void sph_image_pipeline_addSeparable(
+          SPH_IMAGE_PIPELINE * pp,
+          int32_t              kw,
+    const double             * pRowKernel,
+          int32_t              kh,
+    const double             * pColKernel,
+          int32_t              bias,
+          int                  flags);
+
+/*
+ * Choose whether an image pipeline runs its stages on separate threads.
+ * 
+ * By default, the whole pipeline runs on the calling thread, each stage
+ * pulling scanlines from the one before it as needed.  If threaded is
+ * non-zero, the reader and every stage but the last each run on their
+ * own thread, and the last stage and the writer run on the calling
+ * thread.  The rings between stages then get a few extra scanlines so
+ * that each stage can work ahead of the next one.  Stage callbacks are
+ * still called in order for each stage, but callbacks of different
+ * stages may run at the same time.
+ * 
+ * A fault occurs if the pipeline has already run.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   threaded - non-zero to run stages on separate threads
+ */
+void sph_image_pipeline_setThreaded(SPH_IMAGE_PIPELINE *pp, int threaded);
+
+/*
+ * Get the width in pixels of the output of an image pipeline.
+ * 
+ * This is the width of the last stage added so far, or of the reader
+ * if there are no stages.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ * Return:
+ * 
+ *   the output width in pixels
+ */
+int32_t sph_image_pipeline_width(SPH_IMAGE_PIPELINE *pp);
+
+/*
+ * Get the height in pixels of the output of an image pipeline.
+ * 
+ * This is the height of the last stage added so far, or of the reader
+ * if there are no stages.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ * Return:
+ * 
+ *   the output height in pixels
+ */
+int32_t sph_image_pipeline_height(SPH_IMAGE_PIPELINE *pp);
+
+/*
+ * Run an image pipeline into an image writer.
+ * 
+ * All scanlines of the output are produced and written to pw, which
+ * must have the output width and height of the pipeline and must not
+ * have any scanlines written yet.  The writer is not closed.  A
+ * pipeline can only run once.
+ * 
+ * If the reader fails, the writer fails, or a stage returns zero, the
+ * pipeline stops and the error is returned: the error code of the
+ * reader or writer, or SPH_IMAGE_ERR_STAGE.  All threads have finished
+ * when this returns.
+ * 
+ * Parameters:
+ * 
+ *   pp - the pipeline object
+ * 
+ *   pw - the image writer to write to
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_pipeline_run(
+    SPH_IMAGE_PIPELINE * pp,
+    SPH_IMAGE_WRITER   * pw,
+    int                * pError);
+
+/*
+ * Allocate a new image mosaic object.
+ * 
+ * A mosaic stitches a grid of image files, the tiles, into one output
+ * image, without ever holding a whole tile in memory.  The output is
+ * produced in bands of scanlines.  For each band, every tile in the
+ * current row of tiles is decoded straight into its place in the band,
+ * and the band is written as a whole.  Only the tiles of the current
+ * row of tiles are open at any time, so memory depends on the width of
+ * the output and the number of columns, never on its height.  The tiles
+ * of a row are decoded in parallel on worker threads, while the calling
+ * thread encodes the previous band.
+ * 
+ * All tiles in a column must have the same width, and all tiles in a
+ * row must have the same height.  A tile may be left blank, in which
+ * case its area is fully transparent black, but every row and column
+ * needs at least one tile that isn't blank.
+ * 
+ * cols and rows are the number of columns and rows of tiles, which
+ * must both be in range 1 to SPH_IMAGE_MAXDIM.  All tiles start out
+ * blank.
+ * 
+ * Parameters:
+ * 
+ *   cols - the number of columns of tiles
+ * 
+ *   rows - the number of rows of tiles
+ * 
+ * Return:
+ * 
+ *   the new mosaic object
+ */
+SPH_IMAGE_MOSAIC *sph_image_mosaic_new(int32_t cols, int32_t rows);
+
+/*
+ * Free an image mosaic object.
+ * 
+ * Any tiles that are still open are closed.  The writer that the mosaic
+ * ran into is not closed.  If NULL is passed, the call is ignored.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object, or NULL
+ */
+void sph_image_mosaic_free(SPH_IMAGE_MOSAIC *pm);
+
+/*
+ * Set the image file of a tile of an image mosaic.
+ * 
+ * The path is copied.  It is handled the same way as for
+ * sph_image_reader_newFromPath(), but the file isn't opened until the
+ * mosaic is measured.  NULL makes the tile blank again.
+ * 
+ * A fault occurs if col or row is out of range, or if the mosaic has
+ * already been measured.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   col - the column of the tile
+ * 
+ *   row - the row of the tile
+ * 
+ *   pPath - the path to the image file of the tile, or NULL
+ */
+void sph_image_mosaic_setTile(
+          SPH_IMAGE_MOSAIC * pm,
+          int32_t            col,
+          int32_t            row,
+    const char             * pPath);
+
+/*
+ * Set the number of threads that decode the tiles of an image mosaic.
+ * 
+ * threads must be zero or greater.  Zero means the number of online
+ * processors, up to a fixed limit, which is the default.  One means no
+ * worker threads, so tiles are decoded on the calling thread between
+ * writes.  No more threads than columns are used.
+ * 
+ * A fault occurs if the mosaic has already run.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   threads - the number of worker threads, or zero for automatic
+ */
+void sph_image_mosaic_setThreads(SPH_IMAGE_MOSAIC *pm, int threads);
+
+/*
+ * Measure the tiles of an image mosaic.
+ * 
+ * The header of each tile that isn't blank is read to get its size,
+ * and the layout of the output is computed.  This must be called once
+ * after all tiles are set and before the width and height of the
+ * output are queried or the mosaic runs.
+ * 
+ * If a tile can't be opened, its error is returned.  If the tiles don't
+ * line up, or a whole row or column is blank, SPH_IMAGE_ERR_MOSAIC is
+ * returned.  If the output would be larger than SPH_IMAGE_MAXDIM in
+ * either dimension, SPH_IMAGE_ERR_IMAGEDIM is returned.  A fault occurs
+ * if the mosaic has already been measured.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_mosaic_measure(SPH_IMAGE_MOSAIC *pm, int *pError);
+
+/*
+ * Get the width in pixels of the output of an image mosaic.
+ * 
+ * A fault occurs if the mosaic hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ * Return:
+ * 
+ *   the output width in pixels
+ */
+int32_t sph_image_mosaic_width(SPH_IMAGE_MOSAIC *pm);
+
+/*
+ * Get the height in pixels of the output of an image mosaic.
+ * 
+ * A fault occurs if the mosaic hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ * Return:
+ * 
+ *   the output height in pixels
+ */
+int32_t sph_image_mosaic_height(SPH_IMAGE_MOSAIC *pm);
+
+/*
+ * Stitch the tiles of an image mosaic into an image writer.
+ * 
+ * All scanlines of the output are written to pw, which must have the
+ * output width and height of the mosaic and must not have any scanlines
+ * written yet.  The writer is not closed.  A mosaic can only run once,
+ * and it must have been measured successfully.
+ * 
+ * If a tile can't be opened or read, or the writer fails, the mosaic
+ * stops and the error is returned.  If a tile no longer has the size it
+ * had when the mosaic was measured, SPH_IMAGE_ERR_MOSAIC is returned.
+ * All threads have finished when this returns.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mosaic object
+ * 
+ *   pw - the image writer to write to
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_mosaic_run(
+    SPH_IMAGE_MOSAIC * pm,
+    SPH_IMAGE_WRITER * pw,
+    int              * pError);
+
+/*
+ * Allocate a new image trim object.
+ * 
+ * A trim object finds the tight bounding box of the pixels of an image
+ * file that aren't background, and then writes only that box, so that
+ * empty margins around sprites and similar images can be cut away while
+ * streaming.  The image is decoded once to measure the box.  While it
+ * is measured, the scanlines from the first one with content onwards
+ * are kept in memory if they fit within the memory limit (see
+ * sph_image_trim_setMemory()), so that the box can be written without
+ * decoding the image again.  Otherwise, the image is opened again when
+ * the trim object runs, the scanlines above the box are skipped, and
+ * decoding stops after the last scanline of the box.
+ * 
+ * The path is copied.  It is handled the same way as for
+ * sph_image_reader_newFromPath(), but the file isn't opened until the
+ * trim object is measured.  By default, the background is fully
+ * transparent pixels, whatever their color channels.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the image file
+ * 
+ * Return:
+ * 
+ *   the new trim object
+ */
+SPH_IMAGE_TRIM *sph_image_trim_new(const char *pPath);
+
+/*
+ * Free an image trim object.
+ * 
+ * Any scanlines kept in memory are released.  The writer that the trim
+ * object ran into is not closed.  If NULL is passed, the call is
+ * ignored.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object, or NULL
+ */
+void sph_image_trim_free(SPH_IMAGE_TRIM *pt);
+
+/*
+ * Set the background that an image trim object cuts away.
+ * 
+ * mode is one of the SPH_IMAGE_TRIM constants.  SPH_IMAGE_TRIM_ALPHA,
+ * the default, treats all pixels with an alpha of zero as background.
+ * SPH_IMAGE_TRIM_COLOR treats only pixels exactly equal to color,
+ * given as a packed ARGB value (see sph_argb_pack()), as background.
+ * SPH_IMAGE_TRIM_CORNER uses the top-left pixel of the image as the
+ * background color, unless that pixel is fully transparent, in which
+ * case it works the same as SPH_IMAGE_TRIM_ALPHA.  color is ignored
+ * unless mode is SPH_IMAGE_TRIM_COLOR.
+ * 
+ * A fault occurs if the mode is not recognized, or if the trim object
+ * has already been measured.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   mode - the background mode
+ * 
+ *   color - the background color for SPH_IMAGE_TRIM_COLOR
+ */
+void sph_image_trim_setBackground(
+    SPH_IMAGE_TRIM * pt,
+    int              mode,
+    uint32_t         color);
+
+/*
+ * Set the memory limit for the scanlines that an image trim object
+ * keeps while measuring.
+ * 
+ * limit is the most memory in bytes that the kept scanlines may take
+ * up.  The default is 64 MiB.  Zero never keeps any scanlines, so the
+ * image is always decoded again when the trim object runs.
+ * 
+ * A fault occurs if the trim object has already been measured.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   limit - the memory limit in bytes
+ */
+void sph_image_trim_setMemory(SPH_IMAGE_TRIM *pt, size_t limit);
+
+/*
+ * Measure the bounding box of an image trim object.
+ * 
+ * The image is decoded once, and the bounding box of all pixels that
+ * aren't background is found.  This must be called once before the box
+ * is queried or the trim object runs.  If the whole image is
+ * background, the box is the single top-left pixel of the image.
+ * 
+ * If the image can't be opened or read, the error is returned.  A fault
+ * occurs if the trim object has already been measured.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_trim_measure(SPH_IMAGE_TRIM *pt, int *pError);
+
+/*
+ * Get the offset in pixels from the left edge of the image to the left
+ * edge of the bounding box of an image trim object.
+ * 
+ * A fault occurs if the trim object hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ * Return:
+ * 
+ *   the left offset in pixels
+ */
+int32_t sph_image_trim_x(SPH_IMAGE_TRIM *pt);
+
+/*
+ * Get the offset in pixels from the top edge of the image to the top
+ * edge of the bounding box of an image trim object.
+ * 
+ * A fault occurs if the trim object hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ * Return:
+ * 
+ *   the top offset in pixels
+ */
+int32_t sph_image_trim_y(SPH_IMAGE_TRIM *pt);
+
+/*
+ * Get the width in pixels of the bounding box of an image trim object.
+ * 
+ * A fault occurs if the trim object hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ * Return:
+ * 
+ *   the width of the box in pixels
+ */
+int32_t sph_image_trim_width(SPH_IMAGE_TRIM *pt);
+
+/*
+ * Get the height in pixels of the bounding box of an image trim object.
+ * 
+ * A fault occurs if the trim object hasn't been measured successfully.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ * Return:
+ * 
+ *   the height of the box in pixels
+ */
+int32_t sph_image_trim_height(SPH_IMAGE_TRIM *pt);
+
+/*
+ * Write the bounding box of an image trim object to an image writer.
+ * 
+ * All scanlines of the box are written to pw, which must have the width
+ * and height of the box and must not have any scanlines written yet.
+ * The writer is not closed.  A trim object can only run once, and it
+ * must have been measured successfully.  Any scanlines kept in memory
+ * are released afterwards.
+ * 
+ * If the image has to be decoded again and can't be opened or read, or
+ * if the writer fails, the error is returned.  If the image no longer
+ * has the size it had when it was measured, SPH_IMAGE_ERR_READDATA is
+ * returned.
+ * 
+ * Parameters:
+ * 
+ *   pt - the trim object
+ * 
+ *   pw - the image writer to write to
+ * 
+ *   pError - pointer to the error code return, or NULL
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+int sph_image_trim_run(
+    SPH_IMAGE_TRIM   * pt,
+    SPH_IMAGE_WRITER * pw,
+    int              * pError);
+
 /*
  * Given an SPH_IMAGE_ERR error code, return a string describing the
  * error.